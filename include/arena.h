@@ -3,13 +3,16 @@
 
 #include <stddef.h>
 
+#include "diagnostic.h"
+
 typedef struct{
     char* memory;
     size_t capacity;
     size_t offset;
+    Diagnostics* diagnostics;
 } Arena;
 
-void initArena(Arena* arena, size_t capacity);
+void initArena(Arena* arena, size_t capacity, Diagnostics* diagnostics);
 void* arenaAlloc(Arena* arena, size_t size);
 void freeArena(Arena* arena);
 
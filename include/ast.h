@@ -0,0 +1,156 @@
+#ifndef AST_H
+#define AST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "diagnostic.h"
+
+typedef enum{
+    NODE_NUMBER,
+    NODE_IDENTIFIER,
+    NODE_BINARY_OP,
+    NODE_ASSIGN,
+    NODE_IF,
+    NODE_WHILE,
+    NODE_BLOCK,
+    NODE_LOGICAL_AND,
+    NODE_LOGICAL_OR,
+    NODE_PRINT,
+    NODE_EXPRESSION_STATEMENT,
+    NODE_FUNCTION,
+    NODE_CALL,
+    NODE_RETURN,
+    NODE_ARRAY,
+    NODE_INDEX,
+    NODE_STORE,
+    NODE_READ
+} ASTNodeType;
+
+typedef uint32_t NodeId;
+
+#define NULL_NODE 0
+
+#define MAX_PARAMETERS 6
+// Arrays live in the frame, so keep them well inside the default stack.
+#define MAX_ARRAY_LENGTH 65536
+
+// Nodes are stored column-wise and addressed by 32-bit index; slot 0 is
+// reserved so that NULL_NODE means "no node". What each column holds
+// depends on the kind:
+//
+//   NODE_NUMBER                value = literal; one that does not fit in 32
+//                              bits sets op and keeps its high half in left
+//   NODE_IDENTIFIER            left = name id, value = frame offset
+//   NODE_ASSIGN                left = name id, right = expr, value = frame offset
+//   NODE_BINARY_OP             op, left, right
+//   NODE_LOGICAL_AND/OR        left, right
+//   NODE_IF / NODE_WHILE       left = condition, right = body block
+//   NODE_BLOCK                 left = first slot in children, right = count
+//   NODE_PRINT                 left = expression
+//   NODE_EXPRESSION_STATEMENT  left = expression
+//   NODE_FUNCTION              left = name id, right = body block,
+//                              value = frame size, op = parameter count
+//                              (parameter i lives at offset 8 * (i + 1))
+//   NODE_CALL                  left = first slot in children, right = argument
+//                              count, value = callee name id
+//   NODE_RETURN                left = expression or NULL_NODE, op = 1 when it
+//                              is a self tail call compiled as a jump
+//   NODE_ARRAY                 left = name id, right = length,
+//                              value = frame offset of element 0
+//   NODE_INDEX                 left = name id, right = index expr,
+//                              value = frame offset of element 0
+//   NODE_STORE                 left = NODE_INDEX target, right = expr
+//   NODE_READ                  no operands: the next integer on stdin
+//
+// line holds the source line of every node, 0 when unknown.
+typedef struct {
+    uint8_t* kind;
+    uint8_t* op;
+    uint32_t* left;
+    uint32_t* right;
+    int32_t* value;
+    uint32_t* line;
+    uint32_t count;
+    uint32_t capacity;
+
+    // Statement lists of every block, each stored as one contiguous run.
+    NodeId* children;
+    uint32_t childCount;
+    uint32_t childCapacity;
+
+    // Interned identifier spellings; the id is the index into these. The
+    // bytes are copied into nameChars so the AST never points into the
+    // source, which may be a sliding window over a pipe.
+    char* nameChars;
+    size_t nameCharsLength;
+    size_t nameCharsCapacity;
+    size_t* nameOffsets;
+    int* nameLengths;
+    uint32_t nameCount;
+    uint32_t nameCapacity;
+    uint32_t* nameBuckets;
+    uint32_t bucketCount;
+
+    // Set when the columns point into a loaded AST file rather than the
+    // heap; the first growth copies them out.
+    int borrowed;
+
+    // Line given to nodes as they are created. Passes that build nodes
+    // point it at the code they stand for.
+    uint32_t currentLine;
+
+    // Where the passes working on the tree report their errors.
+    Diagnostics* diagnostics;
+} AST;
+
+typedef struct {
+    NodeId* items;
+    uint32_t count;
+    uint32_t capacity;
+} NodeList;
+
+void initAST(AST* ast, Diagnostics* diagnostics);
+void freeAST(AST* ast);
+NodeId newNode(AST* ast, ASTNodeType kind);
+uint32_t appendChildren(AST* ast, const NodeId* ids, uint32_t count);
+int internName(AST* ast, const char* name, size_t length);
+
+// Failures are reported to ast's diagnostics.
+void pushNode(const AST* ast, NodeList* list, NodeId id);
+void pushChildren(const AST* ast, NodeId node, NodeList* list);
+void freeNodeList(NodeList* list);
+
+// One step of lowering a && b or a || b to conditional branches, for the
+// back ends that walk a condition with an explicit stack. state starts at
+// 0 and is advanced on every call. The operator either branches on an
+// operand (operand set) or is finished (operand is NULL_NODE).
+// pastRight marks the branch that skips the right operand: on the first
+// step it goes to a new label instead of the target, and on the last the
+// label has to be placed.
+typedef struct {
+    NodeId operand;
+    int jumpIfTrue;
+    int pastRight;
+} LogicalBranch;
+
+LogicalBranch nextLogicalBranch(const AST* ast, NodeId node, int jumpIfTrue, uint32_t* state);
+
+static inline NodeId* blockStatements(const AST* ast, NodeId block){
+    return ast->children + ast->left[block];
+}
+
+static inline NodeId* callArguments(const AST* ast, NodeId call){
+    return ast->children + ast->left[call];
+}
+
+static inline int64_t numberValue(const AST* ast, NodeId node){
+    if(!ast->op[node]) return ast->value[node];
+    return (int64_t)(((uint64_t)ast->left[node] << 32) | (uint32_t)ast->value[node]);
+}
+
+static inline const char* nameText(const AST* ast, int nameId){
+    return ast->nameChars + ast->nameOffsets[nameId];
+}
+
+#endif
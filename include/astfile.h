@@ -0,0 +1,41 @@
+#ifndef ASTFILE_H
+#define ASTFILE_H
+
+#include "ast.h"
+#include "output.h"
+
+#define AST_FILE_MAGIC "QZAST\0\0\0"
+#define AST_FILE_VERSION 4
+
+// On-disk image of an AST. Every section is addressed by its byte offset
+// from the start of the file and 8-byte aligned, so a mapped file can be
+// used in place wherever it lands in memory.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t program;
+    int32_t frameSize;
+    uint32_t nodeCount;
+    uint32_t childCount;
+    uint32_t nameCount;
+    uint64_t nameCharsLength;
+
+    uint64_t kindOffset;
+    uint64_t opOffset;
+    uint64_t leftOffset;
+    uint64_t rightOffset;
+    uint64_t valueOffset;
+    uint64_t lineOffset;
+    uint64_t childrenOffset;
+    uint64_t nameOffsetsOffset;
+    uint64_t nameLengthsOffset;
+    uint64_t nameCharsOffset;
+} ASTFileHeader;
+
+int isASTFile(const char* data, size_t size);
+// Why the file cannot be loaded safely, or NULL when it can.
+const char* checkASTFile(const char* data, size_t size, Diagnostics* diagnostics);
+void writeASTFile(Output* out, AST* ast, NodeId program, int frameSize);
+void loadASTFile(AST* ast, char* data, size_t size, NodeId* program, int* frameSize, Diagnostics* diagnostics);
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "parser.h"
+#include "symbol.h"
+
+// Register machine: every frame slot is a register (slot [rbp - n] is
+// register n / 8 - 1) and expression temporaries follow the slots, so a
+// variable operand costs no load. The compare and branch opcodes come in
+// the order of Condition so codegen can index them.
+typedef enum {
+    OP_MOVE,            // a = b
+    OP_CONSTANT,        // a = immediate b
+    OP_WIDE_CONSTANT,   // a = constants[b]
+    OP_ADD,             // a = b + c
+    OP_SUBTRACT,
+    OP_MULTIPLY,
+    OP_DIVIDE,
+    OP_ADD_IMMEDIATE,   // a = b + immediate c
+    OP_MULTIPLY_IMMEDIATE,
+    OP_EQUAL,           // a = b == c, one per condition
+    OP_EQUAL_IMMEDIATE = OP_EQUAL + 6,      // a = b == immediate c
+    OP_JUMP_EQUAL = OP_EQUAL_IMMEDIATE + 6, // if a == b goto c
+    OP_JUMP_EQUAL_IMMEDIATE = OP_JUMP_EQUAL + 6, // if a == immediate b goto c
+    OP_JUMP = OP_JUMP_EQUAL_IMMEDIATE + 6,  // goto c
+    OP_JUMP_IF_ZERO,    // if a == 0 goto c
+    OP_JUMP_IF_NOT_ZERO,
+    OP_LOAD_ELEMENT,    // a = register (c - b)
+    OP_STORE_ELEMENT,   // register (c - b) = a
+    OP_CLEAR,           // registers a .. a + b - 1 = 0
+    OP_PRINT,
+    OP_READ,            // a = next integer on stdin
+    OP_CALL,            // a = functions[b](registers c ..)
+    OP_RETURN,
+    OP_HALT,
+    OP_COUNT
+} Opcode;
+
+typedef enum {
+    CONDITION_EQUAL,
+    CONDITION_NOT_EQUAL,
+    CONDITION_LESS,
+    CONDITION_LESS_EQUAL,
+    CONDITION_GREATER,
+    CONDITION_GREATER_EQUAL
+} Condition;
+
+// handler is filled in by the VM on its first run: dispatch jumps
+// straight to it, without decoding op again.
+typedef struct {
+    const void* handler;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+    uint8_t op;
+} Instruction;
+
+// A callee's registers start at the caller's first argument register, so
+// the arguments already sit in its parameter slots.
+typedef struct {
+    uint32_t entry;
+    uint32_t frameRegisters;
+    uint32_t registerCount;
+} BytecodeFunction;
+
+// Function 0 is main.
+typedef struct {
+    Instruction* code;
+    uint32_t count;
+    uint32_t capacity;
+    int64_t* constants;
+    uint32_t constantCount;
+    uint32_t constantCapacity;
+    BytecodeFunction* functions;
+    uint32_t functionCount;
+    // Where each of the program's top-level statements starts in main's
+    // code; a function definition starts where the statement after it does.
+    uint32_t* statementStarts;
+    int threaded;
+} Bytecode;
+
+void compileBytecode(const AST* ast, NodeId program, const SymbolTable* table, Bytecode* bytecode);
+void freeBytecode(Bytecode* bytecode);
+
+// Runs main, reading standard input, and writes what the program prints
+// to out. A fault ends the process the way it would end the native
+// program.
+void runBytecode(Bytecode* bytecode, Output* out);
+
+#endif
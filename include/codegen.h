@@ -3,7 +3,42 @@
 
 #include "parser.h"
 #include "symbol.h"
+#include "profile.h"
+#include "schedule.h"
+#include "incremental.h"
 
-void generateAssembly(ASTNode* node, SymbolTable* table);
+typedef struct {
+    // Emit SIMD copies of simple counted loops over arrays.
+    int vectorize;
+    // Move cold if bodies and functions out of line, and align loop heads
+    // and function entries.
+    int placeBlocks;
+    int alignCode;
+    // Instrument branches and loops; the program writes its counters to
+    // profilePath when it exits.
+    int profileGenerate;
+    const char* profilePath;
+    uint32_t probeCount;
+    uint32_t probeChecksum;
+    // Counters from an earlier run, or NULL.
+    const Profile* profile;
+    // Reorder each basic block for this core, or NULL to emit in tree order.
+    const TuneModel* tune;
+    // Emit a DWARF line table (.file/.loc) pointing at this source file, or
+    // NULL for none.
+    const char* sourceName;
+    // Threads generating the program's regions; 1 or less generates on
+    // the calling thread. The output is the same either way.
+    int jobs;
+    // Print through the runtime of runtime.h instead of libc, for a program
+    // linked with no libc at all.
+    int freestanding;
+    // Generate each top-level statement as a region of its own, taking its
+    // code from this cache when its tree is unchanged and recording it for
+    // the next compilation; NULL for none.
+    IncrementalCache* incremental;
+} CodegenOptions;
+
+void generateProgram(Output* out, AST* ast, NodeId program, SymbolTable* table, const CodegenOptions* options);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef CSE_H
+#define CSE_H
+
+#include "parser.h"
+#include "symbol.h"
+
+void eliminateCommonSubexpressions(AST* ast, NodeId program, SymbolTable* table);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef DIAGNOSTIC_H
+#define DIAGNOSTIC_H
+
+#include <setjmp.h>
+#include <stddef.h>
+
+// Errors go through reportError and fail instead of straight to stderr
+// and exit(), so that libquartz can hand them back to its caller. Every
+// compilation has its own Diagnostics, which the structures it works on
+// (source, tree, symbols, output...) point at; fail() longjmps to its
+// failure, set up by whoever started the compilation.
+typedef struct {
+    jmp_buf failure;
+    // Also print each error to stderr as "Error: ...", as the command line
+    // does.
+    int print;
+    // The first error reported, without the "Error: " prefix.
+    char message[256];
+} Diagnostics;
+
+// With no diagnostics, for code that runs outside any compilation, the
+// error is printed and fail() exits instead.
+void reportError(Diagnostics* diagnostics, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void fail(Diagnostics* diagnostics, int status) __attribute__((noreturn));
+
+#endif
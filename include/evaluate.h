@@ -0,0 +1,21 @@
+#ifndef EVALUATE_H
+#define EVALUATE_H
+
+#include "parser.h"
+#include "symbol.h"
+
+// Bytecode instructions main may run at compile time at -O2.
+#define DEFAULT_EVALUATION_FUEL 1000000
+
+// Partial evaluation: runs main at compile time for up to fuel bytecode
+// instructions. A program that finishes becomes the prints of what it
+// printed. Otherwise the top-level statements that finished are replaced
+// by their output and by stores of the variables they left behind, and
+// the rest of the program is compiled as usual; a statement that faults,
+// reads input or has not finished when the fuel runs out is left to run
+// natively. A prefix is only replaced when that takes no more statements
+// than it had nodes, so a loop printing or storing one value per trip is
+// kept as a loop.
+void evaluateProgram(AST* ast, NodeId program, const SymbolTable* table, uint64_t fuel);
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ast.h"
+#include "diagnostic.h"
+#include "parser.h"
+#include "source.h"
+#include "symbol.h"
+
+#define INCREMENTAL_MAGIC "QZINC\0\0\0"
+#define INCREMENTAL_VERSION 2
+
+// --incremental=file: what the last compilation of a program learnt about
+// each of its top-level statements, so the next one only lexes and parses
+// the statements whose text changed and only generates code for the
+// statements whose tree changed.
+//
+// The source is cut into pieces, one per statement: its leading blank
+// space and its tokens. A piece whose bytes and whose symbols in scope
+// are those of last time gets its tree back from the cached AST image
+// (with its lines moved if text above it grew or shrank) and its
+// declarations replayed into the symbol table, so frame offsets come out
+// as a full parse would give them. Cached code is looked up by a hash of
+// the optimised tree instead, as passes such as inlining let a statement
+// depend on others; its labels and lines are renumbered as it is spliced
+// back in.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t statementCount;
+    uint32_t symbolCount;
+    uint32_t fragmentCount;
+    // Nodes of the image still reachable from a statement; the rest were
+    // left behind by statements since replaced.
+    uint32_t liveNodes;
+    uint32_t reserved;
+    // Code generation settings the fragments were produced under.
+    uint64_t fingerprint;
+    // Blank space after the last statement.
+    uint64_t tailHash;
+    uint64_t tailLength;
+
+    uint64_t statementsOffset;
+    uint64_t symbolsOffset;
+    uint64_t fragmentsOffset;
+    uint64_t imageOffset;
+    uint64_t imageLength;
+    uint64_t textOffset;
+} IncrementalHeader;
+
+typedef struct {
+    uint64_t textHash;
+    // Hash of the top-level symbols in scope where it was parsed; 0 for a
+    // function, which sees none of them.
+    uint64_t scope;
+    uint64_t length;
+    uint32_t line;
+    uint32_t newlines;
+    // Its nodes in the image are [firstNode, root].
+    uint32_t firstNode;
+    uint32_t root;
+    // The top-level symbols it declared, and the frame it needed while
+    // parsing, block scopes included.
+    uint32_t firstSymbol;
+    uint32_t symbolCount;
+    int32_t frameSize;
+    // Newlines before its first token.
+    uint32_t leading;
+} IncrementalStatement;
+
+typedef struct {
+    int32_t nameId;
+    // Element count for arrays, 0 for scalars.
+    int32_t length;
+    // The slot it was given, which a replay has to give it again.
+    int32_t offset;
+    int32_t reserved;
+} IncrementalSymbol;
+
+typedef struct {
+    uint64_t key;
+    uint64_t textOffset;
+    uint64_t length;
+    // Where its labels started counting and the line its tree's lines are
+    // relative to, for renumbering.
+    int32_t labelBase;
+    uint32_t line;
+    uint8_t vectorSupport;
+    uint8_t inputSupport;
+    uint8_t reserved[6];
+} IncrementalFragment;
+
+typedef struct {
+    uint64_t key;
+    char* text;
+    size_t length;
+    int labelBase;
+    uint32_t line;
+    int vectorSupport;
+    int inputSupport;
+} FragmentRecord;
+
+typedef struct {
+    // The previous compilation's cache, mapped; header is NULL when there
+    // was none or it could not be used.
+    char* data;
+    size_t size;
+    const IncrementalHeader* header;
+    uint32_t* buckets;
+    uint32_t bucketCount;
+
+    // What this compilation records.
+    IncrementalStatement* statements;
+    uint32_t statementCount;
+    uint32_t statementCapacity;
+    IncrementalSymbol* symbols;
+    uint32_t symbolCount;
+    uint32_t symbolCapacity;
+    FragmentRecord* fragments;
+    uint32_t fragmentCount;
+    uint32_t fragmentCapacity;
+    uint64_t fingerprint;
+    uint64_t tailHash;
+    uint64_t tailLength;
+    char* image;
+    size_t imageLength;
+    uint32_t liveNodes;
+    // While parsing: the statements so far, and a hash of the top-level
+    // symbols they declared.
+    NodeList roots;
+    uint64_t scope;
+
+    Diagnostics* diagnostics;
+} IncrementalCache;
+
+uint64_t hashBytes(uint64_t hash, const void* data, size_t length);
+
+// A cache that cannot be read is treated as absent.
+void openIncremental(IncrementalCache* cache, const char* path, Diagnostics* diagnostics);
+void closeIncremental(IncrementalCache* cache);
+
+// parseProgram for a source held whole in memory.
+NodeId parseIncremental(IncrementalCache* cache, Parser* parser, AST* ast, SymbolTable* table, const Source* source);
+
+// The key code is cached under: count consecutive top-level statements
+// as optimised, with their lines relative to the first one's when lines
+// is set.
+uint64_t hashStatements(const AST* ast, const NodeId* statements, uint32_t count, int lines, NodeList* work);
+
+// Fragments are only taken from a cache written under the same
+// fingerprint.
+void setFragmentFingerprint(IncrementalCache* cache, uint64_t fingerprint);
+// Copies the code last generated under key into *text, renumbered for
+// labelBase and line; 0 when there is none.
+int reuseFragment(IncrementalCache* cache, uint64_t key, int labelBase, uint32_t line,
+                  char** text, size_t* length, int* vectorSupport, int* inputSupport);
+// Takes ownership of text.
+void recordFragment(IncrementalCache* cache, uint64_t key, char* text, size_t length, int labelBase,
+                    uint32_t line, int vectorSupport, int inputSupport);
+
+// Replaces the cache file with what this compilation recorded.
+void saveIncremental(IncrementalCache* cache, const char* path);
+
+#endif
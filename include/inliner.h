@@ -0,0 +1,12 @@
+#ifndef INLINER_H
+#define INLINER_H
+
+#include "ast.h"
+#include "symbol.h"
+#include "profile.h"
+
+void resolveFunctions(AST* ast, NodeId program);
+void inlineFunctions(AST* ast, NodeId program, SymbolTable* table, const Profile* profile);
+void markTailCalls(AST* ast, NodeId program);
+
+#endif
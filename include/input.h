@@ -0,0 +1,44 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "output.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// read() returns the next integer on stdin: everything up to its first
+// digit is skipped, a '-' right before that digit makes it negative, and
+// the digits accumulate modulo 2^64. At the end of the input it returns 0.
+// A regular file is mapped whole; anything else is read in blocks of
+// INPUT_BLOCK_SIZE.
+#define INPUT_BLOCK_SIZE (1024 * 1024)
+
+typedef enum {
+    INPUT_UNOPENED,
+    INPUT_MAPPED,
+    INPUT_STREAMING,
+    INPUT_ENDED
+} InputState;
+
+// The interpreter's side: reads from fd, which is opened on first use.
+// out is flushed before a failure ends the process.
+typedef struct {
+    int fd;
+    InputState state;
+    const unsigned char* cursor;
+    const unsigned char* end;
+    unsigned char* buffer;
+    void* mapping;
+    size_t mappingLength;
+    Output* out;
+} Input;
+
+void initInput(Input* input, int fd, Output* out);
+int64_t readInput(Input* input);
+void freeInput(Input* input);
+
+// The native side, qz_read, for the code generator. A freestanding
+// program gets it on syscalls instead of libc.
+void emitInputSupport(Output* out, int freestanding);
+
+#endif
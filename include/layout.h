@@ -0,0 +1,10 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "parser.h"
+#include "profile.h"
+
+int isColdBranch(const AST* ast, NodeId node, const Profile* profile);
+int isColdFunction(const AST* ast, NodeId function, const Profile* profile);
+
+#endif
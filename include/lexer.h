@@ -10,6 +10,8 @@
 #include <fcntl.h>   
 #include <unistd.h>  
 
+#include "source.h"
+
 typedef enum {
     TOKEN_IDENTIFIER, TOKEN_NUMBER,
     TOKEN_ASSIGN,     
@@ -32,30 +34,43 @@ typedef enum {
     TOKEN_LOGICAL_AND,
     TOKEN_LOGICAL_OR,    
     TOKEN_ERROR,
-    TOKEN_EQUAL_EQUAL      
+    TOKEN_EQUAL_EQUAL,
+    TOKEN_COMMA,
+    TOKEN_FUNC, TOKEN_RETURN,
+    TOKEN_LBRACKET, TOKEN_RBRACKET, TOKEN_ARRAY,
+    TOKEN_READ
 } TokenType;
 
 typedef struct {
     TokenType type;
     const char* start;
-    int length;
-    int line;
+    size_t length;
+    long line;
 } Token;
 
 typedef struct {
     const char* start;   
     const char* current; 
     const char* end;     
-    int line;            
+    long line;            
+    Source* source;      
+    Token currentToken;
+    Token previousToken;
+    // One token of lookahead, when hasPeekedToken is set.
+    Token peekedToken;
+    int hasPeekedToken;
+    // The source's, taken by initLexer.
+    Diagnostics* diagnostics;
 } Lexer;
 
-extern Token currentToken;
-extern Token previousToken; 
-extern Lexer lexer;
-
-void initLexer(const char* source, size_t length);
-Token scanToken();
-void advanceToken();
-void consume(TokenType type, const char* message);
+void initLexer(Lexer* lexer, Source* source);
+// Lexes only [start, end) of a source held in memory, counting lines from
+// line.
+void seekLexer(Lexer* lexer, const char* start, const char* end, long line);
+Token scanToken(Lexer* lexer);
+Token peekToken(Lexer* lexer);
+const char* tokenTypeName(TokenType type);
+void advanceToken(Lexer* lexer);
+void consume(Lexer* lexer, TokenType type, const char* message);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,13 @@
+#ifndef LIVENESS_H
+#define LIVENESS_H
+
+#include "parser.h"
+#include "symbol.h"
+
+int isPureExpression(const AST* ast, NodeId root, NodeList* work);
+// stableFrame keeps main's variables in the slots the parser gave them
+// instead of packing them, so that an edit to one statement leaves the
+// code of the others as it was.
+void eliminateDeadCode(AST* ast, NodeId program, SymbolTable* table, int stableFrame);
+
+#endif
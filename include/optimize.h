@@ -0,0 +1,16 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "parser.h"
+#include "symbol.h"
+#include "profile.h"
+
+// The tree passes run between parsing and code generation at -O level,
+// shared by the command line and libquartz. reportUnroll sends the loop
+// unroller's decisions to stderr; at -O2 main then runs at compile time
+// for up to fuel instructions, none when 0. stableFrame is passed on to
+// eliminateDeadCode.
+void optimizeProgram(AST* ast, NodeId program, SymbolTable* table, int level, const Profile* profile,
+                     int reportUnroll, uint64_t fuel, int stableFrame);
+
+#endif
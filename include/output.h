@@ -0,0 +1,40 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+
+#include "diagnostic.h"
+
+#ifndef OUTPUT_CHUNK_SIZE
+#define OUTPUT_CHUNK_SIZE (64 * 1024)
+#endif
+#define OUTPUT_BATCH 16
+
+// Generated text accumulates in a batch of fixed-size chunks that is
+// handed to the kernel with one writev once every chunk is full, so a
+// large program costs a handful of syscalls however many lines it has.
+// With no fd (-1) the batches are gathered into one growing buffer
+// instead.
+typedef struct {
+    int fd;
+    char* chunks[OUTPUT_BATCH];
+    size_t chunkLengths[OUTPUT_BATCH];
+    int currentChunk;
+
+    char* memory;
+    size_t memoryLength;
+    size_t memoryCapacity;
+
+    Diagnostics* diagnostics;
+} Output;
+
+void initOutput(Output* out, int fd, Diagnostics* diagnostics);
+void initOutputBuffer(Output* out, Diagnostics* diagnostics);
+char* takeOutputBuffer(Output* out, size_t* length);
+void discardOutput(Output* out);
+void emit(Output* out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void emitBytes(Output* out, const void* data, size_t length);
+void flushOutput(Output* out);
+void freeOutput(Output* out);
+
+#endif
@@ -3,67 +3,33 @@
 
 #include "lexer.h"
 #include "symbol.h"
-#include "arena.h" 
-
-typedef enum{
-    NODE_NUMBER,
-    NODE_IDENTIFIER,
-    NODE_BINARY_OP,
-    NODE_ASSIGN,
-    NODE_IF,
-    NODE_WHILE,
-    NODE_BLOCK,
-    NODE_LOGICAL_AND,
-    NODE_LOGICAL_OR,
-    NODE_PRINT
-} ASTNodeType;
-
-typedef struct ASTNode {
-    ASTNodeType type;
-    struct ASTNode* next;
-
-    union{
-        int numberValue;
-
-        struct
-        {
-            const char* name;
-            int length;
-            int offset;
-        } identifier;
-
-        struct {
-            struct ASTNode* left;
-            struct ASTNode* right;
-            TokenType operator;
-        } binaryOp;
-
-        struct {
-            const char* name;
-            int length;
-            struct ASTNode* expr;
-            int offset;
-        } assign;
-
-        struct{
-            struct ASTNode* condition;
-            struct ASTNode* body;
-        } controlFlow;
-
-        struct {
-            struct ASTNode* head;
-        } block;
-        
-        struct{
-            struct ASTNode* expression;
-        } print; 
-        
-    } as;
-} ASTNode;
-
-
-ASTNode* parseExpression(Arena* arena, SymbolTable* table);
-ASTNode* parseStatement(Arena* arena, SymbolTable* table);
-void printAST(ASTNode* node, int indent);
-
-#endif
\ No newline at end of file
+#include "ast.h"
+#include "output.h"
+
+typedef struct PendingOperator PendingOperator;
+
+// Everything a parse in progress keeps between calls.
+typedef struct {
+    Lexer lexer;
+    // Statements of the blocks (and arguments of the calls) still being
+    // parsed. Each one copies its own run into ast->children once closed,
+    // so nested lists never interleave.
+    NodeList pendingStatements;
+    int insideFunction;
+    PendingOperator* operators;
+    uint32_t operatorCount;
+    uint32_t operatorCapacity;
+} Parser;
+
+// A parser starts zeroed, with its lexer set up by initLexer and advanced
+// to the first token.
+NodeId parseProgram(Parser* parser, AST* ast, SymbolTable* table);
+// Releases the parser's stacks. Also called after a failed parse, which
+// leaves them mid-use.
+void freeParser(Parser* parser);
+NodeId parseExpression(Parser* parser, AST* ast, SymbolTable* table);
+NodeId parseStatement(Parser* parser, AST* ast, SymbolTable* table);
+void printAST(Output* out, AST* ast, NodeId node, int indent);
+void printProgram(Output* out, AST* ast, NodeId program);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdio.h>
+
+typedef enum {
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_RESOLVE,
+    PHASE_INLINE,
+    PHASE_UNROLL,
+    PHASE_TAIL_CALLS,
+    PHASE_CSE,
+    PHASE_DEAD_CODE,
+    PHASE_EVALUATE,
+    PHASE_CODEGEN,
+    PHASE_INTERPRET,
+    PHASE_COUNT
+} Phase;
+
+// --perf-counters: hardware counters of the calling thread, read around
+// each phase through perf_event_open. Counters the kernel or the machine
+// cannot provide are left out of the report; with none at all only wall
+// time is shown. Until startPerfCounters the phase marks cost nothing.
+void startPerfCounters(void);
+int perfCountersEnabled(void);
+void beginPhase(Phase phase);
+void endPhase(Phase phase);
+void reportPerfCounters(FILE* out);
+void stopPerfCounters(void);
+
+#endif
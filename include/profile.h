@@ -0,0 +1,45 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "ast.h"
+#include "output.h"
+
+#define PROFILE_MAGIC "QZPROF\0\0"
+#define PROFILE_VERSION 1
+
+// Every if, while and function body is a probe with two counters:
+// how often it was reached and how often its body then ran. The probe
+// number plus one is kept in the node's value column (the body block's,
+// for functions), which those kinds do not otherwise use.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t probeCount;
+    uint32_t checksum;
+    uint32_t reserved;
+} ProfileHeader;
+
+typedef struct {
+    uint64_t* counts;
+    uint32_t probeCount;
+} Profile;
+
+enum {
+    PROBE_REACHED,
+    PROBE_TAKEN
+};
+
+uint32_t assignProbes(AST* ast, NodeId program, uint32_t* checksum);
+int loadProfile(Profile* profile, const char* path, uint32_t probeCount, uint32_t checksum, Diagnostics* diagnostics);
+void freeProfile(Profile* profile);
+void emitProfileSupport(Output* out, const char* path, uint32_t probeCount, uint32_t checksum, int freestanding);
+
+static inline int probeOf(const AST* ast, NodeId node){
+    return ast->value[node] - 1;
+}
+
+static inline uint64_t probeCount(const Profile* profile, int probe, int counter){
+    return profile->counts[2 * (size_t)probe + counter];
+}
+
+#endif
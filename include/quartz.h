@@ -0,0 +1,75 @@
+#ifndef QUARTZ_H
+#define QUARTZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// libquartz: the compiler as a library, and what the command line runs.
+// A compilation reads source text from memory or a file and leaves its
+// output in memory or writes it to a descriptor; errors come back as a
+// status and a message instead of ending the process. A compilation's
+// state (source, tree, symbols, parser and output) lives in its context
+// and is released when it ends, failed or not; so each thread can run its
+// own compilations alongside the others. A context must not be used by
+// two threads at once.
+
+typedef enum {
+    QUARTZ_OK = 0,
+    QUARTZ_ERROR_USAGE = 64,     // invalid options
+    QUARTZ_ERROR_SOURCE = 65,    // the program does not compile
+    QUARTZ_ERROR_INTERNAL = 70,
+    QUARTZ_ERROR_RESOURCE = 74   // out of memory
+} QuartzStatus;
+
+typedef enum {
+    QUARTZ_EMIT_ASSEMBLY,   // Intel-syntax x86-64, as --emit=asm
+    QUARTZ_EMIT_IR,         // the optimised tree as text, as --emit=ir
+    QUARTZ_EMIT_AST,        // a binary AST image, as --emit=ast
+    QUARTZ_EMIT_TOKENS,     // one line per token, as --emit=tokens
+    // What the program prints, running it on the interpreter with
+    // standard input as its input, as --interpret. A fault in the program
+    // ends the process, as it would end the native program.
+    QUARTZ_EMIT_RUN
+} QuartzEmit;
+
+typedef struct {
+    int optimizationLevel;  // 0, 1 or 2
+    const char* tune;       // -mtune target, NULL for generic
+    QuartzEmit emit;
+    const char* sourceName; // file named in the assembly's line table, NULL for none
+    int jobs;               // code generation threads, as -j; 0 or 1 for none
+    int freestanding;       // assembly for a program linked without libc, as --freestanding
+    const char* profileGenerate; // assembly that writes its profile to this file, as --profile-generate
+    const char* profileUse;      // profile of an earlier run, as --profile-use; NULL for none
+    const char* incremental;     // code cache kept between compilations, as --incremental; assembly only
+    int64_t evaluationFuel; // compile-time evaluation steps, as --eval-fuel; 0 for the default, negative for none
+    int reportUnroll;       // list the loops unrolled on stderr, as --report-unroll
+    int dumpAST;            // print the parsed tree to stderr, as --dump-ast
+    int printErrors;        // also print each error to stderr as "Error: ...", as the command line does
+} QuartzOptions;
+
+typedef struct QuartzContext QuartzContext;
+
+// Returns NULL when out of memory.
+QuartzContext* quartzCreateContext(void);
+void quartzDestroyContext(QuartzContext* context);
+
+// Compiles length bytes of Quartz source. The output and error message
+// stay valid until the next compilation in the same context.
+QuartzStatus quartzCompile(QuartzContext* context, const char* source, size_t length,
+                           const QuartzOptions* options);
+
+// Compiles the Quartz source or AST image at path ("-" for standard
+// input), writing the output to fd as it is produced instead of keeping
+// it. A failure may leave part of the output written.
+QuartzStatus quartzCompileFile(QuartzContext* context, const char* path, int fd, const QuartzOptions* options);
+
+// What the last successful quartzCompile produced; NUL-terminated, though
+// an AST image may also contain NUL bytes.
+const char* quartzOutput(const QuartzContext* context, size_t* length);
+
+// Why the last compilation failed. A compilation that succeeds may still
+// leave the first error it reported and recovered from; otherwise "".
+const char* quartzError(const QuartzContext* context);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include "output.h"
+
+// Output a freestanding program buffers before handing it to write(2).
+#define RUNTIME_OUTPUT_SIZE (64 * 1024)
+
+// The runtime of a program built with --freestanding, which links with
+// -nostdlib -static: _start calls main, flushes what was printed and
+// ends the process with exit_group, all through syscalls. print goes
+// through qz_print (value in edi) and a run of constant text through
+// qz_write_text (address in rdi, length in rsi).
+void emitFreestandingRuntime(Output* out, int profileGenerate);
+
+// Calls function through the PLT, or in a freestanding program makes
+// syscall number itself; the arguments are already in place. Failure
+// comes back as a value in [-4095, -1] either way, but only the libc call
+// leaves errno. A fourth argument goes in rcx for one and r10 for the
+// other.
+void emitSystemCall(Output* out, int freestanding, const char* function, int number);
+
+#endif
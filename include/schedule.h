@@ -0,0 +1,84 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdint.h>
+
+#include "output.h"
+
+typedef enum {
+    UNIT_ALU,
+    UNIT_SHIFT,
+    UNIT_LEA,
+    UNIT_SLOW_LEA,
+    UNIT_MULTIPLY,
+    UNIT_DIVIDE,
+    UNIT_LOAD,
+    UNIT_STORE,
+    UNIT_COUNT
+} Unit;
+
+// Latency and issue ports of one core, as selected by -mtune. Bit i of a
+// port mask is execution port i.
+typedef struct {
+    const char* name;
+    int issueWidth;
+    uint8_t latency[UNIT_COUNT];
+    uint16_t ports[UNIT_COUNT];
+} TuneModel;
+
+const TuneModel* findTuneModel(const char* name);
+
+#define SCHEDULE_WINDOW 64
+#define SCHEDULE_LINE_LENGTH 128
+#define SCHEDULE_ADDRESS_LENGTH 64
+
+typedef enum {
+    MEMORY_NONE,
+    MEMORY_FRAME,
+    MEMORY_STACK,
+    MEMORY_GLOBAL
+} MemoryRegion;
+
+typedef struct {
+    char text[SCHEDULE_LINE_LENGTH];
+    uint32_t uses;
+    uint32_t defs;
+    Unit unit;
+    uint8_t loads;
+    uint8_t reads;
+    uint8_t writes;
+    uint8_t indexed;
+    uint8_t fusible;
+    MemoryRegion region;
+    char address[SCHEDULE_ADDRESS_LENGTH];
+    uint32_t line;
+} ScheduledInstruction;
+
+// Codegen writes through schedule() instead of emit(). With a model set,
+// instructions are held until their basic block ends and then reordered;
+// without one they go straight out.
+//
+// With lineInfo each instruction keeps the source line that was current
+// when it was scheduled, and a .loc for file 1 goes out wherever the line
+// changes in the final order. emitSourceLine forces it out for code that
+// bypasses the scheduler.
+typedef struct {
+    Output* out;
+    const TuneModel* model;
+    ScheduledInstruction window[SCHEDULE_WINDOW];
+    int windowCount;
+    int8_t latency[SCHEDULE_WINDOW][SCHEDULE_WINDOW];
+
+    int lineInfo;
+    uint32_t sourceLine;
+    // Line of the last .loc written; 0 forces the next one out.
+    uint32_t emittedLine;
+} Scheduler;
+
+void startSchedule(Scheduler* scheduler, Output* out, const TuneModel* model, int lineInfo);
+void schedule(Scheduler* scheduler, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void flushSchedule(Scheduler* scheduler);
+void setSourceLine(Scheduler* scheduler, uint32_t line);
+void emitSourceLine(Scheduler* scheduler);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef SELECT_H
+#define SELECT_H
+
+#include "parser.h"
+
+// Patterns an expression node can be covered by. "reg" is the value
+// computed into rax, "imm" a literal that fits in a sign-extended 32-bit
+// field and "mem" a scalar's frame slot.
+typedef enum {
+    TILE_NONE,
+    TILE_PENDING,
+    TILE_GENERIC,       // the node's own code in codegen
+    TILE_IMMEDIATE,     // reg <- NUMBER                 mov / movabs / xor
+    TILE_LOAD,          // reg <- IDENTIFIER             mov rax, [rbp - n]
+    TILE_REG_IMM,       // reg <- op(reg, imm)           add rax, 5
+    TILE_REG_MEM,       // reg <- op(reg, mem)           add rax, [rbp - n]
+    TILE_MEM_IMM,       // reg <- op(mem, imm)           cmp qword ptr [rbp - n], 5
+    TILE_IMM_REG,       // reg <- op(imm, reg)           operands swapped
+    TILE_MEM_REG,       // reg <- op(mem, reg)           operands swapped
+    TILE_REG_REG,       // reg <- op(reg, reg)           left saved on the stack
+    TILE_SCALE,         // reg <- reg * {2,4,8,3,5,9}    shl / lea rax, [rax + rax*k]
+    TILE_LEA_INDEX,     // reg <- reg + reg * {2,4,8}    lea rax, [rbx + rax*k]
+    TILE_LEA_INDEX_SWAPPED, //   with the scaled operand on the left
+    TILE_INDEX,         // reg <- a[reg]
+    TILE_INDEX_OFFSET,  // reg <- a[reg +- imm]          folded into the displacement
+    TILE_INDEX_CONST    // reg <- a[imm]
+} Tile;
+
+// The cheapest tiling found for every node, filled bottom-up.
+typedef struct {
+    uint32_t* cost;
+    uint8_t* tile;
+    uint32_t count;
+} Selection;
+
+void selectInstructions(const AST* ast, NodeId program, Selection* selection);
+void freeSelection(Selection* selection);
+
+int isImmediate(const AST* ast, NodeId node);
+int isComparison(TokenType op);
+int scaleOf(const AST* ast, NodeId node);
+// Frame offset of a[index] for a constant index, or 0 if it would not
+// stay below rbp.
+int elementOffset(const AST* ast, NodeId array, int64_t index);
+int64_t indexShift(const AST* ast, NodeId index);
+
+#endif
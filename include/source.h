@@ -0,0 +1,32 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stddef.h>
+
+#include "diagnostic.h"
+
+#ifndef SOURCE_CHUNK_SIZE
+#define SOURCE_CHUNK_SIZE (64 * 1024)
+#endif
+
+// Program text, either fully in memory (data/size, fd == -1) or streamed
+// through a sliding window from fd when the input cannot be mapped.
+typedef struct {
+    int fd;
+    int mapped;
+    const char* data;
+    size_t size;
+
+    char* window;
+    size_t windowCapacity;
+    size_t windowLength;
+
+    Diagnostics* diagnostics;
+} Source;
+
+void openSource(Source* source, const char* path, Diagnostics* diagnostics);
+void openSourceBuffer(Source* source, const char* data, size_t size, Diagnostics* diagnostics);
+size_t refillSource(Source* source, const char* keep);
+void closeSource(Source* source);
+
+#endif
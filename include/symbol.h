@@ -1,25 +1,39 @@
 #ifndef SYMBOL_H
 #define SYMBOL_H
 
+#include "diagnostic.h"
+
+// Symbols in scope at once.
+#define SYMBOL_CAPACITY 512
+
 typedef struct{
-    const char* name;
-    int length;
+    int nameId;
     int offset;
     int depth;
+    // Element count for arrays, 0 for scalars.
+    int length;
 } Symbol;
 
 typedef struct {
-    Symbol symbols[512];
-    //int capacity;
+    Symbol symbols[SYMBOL_CAPACITY];
     int count;
     int currentScopeDepth;
     int currentOffset;
+    // High-water mark of currentOffset: the frame size. Slots of closed
+    // scopes are handed out again, so the two differ.
+    int frameSize;
+    // First symbol visible from the frame being parsed; function bodies
+    // cannot see main's variables.
+    int frameBase;
+    Diagnostics* diagnostics;
 }SymbolTable;
 
-void initSymbolTable(SymbolTable* table);
-void addSymbol(SymbolTable* table, const char* name, int length);
-int getSymbolOffset(SymbolTable* table, const char* name, int length);
+void initSymbolTable(SymbolTable* table, Diagnostics* diagnostics);
+void addSymbol(SymbolTable* table, int nameId);
+int getSymbolOffset(SymbolTable* table, int nameId);
+void addArray(SymbolTable* table, int nameId, int length);
+Symbol* findSymbol(SymbolTable* table, int nameId);
 void beginScope(SymbolTable* table);
 void endScope(SymbolTable* table);
 
-#endif
\ No newline at end of file
+#endif
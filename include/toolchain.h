@@ -0,0 +1,28 @@
+#ifndef TOOLCHAIN_H
+#define TOOLCHAIN_H
+
+#include <sys/types.h>
+
+typedef enum {
+    OUTPUT_ASSEMBLY,
+    OUTPUT_OBJECT,
+    OUTPUT_EXECUTABLE
+} OutputKind;
+
+typedef struct {
+    pid_t pid;
+    int input;
+    int objectFd;
+    // The .o it writes, or NULL when it writes to objectFd.
+    const char* objectPath;
+} Assembler;
+
+OutputKind outputKindFor(const char* path);
+int startAssembler(Assembler* assembler, const char* objectPath);
+void finishAssembler(Assembler* assembler);
+// Stops the assembler of a compilation that failed and removes what it
+// wrote.
+void abandonAssembler(Assembler* assembler);
+void linkExecutable(Assembler* assembler, const char* exePath, int freestanding);
+
+#endif
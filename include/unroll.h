@@ -0,0 +1,13 @@
+#ifndef UNROLL_H
+#define UNROLL_H
+
+#include "ast.h"
+#include "profile.h"
+
+// Unrolls counted while loops: fully when the trip count is known and
+// small, otherwise by a factor chosen against a node budget, with the
+// original loop left to run the remainder. With report set, what was
+// decided for every loop goes to stderr.
+void unrollLoops(AST* ast, NodeId program, const Profile* profile, int report);
+
+#endif
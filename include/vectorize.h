@@ -0,0 +1,14 @@
+#ifndef VECTORIZE_H
+#define VECTORIZE_H
+
+#include "parser.h"
+#include "profile.h"
+
+// Labels emitVectorLoop takes from *labelCount.
+#define VECTOR_LOOP_LABELS 7
+
+int isVectorLoop(const AST* ast, NodeId loop, const Profile* profile);
+int emitVectorLoop(Output* out, AST* ast, NodeId loop, int* labelCount, const Profile* profile);
+void emitVectorSupport(Output* out);
+
+#endif
@@ -1,14 +1,16 @@
 #include "arena.h"
+#include "diagnostic.h"
 
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
 
-void initArena(Arena* arena, size_t capacity){
+void initArena(Arena* arena, size_t capacity, Diagnostics* diagnostics){
+    arena->diagnostics = diagnostics;
     arena->memory = (char*)malloc(capacity);
     if(arena->memory == NULL){
-        fprintf(stderr, "Error: Failed to allocate mem arena.\n");
-        exit(74);
+        reportError(diagnostics, "Failed to allocate mem arena.");
+        fail(diagnostics, 74);
     }
     arena->capacity = capacity;
     arena->offset = 0;
@@ -16,8 +18,8 @@ void initArena(Arena* arena, size_t capacity){
 
 void* arenaAlloc(Arena* arena, size_t size){
     if(arena->offset+size > arena->capacity){
-        fprintf(stderr, "Error: Memory overflow");
-        exit(74);
+        reportError(arena->diagnostics, "Memory overflow");
+        fail(arena->diagnostics, 74);
     }
 
     size = (size+7) & ~7;
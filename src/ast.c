@@ -0,0 +1,260 @@
+#include "ast.h"
+#include "diagnostic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void* growArray(Diagnostics* diagnostics, void* array, size_t elementSize, uint32_t capacity){
+    void* grown = realloc(array, elementSize * capacity);
+    if(grown == NULL){
+        reportError(diagnostics, "Failed to grow AST storage.");
+        fail(diagnostics, 74);
+    }
+    return grown;
+}
+
+static void* ownCopy(Diagnostics* diagnostics, const void* array, size_t bytes){
+    void* copy = malloc(bytes ? bytes : 1);
+    if(copy == NULL){
+        reportError(diagnostics, "Failed to grow AST storage.");
+        fail(diagnostics, 74);
+    }
+    if(bytes > 0) memcpy(copy, array, bytes);
+    return copy;
+}
+
+// Moves columns borrowed from a mapped AST file onto the heap so they can
+// be reallocated.
+static void ownStorage(AST* ast){
+    if(!ast->borrowed) return;
+    ast->kind = ownCopy(ast->diagnostics, ast->kind, ast->count * sizeof(uint8_t));
+    ast->op = ownCopy(ast->diagnostics, ast->op, ast->count * sizeof(uint8_t));
+    ast->left = ownCopy(ast->diagnostics, ast->left, ast->count * sizeof(uint32_t));
+    ast->right = ownCopy(ast->diagnostics, ast->right, ast->count * sizeof(uint32_t));
+    ast->value = ownCopy(ast->diagnostics, ast->value, ast->count * sizeof(int32_t));
+    ast->line = ownCopy(ast->diagnostics, ast->line, ast->count * sizeof(uint32_t));
+    ast->children = ownCopy(ast->diagnostics, ast->children, ast->childCount * sizeof(NodeId));
+    ast->nameChars = ownCopy(ast->diagnostics, ast->nameChars, ast->nameCharsLength);
+    ast->nameOffsets = ownCopy(ast->diagnostics, ast->nameOffsets, ast->nameCount * sizeof(size_t));
+    ast->nameLengths = ownCopy(ast->diagnostics, ast->nameLengths, ast->nameCount * sizeof(int));
+    ast->capacity = ast->count;
+    ast->childCapacity = ast->childCount;
+    ast->nameCharsCapacity = ast->nameCharsLength;
+    ast->nameCapacity = ast->nameCount;
+    ast->borrowed = 0;
+}
+
+static void growNodes(AST* ast){
+    ownStorage(ast);
+    uint32_t capacity = ast->capacity ? ast->capacity * 2 : 1024;
+    ast->kind = growArray(ast->diagnostics, ast->kind, sizeof(uint8_t), capacity);
+    ast->op = growArray(ast->diagnostics, ast->op, sizeof(uint8_t), capacity);
+    ast->left = growArray(ast->diagnostics, ast->left, sizeof(uint32_t), capacity);
+    ast->right = growArray(ast->diagnostics, ast->right, sizeof(uint32_t), capacity);
+    ast->value = growArray(ast->diagnostics, ast->value, sizeof(int32_t), capacity);
+    ast->line = growArray(ast->diagnostics, ast->line, sizeof(uint32_t), capacity);
+    ast->capacity = capacity;
+}
+
+void initAST(AST* ast, Diagnostics* diagnostics){
+    memset(ast, 0, sizeof(AST));
+    ast->diagnostics = diagnostics;
+    growNodes(ast);
+
+    // Slot 0 is the null node.
+    ast->kind[0] = NODE_NUMBER;
+    ast->op[0] = 0;
+    ast->left[0] = 0;
+    ast->right[0] = 0;
+    ast->value[0] = 0;
+    ast->line[0] = 0;
+    ast->count = 1;
+}
+
+void freeAST(AST* ast){
+    if(ast->borrowed){
+        free(ast->nameBuckets);
+        memset(ast, 0, sizeof(AST));
+        return;
+    }
+    free(ast->kind);
+    free(ast->op);
+    free(ast->left);
+    free(ast->right);
+    free(ast->value);
+    free(ast->line);
+    free(ast->children);
+    free(ast->nameChars);
+    free(ast->nameOffsets);
+    free(ast->nameLengths);
+    free(ast->nameBuckets);
+    memset(ast, 0, sizeof(AST));
+}
+
+NodeId newNode(AST* ast, ASTNodeType kind){
+    if(ast->count == ast->capacity) growNodes(ast);
+
+    NodeId id = ast->count++;
+    ast->kind[id] = (uint8_t)kind;
+    ast->op[id] = 0;
+    ast->left[id] = NULL_NODE;
+    ast->right[id] = NULL_NODE;
+    ast->value[id] = 0;
+    ast->line[id] = ast->currentLine;
+    return id;
+}
+
+uint32_t appendChildren(AST* ast, const NodeId* ids, uint32_t count){
+    ownStorage(ast);
+    if(ast->childCount + count > ast->childCapacity){
+        uint32_t capacity = ast->childCapacity ? ast->childCapacity : 1024;
+        while(capacity < ast->childCount + count) capacity *= 2;
+        ast->children = growArray(ast->diagnostics, ast->children, sizeof(NodeId), capacity);
+        ast->childCapacity = capacity;
+    }
+
+    uint32_t first = ast->childCount;
+    if(count > 0) memcpy(ast->children + first, ids, count * sizeof(NodeId));
+    ast->childCount += count;
+    return first;
+}
+
+static uint32_t hashName(const char* name, size_t length){
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < length; i++){
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void rehashNames(AST* ast){
+    uint32_t bucketCount = ast->bucketCount ? ast->bucketCount * 2 : 256;
+    while(bucketCount <= ast->nameCount * 2) bucketCount *= 2;
+    uint32_t* buckets = (uint32_t*)calloc(bucketCount, sizeof(uint32_t));
+    if(buckets == NULL){
+        reportError(ast->diagnostics, "Failed to grow name table.");
+        fail(ast->diagnostics, 74);
+    }
+
+    for(uint32_t id = 0; id < ast->nameCount; id++){
+        uint32_t slot = hashName(nameText(ast, id), ast->nameLengths[id]) & (bucketCount - 1);
+        while(buckets[slot] != 0) slot = (slot + 1) & (bucketCount - 1);
+        buckets[slot] = id + 1;
+    }
+
+    free(ast->nameBuckets);
+    ast->nameBuckets = buckets;
+    ast->bucketCount = bucketCount;
+}
+
+int internName(AST* ast, const char* name, size_t length){
+    if(length > INT32_MAX){
+        reportError(ast->diagnostics, "Identifier too long.");
+        fail(ast->diagnostics, 65);
+    }
+    if(ast->nameCount * 2 >= ast->bucketCount) rehashNames(ast);
+
+    uint32_t mask = ast->bucketCount - 1;
+    uint32_t slot = hashName(name, length) & mask;
+    while(ast->nameBuckets[slot] != 0){
+        uint32_t id = ast->nameBuckets[slot] - 1;
+        if((size_t)ast->nameLengths[id] == length && memcmp(nameText(ast, id), name, length) == 0){
+            return (int)id;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    ownStorage(ast);
+    if(ast->nameCount == ast->nameCapacity){
+        uint32_t capacity = ast->nameCapacity ? ast->nameCapacity * 2 : 64;
+        ast->nameOffsets = growArray(ast->diagnostics, ast->nameOffsets, sizeof(size_t), capacity);
+        ast->nameLengths = growArray(ast->diagnostics, ast->nameLengths, sizeof(int), capacity);
+        ast->nameCapacity = capacity;
+    }
+
+    if(ast->nameCharsLength + length > ast->nameCharsCapacity){
+        size_t capacity = ast->nameCharsCapacity ? ast->nameCharsCapacity : 4096;
+        while(capacity < ast->nameCharsLength + length) capacity *= 2;
+        ast->nameChars = realloc(ast->nameChars, capacity);
+        if(ast->nameChars == NULL){
+            reportError(ast->diagnostics, "Failed to grow name table.");
+            fail(ast->diagnostics, 74);
+        }
+        ast->nameCharsCapacity = capacity;
+    }
+
+    uint32_t id = ast->nameCount++;
+    ast->nameOffsets[id] = ast->nameCharsLength;
+    ast->nameLengths[id] = (int)length;
+    memcpy(ast->nameChars + ast->nameCharsLength, name, length);
+    ast->nameCharsLength += length;
+    ast->nameBuckets[slot] = id + 1;
+    return (int)id;
+}
+
+void pushNode(const AST* ast, NodeList* list, NodeId id){
+    if(list->count == list->capacity){
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->items = growArray(ast->diagnostics, list->items, sizeof(NodeId), list->capacity);
+    }
+    list->items[list->count++] = id;
+}
+
+// Pushes every direct child of node, whatever its kind, so passes can walk
+// a subtree with a worklist instead of recursing.
+void pushChildren(const AST* ast, NodeId node, NodeList* list){
+    switch(ast->kind[node]){
+        case NODE_BINARY_OP:
+        case NODE_LOGICAL_AND:
+        case NODE_LOGICAL_OR:
+        case NODE_IF:
+        case NODE_WHILE:
+        case NODE_STORE:
+            pushNode(ast, list, ast->left[node]);
+            pushNode(ast, list, ast->right[node]);
+            break;
+        case NODE_ASSIGN:
+        case NODE_FUNCTION:
+        case NODE_INDEX:
+            pushNode(ast, list, ast->right[node]);
+            break;
+        case NODE_PRINT:
+        case NODE_EXPRESSION_STATEMENT:
+        case NODE_RETURN:
+            if(ast->left[node] != NULL_NODE) pushNode(ast, list, ast->left[node]);
+            break;
+        case NODE_BLOCK:
+        case NODE_CALL:
+            for(uint32_t i = 0; i < ast->right[node]; i++){
+                pushNode(ast, list, ast->children[ast->left[node] + i]);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void freeNodeList(NodeList* list){
+    free(list->items);
+    list->items = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+LogicalBranch nextLogicalBranch(const AST* ast, NodeId node, int jumpIfTrue, uint32_t* state){
+    // a && b jumps when false if either does, and a || b when true.
+    // Otherwise a decides on its own only by falling through to b.
+    int direct = (ast->kind[node] == NODE_LOGICAL_AND) != jumpIfTrue;
+    LogicalBranch branch = {NULL_NODE, jumpIfTrue, !direct};
+    if(*state == 0){
+        branch.operand = ast->left[node];
+        if(!direct) branch.jumpIfTrue = !jumpIfTrue;
+    }else if(*state == 1){
+        branch.operand = ast->right[node];
+        branch.pastRight = 0;
+    }
+    (*state)++;
+    return branch;
+}
@@ -0,0 +1,330 @@
+#include "astfile.h"
+#include "diagnostic.h"
+#include "lexer.h"
+#include "output.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t alignSection(uint64_t offset){
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+int isASTFile(const char* data, size_t size){
+    return size >= sizeof(ASTFileHeader) && memcmp(data, AST_FILE_MAGIC, 8) == 0;
+}
+
+static void emitSection(Output* out, uint64_t* written, uint64_t offset, const void* data, size_t length){
+    static const char padding[8] = {0};
+    emitBytes(out, padding, (size_t)(offset - *written));
+    emitBytes(out, data, length);
+    *written = offset + length;
+}
+
+// Writes the AST through the output batches, header first.
+void writeASTFile(Output* out, AST* ast, NodeId program, int frameSize){
+    ASTFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, AST_FILE_MAGIC, 8);
+    header.version = AST_FILE_VERSION;
+    header.program = program;
+    header.frameSize = frameSize;
+    header.nodeCount = ast->count;
+    header.childCount = ast->childCount;
+    header.nameCount = ast->nameCount;
+    header.nameCharsLength = ast->nameCharsLength;
+
+    uint64_t offset = alignSection(sizeof(header));
+    header.kindOffset = offset;        offset = alignSection(offset + ast->count * sizeof(uint8_t));
+    header.opOffset = offset;          offset = alignSection(offset + ast->count * sizeof(uint8_t));
+    header.leftOffset = offset;        offset = alignSection(offset + ast->count * sizeof(uint32_t));
+    header.rightOffset = offset;       offset = alignSection(offset + ast->count * sizeof(uint32_t));
+    header.valueOffset = offset;       offset = alignSection(offset + ast->count * sizeof(int32_t));
+    header.lineOffset = offset;        offset = alignSection(offset + ast->count * sizeof(uint32_t));
+    header.childrenOffset = offset;    offset = alignSection(offset + ast->childCount * sizeof(NodeId));
+    header.nameOffsetsOffset = offset; offset = alignSection(offset + ast->nameCount * sizeof(size_t));
+    header.nameLengthsOffset = offset; offset = alignSection(offset + ast->nameCount * sizeof(int));
+    header.nameCharsOffset = offset;
+
+    uint64_t written = 0;
+    emitSection(out, &written, 0, &header, sizeof(header));
+    emitSection(out, &written, header.kindOffset, ast->kind, ast->count * sizeof(uint8_t));
+    emitSection(out, &written, header.opOffset, ast->op, ast->count * sizeof(uint8_t));
+    emitSection(out, &written, header.leftOffset, ast->left, ast->count * sizeof(uint32_t));
+    emitSection(out, &written, header.rightOffset, ast->right, ast->count * sizeof(uint32_t));
+    emitSection(out, &written, header.valueOffset, ast->value, ast->count * sizeof(int32_t));
+    emitSection(out, &written, header.lineOffset, ast->line, ast->count * sizeof(uint32_t));
+    emitSection(out, &written, header.childrenOffset, ast->children, ast->childCount * sizeof(NodeId));
+    emitSection(out, &written, header.nameOffsetsOffset, ast->nameOffsets, ast->nameCount * sizeof(size_t));
+    emitSection(out, &written, header.nameLengthsOffset, ast->nameLengths, ast->nameCount * sizeof(int));
+    emitSection(out, &written, header.nameCharsOffset, ast->nameChars, ast->nameCharsLength);
+}
+
+static int inFile(size_t size, uint64_t offset, uint64_t count, size_t elementSize){
+    return (offset & 7) == 0 && offset <= size && count <= (size - offset) / elementSize;
+}
+
+// Where a node sits decides what kinds it may have.
+enum {
+    ROLE_EXPRESSION,
+    ROLE_STATEMENT,
+    // A statement of the program itself, where functions are defined.
+    ROLE_TOP,
+    // The body of an if, while or function.
+    ROLE_BODY
+};
+
+typedef struct {
+    NodeId node;
+    uint8_t role;
+    uint8_t inFunction;
+    // Slots the node's frame has.
+    int32_t frameSize;
+} CheckItem;
+
+typedef struct {
+    CheckItem* items;
+    uint32_t count;
+    uint32_t capacity;
+    Diagnostics* diagnostics;
+} CheckStack;
+
+static void pushCheck(CheckStack* stack, NodeId node, int role, int inFunction, int32_t frameSize){
+    if(stack->count == stack->capacity){
+        stack->capacity = stack->capacity ? stack->capacity * 2 : 64;
+        stack->items = realloc(stack->items, stack->capacity * sizeof(CheckItem));
+        if(stack->items == NULL){
+            reportError(stack->diagnostics, "Failed to allocate AST check.");
+            fail(stack->diagnostics, 74);
+        }
+    }
+    stack->items[stack->count++] = (CheckItem){node, (uint8_t)role, (uint8_t)inFunction, frameSize};
+}
+
+static int isComparisonOrArithmetic(uint8_t op){
+    switch(op){
+        case TOKEN_PLUS: case TOKEN_MINUS: case TOKEN_STAR: case TOKEN_SLASH:
+        case TOKEN_EQUAL_EQUAL: case TOKEN_BANG_EQUAL:
+        case TOKEN_LESS: case TOKEN_LESS_EQUAL: case TOKEN_GREATER: case TOKEN_GREATER_EQUAL:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int validSlot(int32_t offset, int32_t frameSize){
+    return offset > 0 && offset % 8 == 0 && offset <= frameSize;
+}
+
+// Walks the tree from the program as the parser left it: every node it
+// reaches must be a kind that belongs there, reached exactly once, with
+// its fields in range: node ids below nodeCount, child runs inside
+// children, name ids below nameCount and frame offsets inside the frame
+// that owns them. Returns what is wrong, or NULL.
+static const char* checkTree(const ASTFileHeader* header, const char* data, Diagnostics* diagnostics){
+    const uint8_t* kind = (const uint8_t*)(data + header->kindOffset);
+    const uint8_t* op = (const uint8_t*)(data + header->opOffset);
+    const uint32_t* left = (const uint32_t*)(data + header->leftOffset);
+    const uint32_t* right = (const uint32_t*)(data + header->rightOffset);
+    const int32_t* value = (const int32_t*)(data + header->valueOffset);
+    const NodeId* children = (const NodeId*)(data + header->childrenOffset);
+    uint32_t nodeCount = header->nodeCount;
+
+    if(header->program == NULL_NODE || header->program >= nodeCount || kind[header->program] != NODE_BLOCK){
+        return "no program block";
+    }
+    if(header->frameSize < 0 || header->frameSize % 8 != 0) return "bad frame size";
+
+    uint8_t* seen = calloc(nodeCount / 8 + 1, 1);
+    if(seen == NULL){
+        reportError(diagnostics, "Failed to allocate AST check.");
+        fail(diagnostics, 74);
+    }
+    CheckStack stack = {NULL, 0, 0, diagnostics};
+    const char* problem = NULL;
+    pushCheck(&stack, header->program, ROLE_BODY, 0, header->frameSize);
+    int program = 1;
+
+    while(problem == NULL && stack.count > 0){
+        CheckItem item = stack.items[--stack.count];
+        NodeId node = item.node;
+        if(node == NULL_NODE || node >= nodeCount){
+            problem = "node id out of range";
+            break;
+        }
+        if(seen[node / 8] & (1u << (node % 8))){
+            problem = "node reached twice";
+            break;
+        }
+        seen[node / 8] |= (uint8_t)(1u << (node % 8));
+
+        uint8_t k = kind[node];
+        int expression = k == NODE_NUMBER || k == NODE_IDENTIFIER || k == NODE_BINARY_OP ||
+                         k == NODE_LOGICAL_AND || k == NODE_LOGICAL_OR || k == NODE_CALL ||
+                         k == NODE_INDEX || k == NODE_READ;
+        if(k > NODE_READ ||
+           (item.role == ROLE_EXPRESSION) != expression ||
+           (item.role == ROLE_BODY && k != NODE_BLOCK) ||
+           (k == NODE_FUNCTION && item.role != ROLE_TOP) ||
+           (k == NODE_RETURN && !item.inFunction)){
+            problem = "node kind out of place";
+            break;
+        }
+        if(op[node] != 0 && k != NODE_NUMBER && k != NODE_BINARY_OP && k != NODE_FUNCTION && k != NODE_RETURN &&
+           !(k == NODE_LOGICAL_AND && op[node] == TOKEN_LOGICAL_AND) &&
+           !(k == NODE_LOGICAL_OR && op[node] == TOKEN_LOGICAL_OR)){
+            problem = "bad operator";
+            break;
+        }
+
+        int32_t frame = item.frameSize;
+        int inFunction = item.inFunction;
+        switch(k){
+            case NODE_NUMBER:
+                if(op[node] > 1) problem = "bad operator";
+                break;
+            case NODE_IDENTIFIER:
+                if(left[node] >= header->nameCount) problem = "name id out of range";
+                else if(!validSlot(value[node], frame)) problem = "frame offset out of range";
+                break;
+            case NODE_ASSIGN:
+                if(left[node] >= header->nameCount) problem = "name id out of range";
+                else if(!validSlot(value[node], frame)) problem = "frame offset out of range";
+                else pushCheck(&stack, right[node], ROLE_EXPRESSION, inFunction, frame);
+                break;
+            case NODE_BINARY_OP:
+                if(!isComparisonOrArithmetic(op[node])) problem = "bad operator";
+                /* fall through */
+            case NODE_LOGICAL_AND:
+            case NODE_LOGICAL_OR:
+                pushCheck(&stack, left[node], ROLE_EXPRESSION, inFunction, frame);
+                pushCheck(&stack, right[node], ROLE_EXPRESSION, inFunction, frame);
+                break;
+            case NODE_IF:
+            case NODE_WHILE:
+                pushCheck(&stack, left[node], ROLE_EXPRESSION, inFunction, frame);
+                pushCheck(&stack, right[node], ROLE_BODY, inFunction, frame);
+                break;
+            case NODE_BLOCK:
+            case NODE_CALL:
+                if((uint64_t)left[node] + right[node] > header->childCount){
+                    problem = "child list out of range";
+                    break;
+                }
+                if(k == NODE_CALL && ((uint32_t)value[node] >= header->nameCount || right[node] > MAX_PARAMETERS)){
+                    problem = "bad call";
+                    break;
+                }
+                for(uint32_t i = 0; i < right[node]; i++){
+                    int role = k == NODE_CALL ? ROLE_EXPRESSION : program ? ROLE_TOP : ROLE_STATEMENT;
+                    pushCheck(&stack, children[left[node] + i], role, inFunction, frame);
+                }
+                break;
+            case NODE_PRINT:
+            case NODE_EXPRESSION_STATEMENT:
+                pushCheck(&stack, left[node], ROLE_EXPRESSION, inFunction, frame);
+                break;
+            case NODE_FUNCTION:
+                if(left[node] >= header->nameCount) problem = "name id out of range";
+                else if(op[node] > MAX_PARAMETERS || value[node] < 8 * op[node] || value[node] % 8 != 0) problem = "bad function frame";
+                else pushCheck(&stack, right[node], ROLE_BODY, 1, value[node]);
+                break;
+            case NODE_RETURN:
+                if(op[node] > 1) problem = "bad operator";
+                else if(left[node] != NULL_NODE) pushCheck(&stack, left[node], ROLE_EXPRESSION, inFunction, frame);
+                break;
+            case NODE_ARRAY:
+                if(left[node] >= header->nameCount) problem = "name id out of range";
+                else if(right[node] == 0 || right[node] > MAX_ARRAY_LENGTH) problem = "bad array length";
+                else if(!validSlot(value[node], frame) || value[node] < 8 * (int64_t)right[node]) problem = "frame offset out of range";
+                break;
+            case NODE_INDEX:
+                if(left[node] >= header->nameCount) problem = "name id out of range";
+                else if(!validSlot(value[node], frame)) problem = "frame offset out of range";
+                else pushCheck(&stack, right[node], ROLE_EXPRESSION, inFunction, frame);
+                break;
+            case NODE_STORE:
+                if(right[node] == NULL_NODE || left[node] >= nodeCount || kind[left[node]] != NODE_INDEX){
+                    problem = "bad store target";
+                    break;
+                }
+                pushCheck(&stack, left[node], ROLE_EXPRESSION, inFunction, frame);
+                pushCheck(&stack, right[node], ROLE_EXPRESSION, inFunction, frame);
+                break;
+            default:
+                break;
+        }
+        program = 0;
+    }
+
+    free(stack.items);
+    free(seen);
+    return problem;
+}
+
+const char* checkASTFile(const char* data, size_t size, Diagnostics* diagnostics){
+    if(!isASTFile(data, size)) return "not an AST file";
+    ASTFileHeader header;
+    memcpy(&header, data, sizeof(header));
+    if(header.version != AST_FILE_VERSION) return "unsupported version";
+    if(header.nodeCount == 0 ||
+       !inFile(size, header.kindOffset, header.nodeCount, sizeof(uint8_t)) ||
+       !inFile(size, header.opOffset, header.nodeCount, sizeof(uint8_t)) ||
+       !inFile(size, header.leftOffset, header.nodeCount, sizeof(uint32_t)) ||
+       !inFile(size, header.rightOffset, header.nodeCount, sizeof(uint32_t)) ||
+       !inFile(size, header.valueOffset, header.nodeCount, sizeof(int32_t)) ||
+       !inFile(size, header.lineOffset, header.nodeCount, sizeof(uint32_t)) ||
+       !inFile(size, header.childrenOffset, header.childCount, sizeof(NodeId)) ||
+       !inFile(size, header.nameOffsetsOffset, header.nameCount, sizeof(size_t)) ||
+       !inFile(size, header.nameLengthsOffset, header.nameCount, sizeof(int)) ||
+       !inFile(size, header.nameCharsOffset, header.nameCharsLength, 1)){
+        return "section out of bounds";
+    }
+
+    const size_t* nameOffsets = (const size_t*)(data + header.nameOffsetsOffset);
+    const int* nameLengths = (const int*)(data + header.nameLengthsOffset);
+    for(uint32_t i = 0; i < header.nameCount; i++){
+        if(nameLengths[i] <= 0 || nameOffsets[i] > header.nameCharsLength ||
+           (uint64_t)nameLengths[i] > header.nameCharsLength - nameOffsets[i]){
+            return "name out of range";
+        }
+    }
+    return checkTree(&header, data, diagnostics);
+}
+
+// Points the AST columns straight at the mapped file: nothing is parsed
+// or copied, and pages are only faulted in as passes touch them. The
+// mapping is private and writable, so passes that rewrite nodes in place
+// just dirty their own copy of the page.
+void loadASTFile(AST* ast, char* data, size_t size, NodeId* program, int* frameSize, Diagnostics* diagnostics){
+    const char* problem = checkASTFile(data, size, diagnostics);
+    if(problem != NULL){
+        reportError(diagnostics, "Corrupt AST file: %s.", problem);
+        fail(diagnostics, 65);
+    }
+    ASTFileHeader header;
+    memcpy(&header, data, sizeof(header));
+
+    memset(ast, 0, sizeof(AST));
+    ast->kind = (uint8_t*)(data + header.kindOffset);
+    ast->op = (uint8_t*)(data + header.opOffset);
+    ast->left = (uint32_t*)(data + header.leftOffset);
+    ast->right = (uint32_t*)(data + header.rightOffset);
+    ast->value = (int32_t*)(data + header.valueOffset);
+    ast->line = (uint32_t*)(data + header.lineOffset);
+    ast->children = (NodeId*)(data + header.childrenOffset);
+    ast->nameOffsets = (size_t*)(data + header.nameOffsetsOffset);
+    ast->nameLengths = (int*)(data + header.nameLengthsOffset);
+    ast->nameChars = data + header.nameCharsOffset;
+
+    ast->count = ast->capacity = header.nodeCount;
+    ast->childCount = ast->childCapacity = header.childCount;
+    ast->nameCount = ast->nameCapacity = header.nameCount;
+    ast->nameCharsLength = ast->nameCharsCapacity = header.nameCharsLength;
+    ast->borrowed = 1;
+    ast->diagnostics = diagnostics;
+
+    *program = header.program;
+    *frameSize = header.frameSize;
+}
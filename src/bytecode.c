@@ -0,0 +1,612 @@
+#include "bytecode.h"
+#include "diagnostic.h"
+#include "select.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Compiles the optimised tree to register bytecode for --interpret. The
+// walk mirrors codegen: an explicit stack of pending nodes, each stepping
+// through states as its children finish. A node is compiled either as a
+// statement, as a value into a given register, or as a condition that
+// jumps to a label when it is false (or true), which is where compare and
+// branch fuse into one instruction.
+
+typedef enum {
+    MODE_STATEMENT,
+    MODE_VALUE,
+    MODE_JUMP_FALSE,
+    MODE_JUMP_TRUE
+} Mode;
+
+// target is the register a value goes to or the label a condition jumps
+// to. mark is the first free temporary when the node was pushed; every
+// temporary the node takes is released back to it. folded is 1 when the
+// right operand is an immediate and 2 when the left one is.
+typedef struct {
+    NodeId node;
+    uint32_t state;
+    uint8_t mode;
+    uint8_t folded;
+    int32_t target;
+    int32_t mark;
+    int32_t left;
+    int32_t right;
+    int32_t label;
+} CompileFrame;
+
+typedef struct {
+    const AST* ast;
+    Bytecode* bytecode;
+    CompileFrame* frames;
+    uint32_t frameCount;
+    uint32_t frameCapacity;
+    int32_t* labels;
+    uint32_t labelCount;
+    uint32_t labelCapacity;
+    // Function index by name id, for calls.
+    int32_t* functionIndex;
+    // Registers of the function being compiled: its frame slots, then
+    // temporaries from top up.
+    int32_t frameRegisters;
+    int32_t top;
+    int32_t registerCount;
+    int entryLabel;
+    NodeId program;
+} Compiler;
+
+static void* grow(Diagnostics* diagnostics, void* items, uint32_t* capacity, size_t size){
+    *capacity = *capacity ? *capacity * 2 : 64;
+    items = realloc(items, *capacity * size);
+    if(items == NULL){
+        reportError(diagnostics, "Failed to grow bytecode.");
+        fail(diagnostics, 74);
+    }
+    return items;
+}
+
+static void emitInstruction(Compiler* c, Opcode op, int32_t a, int32_t b, int32_t target){
+    Bytecode* bytecode = c->bytecode;
+    if(bytecode->count == bytecode->capacity){
+        bytecode->code = grow(c->ast->diagnostics, bytecode->code, &bytecode->capacity, sizeof(Instruction));
+    }
+    Instruction* instruction = &bytecode->code[bytecode->count++];
+    instruction->handler = NULL;
+    instruction->a = a;
+    instruction->b = b;
+    instruction->c = target;
+    instruction->op = (uint8_t)op;
+}
+
+static int newLabel(Compiler* c){
+    if(c->labelCount == c->labelCapacity){
+        c->labels = grow(c->ast->diagnostics, c->labels, &c->labelCapacity, sizeof(int32_t));
+    }
+    c->labels[c->labelCount] = -1;
+    return (int)c->labelCount++;
+}
+
+static void placeLabel(Compiler* c, int label){
+    c->labels[label] = (int32_t)c->bytecode->count;
+}
+
+static void pushCompileFrame(Compiler* c, NodeId node, Mode mode, int32_t target){
+    if(c->frameCount == c->frameCapacity){
+        c->frames = grow(c->ast->diagnostics, c->frames, &c->frameCapacity, sizeof(CompileFrame));
+    }
+    CompileFrame* frame = &c->frames[c->frameCount++];
+    frame->node = node;
+    frame->state = 0;
+    frame->mode = (uint8_t)mode;
+    frame->folded = 0;
+    frame->target = target;
+    frame->mark = c->top;
+    frame->left = 0;
+    frame->right = 0;
+    frame->label = 0;
+}
+
+static void popCompileFrame(Compiler* c){
+    c->top = c->frames[--c->frameCount].mark;
+}
+
+static int32_t allocateRegister(Compiler* c){
+    int32_t reg = c->top++;
+    if(c->top > c->registerCount) c->registerCount = c->top;
+    return reg;
+}
+
+static int32_t slotRegister(int32_t offset){
+    return offset / 8 - 1;
+}
+
+static int32_t variableRegister(Compiler* c, NodeId node){
+    return slotRegister(c->ast->value[node]);
+}
+
+// Variables are read in place; anything else gets a temporary and must
+// then be pushed with pushOperand.
+static int32_t operandRegister(Compiler* c, NodeId node){
+    if(c->ast->kind[node] == NODE_IDENTIFIER) return variableRegister(c, node);
+    return allocateRegister(c);
+}
+
+static void pushOperand(Compiler* c, NodeId node, int32_t reg){
+    if(c->ast->kind[node] != NODE_IDENTIFIER) pushCompileFrame(c, node, MODE_VALUE, reg);
+}
+
+static void emitConstant(Compiler* c, NodeId node, int32_t target){
+    const AST* ast = c->ast;
+    if(!ast->op[node]){
+        emitInstruction(c, OP_CONSTANT, target, ast->value[node], 0);
+        return;
+    }
+    Bytecode* bytecode = c->bytecode;
+    if(bytecode->constantCount == bytecode->constantCapacity){
+        bytecode->constants = grow(c->ast->diagnostics, bytecode->constants, &bytecode->constantCapacity, sizeof(int64_t));
+    }
+    bytecode->constants[bytecode->constantCount] = numberValue(ast, node);
+    emitInstruction(c, OP_WIDE_CONSTANT, target, (int32_t)bytecode->constantCount++, 0);
+}
+
+static Condition conditionOf(TokenType op){
+    switch(op){
+        case TOKEN_EQUAL_EQUAL: return CONDITION_EQUAL;
+        case TOKEN_BANG_EQUAL: return CONDITION_NOT_EQUAL;
+        case TOKEN_LESS: return CONDITION_LESS;
+        case TOKEN_LESS_EQUAL: return CONDITION_LESS_EQUAL;
+        case TOKEN_GREATER: return CONDITION_GREATER;
+        default: return CONDITION_GREATER_EQUAL;
+    }
+}
+
+static Condition swapCondition(Condition condition){
+    switch(condition){
+        case CONDITION_LESS: return CONDITION_GREATER;
+        case CONDITION_LESS_EQUAL: return CONDITION_GREATER_EQUAL;
+        case CONDITION_GREATER: return CONDITION_LESS;
+        case CONDITION_GREATER_EQUAL: return CONDITION_LESS_EQUAL;
+        default: return condition;
+    }
+}
+
+static Condition negateCondition(Condition condition){
+    switch(condition){
+        case CONDITION_EQUAL: return CONDITION_NOT_EQUAL;
+        case CONDITION_NOT_EQUAL: return CONDITION_EQUAL;
+        case CONDITION_LESS: return CONDITION_GREATER_EQUAL;
+        case CONDITION_LESS_EQUAL: return CONDITION_GREATER;
+        case CONDITION_GREATER: return CONDITION_LESS_EQUAL;
+        default: return CONDITION_LESS;
+    }
+}
+
+// The register of a[index] when index is a constant that stays inside
+// the frame, or -1.
+static int32_t constantElement(Compiler* c, NodeId target){
+    const AST* ast = c->ast;
+    NodeId index = ast->right[target];
+    if(!isImmediate(ast, index)) return -1;
+    int64_t reg = (int64_t)slotRegister(ast->value[target]) - ast->value[index];
+    return reg >= 0 && reg < c->frameRegisters ? (int32_t)reg : -1;
+}
+
+// Element accesses take the index in a register and the register of
+// element 0 as an immediate; an index of the form i + k folds k into that
+// immediate. Returns the node that has to be in the index register.
+static NodeId elementIndex(Compiler* c, NodeId target, int32_t* base){
+    const AST* ast = c->ast;
+    NodeId index = ast->right[target];
+    int64_t shift = indexShift(ast, index);
+    int64_t shifted = (int64_t)slotRegister(ast->value[target]) - shift;
+    if(shift != 0 && shifted > INT32_MIN && shifted < INT32_MAX){
+        *base = (int32_t)shifted;
+        return ast->left[index];
+    }
+    *base = slotRegister(ast->value[target]);
+    return index;
+}
+
+static void compileBinary(Compiler* c){
+    const AST* ast = c->ast;
+    CompileFrame* frame = &c->frames[c->frameCount - 1];
+    NodeId node = frame->node;
+    TokenType op = (TokenType)ast->op[node];
+    NodeId left = ast->left[node];
+    NodeId right = ast->right[node];
+
+    if(frame->state == 0){
+        // A 32-bit literal on the right folds into the instruction; one
+        // on the left does too when the operands can trade places.
+        NodeId first = left;
+        if(isImmediate(ast, right) && op != TOKEN_SLASH &&
+           !(op == TOKEN_MINUS && ast->value[right] == INT32_MIN)){
+            frame->folded = 1;
+        }else if(isImmediate(ast, left) && (op == TOKEN_PLUS || op == TOKEN_STAR || isComparison(op))){
+            frame->folded = 2;
+            first = right;
+        }
+        frame->state = frame->folded ? 2 : 1;
+        int32_t reg = operandRegister(c, first);
+        frame->left = reg;
+        pushOperand(c, first, reg);
+        return;
+    }
+    if(frame->state == 1){
+        frame->state = 2;
+        int32_t reg = operandRegister(c, right);
+        frame->right = reg;
+        pushOperand(c, right, reg);
+        return;
+    }
+
+    int32_t immediate = frame->folded == 1 ? ast->value[right] : frame->folded == 2 ? ast->value[left] : 0;
+    if(isComparison(op)){
+        Condition condition = conditionOf(op);
+        if(frame->folded == 2) condition = swapCondition(condition);
+        if(frame->mode == MODE_VALUE){
+            if(frame->folded) emitInstruction(c, OP_EQUAL_IMMEDIATE + condition, frame->target, frame->left, immediate);
+            else emitInstruction(c, OP_EQUAL + condition, frame->target, frame->left, frame->right);
+        }else{
+            if(frame->mode == MODE_JUMP_FALSE) condition = negateCondition(condition);
+            if(frame->folded) emitInstruction(c, OP_JUMP_EQUAL_IMMEDIATE + condition, frame->left, immediate, frame->target);
+            else emitInstruction(c, OP_JUMP_EQUAL + condition, frame->left, frame->right, frame->target);
+        }
+    }else if(frame->folded){
+        if(op == TOKEN_MINUS) immediate = -immediate;
+        emitInstruction(c, op == TOKEN_STAR ? OP_MULTIPLY_IMMEDIATE : OP_ADD_IMMEDIATE, frame->target, frame->left, immediate);
+    }else{
+        Opcode opcode = op == TOKEN_PLUS ? OP_ADD : op == TOKEN_MINUS ? OP_SUBTRACT :
+                        op == TOKEN_STAR ? OP_MULTIPLY : OP_DIVIDE;
+        emitInstruction(c, opcode, frame->target, frame->left, frame->right);
+    }
+    popCompileFrame(c);
+}
+
+// Conditions of if, while and the logical operators. Comparisons branch
+// directly; && and || split into one branch per operand; anything else is
+// computed and tested against zero.
+static void compileJump(Compiler* c){
+    const AST* ast = c->ast;
+    CompileFrame* frame = &c->frames[c->frameCount - 1];
+    NodeId node = frame->node;
+    ASTNodeType type = (ASTNodeType)ast->kind[node];
+    int jumpIfTrue = frame->mode == MODE_JUMP_TRUE;
+
+    if(type == NODE_BINARY_OP && isComparison((TokenType)ast->op[node])){
+        compileBinary(c);
+        return;
+    }
+
+    if(type == NODE_LOGICAL_AND || type == NODE_LOGICAL_OR){
+        LogicalBranch branch = nextLogicalBranch(ast, node, jumpIfTrue, &frame->state);
+        Mode mode = branch.jumpIfTrue ? MODE_JUMP_TRUE : MODE_JUMP_FALSE;
+        if(branch.operand == NULL_NODE){
+            if(branch.pastRight) placeLabel(c, frame->label);
+            popCompileFrame(c);
+        }else if(branch.pastRight){
+            frame->label = newLabel(c);
+            pushCompileFrame(c, branch.operand, mode, frame->label);
+        }else{
+            pushCompileFrame(c, branch.operand, mode, frame->target);
+        }
+        return;
+    }
+
+    if(type == NODE_NUMBER){
+        if((numberValue(ast, node) != 0) == jumpIfTrue) emitInstruction(c, OP_JUMP, 0, 0, frame->target);
+        popCompileFrame(c);
+        return;
+    }
+
+    if(frame->state == 0){
+        frame->state = 1;
+        int32_t reg = operandRegister(c, node);
+        frame->left = reg;
+        pushOperand(c, node, reg);
+        return;
+    }
+    emitInstruction(c, jumpIfTrue ? OP_JUMP_IF_NOT_ZERO : OP_JUMP_IF_ZERO, frame->left, 0, frame->target);
+    popCompileFrame(c);
+}
+
+// Arguments go to consecutive temporaries starting at frame->left, in
+// order. Returns 1 once all of them are in place.
+static int compileArguments(Compiler* c, NodeId call){
+    const AST* ast = c->ast;
+    CompileFrame* frame = &c->frames[c->frameCount - 1];
+    uint32_t count = ast->right[call];
+    NodeId* arguments = callArguments(ast, call);
+
+    if(frame->state == 0){
+        frame->left = c->top;
+        for(uint32_t i = 0; i < count; i++) allocateRegister(c);
+    }
+    while(frame->state < count){
+        NodeId argument = arguments[frame->state];
+        int32_t reg = frame->left + (int32_t)frame->state++;
+        if(ast->kind[argument] == NODE_IDENTIFIER){
+            emitInstruction(c, OP_MOVE, reg, variableRegister(c, argument), 0);
+        }else if(ast->kind[argument] == NODE_NUMBER){
+            emitConstant(c, argument, reg);
+        }else{
+            pushCompileFrame(c, argument, MODE_VALUE, reg);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void compileValue(Compiler* c){
+    const AST* ast = c->ast;
+    CompileFrame* frame = &c->frames[c->frameCount - 1];
+    NodeId node = frame->node;
+    int32_t target = frame->target;
+
+    switch((ASTNodeType)ast->kind[node]){
+        case NODE_NUMBER:
+            emitConstant(c, node, target);
+            break;
+        case NODE_IDENTIFIER: {
+            int32_t reg = variableRegister(c, node);
+            if(reg != target) emitInstruction(c, OP_MOVE, target, reg, 0);
+            break;
+        }
+        case NODE_BINARY_OP:
+            compileBinary(c);
+            return;
+        case NODE_LOGICAL_AND:
+        case NODE_LOGICAL_OR:
+            if(frame->state == 0){
+                frame->state = 1;
+                frame->label = newLabel(c);
+                pushCompileFrame(c, node, MODE_JUMP_FALSE, frame->label);
+                return;
+            }else{
+                int end = newLabel(c);
+                emitInstruction(c, OP_CONSTANT, target, 1, 0);
+                emitInstruction(c, OP_JUMP, 0, 0, end);
+                placeLabel(c, frame->label);
+                emitInstruction(c, OP_CONSTANT, target, 0, 0);
+                placeLabel(c, end);
+            }
+            break;
+        case NODE_INDEX: {
+            int32_t element = constantElement(c, node);
+            if(element >= 0){
+                emitInstruction(c, OP_MOVE, target, element, 0);
+                break;
+            }
+            int32_t base;
+            NodeId index = elementIndex(c, node, &base);
+            if(frame->state == 0){
+                frame->state = 1;
+                int32_t reg = operandRegister(c, index);
+                frame->left = reg;
+                pushOperand(c, index, reg);
+                return;
+            }
+            emitInstruction(c, OP_LOAD_ELEMENT, target, frame->left, base);
+            break;
+        }
+        case NODE_CALL:
+            if(!compileArguments(c, node)) return;
+            emitInstruction(c, OP_CALL, target, c->functionIndex[ast->value[node]], frame->left);
+            break;
+        case NODE_READ:
+            emitInstruction(c, OP_READ, target, 0, 0);
+            break;
+        default:
+            break;
+    }
+    popCompileFrame(c);
+}
+
+static void compileStatement(Compiler* c){
+    const AST* ast = c->ast;
+    CompileFrame* frame = &c->frames[c->frameCount - 1];
+    NodeId node = frame->node;
+
+    switch((ASTNodeType)ast->kind[node]){
+        case NODE_BLOCK:
+            while(frame->state < ast->right[node]){
+                if(node == c->program) c->bytecode->statementStarts[frame->state] = c->bytecode->count;
+                NodeId statement = blockStatements(ast, node)[frame->state++];
+                if(ast->kind[statement] == NODE_FUNCTION) continue;
+                pushCompileFrame(c, statement, MODE_STATEMENT, 0);
+                return;
+            }
+            break;
+        case NODE_ASSIGN: {
+            NodeId value = ast->right[node];
+            popCompileFrame(c);
+            pushCompileFrame(c, value, MODE_VALUE, slotRegister(ast->value[node]));
+            return;
+        }
+        case NODE_STORE: {
+            NodeId target = ast->left[node];
+            NodeId value = ast->right[node];
+            int32_t element = constantElement(c, target);
+            if(element >= 0){
+                popCompileFrame(c);
+                pushCompileFrame(c, value, MODE_VALUE, element);
+                return;
+            }
+            int32_t base;
+            NodeId index = elementIndex(c, target, &base);
+            if(frame->state < 2){
+                NodeId operand = frame->state == 0 ? index : value;
+                int32_t reg = operandRegister(c, operand);
+                if(frame->state++ == 0) frame->left = reg;
+                else frame->right = reg;
+                pushOperand(c, operand, reg);
+                return;
+            }
+            emitInstruction(c, OP_STORE_ELEMENT, frame->right, frame->left, base);
+            break;
+        }
+        case NODE_ARRAY: {
+            int32_t last = slotRegister(ast->value[node]) - (int32_t)ast->right[node] + 1;
+            emitInstruction(c, OP_CLEAR, last, (int32_t)ast->right[node], 0);
+            break;
+        }
+        case NODE_PRINT:
+        case NODE_EXPRESSION_STATEMENT: {
+            NodeId value = ast->left[node];
+            if(frame->state == 0){
+                frame->state = 1;
+                int32_t reg = operandRegister(c, value);
+                frame->left = reg;
+                pushOperand(c, value, reg);
+                return;
+            }
+            if(ast->kind[node] == NODE_PRINT) emitInstruction(c, OP_PRINT, frame->left, 0, 0);
+            break;
+        }
+        case NODE_IF:
+            if(frame->state == 0){
+                frame->state = 1;
+                frame->label = newLabel(c);
+                pushCompileFrame(c, ast->left[node], MODE_JUMP_FALSE, frame->label);
+                return;
+            }
+            if(frame->state == 1){
+                frame->state = 2;
+                pushCompileFrame(c, ast->right[node], MODE_STATEMENT, 0);
+                return;
+            }
+            placeLabel(c, frame->label);
+            break;
+        case NODE_WHILE:
+            // Bottom-tested: one fused compare and branch per iteration.
+            if(frame->state == 0){
+                frame->state = 1;
+                frame->label = newLabel(c);
+                newLabel(c);
+                emitInstruction(c, OP_JUMP, 0, 0, frame->label + 1);
+                placeLabel(c, frame->label);
+                pushCompileFrame(c, ast->right[node], MODE_STATEMENT, 0);
+                return;
+            }
+            if(frame->state == 1){
+                frame->state = 2;
+                placeLabel(c, frame->label + 1);
+                pushCompileFrame(c, ast->left[node], MODE_JUMP_TRUE, frame->label);
+                return;
+            }
+            break;
+        case NODE_RETURN: {
+            NodeId value = ast->left[node];
+            if(ast->op[node]){
+                // Self tail call: all arguments are computed before any
+                // parameter is overwritten, then the body restarts.
+                if(!compileArguments(c, value)) return;
+                for(uint32_t i = 0; i < ast->right[value]; i++){
+                    emitInstruction(c, OP_MOVE, (int32_t)i, frame->left + (int32_t)i, 0);
+                }
+                emitInstruction(c, OP_JUMP, 0, 0, c->entryLabel);
+                break;
+            }
+            if(value == NULL_NODE){
+                int32_t reg = allocateRegister(c);
+                emitInstruction(c, OP_CONSTANT, reg, 0, 0);
+                emitInstruction(c, OP_RETURN, reg, 0, 0);
+                break;
+            }
+            if(frame->state == 0){
+                frame->state = 1;
+                int32_t reg = operandRegister(c, value);
+                frame->left = reg;
+                pushOperand(c, value, reg);
+                return;
+            }
+            emitInstruction(c, OP_RETURN, frame->left, 0, 0);
+            break;
+        }
+        default:
+            break;
+    }
+    popCompileFrame(c);
+}
+
+// Compiles main (returns 0) or a function body (returns 1) into
+// function, ending it with a halt or with the implicit return 0 of the
+// native epilogue.
+static void compileBody(Compiler* c, NodeId body, int32_t frameSize, int returns, BytecodeFunction* function){
+    c->frameRegisters = frameSize / 8;
+    c->top = c->frameRegisters;
+    c->registerCount = c->top;
+    function->entry = c->bytecode->count;
+
+    pushCompileFrame(c, body, MODE_STATEMENT, 0);
+    while(c->frameCount > 0){
+        switch(c->frames[c->frameCount - 1].mode){
+            case MODE_STATEMENT: compileStatement(c); break;
+            case MODE_VALUE: compileValue(c); break;
+            default: compileJump(c); break;
+        }
+    }
+
+    if(returns){
+        int32_t reg = allocateRegister(c);
+        emitInstruction(c, OP_CONSTANT, reg, 0, 0);
+        emitInstruction(c, OP_RETURN, reg, 0, 0);
+    }else{
+        emitInstruction(c, OP_HALT, 0, 0, 0);
+    }
+    function->frameRegisters = (uint32_t)c->frameRegisters;
+    function->registerCount = (uint32_t)c->registerCount;
+}
+
+void compileBytecode(const AST* ast, NodeId program, const SymbolTable* table, Bytecode* bytecode){
+    Compiler c = {0};
+    c.ast = ast;
+    c.bytecode = bytecode;
+    c.program = program;
+    *bytecode = (Bytecode){0};
+
+    NodeId* statements = blockStatements(ast, program);
+    uint32_t count = ast->right[program];
+    c.functionIndex = calloc(ast->nameCount + 1, sizeof(int32_t));
+    bytecode->functions = calloc(count + 1, sizeof(BytecodeFunction));
+    bytecode->statementStarts = calloc(count + 1, sizeof(uint32_t));
+    if(c.functionIndex == NULL || bytecode->functions == NULL || bytecode->statementStarts == NULL){
+        reportError(ast->diagnostics, "Failed to allocate bytecode.");
+        fail(ast->diagnostics, 74);
+    }
+    bytecode->functionCount = 1;
+    for(uint32_t i = 0; i < count; i++){
+        if(ast->kind[statements[i]] == NODE_FUNCTION){
+            c.functionIndex[ast->left[statements[i]]] = (int32_t)bytecode->functionCount++;
+        }
+    }
+
+    compileBody(&c, program, table->frameSize, 0, &bytecode->functions[0]);
+    for(uint32_t i = 0; i < count; i++){
+        NodeId function = statements[i];
+        if(ast->kind[function] != NODE_FUNCTION) continue;
+        c.entryLabel = newLabel(&c);
+        placeLabel(&c, c.entryLabel);
+        compileBody(&c, ast->right[function], ast->value[function], 1,
+                    &bytecode->functions[c.functionIndex[ast->left[function]]]);
+    }
+
+    for(uint32_t i = 0; i < bytecode->count; i++){
+        Instruction* instruction = &bytecode->code[i];
+        if(instruction->op >= OP_JUMP_EQUAL && instruction->op <= OP_JUMP_IF_NOT_ZERO){
+            instruction->c = c.labels[instruction->c];
+        }
+    }
+
+    free(c.frames);
+    free(c.labels);
+    free(c.functionIndex);
+}
+
+void freeBytecode(Bytecode* bytecode){
+    free(bytecode->code);
+    free(bytecode->constants);
+    free(bytecode->functions);
+    free(bytecode->statementStarts);
+    *bytecode = (Bytecode){0};
+}
@@ -1,175 +1,1238 @@
 #include "codegen.h"
+#include "diagnostic.h"
+#include "output.h"
+#include "vectorize.h"
+#include "input.h"
+#include "runtime.h"
+#include "layout.h"
+#include "select.h"
+#include "schedule.h"
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-static int labelCount = 0;
+static const char* argumentRegisters[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 
-void generateAssembly(ASTNode* node, SymbolTable* table) {
-    if (node == NULL) return;
+// Everything one thread needs to generate code. The driver has one, and
+// each region worker one of its own writing to a buffer.
+typedef struct {
+    const CodegenOptions* options;
+    const Selection* selection;
+    Output* out;
+    Scheduler scheduler;
+    Diagnostics* diagnostics;
+    int labelCount;
+    // ELF symbol of the function being emitted, as prefix and name.
+    const char* symbolPrefix;
+    const char* symbolName;
+    int symbolLength;
+    // Values the stack machine currently has pushed on top of the frame.
+    // The frame itself is 16-byte aligned, so an odd count means calls
+    // need 8 bytes of padding to meet the System V alignment.
+    int stackDepth;
+    // Whether the code so far needs the support routines of vectorize.h
+    // and input.h.
+    int vectorSupport;
+    int inputSupport;
+} Codegen;
 
-    if (node->type == NODE_NUMBER) {
-        printf("  mov rax, %d\n", node->as.numberValue);
-        printf("  push rax\n");
-        return;
+static void initCodegen(Codegen* g, Output* out, const CodegenOptions* options, const Selection* selection,
+                        Diagnostics* diagnostics){
+    memset(g, 0, sizeof(*g));
+    g->options = options;
+    g->selection = selection;
+    g->out = out;
+    g->diagnostics = diagnostics;
+}
+
+#define ALIGN_FRAME(size) (((size) + 15) & ~15)
+
+static void emitPush(Codegen* g, const char* reg){
+    schedule(&g->scheduler, "  push %s\n", reg);
+    g->stackDepth++;
+}
+
+static void emitPop(Codegen* g, const char* reg){
+    schedule(&g->scheduler, "  pop %s\n", reg);
+    g->stackDepth--;
+}
+
+static void emitCounter(Codegen* g, AST* ast, NodeId node, int counter){
+    if(!g->options->profileGenerate || ast->value[node] <= 0) return;
+    schedule(&g->scheduler, "  add qword ptr [rip + qz_profile_counters + %d], 1\n", 8 * (2 * probeOf(ast, node) + counter));
+}
+
+// Cold if bodies are moved to .text.unlikely, so the likely path falls
+// straight through.
+static int placeOutOfLine(Codegen* g, AST* ast, NodeId node){
+    return g->options->placeBlocks && isColdBranch(ast, node, g->options->profile);
+}
+
+// Loop heads and function entries start on a 16-byte boundary unless
+// that would take more than 10 bytes of padding.
+static void emitAlignment(Codegen* g){
+    if(g->options->alignCode) schedule(&g->scheduler, ".p2align 4,,10\n");
+}
+
+// Call frame information. Once the prologue has run the CFA is rbp + 16
+// for the rest of the function, so a region that starts in the middle
+// only has to restate that.
+static void emitFrameState(Codegen* g){
+    schedule(&g->scheduler, ".cfi_def_cfa rbp, 16\n");
+    schedule(&g->scheduler, ".cfi_offset rbp, -16\n");
+}
+
+static void emitPrologue(Codegen* g, int frameSize){
+    schedule(&g->scheduler, "  push rbp\n");
+    schedule(&g->scheduler, ".cfi_def_cfa_offset 16\n");
+    schedule(&g->scheduler, ".cfi_offset rbp, -16\n");
+    schedule(&g->scheduler, "  mov rbp, rsp\n");
+    schedule(&g->scheduler, ".cfi_def_cfa_register rbp\n");
+    schedule(&g->scheduler, "  sub rsp, %d\n", ALIGN_FRAME(frameSize));
+}
+
+// Nothing may be scheduled between the pop and the CFA moving back to rsp.
+static void emitEpilogue(Codegen* g){
+    flushSchedule(&g->scheduler);
+    schedule(&g->scheduler, "  mov rsp, rbp\n");
+    schedule(&g->scheduler, "  pop rbp\n");
+    schedule(&g->scheduler, ".cfi_def_cfa rsp, 8\n");
+    schedule(&g->scheduler, "  ret\n");
+}
+
+static void emitFunctionStart(Codegen* g){
+    schedule(&g->scheduler, ".type %s%.*s, @function\n", g->symbolPrefix, g->symbolLength, g->symbolName);
+    schedule(&g->scheduler, "%s%.*s:\n", g->symbolPrefix, g->symbolLength, g->symbolName);
+    schedule(&g->scheduler, ".cfi_startproc\n");
+}
+
+static void emitFunctionEnd(Codegen* g){
+    schedule(&g->scheduler, ".cfi_endproc\n");
+    schedule(&g->scheduler, ".size %s%.*s, .-%s%.*s\n", g->symbolPrefix, g->symbolLength, g->symbolName, g->symbolPrefix, g->symbolLength, g->symbolName);
+}
+
+// A cold if body gets a symbol and an unwind entry of its own, as code in
+// another section cannot share the function's; the rest of the function
+// continues under a fresh entry once it is back.
+static void emitColdStart(Codegen* g, int label){
+    schedule(&g->scheduler, ".cfi_endproc\n");
+    schedule(&g->scheduler, ".pushsection .text.unlikely, \"ax\", @progbits\n");
+    schedule(&g->scheduler, ".type %s%.*s.cold.%d, @function\n", g->symbolPrefix, g->symbolLength, g->symbolName, label);
+    schedule(&g->scheduler, "%s%.*s.cold.%d:\n", g->symbolPrefix, g->symbolLength, g->symbolName, label);
+    schedule(&g->scheduler, ".cfi_startproc\n");
+    emitFrameState(g);
+}
+
+static void emitColdEnd(Codegen* g, int label){
+    schedule(&g->scheduler, ".cfi_endproc\n");
+    schedule(&g->scheduler, ".size %s%.*s.cold.%d, .-%s%.*s.cold.%d\n", g->symbolPrefix, g->symbolLength, g->symbolName, label,
+             g->symbolPrefix, g->symbolLength, g->symbolName, label);
+    schedule(&g->scheduler, ".popsection\n");
+    schedule(&g->scheduler, ".cfi_startproc\n");
+    emitFrameState(g);
+}
+
+static void emitCall(Codegen* g, const char* format, int length, const char* name){
+    int padded = g->stackDepth % 2 != 0;
+    if(padded) schedule(&g->scheduler, "  sub rsp, 8\n");
+    schedule(&g->scheduler, format, length, name);
+    if(padded) schedule(&g->scheduler, "  add rsp, 8\n");
+}
+
+// How a node's code ends: with its value in rax, or, for the condition of
+// an if, a while or a logical operator, as a branch to target taken when
+// the condition is false or when it is true.
+typedef enum {
+    MODE_VALUE,
+    MODE_JUMP_FALSE,
+    MODE_JUMP_TRUE
+} Mode;
+
+// One pending node of the walk. state counts how many of its children have
+// already been emitted; label is the first label the node allocated (a
+// node that needs two takes label and label + 1).
+typedef struct {
+    NodeId node;
+    uint32_t state;
+    int label;
+    uint8_t mode;
+    int target;
+} CodegenFrame;
+
+typedef struct {
+    CodegenFrame* frames;
+    uint32_t count;
+    uint32_t capacity;
+} CodegenStack;
+
+static void pushJump(Codegen* g, CodegenStack* stack, NodeId node, Mode mode, int target){
+    if(node == NULL_NODE) return;
+    if(stack->count == stack->capacity){
+        stack->capacity = stack->capacity ? stack->capacity * 2 : 64;
+        stack->frames = realloc(stack->frames, stack->capacity * sizeof(CodegenFrame));
+        if(stack->frames == NULL){
+            reportError(g->diagnostics, "Failed to grow codegen stack.");
+            fail(g->diagnostics, 74);
+        }
     }
+    stack->frames[stack->count].node = node;
+    stack->frames[stack->count].state = 0;
+    stack->frames[stack->count].label = 0;
+    stack->frames[stack->count].mode = (uint8_t)mode;
+    stack->frames[stack->count].target = target;
+    stack->count++;
+}
 
-    if(node -> type == NODE_IF){
-        int currentLabel = labelCount++;
-        generateAssembly(node->as.controlFlow.condition, table);
-        printf("    pop rax\n");
-        printf("    cmp rax, 0\n");
-        printf("    je .L%d\n", currentLabel);
-        generateAssembly(node->as.controlFlow.body, table);
-        printf(".L%d:\n", currentLabel);
-        return;
+static void pushFrame(Codegen* g, CodegenStack* stack, NodeId node){
+    pushJump(g, stack, node, MODE_VALUE, 0);
+}
+
+static const char* conditionCode(TokenType op, int swapped){
+    switch(op){
+        case TOKEN_EQUAL_EQUAL: return "e";
+        case TOKEN_BANG_EQUAL: return "ne";
+        case TOKEN_LESS: return swapped ? "g" : "l";
+        case TOKEN_LESS_EQUAL: return swapped ? "ge" : "le";
+        case TOKEN_GREATER: return swapped ? "l" : "g";
+        default: return swapped ? "le" : "ge";
     }
+}
 
-    if (node->type == NODE_WHILE) {
-        int labelStart = labelCount++;
-        int labelEnd = labelCount++;
-        printf(".L%d:\n", labelStart);
-        generateAssembly(node->as.controlFlow.condition, table);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je .L%d\n", labelEnd);
-        generateAssembly(node->as.controlFlow.body, table);
-        printf("  jmp .L%d\n", labelStart);
-        printf(".L%d:\n", labelEnd);
+static TokenType negateComparison(TokenType op){
+    switch(op){
+        case TOKEN_EQUAL_EQUAL: return TOKEN_BANG_EQUAL;
+        case TOKEN_BANG_EQUAL: return TOKEN_EQUAL_EQUAL;
+        case TOKEN_LESS: return TOKEN_GREATER_EQUAL;
+        case TOKEN_LESS_EQUAL: return TOKEN_GREATER;
+        case TOKEN_GREATER: return TOKEN_LESS_EQUAL;
+        default: return TOKEN_LESS;
+    }
+}
+
+static int isLeaf(const AST* ast, NodeId node){
+    return ast->kind[node] == NODE_NUMBER || ast->kind[node] == NODE_IDENTIFIER;
+}
+
+static void emitLeaf(Codegen* g, const AST* ast, NodeId node, const char* reg){
+    if(ast->kind[node] == NODE_IDENTIFIER){
+        schedule(&g->scheduler, "  mov %s, [rbp - %d]\n", reg, ast->value[node]);
+    }else if(ast->op[node]){
+        schedule(&g->scheduler, "  movabs %s, %lld\n", reg, (long long)numberValue(ast, node));
+    }else if(ast->value[node] == 0 && reg[1] == 'a'){
+        schedule(&g->scheduler, "  xor eax, eax\n");
+    }else{
+        schedule(&g->scheduler, "  mov %s, %d\n", reg, ast->value[node]);
+    }
+}
+
+// An immediate or memory operand for one of the folding tiles.
+static const char* operandText(const AST* ast, NodeId node, char* buffer, size_t size){
+    if(ast->kind[node] == NODE_NUMBER){
+        snprintf(buffer, size, "%d", ast->value[node]);
+    }else{
+        snprintf(buffer, size, "qword ptr [rbp - %d]", ast->value[node]);
+    }
+    return buffer;
+}
+
+// A comparison in a jump frame is a cmp and a conditional branch the core
+// can fuse. For a value, when tuning for a core the 0/1 result is built in
+// a zeroed ecx: setcc then writes into a register with no pending value
+// and rax is written whole, so nothing waits on a partial-register merge.
+static void emitComparison(Codegen* g, const CodegenFrame* frame, const char* left, const char* right, TokenType op, int swapped){
+    if(frame->mode != MODE_VALUE){
+        if(frame->mode == MODE_JUMP_FALSE) op = negateComparison(op);
+        schedule(&g->scheduler, "  cmp %s, %s\n", left, right);
+        schedule(&g->scheduler, "  j%s .L%d\n", conditionCode(op, swapped), frame->target);
         return;
     }
+    const char* condition = conditionCode(op, swapped);
+    if(g->options->tune != NULL){
+        schedule(&g->scheduler, "  xor ecx, ecx\n");
+        schedule(&g->scheduler, "  cmp %s, %s\n", left, right);
+        schedule(&g->scheduler, "  set%s cl\n", condition);
+        schedule(&g->scheduler, "  mov eax, ecx\n");
+    }else{
+        schedule(&g->scheduler, "  cmp %s, %s\n", left, right);
+        schedule(&g->scheduler, "  set%s al\n", condition);
+        schedule(&g->scheduler, "  movzx eax, al\n");
+    }
+}
 
-    if (node->type == NODE_BLOCK){
-        ASTNode* current = node->as.block.head;
-        while(current != NULL){
-            generateAssembly(current, table);
-            current = current->next;
+// rax = rax op operand, or operand op rax when swapped. Division is never
+// swapped and takes no immediate, so one goes through rbx.
+static void emitOperation(Codegen* g, const CodegenFrame* frame, TokenType op, const char* operand, int immediate, int swapped){
+    if(isComparison(op)){
+        emitComparison(g, frame, "rax", operand, op, swapped);
+    }else if(op == TOKEN_PLUS){
+        schedule(&g->scheduler, "  add rax, %s\n", operand);
+    }else if(op == TOKEN_MINUS){
+        if(swapped){
+            schedule(&g->scheduler, "  neg rax\n");
+            schedule(&g->scheduler, "  add rax, %s\n", operand);
+        }else{
+            schedule(&g->scheduler, "  sub rax, %s\n", operand);
         }
-        return;
+    }else if(op == TOKEN_STAR){
+        if(immediate) schedule(&g->scheduler, "  imul rax, rax, %s\n", operand);
+        else schedule(&g->scheduler, "  imul rax, %s\n", operand);
+    }else{
+        if(immediate){
+            schedule(&g->scheduler, "  mov rbx, %s\n", operand);
+            operand = "rbx";
+        }
+        schedule(&g->scheduler, "  cqo\n");
+        schedule(&g->scheduler, "  idiv %s\n", operand);
     }
+}
 
-    if(node->type == NODE_IDENTIFIER){
-        //int offset = getSymbolOffset(table, node->as.identifier.name, node->as.identifier.length);
-        if(node->as.identifier.offset == -1){
-            fprintf(stderr, "Error: Variable '%.*s' not declared\n", node->as.identifier.length, node->as.identifier.name);
-            return;
+// Steps the binary operator on top of the stack through the tile the
+// selector chose for it. Children folded into the tile as operands are
+// never visited.
+static void emitBinaryTile(Codegen* g, AST* ast, CodegenStack* stack){
+    CodegenFrame* frame = &stack->frames[stack->count - 1];
+    NodeId node = frame->node;
+    TokenType op = (TokenType)ast->op[node];
+    NodeId left = ast->left[node];
+    NodeId right = ast->right[node];
+    Tile tile = (Tile)g->selection->tile[node];
+    char operand[48];
+
+    switch(tile){
+        case TILE_REG_IMM:
+        case TILE_REG_MEM:
+        case TILE_SCALE:
+            if(frame->state == 0){
+                frame->state = 1;
+                pushFrame(g, stack, left);
+                return;
+            }
+            if(tile != TILE_SCALE){
+                emitOperation(g, frame, op, operandText(ast, right, operand, sizeof(operand)), tile == TILE_REG_IMM, 0);
+            }else if(ast->value[right] % 3 == 0 || ast->value[right] == 5){
+                schedule(&g->scheduler, "  lea rax, [rax + rax*%d]\n", ast->value[right] - 1);
+            }else{
+                schedule(&g->scheduler, "  shl rax, %d\n", ast->value[right] == 2 ? 1 : ast->value[right] == 4 ? 2 : 3);
+            }
+            break;
+        case TILE_IMM_REG:
+        case TILE_MEM_REG:
+            if(frame->state == 0){
+                frame->state = 1;
+                pushFrame(g, stack, right);
+                return;
+            }
+            emitOperation(g, frame, op, operandText(ast, left, operand, sizeof(operand)), tile == TILE_IMM_REG, 1);
+            break;
+        case TILE_MEM_IMM:
+            if(isComparison(op)){
+                char slot[48];
+                snprintf(slot, sizeof(slot), "qword ptr [rbp - %d]", ast->value[left]);
+                emitComparison(g, frame, slot, operandText(ast, right, operand, sizeof(operand)), op, 0);
+            }else{
+                schedule(&g->scheduler, "  imul rax, qword ptr [rbp - %d], %d\n", ast->value[left], ast->value[right]);
+            }
+            break;
+        case TILE_LEA_INDEX:
+        case TILE_LEA_INDEX_SWAPPED: {
+            // Operands still run left to right; whichever comes second is
+            // in rax and the first in rbx.
+            int swapped = tile == TILE_LEA_INDEX_SWAPPED;
+            NodeId scaled = swapped ? left : right;
+            if(frame->state == 0){
+                frame->state = 1;
+                pushFrame(g, stack, swapped ? ast->left[scaled] : left);
+                return;
+            }
+            if(frame->state == 1){
+                emitPush(g, "rax");
+                frame->state = 2;
+                pushFrame(g, stack, swapped ? right : ast->left[scaled]);
+                return;
+            }
+            emitPop(g, "rbx");
+            if(swapped) schedule(&g->scheduler, "  lea rax, [rax + rbx*%d]\n", scaleOf(ast, scaled));
+            else schedule(&g->scheduler, "  lea rax, [rbx + rax*%d]\n", scaleOf(ast, scaled));
+            break;
         }
-        printf("  mov rax, [rbp - %d]\n", node->as.identifier.offset);
-        printf("  push rax\n");
+        default:
+            if(frame->state == 0){
+                frame->state = 1;
+                pushFrame(g, stack, left);
+                return;
+            }
+            if(frame->state == 1){
+                emitPush(g, "rax");
+                frame->state = 2;
+                pushFrame(g, stack, right);
+                return;
+            }
+            if(op == TOKEN_SLASH){
+                schedule(&g->scheduler, "  mov rbx, rax\n");
+                emitPop(g, "rax");
+                emitOperation(g, frame, op, "rbx", 0, 0);
+            }else{
+                emitPop(g, "rbx");
+                emitOperation(g, frame, op, "rbx", 0, 1);
+            }
+            break;
+    }
+    stack->count--;
+}
+
+static void emitIndexTile(Codegen* g, AST* ast, CodegenStack* stack){
+    CodegenFrame* frame = &stack->frames[stack->count - 1];
+    NodeId node = frame->node;
+    NodeId index = ast->right[node];
+
+    switch(g->selection->tile[node]){
+        case TILE_INDEX_CONST:
+            schedule(&g->scheduler, "  mov rax, [rbp - %d]\n", elementOffset(ast, node, ast->value[index]));
+            break;
+        case TILE_INDEX_OFFSET:
+            if(frame->state == 0){
+                frame->state = 1;
+                pushFrame(g, stack, ast->left[index]);
+                return;
+            }
+            schedule(&g->scheduler, "  mov rax, [rbp + rax*8 - %d]\n", elementOffset(ast, node, indexShift(ast, index)));
+            break;
+        default:
+            if(frame->state == 0){
+                frame->state = 1;
+                pushFrame(g, stack, index);
+                return;
+            }
+            schedule(&g->scheduler, "  mov rax, [rbp + rax*8 - %d]\n", ast->value[node]);
+            break;
+    }
+    stack->count--;
+}
+
+// Steps a condition in a jump frame. Comparisons branch directly; && and
+// || split into one branch per operand; anything else is computed and
+// tested against zero.
+static void emitJumpTile(Codegen* g, AST* ast, CodegenStack* stack){
+    CodegenFrame* frame = &stack->frames[stack->count - 1];
+    NodeId node = frame->node;
+    ASTNodeType type = (ASTNodeType)ast->kind[node];
+    int jumpIfTrue = frame->mode == MODE_JUMP_TRUE;
+
+    if(type == NODE_BINARY_OP && isComparison((TokenType)ast->op[node])){
+        emitBinaryTile(g, ast, stack);
         return;
     }
 
-    if(node->type == NODE_PRINT){
-        generateAssembly(node->as.print.expression, table);
-        printf("  pop rsi\n\n");
-        printf("  lea rdi, [rip + .LC0]\n");
-        printf("  mov rax, 0\n");
-        printf("  call printf@PLT\n");
+    if(type == NODE_LOGICAL_AND || type == NODE_LOGICAL_OR){
+        LogicalBranch branch = nextLogicalBranch(ast, node, jumpIfTrue, &frame->state);
+        Mode mode = branch.jumpIfTrue ? MODE_JUMP_TRUE : MODE_JUMP_FALSE;
+        if(branch.operand == NULL_NODE){
+            if(branch.pastRight) schedule(&g->scheduler, ".L%d:\n", frame->label);
+            stack->count--;
+        }else if(branch.pastRight){
+            frame->label = g->labelCount++;
+            pushJump(g, stack, branch.operand, mode, frame->label);
+        }else{
+            pushJump(g, stack, branch.operand, mode, frame->target);
+        }
         return;
     }
 
-    if(node->type == NODE_ASSIGN){
-        generateAssembly(node->as.assign.expr, table);
-        //int offset = getSymbolOffset(table, node->as.assign.name, node->as.assign.length);
-        printf("  pop rax\n");
-        printf("  mov [rbp - %d], rax\n", node->as.assign.offset);
+    if(type == NODE_NUMBER){
+        if((numberValue(ast, node) != 0) == jumpIfTrue) schedule(&g->scheduler, "  jmp .L%d\n", frame->target);
+        stack->count--;
         return;
     }
 
-    if (node->type == NODE_BINARY_OP) {
-        generateAssembly(node->as.binaryOp.left, table);
-        generateAssembly(node->as.binaryOp.right, table);
-
-        printf("  pop rbx\n"); 
-        printf("  pop rax\n"); 
-
-        if (node->as.binaryOp.operator == TOKEN_PLUS) {
-            printf("  add rax, rbx\n");
-        } 
-        else if (node->as.binaryOp.operator == TOKEN_MINUS) {
-            printf("  sub rax, rbx\n");
-        }
-        else if (node->as.binaryOp.operator == TOKEN_STAR) {
-            printf("  imul rax, rbx\n");
-        }
-        else if (node->as.binaryOp.operator == TOKEN_SLASH) {
-            printf("  cqo\n");
-            printf("  idiv rbx\n");
-        }else if(node->as.binaryOp.operator == TOKEN_EQUAL_EQUAL){
-            printf("  cmp rax, rbx\n");
-            printf("  sete al\n");
-            printf("  movzx rax, al\n");
-        }else if(node->as.binaryOp.operator == TOKEN_LESS){
-            printf("  cmp rax, rbx\n");
-            printf("  setl al\n");
-            printf("  movzx rax, al\n");
-        }else if(node->as.binaryOp.operator == TOKEN_LESS_EQUAL){
-            printf("  cmp rax, rbx\n");
-            printf("  setle al\n");
-            printf("  movzx rax, al\n");
-        }else if(node->as.binaryOp.operator == TOKEN_GREATER){
-            printf("  cmp rax, rbx\n");
-            printf("  setg al\n");
-            printf("  movzx rax, al\n");
-        }else if(node->as.binaryOp.operator == TOKEN_GREATER_EQUAL){
-            printf("  cmp rax, rbx\n");
-            printf("  setge al\n");
-            printf("  movzx rax, al\n");
-        }else if(node->as.binaryOp.operator == TOKEN_BANG_EQUAL){
-            printf("  cmp rax, rbx\n");
-            printf("  setne al\n");
-            printf("  movzx rax, al\n");
-        }
-        
-        printf("  push rax\n");
+    if(frame->state == 0){
+        frame->state = 1;
+        pushFrame(g, stack, node);
         return;
     }
+    schedule(&g->scheduler, "  test rax, rax\n");
+    schedule(&g->scheduler, "  %s .L%d\n", jumpIfTrue ? "jne" : "je", frame->target);
+    stack->count--;
+}
 
-    if (node->type == NODE_LOGICAL_AND) {
-        int labelFalse = labelCount++;
-        int labelEnd = labelCount++;
+// The address a store writes to, folded the same way as a load: returns
+// the displacement and sets *index to the expression that has to be in a
+// register, if any.
+static int storeTarget(const AST* ast, NodeId target, NodeId* index){
+    NodeId expression = ast->right[target];
+    int offset;
+    *index = NULL_NODE;
+    if(isImmediate(ast, expression) && (offset = elementOffset(ast, target, ast->value[expression]))){
+        return offset;
+    }
+    int64_t shift = indexShift(ast, expression);
+    if(shift != 0 && (offset = elementOffset(ast, target, shift))){
+        *index = ast->left[expression];
+        return offset;
+    }
+    *index = expression;
+    return ast->value[target];
+}
 
-        generateAssembly(node->as.binaryOp.left, table);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je .L%d\n", labelFalse);
+static int isConstantPrint(const AST* ast, NodeId statement){
+    return ast->kind[statement] == NODE_PRINT && ast->kind[ast->left[statement]] == NODE_NUMBER;
+}
 
-        generateAssembly(node->as.binaryOp.right, table);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je .L%d\n", labelFalse);
+// A run of prints of constants, as partial evaluation leaves behind, is
+// written out by one fwrite of its text instead of a printf per line, or
+// by one qz_write_text in a freestanding program.
+// Returns how many statements the run covered.
+static uint32_t emitPrintRun(Codegen* g, const AST* ast, const NodeId* statements, uint32_t count){
+    uint32_t run = 0;
+    while(run < count && isConstantPrint(ast, statements[run])) run++;
+    if(run < 2) return 0;
 
-        printf("  mov rax, 1\n");
-        printf("  jmp .L%d\n", labelEnd);
+    int label = g->labelCount++;
+    size_t length = 0;
+    schedule(&g->scheduler, ".pushsection .rodata\n");
+    schedule(&g->scheduler, ".L%d:\n", label);
+    for(uint32_t i = 0; i < run; i++){
+        char text[24];
+        int written = snprintf(text, sizeof(text), "%" PRId64, numberValue(ast, ast->left[statements[i]]));
+        schedule(&g->scheduler, "  .ascii \"%s\\n\"\n", text);
+        length += (size_t)written + 1;
+    }
+    schedule(&g->scheduler, ".popsection\n");
+    schedule(&g->scheduler, "  lea rdi, [rip + .L%d]\n", label);
+    if(g->options->freestanding){
+        schedule(&g->scheduler, "  mov esi, %zu\n", length);
+        emitCall(g, "  call %.*s\n", 13, "qz_write_text");
+        return run;
+    }
+    schedule(&g->scheduler, "  mov esi, 1\n");
+    schedule(&g->scheduler, "  mov edx, %zu\n", length);
+    schedule(&g->scheduler, "  mov rcx, qword ptr [rip + stdout@GOTPCREL]\n");
+    schedule(&g->scheduler, "  mov rcx, qword ptr [rcx]\n");
+    emitCall(g, "  call %.*s@PLT\n", 6, "fwrite");
+    return run;
+}
 
-        printf(".L%d:\n", labelFalse);
-        printf("  mov rax, 0\n");
+// Walks the tree with an explicit stack so that arbitrarily deep
+// expressions cannot overflow the C stack. Each case emits the code that
+// goes before, between and after its children as state advances.
+// Function definitions met inside the tree are skipped; generateProgram
+// emits them separately after main.
+static void generateAssembly(Codegen* g, AST* ast, NodeId root, SymbolTable* table) {
+    (void)table;
+    CodegenStack stack = {NULL, 0, 0};
+    pushFrame(g, &stack, root);
+    g->stackDepth = 0;
 
-        printf(".L%d:\n", labelEnd);
-        printf("  push rax\n");
-        return;
+    // Body label of the function being emitted; its return label is the
+    // next one.
+    int functionLabel = 0;
+
+    while (stack.count > 0) {
+        CodegenFrame* frame = &stack.frames[stack.count - 1];
+        NodeId node = frame->node;
+        ASTNodeType type = (ASTNodeType)ast->kind[node];
+        setSourceLine(&g->scheduler, ast->line[node]);
+
+        if(frame->mode != MODE_VALUE){
+            emitJumpTile(g, ast, &stack);
+            continue;
+        }
+
+        if (type == NODE_NUMBER) {
+            emitLeaf(g, ast, node, "rax");
+            stack.count--;
+            continue;
+        }
+
+        if(type == NODE_IF){
+            NodeId condition = ast->left[node];
+            if(frame->state == 0){
+                frame->label = g->labelCount++;
+                emitCounter(g, ast, node, PROBE_REACHED);
+                if(placeOutOfLine(g, ast, node)){
+                    int cold = g->labelCount++;
+                    frame->state = 3;
+                    pushJump(g, &stack, condition, MODE_JUMP_TRUE, cold);
+                }else{
+                    frame->state = 1;
+                    pushJump(g, &stack, condition, MODE_JUMP_FALSE, frame->label);
+                }
+            }else if(frame->state == 1){
+                emitCounter(g, ast, node, PROBE_TAKEN);
+                frame->state = 2;
+                pushFrame(g, &stack, ast->right[node]);
+            }else if(frame->state == 2){
+                schedule(&g->scheduler, ".L%d:\n", frame->label);
+                stack.count--;
+            }else if(frame->state == 3){
+                emitColdStart(g, frame->label);
+                schedule(&g->scheduler, ".L%d:\n", frame->label + 1);
+                emitCounter(g, ast, node, PROBE_TAKEN);
+                frame->state = 4;
+                pushFrame(g, &stack, ast->right[node]);
+            }else{
+                NodeId body = ast->right[node];
+                uint32_t count = ast->right[body];
+                if(count == 0 || ast->kind[blockStatements(ast, body)[count - 1]] != NODE_RETURN){
+                    schedule(&g->scheduler, "  jmp .L%d\n", frame->label);
+                }
+                emitColdEnd(g, frame->label);
+                schedule(&g->scheduler, ".L%d:\n", frame->label);
+                stack.count--;
+            }
+            continue;
+        }
+
+        if (type == NODE_WHILE) {
+            // Rotated: a guard skips the loop, and the body ends in the
+            // only branch of each iteration, a test back to its top.
+            NodeId condition = ast->left[node];
+            if(frame->state == 0){
+                // A vectorised copy runs first; the scalar loop below then
+                // only sees the remainder.
+                if(g->options->vectorize){
+                    flushSchedule(&g->scheduler);
+                    emitSourceLine(&g->scheduler);
+                    if(emitVectorLoop(g->out, ast, node, &g->labelCount, g->options->profile)) g->vectorSupport = 1;
+                }
+                frame->label = g->labelCount++;
+                g->labelCount++;
+                emitCounter(g, ast, node, PROBE_REACHED);
+                frame->state = 1;
+                pushJump(g, &stack, condition, MODE_JUMP_FALSE, frame->label + 1);
+            }else if(frame->state == 1){
+                emitAlignment(g);
+                schedule(&g->scheduler, ".L%d:\n", frame->label);
+                emitCounter(g, ast, node, PROBE_TAKEN);
+                frame->state = 2;
+                pushFrame(g, &stack, ast->right[node]);
+            }else if(frame->state == 2){
+                emitCounter(g, ast, node, PROBE_REACHED);
+                frame->state = 3;
+                pushJump(g, &stack, condition, MODE_JUMP_TRUE, frame->label);
+            }else{
+                schedule(&g->scheduler, ".L%d:\n", frame->label + 1);
+                stack.count--;
+            }
+            continue;
+        }
+
+        if (type == NODE_BLOCK){
+            if(frame->state < ast->right[node]){
+                const NodeId* statements = blockStatements(ast, node);
+                uint32_t run = emitPrintRun(g, ast, statements + frame->state, ast->right[node] - frame->state);
+                if(run > 0){
+                    frame->state += run;
+                    continue;
+                }
+                NodeId statement = statements[frame->state];
+                frame->state++;
+                pushFrame(g, &stack, statement);
+            }else{
+                stack.count--;
+            }
+            continue;
+        }
+
+        if(type == NODE_IDENTIFIER){
+            stack.count--;
+            emitLeaf(g, ast, node, "rax");
+            continue;
+        }
+
+        if(type == NODE_PRINT){
+            NodeId value = ast->left[node];
+            if(frame->state == 0 && !isLeaf(ast, value)){
+                frame->state = 1;
+                pushFrame(g, &stack, value);
+            }else if(g->options->freestanding){
+                if(isLeaf(ast, value)) emitLeaf(g, ast, value, "rdi");
+                else schedule(&g->scheduler, "  mov rdi, rax\n");
+                emitCall(g, "  call %.*s\n", 8, "qz_print");
+                stack.count--;
+            }else{
+                if(isLeaf(ast, value)) emitLeaf(g, ast, value, "rsi");
+                else schedule(&g->scheduler, "  mov rsi, rax\n");
+                schedule(&g->scheduler, "  lea rdi, [rip + .LC0]\n");
+                schedule(&g->scheduler, "  mov rax, 0\n");
+                emitCall(g, "  call %.*s@PLT\n", 6, "printf");
+                stack.count--;
+            }
+            continue;
+        }
+
+        if(type == NODE_EXPRESSION_STATEMENT){
+            if(frame->state == 0){
+                frame->state = 1;
+                pushFrame(g, &stack, ast->left[node]);
+            }else{
+                stack.count--;
+            }
+            continue;
+        }
+
+        if(type == NODE_ASSIGN){
+            NodeId value = ast->right[node];
+            if(isImmediate(ast, value)){
+                schedule(&g->scheduler, "  mov qword ptr [rbp - %d], %d\n", ast->value[node], ast->value[value]);
+                stack.count--;
+            }else if(frame->state == 0){
+                frame->state = 1;
+                pushFrame(g, &stack, value);
+            }else{
+                //int offset = getSymbolOffset(table, ast->left[node]);
+                schedule(&g->scheduler, "  mov [rbp - %d], rax\n", ast->value[node]);
+                stack.count--;
+            }
+            continue;
+        }
+
+        if (type == NODE_BINARY_OP) {
+            emitBinaryTile(g, ast, &stack);
+            continue;
+        }
+
+        if (type == NODE_LOGICAL_AND || type == NODE_LOGICAL_OR) {
+            // AND jumps to its false label on the first false operand, OR
+            // to its true label on the first true one.
+            int isAnd = type == NODE_LOGICAL_AND;
+            Mode shortCircuit = isAnd ? MODE_JUMP_FALSE : MODE_JUMP_TRUE;
+
+            if(frame->state == 0){
+                frame->label = g->labelCount++;
+                g->labelCount++;
+                frame->state = 1;
+                pushJump(g, &stack, ast->left[node], shortCircuit, frame->label);
+            }else if(frame->state == 1){
+                frame->state = 2;
+                pushJump(g, &stack, ast->right[node], shortCircuit, frame->label);
+            }else{
+                schedule(&g->scheduler, "  mov rax, %d\n", isAnd ? 1 : 0);
+                schedule(&g->scheduler, "  jmp .L%d\n", frame->label + 1);
+
+                schedule(&g->scheduler, ".L%d:\n", frame->label);
+                schedule(&g->scheduler, "  mov rax, %d\n", isAnd ? 0 : 1);
+
+                schedule(&g->scheduler, ".L%d:\n", frame->label + 1);
+                stack.count--;
+            }
+            continue;
+        }
+
+        if(type == NODE_ARRAY){
+            schedule(&g->scheduler, "  lea rdi, [rbp - %d]\n", ast->value[node]);
+            schedule(&g->scheduler, "  mov rcx, %u\n", ast->right[node]);
+            schedule(&g->scheduler, "  xor eax, eax\n");
+            schedule(&g->scheduler, "  rep stosq\n");
+            stack.count--;
+            continue;
+        }
+
+        if(type == NODE_INDEX){
+            emitIndexTile(g, ast, &stack);
+            continue;
+        }
+
+        if(type == NODE_STORE){
+            NodeId index;
+            NodeId value = ast->right[node];
+            int offset = storeTarget(ast, ast->left[node], &index);
+            if(frame->state == 0){
+                frame->state = 1;
+                pushFrame(g, &stack, index);
+            }else if(frame->state == 1 && isImmediate(ast, value)){
+                if(index != NULL_NODE) schedule(&g->scheduler, "  mov qword ptr [rbp + rax*8 - %d], %d\n", offset, ast->value[value]);
+                else schedule(&g->scheduler, "  mov qword ptr [rbp - %d], %d\n", offset, ast->value[value]);
+                stack.count--;
+            }else if(frame->state == 1){
+                if(index != NULL_NODE) emitPush(g, "rax");
+                frame->state = 2;
+                pushFrame(g, &stack, value);
+            }else{
+                if(index != NULL_NODE){
+                    emitPop(g, "rbx");
+                    schedule(&g->scheduler, "  mov [rbp + rbx*8 - %d], rax\n", offset);
+                }else{
+                    schedule(&g->scheduler, "  mov [rbp - %d], rax\n", offset);
+                }
+                stack.count--;
+            }
+            continue;
+        }
+
+        if(type == NODE_FUNCTION){
+            if(node != root){
+                stack.count--;
+                continue;
+            }
+            if(frame->state == 0){
+                int nameId = ast->left[node];
+                // Functions the profiled run never called go with the
+                // other cold code.
+                int cold = g->options->placeBlocks && isColdFunction(ast, node, g->options->profile);
+                if(cold) schedule(&g->scheduler, ".pushsection .text.unlikely, \"ax\", @progbits\n");
+                schedule(&g->scheduler, "\n");
+                emitAlignment(g);
+                g->symbolPrefix = "qz_";
+                g->symbolName = nameText(ast, nameId);
+                g->symbolLength = ast->nameLengths[nameId];
+                emitFunctionStart(g);
+                emitPrologue(g, ast->value[node]);
+                for(int i = 0; i < ast->op[node]; i++){
+                    schedule(&g->scheduler, "  mov [rbp - %d], %s\n", 8 * (i + 1), argumentRegisters[i]);
+                }
+                emitCounter(g, ast, ast->right[node], PROBE_REACHED);
+                functionLabel = g->labelCount++;
+                g->labelCount++;
+                frame->label = functionLabel;
+                schedule(&g->scheduler, ".L%d:\n", functionLabel);
+                frame->state = cold ? 2 : 1;
+                pushFrame(g, &stack, ast->right[node]);
+            }else{
+                schedule(&g->scheduler, "  mov rax, 0\n");
+                schedule(&g->scheduler, ".L%d:\n", frame->label + 1);
+                emitEpilogue(g);
+                emitFunctionEnd(g);
+                if(frame->state == 2) schedule(&g->scheduler, ".popsection\n");
+                stack.count--;
+            }
+            continue;
+        }
+
+        if(type == NODE_READ){
+            g->inputSupport = 1;
+            emitCall(g, "  call %.*s\n", 7, "qz_read");
+            stack.count--;
+            continue;
+        }
+
+        if(type == NODE_CALL){
+            // Arguments with code of their own run left to right, each
+            // parked on the stack while the next one needs rax. Constants
+            // and variables are loaded straight into their registers at
+            // the end. label is one past the last argument computed.
+            uint32_t count = ast->right[node];
+            NodeId* arguments = callArguments(ast, node);
+            while(frame->state < count && isLeaf(ast, arguments[frame->state])) frame->state++;
+            if(frame->state < count){
+                if(frame->label > 0) emitPush(g, "rax");
+                frame->label = (int)frame->state + 1;
+                frame->state++;
+                pushFrame(g, &stack, arguments[frame->label - 1]);
+            }else{
+                if(frame->label > 0) schedule(&g->scheduler, "  mov %s, rax\n", argumentRegisters[frame->label - 1]);
+                for(int i = frame->label - 1; i-- > 0;){
+                    if(!isLeaf(ast, arguments[i])) emitPop(g, argumentRegisters[i]);
+                }
+                for(uint32_t i = 0; i < count; i++){
+                    if(isLeaf(ast, arguments[i])) emitLeaf(g, ast, arguments[i], argumentRegisters[i]);
+                }
+                int nameId = ast->value[node];
+                emitCall(g, "  call qz_%.*s\n", ast->nameLengths[nameId], nameText(ast, nameId));
+                stack.count--;
+            }
+            continue;
+        }
+
+        if(type == NODE_RETURN){
+            NodeId value = ast->left[node];
+            if(ast->op[node]){
+                // Self tail call: evaluate every argument before any
+                // parameter is overwritten, then restart the body.
+                uint32_t count = ast->right[value];
+                if(frame->state < count){
+                    NodeId argument = callArguments(ast, value)[frame->state];
+                    if(frame->state > 0) emitPush(g, "rax");
+                    frame->state++;
+                    pushFrame(g, &stack, argument);
+                }else{
+                    if(count > 0) schedule(&g->scheduler, "  mov [rbp - %d], rax\n", 8 * count);
+                    for(uint32_t i = count > 0 ? count - 1 : 0; i-- > 0;){
+                        emitPop(g, "rax");
+                        schedule(&g->scheduler, "  mov [rbp - %d], rax\n", 8 * (i + 1));
+                    }
+                    schedule(&g->scheduler, "  jmp .L%d\n", functionLabel);
+                    stack.count--;
+                }
+                continue;
+            }
+            if(frame->state == 0 && value != NULL_NODE){
+                frame->state = 1;
+                pushFrame(g, &stack, value);
+                continue;
+            }
+            if(value == NULL_NODE) schedule(&g->scheduler, "  mov rax, 0\n");
+            schedule(&g->scheduler, "  jmp .L%d\n", functionLabel + 1);
+            stack.count--;
+            continue;
+        }
+
+        stack.count--;
     }
 
-    if (node->type == NODE_LOGICAL_OR) {
-        int labelTrue = labelCount++;
-        int labelEnd = labelCount++;
+    free(stack.frames);
+}
 
-        generateAssembly(node->as.binaryOp.left, table);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  jne .L%d\n", labelTrue);
+// The program is generated in regions: each function, and runs of main's
+// top-level statements of at least REGION_NODES nodes. A region starts
+// with a fresh schedule and numbers its labels from a base of its own, so
+// its text is the same whichever thread generates it; with jobs, worker
+// threads generate regions into buffers of their own and the buffers go
+// out in source order, byte for byte what a serial run writes.
+#define REGION_NODES 4096
 
-        generateAssembly(node->as.binaryOp.right, table);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  jne .L%d\n", labelTrue);
+typedef struct {
+    // Statements [first, end) of the program; a main region skips the
+    // functions among them.
+    uint32_t first;
+    uint32_t end;
+    int function;
+    int labelBase;
+    int64_t labels;
+    // With --incremental, what its code is cached under and the line that
+    // code's lines are relative to.
+    uint64_t key;
+    uint32_t line;
+    // Filled in by the worker that generated the region, or taken from the
+    // incremental cache.
+    char* text;
+    size_t length;
+    int vectorSupport;
+    int inputSupport;
+    int status;
+    char message[256];
+} Region;
 
-        printf("  mov rax, 0\n");
-        printf("  jmp .L%d\n", labelEnd);
+typedef struct {
+    Region* regions;
+    uint32_t count;
+    uint32_t capacity;
+} RegionList;
 
-        printf(".L%d:\n", labelTrue);
-        printf("  mov rax, 1\n");
+typedef struct {
+    AST* ast;
+    NodeId program;
+    SymbolTable* table;
+    const CodegenOptions* options;
+    const Selection* selection;
+    RegionList* list;
+    atomic_uint next;
+    atomic_int failed;
+} RegionQueue;
 
-        printf(".L%d:\n", labelEnd);
-        printf("  push rax\n");
-        return;
+static Region* addRegion(Codegen* g, RegionList* list, uint32_t first, int function){
+    if(list->count == list->capacity){
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->regions = realloc(list->regions, list->capacity * sizeof(Region));
+        if(list->regions == NULL){
+            reportError(g->diagnostics, "Failed to allocate codegen regions.");
+            fail(g->diagnostics, 74);
+        }
+    }
+    Region* region = &list->regions[list->count++];
+    memset(region, 0, sizeof(*region));
+    region->first = first;
+    region->end = first + 1;
+    region->function = function;
+    return region;
+}
+
+// Labels a statement's code can take: a while condition is emitted twice,
+// as guard and as bottom test, a loop may get a vectorised copy, and a
+// print may start a run written in one piece.
+static int64_t labelBound(const AST* ast, NodeId root, NodeList* work, uint32_t* nodes){
+    int64_t labels = 0;
+    work->count = 0;
+    pushNode(ast, work, root);
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        (*nodes)++;
+        switch(ast->kind[node]){
+            case NODE_IF:
+            case NODE_FUNCTION:
+                labels += 2;
+                break;
+            case NODE_WHILE:
+                labels += 2 + VECTOR_LOOP_LABELS;
+                break;
+            case NODE_LOGICAL_AND:
+            case NODE_LOGICAL_OR:
+                labels += 4;
+                break;
+            case NODE_PRINT:
+                labels += 1;
+                break;
+            default:
+                break;
+        }
+        pushChildren(ast, node, work);
+    }
+    return labels;
+}
+
+// Main's regions come first, in order, then one per function; label bases
+// follow the same order. An incremental compilation closes a region after
+// every statement, save within a run of constant prints, so that an edit
+// only invalidates the code of the statement it touched.
+static void splitRegions(Codegen* g, const AST* ast, NodeId program, RegionList* list){
+    NodeId* statements = blockStatements(ast, program);
+    uint32_t count = ast->right[program];
+    NodeList work = {NULL, 0, 0};
+    Region* open = NULL;
+    uint32_t openNodes = 0;
+    for(uint32_t i = 0; i < count; i++){
+        if(ast->kind[statements[i]] == NODE_FUNCTION) continue;
+        if(open == NULL){
+            open = addRegion(g, list, i, 0);
+            openNodes = 0;
+        }
+        open->labels += labelBound(ast, statements[i], &work, &openNodes);
+        open->end = i + 1;
+        if(openNodes >= REGION_NODES) open = NULL;
+        else if(g->options->incremental != NULL &&
+                !(i + 1 < count && isConstantPrint(ast, statements[i]) && isConstantPrint(ast, statements[i + 1]))){
+            open = NULL;
+        }
+    }
+    for(uint32_t i = 0; i < count; i++){
+        if(ast->kind[statements[i]] != NODE_FUNCTION) continue;
+        uint32_t nodes = 0;
+        addRegion(g, list, i, 1)->labels = labelBound(ast, statements[i], &work, &nodes);
+    }
+    freeNodeList(&work);
+
+    int64_t base = 0;
+    for(uint32_t i = 0; i < list->count; i++){
+        list->regions[i].labelBase = (int)base;
+        base += list->regions[i].labels;
+        if(base > INT_MAX){
+            reportError(g->diagnostics, "Program has too many branches to label.");
+            fail(g->diagnostics, 70);
+        }
+    }
+}
+
+static void generateRegion(Codegen* g, AST* ast, NodeId program, const Region* region, SymbolTable* table){
+    startSchedule(&g->scheduler, g->out, g->options->tune, g->options->sourceName != NULL);
+    g->labelCount = region->labelBase;
+    g->symbolPrefix = "";
+    g->symbolName = "main";
+    g->symbolLength = 4;
+    NodeId* statements = blockStatements(ast, program);
+    for(uint32_t i = region->first; i < region->end; i++){
+        if(!region->function){
+            uint32_t run = emitPrintRun(g, ast, statements + i, region->end - i);
+            if(run > 0){
+                i += run - 1;
+                continue;
+            }
+        }
+        if(region->function || ast->kind[statements[i]] != NODE_FUNCTION){
+            generateAssembly(g, ast, statements[i], table);
+        }
+    }
+    flushSchedule(&g->scheduler);
+}
+
+// Code generation settings that a region's text depends on besides its
+// tree.
+static uint64_t optionsFingerprint(const CodegenOptions* options){
+    uint64_t settings[] = {
+        (uint64_t)options->vectorize, (uint64_t)options->placeBlocks, (uint64_t)options->alignCode,
+        (uint64_t)options->profileGenerate, options->probeCount, options->probeChecksum,
+        options->sourceName != NULL, (uint64_t)options->freestanding,
+    };
+    uint64_t hash = hashBytes(0, settings, sizeof(settings));
+    if(options->tune != NULL) hash = hashBytes(hash, options->tune->name, strlen(options->tune->name));
+    if(options->profile != NULL){
+        hash = hashBytes(hash, options->profile->counts, 2 * (size_t)options->profile->probeCount * sizeof(uint64_t));
+    }
+    return hash;
+}
+
+// Takes the code of every region whose tree was compiled before from the
+// incremental cache; only the others are generated.
+static void spliceRegions(Codegen* g, const AST* ast, NodeId program, RegionList* list){
+    IncrementalCache* cache = g->options->incremental;
+    setFragmentFingerprint(cache, optionsFingerprint(g->options));
+    NodeId* statements = blockStatements(ast, program);
+    NodeList work = {NULL, 0, 0};
+    for(uint32_t i = 0; i < list->count; i++){
+        Region* region = &list->regions[i];
+        region->key = hashStatements(ast, statements + region->first, region->end - region->first,
+                                     g->options->sourceName != NULL, &work);
+        region->line = ast->line[statements[region->first]];
+        if(reuseFragment(cache, region->key, region->labelBase, region->line, &region->text, &region->length,
+                         &region->vectorSupport, &region->inputSupport)){
+            g->vectorSupport |= region->vectorSupport;
+            g->inputSupport |= region->inputSupport;
+        }
+    }
+    freeNodeList(&work);
+}
+
+// Takes regions off the queue until none are left. Failures are kept
+// with the region for the driver to report, as a worker cannot end the
+// compilation itself.
+static void* regionWorker(void* argument){
+    RegionQueue* queue = argument;
+    Diagnostics diagnostics;
+    Output out;
+    Codegen g;
+    for(;;){
+        uint32_t index = atomic_fetch_add(&queue->next, 1);
+        if(index >= queue->list->count || atomic_load(&queue->failed)) break;
+        Region* region = &queue->list->regions[index];
+        if(region->text != NULL) continue;
+        diagnostics.print = 0;
+        diagnostics.message[0] = '\0';
+        initOutputBuffer(&out, &diagnostics);
+        initCodegen(&g, &out, queue->options, queue->selection, &diagnostics);
+        int status = setjmp(diagnostics.failure);
+        if(status == 0){
+            generateRegion(&g, queue->ast, queue->program, region, queue->table);
+            region->text = takeOutputBuffer(&out, &region->length);
+            // Incremental regions are many and small, and are kept until
+            // the cache is written.
+            if(queue->options->incremental != NULL){
+                char* fitted = realloc(region->text, region->length + 1);
+                if(fitted != NULL) region->text = fitted;
+            }
+        }else{
+            region->status = status;
+            atomic_store(&queue->failed, 1);
+        }
+        memcpy(region->message, diagnostics.message, sizeof(region->message));
+        region->vectorSupport = g.vectorSupport;
+        region->inputSupport = g.inputSupport;
+        discardOutput(&out);
+    }
+    return NULL;
+}
+
+// Returns 0, having generated nothing, when no thread could be started.
+static int generateRegionsInParallel(Codegen* g, AST* ast, NodeId program, SymbolTable* table, RegionList* list, int jobs){
+    RegionQueue queue = {ast, program, table, g->options, g->selection, list, 0, 0};
+    if((uint32_t)jobs > list->count) jobs = (int)list->count;
+    pthread_t* threads = malloc((size_t)jobs * sizeof(pthread_t));
+    if(threads == NULL){
+        reportError(g->diagnostics, "Failed to allocate codegen threads.");
+        fail(g->diagnostics, 74);
+    }
+    int started = 0;
+    while(started < jobs && pthread_create(&threads[started], NULL, regionWorker, &queue) == 0) started++;
+    for(int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    if(started == 0) return 0;
+
+    for(uint32_t i = 0; i < list->count; i++){
+        Region* region = &list->regions[i];
+        if(region->message[0] != '\0') reportError(g->diagnostics, "%s", region->message);
+        if(region->status != 0){
+            for(uint32_t j = 0; j < list->count; j++) free(list->regions[j].text);
+            free(list->regions);
+            fail(g->diagnostics, region->status);
+        }
+        g->vectorSupport |= region->vectorSupport;
+        g->inputSupport |= region->inputSupport;
+    }
+    return 1;
+}
+
+static void emitRegion(Codegen* g, Region* region){
+    if(region->text == NULL) return;
+    emitBytes(g->out, region->text, region->length);
+    // A region that reported something is generated again next time, so
+    // the report is too.
+    if(g->options->incremental != NULL && region->message[0] == '\0'){
+        recordFragment(g->options->incremental, region->key, region->text, region->length, region->labelBase,
+                       region->line, region->vectorSupport, region->inputSupport);
+    }else{
+        free(region->text);
+    }
+    region->text = NULL;
+}
+
+void generateProgram(Output* out, AST* ast, NodeId program, SymbolTable* table, const CodegenOptions* options) {
+    Selection selection;
+    selectInstructions(ast, program, &selection);
+    Codegen codegen;
+    Codegen* g = &codegen;
+    initCodegen(g, out, options, &selection, ast->diagnostics);
+    RegionList list = {NULL, 0, 0};
+    splitRegions(g, ast, program, &list);
+    // Incremental regions are always generated into buffers, on at least
+    // one worker thread, so their text can be recorded.
+    int parallel;
+    if(options->incremental != NULL){
+        spliceRegions(g, ast, program, &list);
+        parallel = list.count > 0 &&
+                   generateRegionsInParallel(g, ast, program, table, &list, options->jobs > 1 ? options->jobs : 1);
+    }else{
+        parallel = options->jobs > 1 && list.count > 1 &&
+                   generateRegionsInParallel(g, ast, program, table, &list, options->jobs);
+    }
+
+    startSchedule(&g->scheduler, out, options->tune, options->sourceName != NULL);
+    schedule(&g->scheduler, ".intel_syntax noprefix\n");
+    if(options->sourceName != NULL){
+        emit(out, ".file 1 \"");
+        for(const char* c = options->sourceName; *c != '\0'; c++){
+            if(*c == '"' || *c == '\\') emit(out, "\\%c", *c);
+            else emit(out, "%c", *c);
+        }
+        emit(out, "\"\n");
+    }
+
+    if(!options->freestanding){
+        schedule(&g->scheduler, ".data\n");
+        schedule(&g->scheduler, ".LC0:\n");
+        schedule(&g->scheduler, "  .string \"%%ld\\n\"\n");
+    }
+
+    schedule(&g->scheduler, ".text\n");
+    schedule(&g->scheduler, ".global main\n");
+    g->symbolPrefix = "";
+    g->symbolName = "main";
+    g->symbolLength = 4;
+    setSourceLine(&g->scheduler, ast->line[program]);
+    emitFunctionStart(g);
+    emitPrologue(g, table->frameSize);
+    flushSchedule(&g->scheduler);
+
+    uint32_t i = 0;
+    for(; i < list.count && !list.regions[i].function; i++){
+        if(parallel || list.regions[i].text != NULL) emitRegion(g, &list.regions[i]);
+        else generateRegion(g, ast, program, &list.regions[i], table);
+    }
+
+    // The epilogue starts a schedule of its own, as it would after a
+    // region generated on this thread.
+    startSchedule(&g->scheduler, out, options->tune, options->sourceName != NULL);
+    g->symbolPrefix = "";
+    g->symbolName = "main";
+    g->symbolLength = 4;
+    schedule(&g->scheduler, "  mov rax, 0\n");
+    emitEpilogue(g);
+    emitFunctionEnd(g);
+    flushSchedule(&g->scheduler);
+
+    for(; i < list.count; i++){
+        if(parallel || list.regions[i].text != NULL) emitRegion(g, &list.regions[i]);
+        else generateRegion(g, ast, program, &list.regions[i], table);
+    }
+    free(list.regions);
+    freeSelection(&selection);
+
+    // The support routines have no source line of their own.
+    if(options->sourceName != NULL) emit(out, ".loc 1 0\n");
+    if(g->vectorSupport) emitVectorSupport(out);
+    if(g->inputSupport) emitInputSupport(out, options->freestanding);
+    if(options->profileGenerate){
+        emitProfileSupport(out, options->profilePath, options->probeCount, options->probeChecksum, options->freestanding);
     }
-}
\ No newline at end of file
+    if(options->freestanding) emitFreestandingRuntime(out, options->profileGenerate);
+}
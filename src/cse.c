@@ -0,0 +1,475 @@
+#include "cse.h"
+#include "diagnostic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Value numbering over each frame's statements. Every pure expression
+// gets a number from its operator and its operands' numbers; a variable's
+// number is its slot and the version it was last assigned, so an
+// assignment changes the number of everything that reads it. A number
+// already computed by a dominating statement is reused from a temporary
+// slot: the first occurrence is hoisted into "t = expr;" in front of its
+// statement and every later one becomes a read of t.
+//
+// Scopes follow the structured tree: an if or while body sees what its
+// enclosing statements computed, and what it computes itself is
+// forgotten when it ends. Variables a body may assign get fresh versions
+// at the join, and a loop's at its head as well.
+
+typedef struct {
+    uint8_t kind;
+    uint8_t op;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t value;
+} ValueEntry;
+
+typedef struct {
+    AST* ast;
+
+    ValueEntry* entries;
+    uint32_t entryCapacity;
+    uint32_t entryCount;
+    uint32_t valueCount;
+
+    // Current version of each slot (offset / 8) of the frame.
+    uint32_t* versions;
+    uint32_t slotCount;
+    uint32_t versionCount;
+
+    // Dominating occurrence of each value number, and the numbers made
+    // available since each open scope began.
+    NodeId* available;
+    uint32_t availableCapacity;
+    NodeList defined;
+
+    // Per node: its value number; for a reuse, the occurrence it reads;
+    // for a first occurrence, how many reuses it has and the next hoisted
+    // expression of the same statement.
+    uint32_t* values;
+    NodeId* sources;
+    uint32_t* uses;
+    NodeId* nextHoisted;
+    NodeId* firstHoisted;
+
+    NodeList hoisted;
+    NodeList reuses;
+    NodeList work;
+    NodeList flags;
+    NodeList parts;
+    int tempName;
+} Numbering;
+
+static void* allocate(Diagnostics* diagnostics, size_t count, size_t size){
+    void* memory = calloc(count, size);
+    if(memory == NULL){
+        reportError(diagnostics, "Failed to allocate value numbering.");
+        fail(diagnostics, 74);
+    }
+    return memory;
+}
+
+static uint32_t hashKey(uint8_t kind, uint8_t op, uint32_t a, uint32_t b, uint32_t c){
+    uint32_t hash = 2166136261u;
+    uint32_t parts[5] = {kind, op, a, b, c};
+    for(int i = 0; i < 5; i++){
+        hash ^= parts[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t freshValue(Numbering* vn){
+    return vn->valueCount++;
+}
+
+static void growEntries(Numbering* vn){
+    uint32_t oldCapacity = vn->entryCapacity;
+    ValueEntry* old = vn->entries;
+    vn->entryCapacity = oldCapacity ? oldCapacity * 2 : 1024;
+    vn->entries = allocate(vn->ast->diagnostics, vn->entryCapacity, sizeof(ValueEntry));
+    for(uint32_t i = 0; i < oldCapacity; i++){
+        if(old[i].value == 0) continue;
+        uint32_t slot = hashKey(old[i].kind, old[i].op, old[i].a, old[i].b, old[i].c) & (vn->entryCapacity - 1);
+        while(vn->entries[slot].value != 0) slot = (slot + 1) & (vn->entryCapacity - 1);
+        vn->entries[slot] = old[i];
+    }
+    free(old);
+}
+
+// The number of the expression with this shape, made up on first sight.
+static uint32_t valueOf(Numbering* vn, uint8_t kind, uint8_t op, uint32_t a, uint32_t b, uint32_t c){
+    if(2 * (vn->entryCount + 1) > vn->entryCapacity) growEntries(vn);
+    uint32_t slot = hashKey(kind, op, a, b, c) & (vn->entryCapacity - 1);
+    for(;;){
+        ValueEntry* entry = &vn->entries[slot];
+        if(entry->value == 0){
+            *entry = (ValueEntry){kind, op, a, b, c, freshValue(vn)};
+            vn->entryCount++;
+            return entry->value;
+        }
+        if(entry->kind == kind && entry->op == op && entry->a == a && entry->b == b && entry->c == c){
+            return entry->value;
+        }
+        slot = (slot + 1) & (vn->entryCapacity - 1);
+    }
+}
+
+static uint32_t versionOf(Numbering* vn, int offset){
+    uint32_t slot = (uint32_t)offset / 8;
+    return slot < vn->slotCount ? vn->versions[slot] : 0;
+}
+
+static void newVersion(Numbering* vn, int offset){
+    uint32_t slot = (uint32_t)offset / 8;
+    if(slot < vn->slotCount) vn->versions[slot] = ++vn->versionCount;
+}
+
+static NodeId availableValue(Numbering* vn, uint32_t value){
+    return value < vn->availableCapacity ? vn->available[value] : NULL_NODE;
+}
+
+static void makeAvailable(Numbering* vn, uint32_t value, NodeId node){
+    if(value >= vn->availableCapacity){
+        uint32_t capacity = vn->availableCapacity ? vn->availableCapacity : 1024;
+        while(capacity <= value) capacity *= 2;
+        vn->available = realloc(vn->available, capacity * sizeof(NodeId));
+        if(vn->available == NULL){
+            reportError(vn->ast->diagnostics, "Failed to allocate value numbering.");
+            fail(vn->ast->diagnostics, 74);
+        }
+        memset(vn->available + vn->availableCapacity, 0, (capacity - vn->availableCapacity) * sizeof(NodeId));
+        vn->availableCapacity = capacity;
+    }
+    vn->available[value] = node;
+    pushNode(vn->ast, &vn->defined, value);
+}
+
+static void closeScope(Numbering* vn, uint32_t mark){
+    while(vn->defined.count > mark){
+        vn->available[vn->defined.items[--vn->defined.count]] = NULL_NODE;
+    }
+}
+
+static int isCommutative(uint8_t op){
+    return op == TOKEN_PLUS || op == TOKEN_STAR || op == TOKEN_EQUAL_EQUAL || op == TOKEN_BANG_EQUAL;
+}
+
+static int isLeaf(const AST* ast, NodeId node){
+    return ast->kind[node] == NODE_NUMBER || ast->kind[node] == NODE_IDENTIFIER;
+}
+
+// Worth a temporary: an operator, or an element load whose index needs
+// computing. Reloading a plain a[i] costs as much as reading t.
+static int isCandidate(const AST* ast, NodeId node){
+    return ast->kind[node] == NODE_BINARY_OP ||
+           (ast->kind[node] == NODE_INDEX && !isLeaf(ast, ast->right[node]));
+}
+
+// Division is only numbered by a constant that cannot trap, so hoisting
+// never moves a fault.
+static uint32_t numberNode(Numbering* vn, NodeId node){
+    AST* ast = vn->ast;
+    switch(ast->kind[node]){
+        case NODE_NUMBER:
+            return valueOf(vn, NODE_NUMBER, ast->op[node], (uint32_t)ast->value[node], ast->left[node], 0);
+        case NODE_IDENTIFIER:
+            return valueOf(vn, NODE_IDENTIFIER, 0, (uint32_t)ast->value[node], versionOf(vn, ast->value[node]), 0);
+        case NODE_INDEX:
+            return valueOf(vn, NODE_INDEX, 0, (uint32_t)ast->value[node], vn->values[ast->right[node]],
+                           versionOf(vn, ast->value[node]));
+        case NODE_BINARY_OP: {
+            uint8_t op = ast->op[node];
+            NodeId divisor = ast->right[node];
+            if(op == TOKEN_SLASH && (ast->kind[divisor] != NODE_NUMBER ||
+                                     numberValue(ast, divisor) == 0 || numberValue(ast, divisor) == -1)){
+                return freshValue(vn);
+            }
+            uint32_t left = vn->values[ast->left[node]];
+            uint32_t right = vn->values[ast->right[node]];
+            if(isCommutative(op) && right < left){
+                uint32_t swap = left;
+                left = right;
+                right = swap;
+            }
+            return valueOf(vn, NODE_BINARY_OP, op, left, right, 0);
+        }
+        default:
+            return freshValue(vn);
+    }
+}
+
+// Numbers the expression bottom-up, then looks for earlier occurrences
+// top-down. A match replaces the whole subtree, so nothing under it is
+// looked at. Only unconditionally evaluated occurrences, and only when
+// define is set, become available to later ones.
+static void numberExpression(Numbering* vn, NodeId root, NodeId statement, int define){
+    AST* ast = vn->ast;
+    if(root == NULL_NODE) return;
+
+    NodeList* work = &vn->work;
+    work->count = 0;
+    pushNode(ast, work, root);
+    while(work->count > 0){
+        NodeId node = work->items[work->count - 1];
+        if(vn->values[node] == 0){
+            vn->values[node] = UINT32_MAX;
+            pushChildren(ast, node, work);
+            continue;
+        }
+        work->count--;
+        if(vn->values[node] == UINT32_MAX) vn->values[node] = numberNode(vn, node);
+    }
+
+    NodeList* flags = &vn->flags;
+    flags->count = 0;
+    pushNode(ast, work, root);
+    pushNode(ast, flags, 0);
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        uint32_t conditional = flags->items[--flags->count];
+
+        if(isCandidate(ast, node)){
+            NodeId source = availableValue(vn, vn->values[node]);
+            if(source != NULL_NODE){
+                vn->sources[node] = source;
+                if(vn->uses[source]++ == 0) pushNode(ast, &vn->hoisted, source);
+                pushNode(ast, &vn->reuses, node);
+                continue;
+            }
+            if(!conditional && define){
+                makeAvailable(vn, vn->values[node], node);
+                vn->nextHoisted[node] = vn->firstHoisted[statement];
+                vn->firstHoisted[statement] = node;
+            }
+        }
+
+        uint8_t kind = ast->kind[node];
+        if(kind == NODE_LOGICAL_AND || kind == NODE_LOGICAL_OR){
+            pushNode(ast, work, ast->right[node]);
+            pushNode(ast, flags, 1);
+            pushNode(ast, work, ast->left[node]);
+            pushNode(ast, flags, conditional);
+            continue;
+        }
+        uint32_t before = work->count;
+        pushChildren(ast, node, work);
+        for(uint32_t i = before; i < work->count; i++) pushNode(ast, flags, conditional);
+    }
+}
+
+// Every slot the statement may assign gets a fresh version.
+static void forgetAssigned(Numbering* vn, NodeId root){
+    AST* ast = vn->ast;
+    NodeList* work = &vn->work;
+    work->count = 0;
+    pushNode(ast, work, root);
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        switch(ast->kind[node]){
+            case NODE_ASSIGN:
+            case NODE_ARRAY:
+                newVersion(vn, ast->value[node]);
+                break;
+            case NODE_STORE:
+                newVersion(vn, ast->value[ast->left[node]]);
+                break;
+            case NODE_FUNCTION:
+                continue;
+            default:
+                break;
+        }
+        if(ast->kind[node] == NODE_BLOCK || ast->kind[node] == NODE_IF || ast->kind[node] == NODE_WHILE){
+            pushChildren(ast, node, work);
+        }
+    }
+}
+
+static void numberBlock(Numbering* vn, NodeId block);
+
+static void numberStatement(Numbering* vn, NodeId node){
+    AST* ast = vn->ast;
+    switch(ast->kind[node]){
+        case NODE_ASSIGN:
+            numberExpression(vn, ast->right[node], node, 1);
+            newVersion(vn, ast->value[node]);
+            break;
+        case NODE_STORE: {
+            NodeId target = ast->left[node];
+            numberExpression(vn, ast->right[target], node, 1);
+            numberExpression(vn, ast->right[node], node, 1);
+            newVersion(vn, ast->value[target]);
+            break;
+        }
+        case NODE_ARRAY:
+            newVersion(vn, ast->value[node]);
+            break;
+        case NODE_PRINT:
+        case NODE_EXPRESSION_STATEMENT:
+        case NODE_RETURN:
+            numberExpression(vn, ast->left[node], node, 1);
+            break;
+        case NODE_BLOCK:
+            numberBlock(vn, node);
+            break;
+        case NODE_IF: {
+            numberExpression(vn, ast->left[node], node, 1);
+            uint32_t mark = vn->defined.count;
+            numberBlock(vn, ast->right[node]);
+            closeScope(vn, mark);
+            forgetAssigned(vn, ast->right[node]);
+            break;
+        }
+        case NODE_WHILE: {
+            // The condition runs again on every iteration, so nothing in
+            // it can be hoisted in front of the loop.
+            forgetAssigned(vn, node);
+            numberExpression(vn, ast->left[node], node, 0);
+            uint32_t mark = vn->defined.count;
+            numberBlock(vn, ast->right[node]);
+            closeScope(vn, mark);
+            forgetAssigned(vn, node);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void numberBlock(Numbering* vn, NodeId block){
+    uint32_t count = vn->ast->right[block];
+    for(uint32_t i = 0; i < count; i++){
+        numberStatement(vn, blockStatements(vn->ast, block)[i]);
+    }
+}
+
+// Splices "t = expr;" in front of every statement whose expressions are
+// reused later, innermost first.
+static void hoistBlock(Numbering* vn, NodeId block, const int* temps){
+    AST* ast = vn->ast;
+    uint32_t count = ast->right[block];
+    int changed = 0;
+
+    for(uint32_t i = 0; i < count; i++){
+        NodeId statement = blockStatements(ast, block)[i];
+        uint8_t kind = ast->kind[statement];
+        if(kind == NODE_BLOCK) hoistBlock(vn, statement, temps);
+        if(kind == NODE_IF || kind == NODE_WHILE) hoistBlock(vn, ast->right[statement], temps);
+        for(NodeId node = vn->firstHoisted[statement]; node != NULL_NODE; node = vn->nextHoisted[node]){
+            if(vn->uses[node] > 0) changed = 1;
+        }
+    }
+    if(!changed) return;
+
+    NodeList* parts = &vn->parts;
+    parts->count = 0;
+    for(uint32_t i = 0; i < count; i++){
+        NodeId statement = blockStatements(ast, block)[i];
+        ast->currentLine = ast->line[statement];
+        for(NodeId node = vn->firstHoisted[statement]; node != NULL_NODE; node = vn->nextHoisted[node]){
+            if(vn->uses[node] == 0) continue;
+            NodeId copy = newNode(ast, (ASTNodeType)ast->kind[node]);
+            ast->op[copy] = ast->op[node];
+            ast->left[copy] = ast->left[node];
+            ast->right[copy] = ast->right[node];
+            ast->value[copy] = ast->value[node];
+
+            NodeId store = newNode(ast, NODE_ASSIGN);
+            ast->left[store] = (uint32_t)vn->tempName;
+            ast->right[store] = copy;
+            ast->value[store] = temps[vn->uses[node] - 1];
+            pushNode(ast, parts, store);
+
+            ast->kind[node] = NODE_IDENTIFIER;
+            ast->op[node] = 0;
+            ast->left[node] = (uint32_t)vn->tempName;
+            ast->right[node] = 0;
+            ast->value[node] = temps[vn->uses[node] - 1];
+        }
+        pushNode(ast, parts, statement);
+    }
+
+    ast->left[block] = appendChildren(ast, parts->items, parts->count);
+    ast->right[block] = parts->count;
+}
+
+static void numberFrame(Numbering* vn, NodeId body, int* frameSize){
+    AST* ast = vn->ast;
+    vn->slotCount = (uint32_t)*frameSize / 8 + 1;
+    vn->versions = allocate(ast->diagnostics, vn->slotCount, sizeof(uint32_t));
+    vn->hoisted.count = 0;
+    vn->reuses.count = 0;
+    vn->defined.count = 0;
+
+    numberBlock(vn, body);
+    closeScope(vn, 0);
+
+    if(vn->hoisted.count > 0){
+        // Each reused occurrence gets its own slot; uses[] is turned into
+        // an index into temps so the rewrite can find it.
+        int* temps = allocate(ast->diagnostics, vn->hoisted.count, sizeof(int));
+        for(uint32_t i = 0; i < vn->hoisted.count; i++){
+            *frameSize += 8;
+            temps[i] = *frameSize;
+        }
+        for(uint32_t i = 0; i < vn->hoisted.count; i++){
+            vn->uses[vn->hoisted.items[i]] = i + 1;
+        }
+        for(uint32_t i = 0; i < vn->reuses.count; i++){
+            NodeId reuse = vn->reuses.items[i];
+            int offset = temps[vn->uses[vn->sources[reuse]] - 1];
+            ast->kind[reuse] = NODE_IDENTIFIER;
+            ast->op[reuse] = 0;
+            ast->left[reuse] = (uint32_t)vn->tempName;
+            ast->right[reuse] = 0;
+            ast->value[reuse] = offset;
+        }
+        hoistBlock(vn, body, temps);
+        free(temps);
+    }
+
+    free(vn->versions);
+    vn->versions = NULL;
+}
+
+void eliminateCommonSubexpressions(AST* ast, NodeId program, SymbolTable* table){
+    Numbering vn;
+    memset(&vn, 0, sizeof(vn));
+    vn.ast = ast;
+    vn.valueCount = 1;
+    vn.values = allocate(ast->diagnostics, ast->count, sizeof(uint32_t));
+    vn.sources = allocate(ast->diagnostics, ast->count, sizeof(NodeId));
+    vn.uses = allocate(ast->diagnostics, ast->count, sizeof(uint32_t));
+    vn.nextHoisted = allocate(ast->diagnostics, ast->count, sizeof(NodeId));
+    vn.firstHoisted = allocate(ast->diagnostics, ast->count, sizeof(NodeId));
+    vn.tempName = internName(ast, "$t", 2);
+
+    numberFrame(&vn, program, &table->frameSize);
+
+    uint32_t count = ast->right[program];
+    for(uint32_t i = 0; i < count; i++){
+        NodeId function = blockStatements(ast, program)[i];
+        if(ast->kind[function] != NODE_FUNCTION) continue;
+
+        int frameSize = ast->value[function];
+        numberFrame(&vn, ast->right[function], &frameSize);
+        ast->value[function] = frameSize;
+    }
+
+    free(vn.entries);
+    free(vn.available);
+    free(vn.values);
+    free(vn.sources);
+    free(vn.uses);
+    free(vn.nextHoisted);
+    free(vn.firstHoisted);
+    freeNodeList(&vn.defined);
+    freeNodeList(&vn.hoisted);
+    freeNodeList(&vn.reuses);
+    freeNodeList(&vn.work);
+    freeNodeList(&vn.flags);
+    freeNodeList(&vn.parts);
+}
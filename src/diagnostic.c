@@ -0,0 +1,26 @@
+#include "diagnostic.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void reportError(Diagnostics* diagnostics, const char* format, ...){
+    va_list args;
+    if(diagnostics == NULL || diagnostics->print){
+        va_start(args, format);
+        fputs("Error: ", stderr);
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+        va_end(args);
+    }
+    if(diagnostics != NULL && diagnostics->message[0] == '\0'){
+        va_start(args, format);
+        vsnprintf(diagnostics->message, sizeof(diagnostics->message), format, args);
+        va_end(args);
+    }
+}
+
+void fail(Diagnostics* diagnostics, int status){
+    if(diagnostics != NULL) longjmp(diagnostics->failure, status);
+    exit(status);
+}
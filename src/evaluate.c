@@ -0,0 +1,378 @@
+#include "evaluate.h"
+#include "bytecode.h"
+#include "diagnostic.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Registers of all live frames, 8 MiB at most: about the stack the
+// native program gets. A deeper program is left to find that out itself.
+#define MAX_EVALUATION_REGISTERS (1u << 20)
+
+// Shorter prefixes tried when the longest one would emit too much; each
+// try runs main again up to its end.
+#define MAX_EVALUATION_RETRIES 8
+
+typedef struct {
+    uint32_t returnTo;
+    uint32_t base;
+    int32_t target;
+    uint32_t frameRegisters;
+} CallRecord;
+
+typedef enum {
+    RUN_HALTED,
+    RUN_STOPPED
+} RunResult;
+
+typedef struct {
+    const Bytecode* bytecode;
+    uint32_t statementCount;
+    int64_t* registers;
+    uint32_t capacity;
+    CallRecord* calls;
+    uint32_t callCount;
+    uint32_t callCapacity;
+    int64_t* printed;
+    uint32_t printedCount;
+    uint32_t printedCapacity;
+    // Top-level statements before finished have run to completion.
+    // printedAt[i] is how many values had been printed when statement i
+    // started, or when main halted for i == statementCount.
+    uint32_t finished;
+    uint32_t* printedAt;
+    Diagnostics* diagnostics;
+} Evaluator;
+
+static void* grow(Diagnostics* diagnostics, void* items, uint32_t* capacity, size_t size){
+    *capacity = *capacity ? *capacity * 2 : 256;
+    items = realloc(items, *capacity * size);
+    if(items == NULL){
+        reportError(diagnostics, "Failed to grow compile-time evaluation.");
+        fail(diagnostics, 74);
+    }
+    return items;
+}
+
+static int reserveRegisters(Evaluator* e, uint64_t count){
+    if(count <= e->capacity) return 1;
+    if(count > MAX_EVALUATION_REGISTERS) return 0;
+    uint32_t old = e->capacity;
+    while(e->capacity < count) e->registers = grow(e->diagnostics, e->registers, &e->capacity, sizeof(int64_t));
+    memset(e->registers + old, 0, (e->capacity - old) * sizeof(int64_t));
+    return 1;
+}
+
+static int holds(int condition, int64_t a, int64_t b){
+    switch(condition){
+        case CONDITION_EQUAL: return a == b;
+        case CONDITION_NOT_EQUAL: return a != b;
+        case CONDITION_LESS: return a < b;
+        case CONDITION_LESS_EQUAL: return a <= b;
+        case CONDITION_GREATER: return a > b;
+        default: return a >= b;
+    }
+}
+
+// Runs main from the start until it halts, faults, spends its fuel or is
+// about to start top-level statement stop. Faults the native program
+// would die of, or might, stop the run just like the fuel running out.
+static RunResult runMain(Evaluator* e, uint64_t fuel, uint32_t stop){
+    const Instruction* code = e->bytecode->code;
+    const BytecodeFunction* functions = e->bytecode->functions;
+    const uint32_t* starts = e->bytecode->statementStarts;
+    e->callCount = 0;
+    e->printedCount = 0;
+    e->finished = 0;
+    if(e->capacity > 0) memset(e->registers, 0, e->capacity * sizeof(int64_t));
+    if(!reserveRegisters(e, functions[0].registerCount + 1)) return RUN_STOPPED;
+
+    uint32_t base = 0;
+    uint32_t frameRegisters = functions[0].frameRegisters;
+    uint32_t pc = functions[0].entry;
+    uint32_t next = 0;
+    for(;; pc++){
+        if(e->callCount == 0 && next < e->statementCount && pc == starts[next]){
+            while(next < e->statementCount && starts[next] == pc) e->printedAt[next++] = e->printedCount;
+            e->finished = next - 1;
+            if(e->finished >= stop) return RUN_STOPPED;
+        }
+        if(fuel-- == 0) return RUN_STOPPED;
+
+        const Instruction* in = &code[pc];
+        int64_t* r = e->registers + base;
+        if(in->op >= OP_EQUAL && in->op < OP_EQUAL_IMMEDIATE){
+            r[in->a] = holds(in->op - OP_EQUAL, r[in->b], r[in->c]);
+            continue;
+        }
+        if(in->op >= OP_EQUAL_IMMEDIATE && in->op < OP_JUMP_EQUAL){
+            r[in->a] = holds(in->op - OP_EQUAL_IMMEDIATE, r[in->b], in->c);
+            continue;
+        }
+        if(in->op >= OP_JUMP_EQUAL && in->op < OP_JUMP_EQUAL_IMMEDIATE){
+            if(holds(in->op - OP_JUMP_EQUAL, r[in->a], r[in->b])) pc = (uint32_t)in->c - 1;
+            continue;
+        }
+        if(in->op >= OP_JUMP_EQUAL_IMMEDIATE && in->op < OP_JUMP){
+            if(holds(in->op - OP_JUMP_EQUAL_IMMEDIATE, r[in->a], in->b)) pc = (uint32_t)in->c - 1;
+            continue;
+        }
+
+        switch(in->op){
+            case OP_MOVE: r[in->a] = r[in->b]; break;
+            case OP_CONSTANT: r[in->a] = in->b; break;
+            case OP_WIDE_CONSTANT: r[in->a] = e->bytecode->constants[in->b]; break;
+            case OP_ADD: r[in->a] = (int64_t)((uint64_t)r[in->b] + (uint64_t)r[in->c]); break;
+            case OP_SUBTRACT: r[in->a] = (int64_t)((uint64_t)r[in->b] - (uint64_t)r[in->c]); break;
+            case OP_MULTIPLY: r[in->a] = (int64_t)((uint64_t)r[in->b] * (uint64_t)r[in->c]); break;
+            case OP_DIVIDE:
+                if(r[in->c] == 0 || (r[in->c] == -1 && r[in->b] == INT64_MIN)) return RUN_STOPPED;
+                r[in->a] = r[in->b] / r[in->c];
+                break;
+            case OP_ADD_IMMEDIATE: r[in->a] = (int64_t)((uint64_t)r[in->b] + (uint64_t)(int64_t)in->c); break;
+            case OP_MULTIPLY_IMMEDIATE: r[in->a] = (int64_t)((uint64_t)r[in->b] * (uint64_t)(int64_t)in->c); break;
+            case OP_JUMP: pc = (uint32_t)in->c - 1; break;
+            case OP_JUMP_IF_ZERO: if(r[in->a] == 0) pc = (uint32_t)in->c - 1; break;
+            case OP_JUMP_IF_NOT_ZERO: if(r[in->a] != 0) pc = (uint32_t)in->c - 1; break;
+            case OP_LOAD_ELEMENT:
+            case OP_STORE_ELEMENT: {
+                // Native code would read or write some other slot, or
+                // outside the frame altogether.
+                uint64_t element = (uint64_t)((int64_t)in->c - r[in->b]);
+                if(element >= frameRegisters) return RUN_STOPPED;
+                if(in->op == OP_LOAD_ELEMENT) r[in->a] = r[element];
+                else r[element] = r[in->a];
+                break;
+            }
+            case OP_CLEAR:
+                memset(&r[in->a], 0, (size_t)in->b * sizeof(int64_t));
+                break;
+            case OP_PRINT:
+                if(e->printedCount == e->printedCapacity){
+                    e->printed = grow(e->diagnostics, e->printed, &e->printedCapacity, sizeof(int64_t));
+                }
+                e->printed[e->printedCount++] = r[in->a];
+                break;
+            case OP_READ:
+                // Input is only known when the program runs.
+                return RUN_STOPPED;
+            case OP_CALL: {
+                const BytecodeFunction* function = &functions[in->b];
+                if(e->callCount == e->callCapacity) e->calls = grow(e->diagnostics, e->calls, &e->callCapacity, sizeof(CallRecord));
+                CallRecord* record = &e->calls[e->callCount++];
+                record->returnTo = pc + 1;
+                record->base = base;
+                record->target = in->a;
+                record->frameRegisters = frameRegisters;
+                base += (uint32_t)in->c;
+                if(!reserveRegisters(e, (uint64_t)base + function->registerCount)) return RUN_STOPPED;
+                frameRegisters = function->frameRegisters;
+                pc = function->entry - 1;
+                break;
+            }
+            case OP_RETURN: {
+                int64_t value = r[in->a];
+                CallRecord* record = &e->calls[--e->callCount];
+                base = record->base;
+                e->registers[base + (uint32_t)record->target] = value;
+                frameRegisters = record->frameRegisters;
+                pc = record->returnTo - 1;
+                break;
+            }
+            default:
+                e->printedAt[e->statementCount] = e->printedCount;
+                return RUN_HALTED;
+        }
+    }
+}
+
+static NodeId newNumber(AST* ast, int64_t literal){
+    NodeId node = newNode(ast, NODE_NUMBER);
+    ast->value[node] = (int32_t)literal;
+    if(literal != ast->value[node]){
+        ast->op[node] = 1;
+        ast->left[node] = (uint32_t)((uint64_t)literal >> 32);
+    }
+    return node;
+}
+
+static NodeId newPrint(AST* ast, int64_t value){
+    NodeId number = newNumber(ast, value);
+    NodeId node = newNode(ast, NODE_PRINT);
+    ast->left[node] = number;
+    return node;
+}
+
+// What main's frame slots are, from the statements outside functions: the
+// name each variable slot goes by, and the array declarations.
+static void describeFrame(const AST* ast, NodeId program, int32_t* names, NodeList* arrays){
+    NodeList work = {NULL, 0, 0};
+    NodeId* statements = blockStatements(ast, program);
+    for(uint32_t i = 0; i < ast->right[program]; i++){
+        if(ast->kind[statements[i]] == NODE_FUNCTION) continue;
+        pushNode(ast, &work, statements[i]);
+        while(work.count > 0){
+            NodeId node = work.items[--work.count];
+            uint8_t kind = ast->kind[node];
+            if((kind == NODE_IDENTIFIER || kind == NODE_ASSIGN) && ast->value[node] > 0){
+                names[ast->value[node] / 8 - 1] = (int32_t)ast->left[node];
+            }
+            if(kind == NODE_ARRAY) pushNode(ast, arrays, node);
+            pushChildren(ast, node, &work);
+        }
+    }
+    freeNodeList(&work);
+}
+
+// The variables as main left them: every array cleared and its non-zero
+// elements stored, every other named slot assigned. Returns how many
+// statements that takes; with out NULL they are only counted.
+static uint32_t restoreFrame(AST* ast, NodeId program, const int64_t* registers, uint32_t frameRegisters, NodeList* out){
+    int32_t* names = malloc((frameRegisters + 1) * sizeof(int32_t));
+    if(names == NULL){
+        reportError(ast->diagnostics, "Failed to allocate compile-time evaluation.");
+        fail(ast->diagnostics, 74);
+    }
+    for(uint32_t i = 0; i < frameRegisters; i++) names[i] = -1;
+    NodeList arrays = {NULL, 0, 0};
+    describeFrame(ast, program, names, &arrays);
+
+    uint32_t emitted = 0;
+    for(uint32_t i = 0; i < arrays.count; i++){
+        NodeId declaration = arrays.items[i];
+        int32_t first = ast->value[declaration] / 8 - 1;
+        emitted++;
+        if(out == NULL){
+            for(uint32_t element = 0; element < ast->right[declaration]; element++){
+                names[first - (int32_t)element] = -1;
+                emitted += registers[first - (int32_t)element] != 0;
+            }
+            continue;
+        }
+        NodeId clear = newNode(ast, NODE_ARRAY);
+        ast->left[clear] = ast->left[declaration];
+        ast->right[clear] = ast->right[declaration];
+        ast->value[clear] = ast->value[declaration];
+        pushNode(ast, out, clear);
+        for(uint32_t element = 0; element < ast->right[declaration]; element++){
+            int32_t reg = first - (int32_t)element;
+            names[reg] = -1;
+            if(registers[reg] == 0) continue;
+            NodeId index = newNumber(ast, element);
+            NodeId target = newNode(ast, NODE_INDEX);
+            ast->left[target] = ast->left[declaration];
+            ast->right[target] = index;
+            ast->value[target] = ast->value[declaration];
+            NodeId stored = newNumber(ast, registers[reg]);
+            NodeId store = newNode(ast, NODE_STORE);
+            ast->left[store] = target;
+            ast->right[store] = stored;
+            pushNode(ast, out, store);
+        }
+    }
+    for(uint32_t reg = 0; reg < frameRegisters; reg++){
+        if(names[reg] < 0) continue;
+        emitted++;
+        if(out == NULL) continue;
+        NodeId assigned = newNumber(ast, registers[reg]);
+        NodeId assign = newNode(ast, NODE_ASSIGN);
+        ast->left[assign] = (uint32_t)names[reg];
+        ast->right[assign] = assigned;
+        ast->value[assign] = 8 * (int32_t)(reg + 1);
+        pushNode(ast, out, assign);
+    }
+    freeNodeList(&arrays);
+    free(names);
+    return emitted;
+}
+
+// replaced[i] is the node count of the top-level statements before i that
+// evaluation would replace, which is all of them but the functions.
+static uint32_t* countReplacedNodes(const AST* ast, NodeId program){
+    uint32_t count = ast->right[program];
+    uint32_t* replaced = malloc((count + 1) * sizeof(uint32_t));
+    if(replaced == NULL){
+        reportError(ast->diagnostics, "Failed to allocate compile-time evaluation.");
+        fail(ast->diagnostics, 74);
+    }
+    NodeList work = {NULL, 0, 0};
+    NodeId* statements = blockStatements(ast, program);
+    replaced[0] = 0;
+    for(uint32_t i = 0; i < count; i++){
+        replaced[i + 1] = replaced[i];
+        if(ast->kind[statements[i]] == NODE_FUNCTION) continue;
+        pushNode(ast, &work, statements[i]);
+        while(work.count > 0){
+            NodeId node = work.items[--work.count];
+            replaced[i + 1]++;
+            pushChildren(ast, node, &work);
+        }
+    }
+    freeNodeList(&work);
+    return replaced;
+}
+
+void evaluateProgram(AST* ast, NodeId program, const SymbolTable* table, uint64_t fuel){
+    uint32_t count = ast->right[program];
+    if(fuel == 0 || count == 0) return;
+
+    Bytecode bytecode;
+    compileBytecode(ast, program, table, &bytecode);
+    Evaluator e = {0};
+    e.bytecode = &bytecode;
+    e.statementCount = count;
+    e.diagnostics = ast->diagnostics;
+
+    e.printedAt = malloc((count + 1) * sizeof(uint32_t));
+    if(e.printedAt == NULL){
+        reportError(ast->diagnostics, "Failed to allocate compile-time evaluation.");
+        fail(ast->diagnostics, 74);
+    }
+    uint32_t frameRegisters = (uint32_t)table->frameSize / 8;
+
+    // The finished prefix is replaced only if that takes no more
+    // statements than it had nodes: a loop that prints or fills an array
+    // stays a loop instead of growing into one statement per value.
+    // Otherwise a shorter prefix is tried, run again to have main's
+    // variables as they were where it ends.
+    RunResult result = runMain(&e, fuel, count);
+    uint32_t* replaced = countReplacedNodes(ast, program);
+    uint32_t prefix = result == RUN_HALTED ? count : e.finished;
+    uint32_t retries = 0;
+    while(prefix > 0){
+        if(e.printedAt[prefix] <= replaced[prefix]){
+            if(prefix == count) break;
+            if(retries++ == MAX_EVALUATION_RETRIES){
+                prefix = 0;
+                break;
+            }
+            runMain(&e, UINT64_MAX, prefix);
+            uint32_t restored = restoreFrame(ast, program, e.registers, frameRegisters, NULL);
+            if(e.printedAt[prefix] + restored <= replaced[prefix]) break;
+        }
+        prefix--;
+    }
+
+    if(prefix > 0){
+        NodeList statements = {NULL, 0, 0};
+        ast->currentLine = ast->line[program];
+        for(uint32_t i = 0; i < e.printedAt[prefix]; i++) pushNode(ast, &statements, newPrint(ast, e.printed[i]));
+        if(prefix < count){
+            restoreFrame(ast, program, e.registers, frameRegisters, &statements);
+            NodeId* original = blockStatements(ast, program);
+            for(uint32_t i = 0; i < count; i++){
+                if(i >= prefix || ast->kind[original[i]] == NODE_FUNCTION) pushNode(ast, &statements, original[i]);
+            }
+        }
+        ast->left[program] = appendChildren(ast, statements.items, statements.count);
+        ast->right[program] = statements.count;
+        freeNodeList(&statements);
+    }
+
+    free(replaced);
+    freeBytecode(&bytecode);
+    free(e.registers);
+    free(e.calls);
+    free(e.printed);
+    free(e.printedAt);
+}
@@ -0,0 +1,644 @@
+#include "incremental.h"
+#include "astfile.h"
+#include "diagnostic.h"
+#include "lexer.h"
+#include "output.h"
+#include "parser.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint64_t mix(uint64_t hash, uint64_t word){
+    hash ^= word;
+    hash *= 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 29);
+}
+
+// Eight bytes per multiply: enough to tell edits apart, though not meant
+// to stand up to collisions crafted on purpose.
+uint64_t hashBytes(uint64_t hash, const void* data, size_t length){
+    const unsigned char* bytes = (const unsigned char*)data;
+    hash = mix(hash, length);
+    for(; length >= 8; bytes += 8, length -= 8){
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash = mix(hash, word);
+    }
+    uint64_t rest = 0;
+    if(length > 0) memcpy(&rest, bytes, length);
+    return mix(hash, rest);
+}
+
+static void* grow(Diagnostics* diagnostics, void* array, uint32_t* capacity, uint32_t needed, size_t elementSize){
+    if(needed <= *capacity) return array;
+    uint32_t grown = *capacity ? *capacity * 2 : 64;
+    while(grown < needed) grown *= 2;
+    array = realloc(array, (size_t)grown * elementSize);
+    if(array == NULL){
+        reportError(diagnostics, "Failed to grow incremental cache.");
+        fail(diagnostics, 74);
+    }
+    *capacity = grown;
+    return array;
+}
+
+static int inBounds(size_t size, uint64_t offset, uint64_t count, size_t elementSize){
+    return (offset & 7) == 0 && offset <= size && count <= (size - offset) / elementSize;
+}
+
+// Checks everything parseIncremental and reuseFragment index with, so that
+// a damaged cache is dropped rather than followed.
+static int validCache(const char* data, size_t size, Diagnostics* diagnostics){
+    const IncrementalHeader* header = (const IncrementalHeader*)data;
+    if(memcmp(header->magic, INCREMENTAL_MAGIC, 8) != 0 || header->version != INCREMENTAL_VERSION) return 0;
+    if(!inBounds(size, header->statementsOffset, header->statementCount, sizeof(IncrementalStatement)) ||
+       !inBounds(size, header->symbolsOffset, header->symbolCount, sizeof(IncrementalSymbol)) ||
+       !inBounds(size, header->fragmentsOffset, header->fragmentCount, sizeof(IncrementalFragment)) ||
+       !inBounds(size, header->imageOffset, header->imageLength, 1) ||
+       header->textOffset > size){
+        return 0;
+    }
+
+    ASTFileHeader image;
+    memset(&image, 0, sizeof(image));
+    if(header->statementCount > 0){
+        // The same checks a loaded AST file gets, so every statement the
+        // program lists is a whole, well-formed tree.
+        if(checkASTFile(data + header->imageOffset, header->imageLength, diagnostics) != NULL) return 0;
+        memcpy(&image, data + header->imageOffset, sizeof(image));
+    }
+
+    const IncrementalStatement* statements = (const IncrementalStatement*)(data + header->statementsOffset);
+    const uint32_t* right = (const uint32_t*)(data + header->imageOffset + image.rightOffset);
+    const uint32_t* left = (const uint32_t*)(data + header->imageOffset + image.leftOffset);
+    const NodeId* roots = (const NodeId*)(data + header->imageOffset + image.childrenOffset);
+    if(header->statementCount > 0 && right[image.program] != header->statementCount) return 0;
+    for(uint32_t i = 0; i < header->statementCount; i++){
+        const IncrementalStatement* statement = &statements[i];
+        if(statement->root != roots[left[image.program] + i] ||
+           statement->firstNode == NULL_NODE || statement->firstNode > statement->root ||
+           statement->frameSize < 0 || statement->frameSize > image.frameSize ||
+           (uint64_t)statement->firstSymbol + statement->symbolCount > header->symbolCount){
+            return 0;
+        }
+    }
+    const IncrementalSymbol* symbols = (const IncrementalSymbol*)(data + header->symbolsOffset);
+    for(uint32_t i = 0; i < header->symbolCount; i++){
+        if(symbols[i].nameId < 0 || (uint32_t)symbols[i].nameId >= image.nameCount || symbols[i].length < 0 ||
+           symbols[i].offset <= 0){
+            return 0;
+        }
+    }
+    const IncrementalFragment* fragments = (const IncrementalFragment*)(data + header->fragmentsOffset);
+    for(uint32_t i = 0; i < header->fragmentCount; i++){
+        uint64_t room = size - header->textOffset;
+        if(fragments[i].textOffset > room || fragments[i].length > room - fragments[i].textOffset) return 0;
+    }
+    return 1;
+}
+
+void openIncremental(IncrementalCache* cache, const char* path, Diagnostics* diagnostics){
+    memset(cache, 0, sizeof(IncrementalCache));
+    cache->diagnostics = diagnostics;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return;
+
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size >= sizeof(IncrementalHeader)){
+        // Private and writable like a mapped source: a reused tree has its
+        // lines moved in place.
+        char* data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED){
+            cache->data = data;
+            cache->size = (size_t)st.st_size;
+            if(validCache(data, cache->size, diagnostics)) cache->header = (const IncrementalHeader*)data;
+        }
+    }
+    close(fd);
+}
+
+void closeIncremental(IncrementalCache* cache){
+    if(cache->data != NULL) munmap(cache->data, cache->size);
+    free(cache->buckets);
+    free(cache->statements);
+    free(cache->symbols);
+    for(uint32_t i = 0; i < cache->fragmentCount; i++) free(cache->fragments[i].text);
+    free(cache->fragments);
+    free(cache->image);
+    freeNodeList(&cache->roots);
+    memset(cache, 0, sizeof(IncrementalCache));
+}
+
+// Where in the source the next statement's piece starts, and its line.
+typedef struct {
+    IncrementalCache* cache;
+    Parser* parser;
+    AST* ast;
+    SymbolTable* table;
+    const char* text;
+    size_t piece;
+    uint32_t line;
+} Splice;
+
+static uint32_t countNewlines(const char* text, size_t length){
+    uint32_t count = 0;
+    const char* end = text + length;
+    while(text < end && (text = memchr(text, '\n', (size_t)(end - text))) != NULL){
+        count++;
+        text++;
+    }
+    return count;
+}
+
+static IncrementalStatement* addStatement(Splice* s, size_t end){
+    IncrementalCache* cache = s->cache;
+    cache->statements = grow(cache->diagnostics, cache->statements, &cache->statementCapacity, cache->statementCount + 1,
+                             sizeof(IncrementalStatement));
+    IncrementalStatement* statement = &cache->statements[cache->statementCount++];
+    memset(statement, 0, sizeof(*statement));
+    statement->length = end - s->piece;
+    statement->line = s->line;
+    statement->firstSymbol = cache->symbolCount;
+    return statement;
+}
+
+static void declareSymbol(IncrementalCache* cache, const Symbol* symbol){
+    cache->symbols = grow(cache->diagnostics, cache->symbols, &cache->symbolCapacity, cache->symbolCount + 1, sizeof(IncrementalSymbol));
+    cache->symbols[cache->symbolCount].nameId = symbol->nameId;
+    cache->symbols[cache->symbolCount].length = symbol->length;
+    cache->symbols[cache->symbolCount].offset = symbol->offset;
+    cache->symbols[cache->symbolCount].reserved = 0;
+    cache->symbolCount++;
+    cache->scope = mix(mix(cache->scope, (uint32_t)symbol->nameId),
+                       (uint64_t)(uint32_t)symbol->offset << 32 | (uint32_t)symbol->length);
+}
+
+static void finishStatement(Splice* s, IncrementalStatement* statement){
+    s->cache->liveNodes += statement->root - statement->firstNode + 1;
+    pushNode(s->ast, &s->cache->roots, statement->root);
+    s->piece += statement->length;
+    s->line += statement->newlines;
+}
+
+// Lexes and parses the statements in [s->piece, end).
+static void parsePieces(Splice* s, size_t end){
+    AST* ast = s->ast;
+    SymbolTable* table = s->table;
+    IncrementalCache* cache = s->cache;
+    Lexer* lexer = &s->parser->lexer;
+    seekLexer(lexer, s->text + s->piece, s->text + end, s->line);
+    advanceToken(lexer);
+    while(lexer->currentToken.type != TOKEN_EOF){
+        uint64_t scope = lexer->currentToken.type == TOKEN_FUNC ? 0 : cache->scope;
+        uint32_t leading = (uint32_t)lexer->currentToken.line - s->line;
+        uint32_t firstNode = ast->count;
+        int firstSymbol = table->count;
+        int frameSize = table->frameSize;
+        table->frameSize = table->currentOffset;
+
+        NodeId root = parseStatement(s->parser, ast, table);
+
+        size_t stop = (size_t)(lexer->previousToken.start + lexer->previousToken.length - s->text);
+        IncrementalStatement* statement = addStatement(s, stop);
+        statement->textHash = hashBytes(0, s->text + s->piece, statement->length);
+        statement->scope = scope;
+        statement->leading = leading;
+        statement->newlines = countNewlines(s->text + s->piece, statement->length);
+        statement->firstNode = firstNode;
+        statement->root = root;
+        statement->frameSize = table->frameSize;
+        statement->symbolCount = (uint32_t)(table->count - firstSymbol);
+        for(int i = firstSymbol; i < table->count; i++) declareSymbol(cache, &table->symbols[i]);
+        if(frameSize > table->frameSize) table->frameSize = frameSize;
+        finishStatement(s, statement);
+    }
+}
+
+// Whether replaying the statement's declarations here puts them in the
+// slots its tree refers to, and leaves them inside the frame it needed.
+static int replaysInPlace(const SymbolTable* table, const IncrementalStatement* old, const IncrementalSymbol* symbols){
+    int64_t offset = table->currentOffset;
+    for(uint32_t i = 0; i < old->symbolCount; i++){
+        const IncrementalSymbol* symbol = &symbols[old->firstSymbol + i];
+        offset += 8 * (int64_t)(symbol->length > 0 ? symbol->length : 1);
+        if(offset != symbol->offset) return 0;
+    }
+    return offset <= old->frameSize;
+}
+
+// Takes back the statement whose old piece now starts at, replaying its
+// declarations; when the symbols in scope there are no longer the ones it
+// was parsed against, or its slots would not come out the same, it is
+// parsed again instead.
+static void reuseStatement(Splice* s, const IncrementalStatement* old, const IncrementalSymbol* symbols, size_t at){
+    AST* ast = s->ast;
+    SymbolTable* table = s->table;
+    IncrementalCache* cache = s->cache;
+    int function = ast->kind[old->root] == NODE_FUNCTION;
+    if((!function && old->scope != cache->scope) || !replaysInPlace(table, old, symbols)){
+        parsePieces(s, at + old->length);
+        return;
+    }
+
+    uint32_t line = s->line + countNewlines(s->text + s->piece, at - s->piece);
+    if(line != old->line){
+        for(NodeId node = old->firstNode; node <= old->root; node++) ast->line[node] += line - old->line;
+    }
+
+    IncrementalStatement* statement = addStatement(s, at + old->length);
+    statement->textHash = at == s->piece ? old->textHash : hashBytes(0, s->text + s->piece, statement->length);
+    statement->scope = function ? 0 : cache->scope;
+    statement->leading = old->leading + (line - s->line);
+    statement->newlines = old->newlines + (line - s->line);
+    statement->firstNode = old->firstNode;
+    statement->root = old->root;
+    statement->frameSize = old->frameSize;
+    statement->symbolCount = old->symbolCount;
+    for(uint32_t i = 0; i < old->symbolCount; i++){
+        const IncrementalSymbol* symbol = &symbols[old->firstSymbol + i];
+        if(symbol->length > 0) addArray(table, symbol->nameId, symbol->length);
+        else addSymbol(table, symbol->nameId);
+        declareSymbol(cache, &table->symbols[table->count - 1]);
+    }
+    if(old->frameSize > table->frameSize) table->frameSize = old->frameSize;
+    finishStatement(s, statement);
+}
+
+// The changed text is parsed on its own, up to the first statement reused
+// after it. Should that fail, the text after it may be what completes it,
+// so everything from there to the end of the source is parsed instead and
+// 0 returned.
+static int parseChanged(Splice* s, size_t end, size_t size){
+    IncrementalCache* cache = s->cache;
+    Splice saved = *s;
+    SymbolTable table = *s->table;
+    uint32_t nodes = s->ast->count;
+    uint32_t children = s->ast->childCount;
+    uint32_t statements = cache->statementCount;
+    uint32_t symbols = cache->symbolCount;
+    uint32_t roots = cache->roots.count;
+    uint32_t liveNodes = cache->liveNodes;
+    uint64_t scope = cache->scope;
+
+    // Everything the parse can fail through reports here meanwhile.
+    Diagnostics diagnostics = {.print = 0, .message = ""};
+    Diagnostics* outer = cache->diagnostics;
+    Diagnostics** reporters[] = {&cache->diagnostics, &s->ast->diagnostics, &s->table->diagnostics,
+                                 &s->parser->lexer.diagnostics};
+    for(size_t i = 0; i < sizeof(reporters) / sizeof(reporters[0]); i++) *reporters[i] = &diagnostics;
+    int failed = setjmp(diagnostics.failure);
+    if(!failed) parsePieces(s, end);
+    for(size_t i = 0; i < sizeof(reporters) / sizeof(reporters[0]); i++) *reporters[i] = outer;
+    if(!failed) return 1;
+    freeParser(s->parser);
+
+    *s = saved;
+    *s->table = table;
+    s->ast->count = nodes;
+    s->ast->childCount = children;
+    cache->statementCount = statements;
+    cache->symbolCount = symbols;
+    cache->roots.count = roots;
+    cache->liveNodes = liveNodes;
+    cache->scope = scope;
+    parsePieces(s, size);
+    return 0;
+}
+
+NodeId parseIncremental(IncrementalCache* cache, Parser* parser, AST* ast, SymbolTable* table, const Source* source){
+    const char* text = source->data;
+    size_t size = source->size;
+    const IncrementalHeader* old = cache->header;
+    const IncrementalStatement* previous = NULL;
+    const IncrementalSymbol* symbols = NULL;
+    uint32_t count = 0;
+
+    // Once more than half the image is left over from statements since
+    // replaced, or from the statement lists of earlier programs, everything
+    // is parsed afresh, which compacts it again.
+    if(old != NULL && old->statementCount > 0){
+        ASTFileHeader image;
+        memcpy(&image, cache->data + old->imageOffset, sizeof(image));
+        if((uint64_t)old->liveNodes * 2 >= image.nodeCount && image.childCount < 2 * (uint64_t)image.nodeCount){
+            NodeId program;
+            int frameSize;
+            loadASTFile(ast, cache->data + old->imageOffset, old->imageLength, &program, &frameSize, cache->diagnostics);
+            previous = (const IncrementalStatement*)(cache->data + old->statementsOffset);
+            symbols = (const IncrementalSymbol*)(cache->data + old->symbolsOffset);
+            count = old->statementCount;
+        }
+    }
+    if(previous == NULL) initAST(ast, cache->diagnostics);
+
+    // The unchanged statements at either end are found by their text
+    // alone; only what lies between them is lexed.
+    size_t pos = 0;
+    uint32_t first = 0;
+    while(first < count && previous[first].length <= size - pos &&
+          hashBytes(0, text + pos, previous[first].length) == previous[first].textHash){
+        pos += previous[first].length;
+        first++;
+    }
+    size_t end = size;
+    uint32_t last = count;
+    if(count > 0 && old->tailLength <= size - pos &&
+       hashBytes(0, text + size - old->tailLength, old->tailLength) == old->tailHash){
+        end = size - old->tailLength;
+        while(last > first && previous[last - 1].length <= end - pos &&
+              hashBytes(0, text + end - previous[last - 1].length, previous[last - 1].length) == previous[last - 1].textHash){
+            end -= previous[last - 1].length;
+            last--;
+        }
+    }
+
+    Splice s = {cache, parser, ast, table, text, 0, 1};
+    for(uint32_t i = 0; i < first; i++) reuseStatement(&s, &previous[i], symbols, s.piece);
+    if(pos == end || parseChanged(&s, end, size)){
+        size_t at = end;
+        for(uint32_t i = last; i < count; i++){
+            reuseStatement(&s, &previous[i], symbols, at);
+            at += previous[i].length;
+        }
+    }
+    cache->tailLength = size - s.piece;
+    cache->tailHash = hashBytes(0, text + s.piece, cache->tailLength);
+
+    NodeId program = newNode(ast, NODE_BLOCK);
+    ast->left[program] = appendChildren(ast, cache->roots.items, cache->roots.count);
+    ast->right[program] = cache->roots.count;
+    ast->line[program] = cache->statementCount > 0 ? cache->statements[0].line + cache->statements[0].leading
+                                                    : s.line + countNewlines(text + s.piece, cache->tailLength);
+    freeParser(parser);
+
+    // Taken before the passes rewrite the tree.
+    Output image;
+    initOutputBuffer(&image, cache->diagnostics);
+    writeASTFile(&image, ast, program, table->frameSize);
+    cache->image = takeOutputBuffer(&image, &cache->imageLength);
+    discardOutput(&image);
+    return program;
+}
+
+static uint64_t hashName(uint64_t hash, const AST* ast, int nameId){
+    return hashBytes(hash, nameText(ast, nameId), (size_t)ast->nameLengths[nameId]);
+}
+
+// Names are hashed by spelling, as a fresh parse numbers them anew.
+uint64_t hashStatements(const AST* ast, const NodeId* statements, uint32_t count, int lines, NodeList* work){
+    uint64_t hash = mix(0, count);
+    uint32_t base = ast->line[statements[0]];
+    for(uint32_t i = 0; i < count; i++){
+        work->count = 0;
+        pushNode(ast, work, statements[i]);
+        while(work->count > 0){
+            NodeId node = work->items[--work->count];
+            uint8_t kind = ast->kind[node];
+            uint32_t value = kind == NODE_CALL ? 0 : (uint32_t)ast->value[node];
+            hash = mix(hash, kind | (uint64_t)ast->op[node] << 8 | (uint64_t)value << 32);
+            if(lines) hash = mix(hash, ast->line[node] != 0 ? ast->line[node] - base + 1 : 0);
+            switch(kind){
+                case NODE_NUMBER:
+                    hash = mix(hash, ast->left[node]);
+                    break;
+                case NODE_IDENTIFIER:
+                case NODE_ASSIGN:
+                case NODE_FUNCTION:
+                case NODE_INDEX:
+                    hash = hashName(hash, ast, (int)ast->left[node]);
+                    break;
+                case NODE_ARRAY:
+                    hash = mix(hashName(hash, ast, (int)ast->left[node]), ast->right[node]);
+                    break;
+                case NODE_CALL:
+                    hash = mix(hashName(hash, ast, ast->value[node]), ast->right[node]);
+                    break;
+                case NODE_BLOCK:
+                    hash = mix(hash, ast->right[node]);
+                    break;
+                case NODE_RETURN:
+                    hash = mix(hash, ast->left[node] != NULL_NODE);
+                    break;
+                default:
+                    break;
+            }
+            pushChildren(ast, node, work);
+        }
+    }
+    return hash;
+}
+
+void setFragmentFingerprint(IncrementalCache* cache, uint64_t fingerprint){
+    cache->fingerprint = fingerprint;
+}
+
+static void buildBuckets(IncrementalCache* cache){
+    const IncrementalHeader* old = cache->header;
+    const IncrementalFragment* fragments = (const IncrementalFragment*)(cache->data + old->fragmentsOffset);
+    uint32_t bucketCount = 16;
+    while(bucketCount < old->fragmentCount * 2) bucketCount *= 2;
+    cache->buckets = (uint32_t*)calloc(bucketCount, sizeof(uint32_t));
+    if(cache->buckets == NULL){
+        reportError(cache->diagnostics, "Failed to allocate incremental cache.");
+        fail(cache->diagnostics, 74);
+    }
+    cache->bucketCount = bucketCount;
+    for(uint32_t i = 0; i < old->fragmentCount; i++){
+        uint32_t slot = (uint32_t)fragments[i].key & (bucketCount - 1);
+        while(cache->buckets[slot] != 0) slot = (slot + 1) & (bucketCount - 1);
+        cache->buckets[slot] = i + 1;
+    }
+}
+
+typedef struct {
+    char* text;
+    size_t length;
+    size_t capacity;
+    Diagnostics* diagnostics;
+} Text;
+
+static void appendText(Text* out, const char* bytes, size_t length){
+    if(out->length + length > out->capacity){
+        size_t capacity = out->capacity ? out->capacity : 256;
+        while(capacity < out->length + length) capacity *= 2;
+        out->text = (char*)realloc(out->text, capacity);
+        if(out->text == NULL){
+            reportError(out->diagnostics, "Failed to allocate incremental cache.");
+            fail(out->diagnostics, 74);
+        }
+        out->capacity = capacity;
+    }
+    memcpy(out->text + out->length, bytes, length);
+    out->length += length;
+}
+
+static int isDigitAt(const char* text, size_t length, size_t at){
+    return at < length && text[at] >= '0' && text[at] <= '9';
+}
+
+// Labels are .L<n>, and cold blocks <function>.cold.<n>; lines only appear
+// as ".loc 1 <line>" directives. Nothing else in generated code puts a
+// digit right after those prefixes.
+static char* renumber(Diagnostics* diagnostics, const char* text, size_t length, int64_t labelDelta, int64_t lineDelta, size_t* result){
+    Text out = {NULL, 0, 0, diagnostics};
+    size_t i = 0;
+    while(i < length){
+        const char* dot = memchr(text + i, '.', length - i);
+        size_t at = dot != NULL ? (size_t)(dot - text) : length;
+        appendText(&out, text + i, at - i);
+        if(dot == NULL) break;
+
+        size_t prefix = 0;
+        int64_t delta = 0;
+        if(labelDelta != 0 && at + 1 < length && text[at + 1] == 'L' && isDigitAt(text, length, at + 2)){
+            prefix = 2;
+            delta = labelDelta;
+        }else if(labelDelta != 0 && length - at > 6 && memcmp(text + at, ".cold.", 6) == 0 &&
+                 isDigitAt(text, length, at + 6)){
+            prefix = 6;
+            delta = labelDelta;
+        }else if(lineDelta != 0 && (at == 0 || text[at - 1] == '\n') && length - at > 7 &&
+                 memcmp(text + at, ".loc 1 ", 7) == 0 && isDigitAt(text, length, at + 7)){
+            prefix = 7;
+            delta = lineDelta;
+        }
+        if(prefix == 0){
+            appendText(&out, ".", 1);
+            i = at + 1;
+            continue;
+        }
+
+        appendText(&out, text + at, prefix);
+        int64_t number = 0;
+        for(i = at + prefix; isDigitAt(text, length, i); i++) number = number * 10 + (text[i] - '0');
+        char digits[24];
+        int written = snprintf(digits, sizeof(digits), "%lld", (long long)(number + delta));
+        appendText(&out, digits, (size_t)written);
+    }
+    appendText(&out, "", 1);
+    *result = out.length - 1;
+    return out.text;
+}
+
+int reuseFragment(IncrementalCache* cache, uint64_t key, int labelBase, uint32_t line,
+                  char** text, size_t* length, int* vectorSupport, int* inputSupport){
+    const IncrementalHeader* old = cache->header;
+    if(old == NULL || old->fragmentCount == 0 || old->fingerprint != cache->fingerprint) return 0;
+    if(cache->buckets == NULL) buildBuckets(cache);
+
+    const IncrementalFragment* fragments = (const IncrementalFragment*)(cache->data + old->fragmentsOffset);
+    uint32_t mask = cache->bucketCount - 1;
+    for(uint32_t slot = (uint32_t)key & mask; cache->buckets[slot] != 0; slot = (slot + 1) & mask){
+        const IncrementalFragment* fragment = &fragments[cache->buckets[slot] - 1];
+        if(fragment->key != key) continue;
+        *text = renumber(cache->diagnostics, cache->data + old->textOffset + fragment->textOffset, fragment->length,
+                         (int64_t)labelBase - fragment->labelBase, (int64_t)line - fragment->line, length);
+        *vectorSupport = fragment->vectorSupport;
+        *inputSupport = fragment->inputSupport;
+        return 1;
+    }
+    return 0;
+}
+
+void recordFragment(IncrementalCache* cache, uint64_t key, char* text, size_t length, int labelBase,
+                    uint32_t line, int vectorSupport, int inputSupport){
+    cache->fragments = grow(cache->diagnostics, cache->fragments, &cache->fragmentCapacity, cache->fragmentCount + 1, sizeof(FragmentRecord));
+    FragmentRecord* record = &cache->fragments[cache->fragmentCount++];
+    record->key = key;
+    record->text = text;
+    record->length = length;
+    record->labelBase = labelBase;
+    record->line = line;
+    record->vectorSupport = vectorSupport;
+    record->inputSupport = inputSupport;
+}
+
+static uint64_t alignSection(uint64_t offset){
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+static void emitSection(Output* out, uint64_t* written, uint64_t offset, const void* data, size_t length){
+    static const char padding[8] = {0};
+    emitBytes(out, padding, (size_t)(offset - *written));
+    emitBytes(out, data, length);
+    *written = offset + length;
+}
+
+// Written beside the old cache and renamed over it, so a compilation that
+// dies halfway leaves the old one whole, and the old one can stay mapped
+// while the new one is written.
+void saveIncremental(IncrementalCache* cache, const char* path){
+    char temporary[PATH_MAX];
+    if(snprintf(temporary, sizeof(temporary), "%s.tmp", path) >= (int)sizeof(temporary)){
+        reportError(cache->diagnostics, "Incremental cache path too long.");
+        fail(cache->diagnostics, 64);
+    }
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        reportError(cache->diagnostics, "not possible to write incremental cache '%s'.", path);
+        fail(cache->diagnostics, 74);
+    }
+
+    IncrementalFragment* fragments = calloc(cache->fragmentCount ? cache->fragmentCount : 1, sizeof(IncrementalFragment));
+    if(fragments == NULL){
+        reportError(cache->diagnostics, "Failed to allocate incremental cache.");
+        fail(cache->diagnostics, 74);
+    }
+    uint64_t textLength = 0;
+    for(uint32_t i = 0; i < cache->fragmentCount; i++){
+        const FragmentRecord* record = &cache->fragments[i];
+        fragments[i].key = record->key;
+        fragments[i].textOffset = textLength;
+        fragments[i].length = record->length;
+        fragments[i].labelBase = record->labelBase;
+        fragments[i].line = record->line;
+        fragments[i].vectorSupport = (uint8_t)record->vectorSupport;
+        fragments[i].inputSupport = (uint8_t)record->inputSupport;
+        textLength += record->length;
+    }
+
+    IncrementalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INCREMENTAL_MAGIC, 8);
+    header.version = INCREMENTAL_VERSION;
+    header.statementCount = cache->statementCount;
+    header.symbolCount = cache->symbolCount;
+    header.fragmentCount = cache->fragmentCount;
+    header.liveNodes = cache->liveNodes;
+    header.fingerprint = cache->fingerprint;
+    header.tailHash = cache->tailHash;
+    header.tailLength = cache->tailLength;
+
+    uint64_t offset = alignSection(sizeof(header));
+    header.statementsOffset = offset; offset = alignSection(offset + cache->statementCount * sizeof(IncrementalStatement));
+    header.symbolsOffset = offset;    offset = alignSection(offset + cache->symbolCount * sizeof(IncrementalSymbol));
+    header.fragmentsOffset = offset;  offset = alignSection(offset + cache->fragmentCount * sizeof(IncrementalFragment));
+    header.imageOffset = offset;      offset = alignSection(offset + cache->imageLength);
+    header.imageLength = cache->imageLength;
+    header.textOffset = offset;
+
+    Output out;
+    initOutput(&out, fd, cache->diagnostics);
+    uint64_t written = 0;
+    emitSection(&out, &written, 0, &header, sizeof(header));
+    emitSection(&out, &written, header.statementsOffset, cache->statements, cache->statementCount * sizeof(IncrementalStatement));
+    emitSection(&out, &written, header.symbolsOffset, cache->symbols, cache->symbolCount * sizeof(IncrementalSymbol));
+    emitSection(&out, &written, header.fragmentsOffset, fragments, cache->fragmentCount * sizeof(IncrementalFragment));
+    emitSection(&out, &written, header.imageOffset, cache->image, cache->imageLength);
+    emitSection(&out, &written, header.textOffset, NULL, 0);
+    for(uint32_t i = 0; i < cache->fragmentCount; i++) emitBytes(&out, cache->fragments[i].text, cache->fragments[i].length);
+    freeOutput(&out);
+    free(fragments);
+
+    if(close(fd) != 0 || rename(temporary, path) != 0){
+        unlink(temporary);
+        reportError(cache->diagnostics, "not possible to write incremental cache '%s'.", path);
+        fail(cache->diagnostics, 74);
+    }
+}
@@ -0,0 +1,558 @@
+#include "inliner.h"
+#include "diagnostic.h"
+#include "liveness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Callees larger than this many nodes are never copied into a caller.
+#define INLINE_BUDGET 64
+// With a profile, sites that ran at least HOT_SITE_COUNT times may take
+// bigger callees, and sites that never ran take none.
+#define HOT_SITE_COUNT 1000
+#define HOT_INLINE_BUDGET 256
+// Each round can expose calls that came in with an inlined body; mutual
+// recursion is what keeps this bounded.
+#define INLINE_ROUNDS 3
+
+typedef struct {
+    AST* ast;
+    NodeId* functions;
+    NodeList walk;
+    NodeList scratch;
+    NodeList sites;
+    NodeList parts;
+    // Execution counts matching walk and sites entry for entry.
+    uint64_t* walkCounts;
+    uint64_t* siteCounts;
+    uint32_t walkCountCapacity;
+    uint32_t siteCountCapacity;
+    const Profile* profile;
+} Inliner;
+
+static void setCount(Diagnostics* diagnostics, uint64_t** counts, uint32_t* capacity, uint32_t index, uint64_t count){
+    if(index >= *capacity){
+        uint32_t grown = *capacity ? *capacity * 2 : 64;
+        while(grown <= index) grown *= 2;
+        *counts = (uint64_t*)realloc(*counts, grown * sizeof(uint64_t));
+        if(*counts == NULL){
+            reportError(diagnostics, "Failed to grow inliner counts.");
+            fail(diagnostics, 74);
+        }
+        *capacity = grown;
+    }
+    (*counts)[index] = count;
+}
+
+static uint64_t takenCount(const Inliner* in, NodeId node, uint64_t fallback){
+    if(in->profile == NULL || in->ast->value[node] <= 0) return fallback;
+    return probeCount(in->profile, probeOf(in->ast, node), PROBE_TAKEN);
+}
+
+static uint32_t siteBudget(const Inliner* in, uint64_t count){
+    if(in->profile == NULL) return INLINE_BUDGET;
+    if(count == 0) return 0;
+    return count >= HOT_SITE_COUNT ? HOT_INLINE_BUDGET : INLINE_BUDGET;
+}
+
+// Function definitions indexed by the name id they were declared under.
+static NodeId* mapFunctions(AST* ast, NodeId program){
+    NodeId* functions = (NodeId*)calloc(ast->nameCount > 0 ? ast->nameCount : 1, sizeof(NodeId));
+    if(functions == NULL){
+        reportError(ast->diagnostics, "Failed to allocate function table.");
+        fail(ast->diagnostics, 74);
+    }
+
+    NodeId* statements = blockStatements(ast, program);
+    for(uint32_t i = 0; i < ast->right[program]; i++){
+        NodeId function = statements[i];
+        if(ast->kind[function] != NODE_FUNCTION) continue;
+        if(functions[ast->left[function]] != NULL_NODE){
+            reportError(ast->diagnostics, "Function '%.*s' is defined twice.",
+                    ast->nameLengths[ast->left[function]], nameText(ast, ast->left[function]));
+            free(functions);
+            fail(ast->diagnostics, 65);
+        }
+        functions[ast->left[function]] = function;
+    }
+    return functions;
+}
+
+// Calls may name functions defined further down, so they are only checked
+// once the whole program has been parsed. A bad call is the usual way a
+// library compilation fails, so it cleans up before failing.
+void resolveFunctions(AST* ast, NodeId program){
+    NodeId* functions = mapFunctions(ast, program);
+    NodeList work = {NULL, 0, 0};
+    int status = 0;
+    pushNode(ast, &work, program);
+
+    while(work.count > 0){
+        NodeId node = work.items[--work.count];
+        if(ast->kind[node] == NODE_CALL){
+            int nameId = ast->value[node];
+            NodeId callee = functions[nameId];
+            if(callee == NULL_NODE){
+                reportError(ast->diagnostics, "Call to undefined function '%.*s'.",
+                        ast->nameLengths[nameId], nameText(ast, nameId));
+                status = 65;
+                break;
+            }
+            if(ast->op[callee] != ast->right[node]){
+                reportError(ast->diagnostics, "Function '%.*s' expects %d arguments, got %u.",
+                        ast->nameLengths[nameId], nameText(ast, nameId), ast->op[callee], ast->right[node]);
+                status = 65;
+                break;
+            }
+        }
+        pushChildren(ast, node, &work);
+    }
+
+    freeNodeList(&work);
+    free(functions);
+    if(status != 0) fail(ast->diagnostics, status);
+}
+
+void markTailCalls(AST* ast, NodeId program){
+    NodeList work = {NULL, 0, 0};
+    uint32_t count = ast->right[program];
+
+    for(uint32_t i = 0; i < count; i++){
+        NodeId function = blockStatements(ast, program)[i];
+        if(ast->kind[function] != NODE_FUNCTION) continue;
+
+        pushNode(ast, &work, ast->right[function]);
+        while(work.count > 0){
+            NodeId node = work.items[--work.count];
+            if(ast->kind[node] == NODE_RETURN){
+                NodeId value = ast->left[node];
+                if(value != NULL_NODE && ast->kind[value] == NODE_CALL &&
+                   ast->value[value] == (int32_t)ast->left[function]){
+                    ast->op[node] = 1;
+                }
+                continue;
+            }
+            pushChildren(ast, node, &work);
+        }
+    }
+
+    freeNodeList(&work);
+}
+
+static uint32_t countNodes(Inliner* in, NodeId root){
+    NodeList* work = &in->scratch;
+    work->count = 0;
+    pushNode(in->ast, work, root);
+
+    uint32_t count = 0;
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        count++;
+        pushChildren(in->ast, node, work);
+    }
+    return count;
+}
+
+static uint32_t countUses(Inliner* in, NodeId root, int offset){
+    NodeList* work = &in->scratch;
+    work->count = 0;
+    pushNode(in->ast, work, root);
+
+    uint32_t uses = 0;
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        if(in->ast->kind[node] == NODE_IDENTIFIER && in->ast->value[node] == offset) uses++;
+        pushChildren(in->ast, node, work);
+    }
+    return uses;
+}
+
+// Copies a callee subtree. Offsets move by shift into the caller's frame;
+// with substitute set, parameters are replaced by the call's arguments.
+// Callee bodies are bounded by HOT_INLINE_BUDGET, so recursing is fine here.
+static NodeId cloneTree(Inliner* in, NodeId node, int shift, const NodeId* substitute){
+    AST* ast = in->ast;
+
+    if(substitute != NULL && ast->kind[node] == NODE_IDENTIFIER){
+        NodeId argument = substitute[ast->value[node] / 8 - 1];
+        uint8_t argumentKind = ast->kind[argument];
+        if(argumentKind != NODE_NUMBER && argumentKind != NODE_IDENTIFIER) return argument;
+        node = argument;
+        shift = 0;
+        substitute = NULL;
+    }
+
+    NodeId copy = newNode(ast, (ASTNodeType)ast->kind[node]);
+    ast->op[copy] = ast->op[node];
+    ast->left[copy] = ast->left[node];
+    ast->right[copy] = ast->right[node];
+    ast->value[copy] = ast->value[node];
+    ast->line[copy] = ast->line[node];
+
+    NodeId child;
+    switch(ast->kind[node]){
+        case NODE_IDENTIFIER:
+        case NODE_ARRAY:
+            ast->value[copy] += shift;
+            break;
+        case NODE_ASSIGN:
+        case NODE_INDEX:
+            ast->value[copy] += shift;
+            child = cloneTree(in, ast->right[node], shift, substitute);
+            ast->right[copy] = child;
+            break;
+        case NODE_BINARY_OP:
+        case NODE_LOGICAL_AND:
+        case NODE_LOGICAL_OR:
+        case NODE_IF:
+        case NODE_WHILE:
+        case NODE_STORE:
+            child = cloneTree(in, ast->left[node], shift, substitute);
+            ast->left[copy] = child;
+            child = cloneTree(in, ast->right[node], shift, substitute);
+            ast->right[copy] = child;
+            break;
+        case NODE_PRINT:
+        case NODE_EXPRESSION_STATEMENT:
+        case NODE_RETURN:
+            if(ast->left[node] != NULL_NODE){
+                child = cloneTree(in, ast->left[node], shift, substitute);
+                ast->left[copy] = child;
+            }
+            break;
+        case NODE_BLOCK:
+        case NODE_CALL: {
+            uint32_t count = ast->right[node];
+            NodeId* copies = (NodeId*)malloc((count > 0 ? count : 1) * sizeof(NodeId));
+            if(copies == NULL){
+                reportError(ast->diagnostics, "Failed to allocate inlined block.");
+                fail(ast->diagnostics, 74);
+            }
+            for(uint32_t i = 0; i < count; i++){
+                copies[i] = cloneTree(in, ast->children[ast->left[node] + i], shift, substitute);
+            }
+            ast->left[copy] = appendChildren(ast, copies, count);
+            free(copies);
+            break;
+        }
+        default:
+            break;
+    }
+    return copy;
+}
+
+// A body of the form { return e; } whose arguments can be substituted
+// without changing what gets evaluated is folded straight into the call.
+static int inlineExpression(Inliner* in, NodeId call, NodeId self, uint32_t budget){
+    AST* ast = in->ast;
+    NodeId callee = in->functions[ast->value[call]];
+    if(callee == self) return 0;
+
+    NodeId body = ast->right[callee];
+    if(ast->right[body] != 1) return 0;
+    NodeId statement = blockStatements(ast, body)[0];
+    if(ast->kind[statement] != NODE_RETURN || ast->left[statement] == NULL_NODE) return 0;
+    NodeId result = ast->left[statement];
+    if(countNodes(in, result) > budget) return 0;
+
+    NodeId substitute[8];
+    uint32_t argumentCount = ast->right[call];
+    for(uint32_t i = 0; i < argumentCount; i++){
+        NodeId argument = callArguments(ast, call)[i];
+        if(!isPureExpression(ast, argument, &in->scratch)) return 0;
+        uint8_t kind = ast->kind[argument];
+        if(kind != NODE_NUMBER && kind != NODE_IDENTIFIER &&
+           countUses(in, result, 8 * (i + 1)) > 1) return 0;
+        substitute[i] = argument;
+    }
+
+    NodeId copy = cloneTree(in, result, 0, substitute);
+    ast->kind[call] = ast->kind[copy];
+    ast->op[call] = ast->op[copy];
+    ast->left[call] = ast->left[copy];
+    ast->right[call] = ast->right[copy];
+    ast->value[call] = ast->value[copy];
+    return 1;
+}
+
+static int inlineExpressions(Inliner* in, NodeId root, NodeId self, uint32_t budget){
+    NodeList* work = &in->walk;
+    work->count = 0;
+    if(root != NULL_NODE) pushNode(in->ast, work, root);
+
+    int changed = 0;
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        // An inlined result is left for the next round.
+        if(in->ast->kind[node] == NODE_CALL && inlineExpression(in, node, self, budget)){
+            changed = 1;
+            continue;
+        }
+        pushChildren(in->ast, node, work);
+    }
+    return changed;
+}
+
+// Statement-level inlining needs every exit of the callee to be its final
+// statement, so the copied body can simply fall through into the site.
+static int canInlineBody(Inliner* in, NodeId callee, uint32_t budget){
+    AST* ast = in->ast;
+    NodeId body = ast->right[callee];
+    uint32_t count = ast->right[body];
+    int finalReturn = count > 0 && ast->kind[blockStatements(ast, body)[count - 1]] == NODE_RETURN;
+
+    NodeList* work = &in->scratch;
+    work->count = 0;
+    pushNode(ast, work, body);
+
+    uint32_t nodes = 0;
+    int returns = 0;
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        if(ast->kind[node] == NODE_RETURN) returns++;
+        if(++nodes > budget) return 0;
+        pushChildren(ast, node, work);
+    }
+    return returns == finalReturn;
+}
+
+static int parameterName(Inliner* in, NodeId callee, int offset){
+    NodeList* work = &in->scratch;
+    work->count = 0;
+    pushNode(in->ast, work, in->ast->right[callee]);
+
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        uint8_t kind = in->ast->kind[node];
+        if((kind == NODE_IDENTIFIER || kind == NODE_ASSIGN) && in->ast->value[node] == offset){
+            return (int)in->ast->left[node];
+        }
+        pushChildren(in->ast, node, work);
+    }
+    return -1;
+}
+
+static NodeId wrapExpression(AST* ast, ASTNodeType kind, NodeId expression){
+    NodeId node = newNode(ast, kind);
+    ast->left[node] = expression;
+    return node;
+}
+
+// Rewrites the statement into a block that stores the arguments in fresh
+// slots of the caller's frame, runs a copy of the callee body there and
+// then performs the original statement on the returned value.
+static void inlineStatement(Inliner* in, NodeId statement, NodeId call, int* frameSize){
+    AST* ast = in->ast;
+    NodeId callee = in->functions[ast->value[call]];
+    int shift = *frameSize;
+    *frameSize += ast->value[callee];
+    // Argument stores and the final assignment stay on the call's line;
+    // the copied body keeps the callee's lines.
+    ast->currentLine = ast->line[statement];
+
+    NodeList* parts = &in->parts;
+    parts->count = 0;
+
+    uint32_t argumentCount = ast->right[call];
+    for(uint32_t i = 0; i < argumentCount; i++){
+        NodeId argument = callArguments(ast, call)[i];
+        int offset = 8 * (int)(i + 1);
+        int nameId = parameterName(in, callee, offset);
+        if(nameId < 0){
+            pushNode(ast, parts, wrapExpression(ast, NODE_EXPRESSION_STATEMENT, argument));
+            continue;
+        }
+        NodeId store = newNode(ast, NODE_ASSIGN);
+        ast->left[store] = (uint32_t)nameId;
+        ast->right[store] = argument;
+        ast->value[store] = shift + offset;
+        pushNode(ast, parts, store);
+    }
+
+    NodeId body = ast->right[callee];
+    uint32_t count = ast->right[body];
+    NodeId result = NULL_NODE;
+    for(uint32_t i = 0; i < count; i++){
+        NodeId source = blockStatements(ast, body)[i];
+        if(ast->kind[source] == NODE_RETURN){
+            if(ast->left[source] != NULL_NODE) result = cloneTree(in, ast->left[source], shift, NULL);
+            break;
+        }
+        pushNode(ast, parts, cloneTree(in, source, shift, NULL));
+    }
+
+    uint8_t kind = ast->kind[statement];
+    if(result == NULL_NODE && kind != NODE_EXPRESSION_STATEMENT){
+        result = newNode(ast, NODE_NUMBER);
+    }
+    if(kind == NODE_ASSIGN){
+        NodeId store = newNode(ast, NODE_ASSIGN);
+        ast->left[store] = ast->left[statement];
+        ast->right[store] = result;
+        ast->value[store] = ast->value[statement];
+        pushNode(ast, parts, store);
+    }else if(result != NULL_NODE){
+        pushNode(ast, parts, wrapExpression(ast, (ASTNodeType)kind, result));
+    }
+
+    uint32_t first = appendChildren(ast, parts->items, parts->count);
+    ast->kind[statement] = NODE_BLOCK;
+    ast->op[statement] = 0;
+    ast->left[statement] = first;
+    ast->right[statement] = parts->count;
+    ast->value[statement] = 0;
+}
+
+static NodeId siteCall(AST* ast, NodeId statement){
+    NodeId expression;
+    switch(ast->kind[statement]){
+        case NODE_ASSIGN:
+            expression = ast->right[statement];
+            break;
+        case NODE_PRINT:
+        case NODE_EXPRESSION_STATEMENT:
+        case NODE_RETURN:
+            expression = ast->left[statement];
+            break;
+        default:
+            return NULL_NODE;
+    }
+    if(expression == NULL_NODE || ast->kind[expression] != NODE_CALL) return NULL_NODE;
+    return expression;
+}
+
+// One inlining round over the statements of a single frame.
+// count is how often the frame's body ran in the profiled run.
+static int inlineFrame(Inliner* in, NodeId body, NodeId self, int* frameSize, uint64_t count){
+    AST* ast = in->ast;
+    NodeList* sites = &in->sites;
+    sites->count = 0;
+
+    NodeList* work = &in->walk;
+    work->count = 0;
+    pushNode(ast, work, body);
+    setCount(in->ast->diagnostics, &in->walkCounts, &in->walkCountCapacity, 0, count);
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        uint64_t nodeCount = in->walkCounts[work->count];
+        switch(ast->kind[node]){
+            case NODE_BLOCK: {
+                uint32_t first = work->count;
+                pushChildren(ast, node, work);
+                for(uint32_t i = first; i < work->count; i++){
+                    setCount(in->ast->diagnostics, &in->walkCounts, &in->walkCountCapacity, i, nodeCount);
+                }
+                break;
+            }
+            case NODE_IF:
+            case NODE_WHILE:
+                setCount(in->ast->diagnostics, &in->siteCounts, &in->siteCountCapacity, sites->count, nodeCount);
+                pushNode(ast, sites, node);
+                setCount(in->ast->diagnostics, &in->walkCounts, &in->walkCountCapacity, work->count, takenCount(in, node, nodeCount));
+                pushNode(ast, work, ast->right[node]);
+                break;
+            case NODE_FUNCTION:
+                break;
+            default:
+                setCount(in->ast->diagnostics, &in->siteCounts, &in->siteCountCapacity, sites->count, nodeCount);
+                pushNode(ast, sites, node);
+                break;
+        }
+    }
+
+    int changed = 0;
+    for(uint32_t i = 0; i < sites->count; i++){
+        NodeId statement = sites->items[i];
+        uint32_t budget = siteBudget(in, in->siteCounts[i]);
+        if(budget == 0) continue;
+
+        uint8_t kind = ast->kind[statement];
+        NodeId expression = (kind == NODE_ASSIGN) ? ast->right[statement] : ast->left[statement];
+        changed |= inlineExpressions(in, expression, self, budget);
+
+        NodeId call = siteCall(ast, statement);
+        if(call == NULL_NODE) continue;
+        NodeId callee = in->functions[ast->value[call]];
+        if(callee == self || !canInlineBody(in, callee, budget)) continue;
+        inlineStatement(in, statement, call, frameSize);
+        changed = 1;
+    }
+    return changed;
+}
+
+// Drops definitions nothing calls any more, except from their own body.
+static void removeUncalled(Inliner* in, NodeId program){
+    AST* ast = in->ast;
+    uint32_t* calls = (uint32_t*)calloc(ast->nameCount > 0 ? ast->nameCount : 1, sizeof(uint32_t));
+    if(calls == NULL){
+        reportError(ast->diagnostics, "Failed to allocate call counts.");
+        fail(ast->diagnostics, 74);
+    }
+
+    for(;;){
+        NodeId* statements = blockStatements(ast, program);
+        uint32_t count = ast->right[program];
+        for(uint32_t i = 0; i < ast->nameCount; i++) calls[i] = 0;
+
+        for(uint32_t i = 0; i <= count; i++){
+            NodeId frame = i < count ? statements[i] : program;
+            int self = -1;
+            if(i < count){
+                if(ast->kind[frame] != NODE_FUNCTION) continue;
+                self = (int)ast->left[frame];
+            }
+
+            NodeList* work = &in->walk;
+            work->count = 0;
+            pushNode(ast, work, i < count ? ast->right[frame] : frame);
+            while(work->count > 0){
+                NodeId node = work->items[--work->count];
+                if(ast->kind[node] == NODE_FUNCTION) continue;
+                if(ast->kind[node] == NODE_CALL && ast->value[node] != self) calls[ast->value[node]]++;
+                pushChildren(ast, node, work);
+            }
+        }
+
+        uint32_t kept = 0;
+        for(uint32_t i = 0; i < count; i++){
+            NodeId node = statements[i];
+            if(ast->kind[node] == NODE_FUNCTION && calls[ast->left[node]] == 0) continue;
+            statements[kept++] = node;
+        }
+        if(kept == count) break;
+        ast->right[program] = kept;
+    }
+
+    free(calls);
+}
+
+void inlineFunctions(AST* ast, NodeId program, SymbolTable* table, const Profile* profile){
+    Inliner in = {ast, mapFunctions(ast, program), {NULL, 0, 0}, {NULL, 0, 0}, {NULL, 0, 0}, {NULL, 0, 0},
+                  NULL, NULL, 0, 0, profile};
+
+    for(int round = 0; round < INLINE_ROUNDS; round++){
+        int changed = inlineFrame(&in, program, NULL_NODE, &table->frameSize, 1);
+
+        for(uint32_t i = 0; i < ast->right[program]; i++){
+            NodeId function = blockStatements(ast, program)[i];
+            if(ast->kind[function] != NODE_FUNCTION) continue;
+
+            int frameSize = ast->value[function];
+            uint64_t calls = profile != NULL && ast->value[ast->right[function]] > 0
+                ? probeCount(profile, probeOf(ast, ast->right[function]), PROBE_REACHED) : 1;
+            changed |= inlineFrame(&in, ast->right[function], function, &frameSize, calls);
+            ast->value[function] = frameSize;
+        }
+        if(!changed) break;
+    }
+
+    removeUncalled(&in, program);
+
+    freeNodeList(&in.walk);
+    freeNodeList(&in.scratch);
+    freeNodeList(&in.sites);
+    freeNodeList(&in.parts);
+    free(in.walkCounts);
+    free(in.siteCounts);
+    free(in.functions);
+}
@@ -0,0 +1,377 @@
+#include "input.h"
+#include "diagnostic.h"
+#include "output.h"
+#include "runtime.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Numbers are taken eight digits at a time where the buffer allows: one
+// load, a mask of the bytes that are not digits, and the eight digits
+// combined pairwise by three multiplications (SWAR, no vector registers
+// needed). Only the last few bytes of a block go digit by digit.
+
+#define ONES 0x0101010101010101ull
+#define HIGH_NIBBLES (0xF0 * ONES)
+#define ZEROS (0x30 * ONES)
+#define MASK_PAIRS 0x000000FF000000FFull
+#define MUL_HIGH 0x000F424000000064ull   // 100 + (1000000 << 32)
+#define MUL_LOW 0x0000271000000001ull    // 1 + (10000 << 32)
+
+static const uint64_t powersOfTen[9] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+};
+
+// Nonzero in every byte of chunk that is not an ASCII digit; a byte past
+// the first such one may be marked wrongly, which no caller looks at.
+static inline uint64_t nonDigits(uint64_t chunk){
+    return ((chunk & HIGH_NIBBLES) ^ ZEROS) | (((chunk + 6 * ONES) & HIGH_NIBBLES) ^ ZEROS);
+}
+
+// Eight digit values, the first in the low byte, as one number.
+static inline uint64_t parseEight(uint64_t digits){
+    digits = digits * 10 + (digits >> 8);
+    return ((digits & MASK_PAIRS) * MUL_HIGH + ((digits >> 16) & MASK_PAIRS) * MUL_LOW) >> 32;
+}
+
+void initInput(Input* input, int fd, Output* out){
+    memset(input, 0, sizeof(*input));
+    input->fd = fd;
+    input->out = out;
+}
+
+static int openInput(Input* input){
+    input->state = INPUT_STREAMING;
+    struct stat info;
+    if(fstat(input->fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0){
+        off_t position = lseek(input->fd, 0, SEEK_CUR);
+        if(position >= 0 && position < info.st_size){
+            void* mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, input->fd, 0);
+            if(mapping != MAP_FAILED){
+                input->mapping = mapping;
+                input->mappingLength = (size_t)info.st_size;
+                input->cursor = (const unsigned char*)mapping + position;
+                input->end = (const unsigned char*)mapping + info.st_size;
+                input->state = INPUT_MAPPED;
+                return 1;
+            }
+        }
+    }
+    input->buffer = malloc(INPUT_BLOCK_SIZE);
+    if(input->buffer == NULL){
+        flushOutput(input->out);
+        reportError(NULL, "Failed to allocate input buffer.");
+        fail(NULL, 74);
+    }
+    return 0;
+}
+
+// Makes bytes available past the cursor; 0 at the end of the input->
+static int fillInput(Input* input){
+    if(input->state == INPUT_UNOPENED && openInput(input)) return 1;
+    if(input->state != INPUT_STREAMING) return 0;
+    for(;;){
+        ssize_t length = read(input->fd, input->buffer, INPUT_BLOCK_SIZE);
+        if(length > 0){
+            input->cursor = input->buffer;
+            input->end = input->buffer + length;
+            return 1;
+        }
+        if(length < 0 && errno == EINTR) continue;
+        input->state = INPUT_ENDED;
+        return 0;
+    }
+}
+
+int64_t readInput(Input* input){
+    int negative = 0;
+    for(;;){
+        if(input->cursor == input->end && !fillInput(input)) return 0;
+        unsigned char c = *input->cursor;
+        if((unsigned)(c - '0') <= 9) break;
+        negative = c == '-';
+        input->cursor++;
+    }
+
+    uint64_t value = 0;
+    for(;;){
+        while(input->end - input->cursor >= 8){
+            uint64_t chunk;
+            memcpy(&chunk, input->cursor, sizeof(chunk));
+            uint64_t mask = nonDigits(chunk);
+            if(mask == 0){
+                value = value * powersOfTen[8] + parseEight(chunk - ZEROS);
+                input->cursor += 8;
+                continue;
+            }
+            int digits = __builtin_ctzll(mask) / 8;
+            if(digits > 0){
+                value = value * powersOfTen[digits] + parseEight((chunk - ZEROS) << (64 - 8 * digits));
+                input->cursor += digits;
+            }
+            return (int64_t)(negative ? 0 - value : value);
+        }
+        if(input->cursor == input->end && !fillInput(input)) break;
+        unsigned digit = (unsigned)(*input->cursor - '0');
+        if(digit > 9) break;
+        value = value * 10 + digit;
+        input->cursor++;
+    }
+    return (int64_t)(negative ? 0 - value : value);
+}
+
+void freeInput(Input* input){
+    if(input->mapping != NULL) munmap(input->mapping, input->mappingLength);
+    free(input->buffer);
+    input->state = INPUT_UNOPENED;
+    input->cursor = NULL;
+    input->end = NULL;
+    input->buffer = NULL;
+    input->mapping = NULL;
+    input->mappingLength = 0;
+}
+
+static void emitParseEight(Output* out){
+    emit(out, "  mov r8, rax\n");
+    emit(out, "  shr r8, 8\n");
+    emit(out, "  lea rax, [rax + rax*4]\n");
+    emit(out, "  lea rax, [r8 + rax*2]\n");
+    emit(out, "  mov r8, rax\n");
+    emit(out, "  shr r8, 16\n");
+    emit(out, "  movabs r10, 0x%llx\n", MASK_PAIRS);
+    emit(out, "  and rax, r10\n");
+    emit(out, "  and r8, r10\n");
+    emit(out, "  movabs r11, 0x%llx\n", MUL_HIGH);
+    emit(out, "  imul rax, r11\n");
+    emit(out, "  movabs r11, 0x%llx\n", MUL_LOW);
+    emit(out, "  imul r8, r11\n");
+    emit(out, "  add rax, r8\n");
+    emit(out, "  shr rax, 32\n");
+}
+
+// qz_input_fill follows the same states as fillInput, with the cursor
+// and end in memory. qz_read keeps them in rdi and rdx, the value in r12
+// and the sign in rbx.
+void emitInputSupport(Output* out, int freestanding){
+    emit(out, "\n.data\n");
+    emit(out, ".p2align 3\n");
+    emit(out, "qz_input_cursor:\n");
+    emit(out, "  .quad 0\n");
+    emit(out, "qz_input_end:\n");
+    emit(out, "  .quad 0\n");
+    emit(out, "qz_input_state:\n");
+    emit(out, "  .long %d\n", INPUT_UNOPENED);
+    emit(out, ".section .rodata\n");
+    emit(out, ".p2align 3\n");
+    emit(out, "qz_input_powers:\n");
+    for(int i = 0; i < 9; i++) emit(out, "  .quad %llu\n", (unsigned long long)powersOfTen[i]);
+    emit(out, ".bss\n");
+    emit(out, ".p2align 6\n");
+    emit(out, "qz_input_buffer:\n");
+    emit(out, "  .zero %d\n", INPUT_BLOCK_SIZE);
+
+    // The stat buffer is followed by the file size and the position.
+    int frame = (int)((sizeof(struct stat) + 16 + 15) & ~(size_t)15) + 8;
+    int sizeSlot = (int)sizeof(struct stat);
+    int positionSlot = sizeSlot + 8;
+    emit(out, ".text\n");
+    emit(out, ".type qz_input_fill, @function\n");
+    emit(out, "qz_input_fill:\n");
+    emit(out, ".cfi_startproc\n");
+    emit(out, "  sub rsp, %d\n", frame);
+    emit(out, ".cfi_def_cfa_offset %d\n", frame + 8);
+    emit(out, "  mov eax, dword ptr [rip + qz_input_state]\n");
+    emit(out, "  cmp eax, %d\n", INPUT_STREAMING);
+    emit(out, "  je .Lqz_input_read\n");
+    emit(out, "  test eax, eax\n");
+    emit(out, "  jne .Lqz_input_none\n");
+    emit(out, "  mov dword ptr [rip + qz_input_state], %d\n", INPUT_STREAMING);
+    emit(out, "  xor edi, edi\n");
+    emit(out, "  mov rsi, rsp\n");
+    emitSystemCall(out, freestanding, "fstat", SYS_fstat);
+    emit(out, "  test eax, eax\n");
+    emit(out, "  jne .Lqz_input_read\n");
+    emit(out, "  mov eax, dword ptr [rsp + %zu]\n", offsetof(struct stat, st_mode));
+    emit(out, "  and eax, %d\n", S_IFMT);
+    emit(out, "  cmp eax, %d\n", S_IFREG);
+    emit(out, "  jne .Lqz_input_read\n");
+    emit(out, "  mov rax, qword ptr [rsp + %zu]\n", offsetof(struct stat, st_size));
+    emit(out, "  test rax, rax\n");
+    emit(out, "  jle .Lqz_input_read\n");
+    emit(out, "  mov qword ptr [rsp + %d], rax\n", sizeSlot);
+    emit(out, "  xor edi, edi\n");
+    emit(out, "  xor esi, esi\n");
+    emit(out, "  mov edx, %d\n", SEEK_CUR);
+    emitSystemCall(out, freestanding, "lseek", SYS_lseek);
+    emit(out, "  test rax, rax\n");
+    emit(out, "  js .Lqz_input_read\n");
+    emit(out, "  cmp rax, qword ptr [rsp + %d]\n", sizeSlot);
+    emit(out, "  jge .Lqz_input_read\n");
+    emit(out, "  mov qword ptr [rsp + %d], rax\n", positionSlot);
+    emit(out, "  xor edi, edi\n");
+    emit(out, "  mov rsi, qword ptr [rsp + %d]\n", sizeSlot);
+    emit(out, "  mov edx, %d\n", PROT_READ);
+    emit(out, "  mov %s, %d\n", freestanding ? "r10d" : "ecx", MAP_PRIVATE);
+    emit(out, "  xor r8d, r8d\n");
+    emit(out, "  xor r9d, r9d\n");
+    emitSystemCall(out, freestanding, "mmap", SYS_mmap);
+    emit(out, "  cmp rax, -4096\n");
+    emit(out, "  ja .Lqz_input_read\n");
+    emit(out, "  mov rcx, rax\n");
+    emit(out, "  add rcx, qword ptr [rsp + %d]\n", positionSlot);
+    emit(out, "  mov qword ptr [rip + qz_input_cursor], rcx\n");
+    emit(out, "  add rax, qword ptr [rsp + %d]\n", sizeSlot);
+    emit(out, "  mov qword ptr [rip + qz_input_end], rax\n");
+    emit(out, "  mov dword ptr [rip + qz_input_state], %d\n", INPUT_MAPPED);
+    emit(out, "  mov eax, 1\n");
+    emit(out, "  jmp .Lqz_input_done\n");
+    emit(out, ".Lqz_input_read:\n");
+    // Without libc nothing else flushes stdout before the program waits
+    // on a terminal or a pipe, so what it printed so far goes out first.
+    if(freestanding) emit(out, "  call qz_flush\n");
+    emit(out, "  xor edi, edi\n");
+    emit(out, "  lea rsi, [rip + qz_input_buffer]\n");
+    emit(out, "  mov edx, %d\n", INPUT_BLOCK_SIZE);
+    emitSystemCall(out, freestanding, "read", SYS_read);
+    emit(out, "  test rax, rax\n");
+    emit(out, "  jg .Lqz_input_got\n");
+    emit(out, "  je .Lqz_input_ended\n");
+    if(freestanding){
+        emit(out, "  cmp rax, %d\n", -EINTR);
+    }else{
+        emit(out, "  call __errno_location@PLT\n");
+        emit(out, "  cmp dword ptr [rax], %d\n", EINTR);
+    }
+    emit(out, "  je .Lqz_input_read\n");
+    emit(out, ".Lqz_input_ended:\n");
+    emit(out, "  mov dword ptr [rip + qz_input_state], %d\n", INPUT_ENDED);
+    emit(out, ".Lqz_input_none:\n");
+    emit(out, "  xor eax, eax\n");
+    emit(out, "  jmp .Lqz_input_done\n");
+    emit(out, ".Lqz_input_got:\n");
+    emit(out, "  lea rsi, [rip + qz_input_buffer]\n");
+    emit(out, "  mov qword ptr [rip + qz_input_cursor], rsi\n");
+    emit(out, "  add rax, rsi\n");
+    emit(out, "  mov qword ptr [rip + qz_input_end], rax\n");
+    emit(out, "  mov eax, 1\n");
+    emit(out, ".Lqz_input_done:\n");
+    emit(out, "  add rsp, %d\n", frame);
+    emit(out, ".cfi_def_cfa_offset 8\n");
+    emit(out, "  ret\n");
+    emit(out, ".cfi_endproc\n");
+    emit(out, ".size qz_input_fill, .-qz_input_fill\n");
+
+    emit(out, ".type qz_read, @function\n");
+    emit(out, "qz_read:\n");
+    emit(out, ".cfi_startproc\n");
+    emit(out, "  push rbx\n");
+    emit(out, ".cfi_def_cfa_offset 16\n");
+    emit(out, ".cfi_offset rbx, -16\n");
+    emit(out, "  push r12\n");
+    emit(out, ".cfi_def_cfa_offset 24\n");
+    emit(out, ".cfi_offset r12, -24\n");
+    emit(out, "  sub rsp, 8\n");
+    emit(out, ".cfi_def_cfa_offset 32\n");
+    emit(out, "  xor ebx, ebx\n");
+    emit(out, "  xor r12d, r12d\n");
+    emit(out, "  mov rdi, qword ptr [rip + qz_input_cursor]\n");
+    emit(out, "  mov rdx, qword ptr [rip + qz_input_end]\n");
+    emit(out, ".Lqz_read_skip:\n");
+    emit(out, "  cmp rdi, rdx\n");
+    emit(out, "  jb .Lqz_read_next\n");
+    emit(out, "  mov qword ptr [rip + qz_input_cursor], rdi\n");
+    emit(out, "  call qz_input_fill\n");
+    emit(out, "  test eax, eax\n");
+    emit(out, "  jz .Lqz_read_return\n");
+    emit(out, "  mov rdi, qword ptr [rip + qz_input_cursor]\n");
+    emit(out, "  mov rdx, qword ptr [rip + qz_input_end]\n");
+    emit(out, ".Lqz_read_next:\n");
+    emit(out, "  movzx eax, byte ptr [rdi]\n");
+    emit(out, "  lea ecx, [rax - 48]\n");
+    emit(out, "  cmp ecx, 9\n");
+    emit(out, "  jbe .Lqz_read_digits\n");
+    emit(out, "  xor ebx, ebx\n");
+    emit(out, "  cmp eax, 45\n");
+    emit(out, "  sete bl\n");
+    emit(out, "  inc rdi\n");
+    emit(out, "  jmp .Lqz_read_skip\n");
+    emit(out, ".Lqz_read_digits:\n");
+    emit(out, "  mov rax, rdx\n");
+    emit(out, "  sub rax, rdi\n");
+    emit(out, "  cmp rax, 8\n");
+    emit(out, "  jb .Lqz_read_byte\n");
+    emit(out, "  mov rax, qword ptr [rdi]\n");
+    emit(out, "  movabs r8, 0x%llx\n", HIGH_NIBBLES);
+    emit(out, "  movabs r9, 0x%llx\n", ZEROS);
+    emit(out, "  movabs r10, 0x%llx\n", 6 * ONES);
+    emit(out, "  add r10, rax\n");
+    emit(out, "  and r10, r8\n");
+    emit(out, "  xor r10, r9\n");
+    emit(out, "  mov rsi, rax\n");
+    emit(out, "  and rsi, r8\n");
+    emit(out, "  xor rsi, r9\n");
+    emit(out, "  or rsi, r10\n");
+    emit(out, "  jnz .Lqz_read_partial\n");
+    emit(out, "  sub rax, r9\n");
+    emitParseEight(out);
+    emit(out, "  imul r12, r12, %llu\n", (unsigned long long)powersOfTen[8]);
+    emit(out, "  add r12, rax\n");
+    emit(out, "  add rdi, 8\n");
+    emit(out, "  jmp .Lqz_read_digits\n");
+    emit(out, ".Lqz_read_partial:\n");
+    emit(out, "  bsf rsi, rsi\n");
+    emit(out, "  shr esi, 3\n");
+    emit(out, "  jz .Lqz_read_store\n");
+    emit(out, "  sub rax, r9\n");
+    emit(out, "  lea ecx, [rsi*8]\n");
+    emit(out, "  neg ecx\n");
+    emit(out, "  add ecx, 64\n");
+    emit(out, "  shl rax, cl\n");
+    emitParseEight(out);
+    emit(out, "  lea r8, [rip + qz_input_powers]\n");
+    emit(out, "  imul r12, qword ptr [r8 + rsi*8]\n");
+    emit(out, "  add r12, rax\n");
+    emit(out, "  add rdi, rsi\n");
+    emit(out, "  jmp .Lqz_read_store\n");
+    emit(out, ".Lqz_read_byte:\n");
+    emit(out, "  cmp rdi, rdx\n");
+    emit(out, "  jb .Lqz_read_have\n");
+    emit(out, "  mov qword ptr [rip + qz_input_cursor], rdi\n");
+    emit(out, "  call qz_input_fill\n");
+    emit(out, "  test eax, eax\n");
+    emit(out, "  jz .Lqz_read_return\n");
+    emit(out, "  mov rdi, qword ptr [rip + qz_input_cursor]\n");
+    emit(out, "  mov rdx, qword ptr [rip + qz_input_end]\n");
+    emit(out, ".Lqz_read_have:\n");
+    emit(out, "  movzx eax, byte ptr [rdi]\n");
+    emit(out, "  sub eax, 48\n");
+    emit(out, "  cmp eax, 9\n");
+    emit(out, "  ja .Lqz_read_store\n");
+    emit(out, "  lea r12, [r12 + r12*4]\n");
+    emit(out, "  lea r12, [rax + r12*2]\n");
+    emit(out, "  inc rdi\n");
+    emit(out, "  jmp .Lqz_read_digits\n");
+    emit(out, ".Lqz_read_store:\n");
+    emit(out, "  mov qword ptr [rip + qz_input_cursor], rdi\n");
+    emit(out, ".Lqz_read_return:\n");
+    emit(out, "  mov rax, r12\n");
+    emit(out, "  neg r12\n");
+    emit(out, "  test ebx, ebx\n");
+    emit(out, "  cmovnz rax, r12\n");
+    emit(out, "  add rsp, 8\n");
+    emit(out, ".cfi_def_cfa_offset 24\n");
+    emit(out, "  pop r12\n");
+    emit(out, ".cfi_def_cfa_offset 16\n");
+    emit(out, "  pop rbx\n");
+    emit(out, ".cfi_def_cfa_offset 8\n");
+    emit(out, "  ret\n");
+    emit(out, ".cfi_endproc\n");
+    emit(out, ".size qz_read, .-qz_read\n");
+    emit(out, ".text\n");
+}
@@ -0,0 +1,31 @@
+#include "layout.h"
+
+// Decides which code codegen moves out of the straight-line path. A
+// profile answers directly wherever the probe was reached; elsewhere a
+// few static guesses in the spirit of Ball and Larus are used.
+
+static int endsInReturn(const AST* ast, NodeId block){
+    uint32_t count = ast->right[block];
+    return count > 0 && ast->kind[blockStatements(ast, block)[count - 1]] == NODE_RETURN;
+}
+
+// True when the if's body is expected to run less often than not.
+int isColdBranch(const AST* ast, NodeId node, const Profile* profile){
+    if(profile != NULL && ast->value[node] > 0){
+        uint64_t reached = probeCount(profile, probeOf(ast, node), PROBE_REACHED);
+        uint64_t taken = probeCount(profile, probeOf(ast, node), PROBE_TAKEN);
+        if(reached > 0) return taken * 2 < reached;
+    }
+
+    // A body that leaves the function early is usually the exceptional
+    // case (a recursion's base case, an error exit). The test alone says
+    // too little: an equality can as well be the loop's common case.
+    return endsInReturn(ast, ast->right[node]);
+}
+
+// Only a profile can tell that a whole function is cold.
+int isColdFunction(const AST* ast, NodeId function, const Profile* profile){
+    NodeId body = ast->right[function];
+    if(profile == NULL || ast->value[body] <= 0) return 0;
+    return probeCount(profile, probeOf(ast, body), PROBE_REACHED) == 0;
+}
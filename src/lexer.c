@@ -1,27 +1,69 @@
 #include "lexer.h"
+#include "diagnostic.h"
 
-Token currentToken;
-Token previousToken;
-Lexer lexer;
+void initLexer(Lexer* lexer, Source* source) {
+    lexer->start = source->data;
+    lexer->current = source->data;
+    lexer->end = source->data + source->size;
+    lexer->line = 1;
+    lexer->source = source->fd >= 0 ? source : NULL;
+    lexer->hasPeekedToken = 0;
+    lexer->diagnostics = source->diagnostics;
+}
+
+static void rebase(const Lexer* lexer, const char** pointer, const char* keep, const char* base) {
+    if (*pointer >= keep && *pointer <= lexer->end) {
+        *pointer = base + (*pointer - keep);
+    }
+}
+
+void seekLexer(Lexer* lexer, const char* start, const char* end, long line) {
+    lexer->start = start;
+    lexer->current = start;
+    lexer->end = end;
+    lexer->line = line;
+    lexer->source = NULL;
+    lexer->hasPeekedToken = 0;
+}
+
+// Streaming inputs only hold a window of the text. Before sliding it, keep
+// everything from the oldest byte a live token still points at, then move
+// every pointer into the window along with it.
+static int refillWindow(Lexer* lexer) {
+    Source* source = lexer->source;
+    if (source == NULL || source->fd < 0) return 0;
+
+    const char* keep = lexer->start;
+    const Token* pinned[] = {&lexer->currentToken, &lexer->previousToken, &lexer->peekedToken};
+    for (int i = 0; i < 3; i++) {
+        const char* start = pinned[i]->start;
+        if (start >= source->window && start < keep) keep = start;
+    }
+
+    size_t got = refillSource(source, keep);
+    const char* base = source->window;
 
-void initLexer(const char* source, size_t length) {
-    lexer.start = source;
-    lexer.current = source;
-    lexer.end = source + length;
-    lexer.line = 1;
+    rebase(lexer, &lexer->currentToken.start, keep, base);
+    rebase(lexer, &lexer->previousToken.start, keep, base);
+    rebase(lexer, &lexer->peekedToken.start, keep, base);
+    lexer->start = base + (lexer->start - keep);
+    lexer->current = base + (lexer->current - keep);
+    lexer->end = base + source->windowLength;
+
+    return got > 0;
 }
 
-static int isAtEnd() {
-    return lexer.current >= lexer.end; 
+static int isAtEnd(Lexer* lexer) {
+    return lexer->current >= lexer->end && !refillWindow(lexer); 
 }
 
-static char advance() {
-    return *lexer.current++;
+static char advance(Lexer* lexer) {
+    return *lexer->current++;
 }
 
-static char peek() {
-    if(isAtEnd()) return '\0';
-    return *lexer.current;
+static char peek(Lexer* lexer) {
+    if(isAtEnd(lexer)) return '\0';
+    return *lexer->current;
 }
 
 static int isAlpha(char c) {
@@ -32,26 +74,18 @@ static int isDigit(char c) {
     return c >= '0' && c <= '9';
 }
 
-#include "parser.h"
-#include <stdio.h>
-#include <stdlib.h>
-
-extern Token currentToken;
-extern void advanceToken();
-extern void consume(TokenType type, const char* message);
-
-void skipSpace() {
+static void skipSpace(Lexer* lexer) {
     for(;;) {
-        char c = peek(); 
+        char c = peek(lexer); 
         switch(c) {
             case ' ':
             case '\r':
             case '\t':
-                advance();
+                advance(lexer);
                 break;
             case '\n':
-                lexer.line++;
-                advance(); 
+                lexer->line++;
+                advance(lexer); 
                 break;
             default:
                 return;
@@ -59,124 +93,171 @@ void skipSpace() {
     }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    int tokenLength = (int)(lexer.current - lexer.start);
+static TokenType checkKeyword(const Lexer* lexer, size_t start, size_t length, const char* rest, TokenType type) {
+    size_t tokenLength = (size_t)(lexer->current - lexer->start);
     if (tokenLength == start + length && 
-        strncmp(lexer.start + start, rest, length) == 0) {
+        strncmp(lexer->start + start, rest, length) == 0) {
         return type;
     }
     return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType() {
-    switch (lexer.start[0]) {
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+static TokenType identifierType(Lexer* lexer) {
+    switch (lexer->start[0]) {
+        case 'a': return checkKeyword(lexer, 1, 4, "rray", TOKEN_ARRAY);
+        case 'f': return checkKeyword(lexer, 1, 3, "unc", TOKEN_FUNC);
+        case 'i': return checkKeyword(lexer, 1, 1, "f", TOKEN_IF);
+        case 'p': return checkKeyword(lexer, 1, 4, "rint", TOKEN_PRINT);
+        case 'r':
+            if (lexer->current - lexer->start > 2 && lexer->start[1] == 'e') {
+                switch (lexer->start[2]) {
+                    case 'a': return checkKeyword(lexer, 3, 1, "d", TOKEN_READ);
+                    case 't': return checkKeyword(lexer, 3, 3, "urn", TOKEN_RETURN);
+                }
+            }
+            break;
+        case 'w': return checkKeyword(lexer, 1, 4, "hile", TOKEN_WHILE);
     }
     return TOKEN_IDENTIFIER;
 }
 
-static Token makeToken(TokenType type) {
+static Token makeToken(const Lexer* lexer, TokenType type) {
     Token token;
     token.type = type;
-    token.start = lexer.start;
-    token.length = (int)(lexer.current - lexer.start); 
-    token.line = lexer.line;
+    token.start = lexer->start;
+    token.length = (size_t)(lexer->current - lexer->start); 
+    token.line = lexer->line;
     return token;
 }
 
-Token scanToken() {
-    skipSpace();
-    lexer.start = lexer.current;
+Token scanToken(Lexer* lexer) {
+    skipSpace(lexer);
+    lexer->start = lexer->current;
 
-    if(isAtEnd()) return makeToken(TOKEN_EOF);
+    if(isAtEnd(lexer)) return makeToken(lexer, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(lexer);
 
     switch (c) {
-        case '(': return makeToken(TOKEN_LPAREN);
-        case ')': return makeToken(TOKEN_RPAREN);
-        case '{': return makeToken(TOKEN_LBRACE);
-        case '}': return makeToken(TOKEN_RBRACE);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case '+': return makeToken(TOKEN_PLUS);
-        case '-': return makeToken(TOKEN_MINUS);
-        case '*': return makeToken(TOKEN_STAR);
-        case '/': return makeToken(TOKEN_SLASH);
+        case '(': return makeToken(lexer, TOKEN_LPAREN);
+        case ')': return makeToken(lexer, TOKEN_RPAREN);
+        case '{': return makeToken(lexer, TOKEN_LBRACE);
+        case '}': return makeToken(lexer, TOKEN_RBRACE);
+        case ';': return makeToken(lexer, TOKEN_SEMICOLON);
+        case ',': return makeToken(lexer, TOKEN_COMMA);
+        case '[': return makeToken(lexer, TOKEN_LBRACKET);
+        case ']': return makeToken(lexer, TOKEN_RBRACKET);
+        case '+': return makeToken(lexer, TOKEN_PLUS);
+        case '-': return makeToken(lexer, TOKEN_MINUS);
+        case '*': return makeToken(lexer, TOKEN_STAR);
+        case '/': return makeToken(lexer, TOKEN_SLASH);
         case '=': 
-            if(peek() == '='){
-                advance();
-                return makeToken(TOKEN_EQUAL_EQUAL);
+            if(peek(lexer) == '='){
+                advance(lexer);
+                return makeToken(lexer, TOKEN_EQUAL_EQUAL);
             }
-            return makeToken(TOKEN_ASSIGN); 
+            return makeToken(lexer, TOKEN_ASSIGN); 
 
         case '!':
-            if(peek() == '='){
-                advance();
-                return makeToken(TOKEN_BANG_EQUAL);
+            if(peek(lexer) == '='){
+                advance(lexer);
+                return makeToken(lexer, TOKEN_BANG_EQUAL);
             }
            
-            return makeToken(TOKEN_ERROR);
+            return makeToken(lexer, TOKEN_ERROR);
 
         case '<':
-            if(peek() == '='){
-                advance();
-                return makeToken(TOKEN_LESS_EQUAL);
+            if(peek(lexer) == '='){
+                advance(lexer);
+                return makeToken(lexer, TOKEN_LESS_EQUAL);
             }
-            return makeToken(TOKEN_LESS);
+            return makeToken(lexer, TOKEN_LESS);
 
         case '>':
-            if(peek() == '='){
-                advance();
-                return makeToken(TOKEN_GREATER_EQUAL);
+            if(peek(lexer) == '='){
+                advance(lexer);
+                return makeToken(lexer, TOKEN_GREATER_EQUAL);
             }
-            return makeToken(TOKEN_GREATER);
+            return makeToken(lexer, TOKEN_GREATER);
         case '&':
-            if(peek() == '&'){
-                advance();
-                return makeToken(TOKEN_LOGICAL_AND);
+            if(peek(lexer) == '&'){
+                advance(lexer);
+                return makeToken(lexer, TOKEN_LOGICAL_AND);
             }
-            return makeToken(TOKEN_ERROR);
+            return makeToken(lexer, TOKEN_ERROR);
         case '|':
-            if(peek() == '|'){
-                advance();
-                return makeToken(TOKEN_LOGICAL_OR);
+            if(peek(lexer) == '|'){
+                advance(lexer);
+                return makeToken(lexer, TOKEN_LOGICAL_OR);
             }
-            return makeToken(TOKEN_ERROR);
+            return makeToken(lexer, TOKEN_ERROR);
     }
 
     if(isDigit(c)) {
-        while (isDigit(peek())) advance();
-        return makeToken(TOKEN_NUMBER);
+        while (isDigit(peek(lexer))) advance(lexer);
+        return makeToken(lexer, TOKEN_NUMBER);
     }
 
     if(isAlpha(c)) {
-        while(isAlpha(peek()) || isDigit(peek())) advance();
-        return makeToken(identifierType());
+        while(isAlpha(peek(lexer)) || isDigit(peek(lexer))) advance(lexer);
+        return makeToken(lexer, identifierType(lexer));
     }
 
-    return makeToken(TOKEN_ERROR);
+    return makeToken(lexer, TOKEN_ERROR);
+}
+
+const char* tokenTypeName(TokenType type) {
+    static const char* names[] = {
+        [TOKEN_IDENTIFIER] = "IDENTIFIER", [TOKEN_NUMBER] = "NUMBER",
+        [TOKEN_ASSIGN] = "ASSIGN", [TOKEN_PLUS] = "PLUS", [TOKEN_MINUS] = "MINUS",
+        [TOKEN_STAR] = "STAR", [TOKEN_SLASH] = "SLASH", [TOKEN_BANG_EQUAL] = "BANG_EQUAL",
+        [TOKEN_LESS] = "LESS", [TOKEN_GREATER] = "GREATER", [TOKEN_LESS_EQUAL] = "LESS_EQUAL",
+        [TOKEN_GREATER_EQUAL] = "GREATER_EQUAL", [TOKEN_LPAREN] = "LPAREN",
+        [TOKEN_RPAREN] = "RPAREN", [TOKEN_LBRACE] = "LBRACE", [TOKEN_RBRACE] = "RBRACE",
+        [TOKEN_SEMICOLON] = "SEMICOLON", [TOKEN_IF] = "IF", [TOKEN_WHILE] = "WHILE",
+        [TOKEN_PRINT] = "PRINT", [TOKEN_EOF] = "EOF", [TOKEN_LOGICAL_AND] = "LOGICAL_AND",
+        [TOKEN_LOGICAL_OR] = "LOGICAL_OR", [TOKEN_ERROR] = "ERROR",
+        [TOKEN_EQUAL_EQUAL] = "EQUAL_EQUAL", [TOKEN_COMMA] = "COMMA",
+        [TOKEN_FUNC] = "FUNC", [TOKEN_RETURN] = "RETURN",
+        [TOKEN_LBRACKET] = "LBRACKET", [TOKEN_RBRACKET] = "RBRACKET", [TOKEN_ARRAY] = "ARRAY",
+        [TOKEN_READ] = "READ",
+    };
+    if ((unsigned)type >= sizeof(names) / sizeof(names[0]) || names[type] == NULL) return "UNKNOWN";
+    return names[type];
 }
 
-void advanceToken(){
-    previousToken = currentToken;
+// One token of lookahead, handed to advanceToken on its next call.
+Token peekToken(Lexer* lexer){
+    if(!lexer->hasPeekedToken){
+        lexer->peekedToken = scanToken(lexer);
+        lexer->hasPeekedToken = 1;
+    }
+    return lexer->peekedToken;
+}
+
+void advanceToken(Lexer* lexer){
+    lexer->previousToken = lexer->currentToken;
     for(;;){
-        currentToken = scanToken();
-        if (currentToken.type != TOKEN_ERROR) break;
+        if(lexer->hasPeekedToken){
+            lexer->currentToken = lexer->peekedToken;
+            lexer->hasPeekedToken = 0;
+        }else{
+            lexer->currentToken = scanToken(lexer);
+        }
+        if (lexer->currentToken.type != TOKEN_ERROR) break;
 
-        fprintf(stderr, "Error: Unexpected character '%.*s' at line %d.\n", currentToken.length, currentToken.start, currentToken.line);
-        exit(65);
+        reportError(lexer->diagnostics, "Unexpected character '%.*s' at line %ld.", (int)lexer->currentToken.length, lexer->currentToken.start, lexer->currentToken.line);
+        fail(lexer->diagnostics, 65);
     }
 }
 
-void consume(TokenType type, const char* message){
-    if(currentToken.type == type){
-        advanceToken();
+void consume(Lexer* lexer, TokenType type, const char* message){
+    if(lexer->currentToken.type == type){
+        advanceToken(lexer);
         return;
     }
-    fprintf(stderr, "Error: %s at line %d.\n", message, currentToken.line);
-    exit(65);
+    reportError(lexer->diagnostics, "%s at line %ld.", message, lexer->currentToken.line);
+    fail(lexer->diagnostics, 65);
 }
 
 
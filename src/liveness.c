@@ -0,0 +1,445 @@
+#include "liveness.h"
+#include "diagnostic.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Backward liveness over the statement lists. Variables are identified by
+// their frame slot; two block-local variables the parser placed in the
+// same slot are simply treated as one.
+typedef struct {
+    AST* ast;
+    NodeList worklist;
+    int wordCount;
+    int changed;
+    // When set, one row of wordCount words per slot: the slots whose
+    // values are live at the same time, so they cannot share storage.
+    uint64_t* interference;
+} Liveness;
+
+// Above this many slots the interference matrix is not worth building and
+// the frame is only compacted.
+#define MAX_COLOURED_SLOTS 4096
+
+static uint64_t* newSet(Liveness* lv){
+    uint64_t* set = (uint64_t*)calloc(lv->wordCount, sizeof(uint64_t));
+    if(set == NULL){
+        reportError(lv->ast->diagnostics, "Failed to allocate liveness set.");
+        fail(lv->ast->diagnostics, 74);
+    }
+    return set;
+}
+
+static uint64_t* copySet(Liveness* lv, const uint64_t* src){
+    uint64_t* set = newSet(lv);
+    memcpy(set, src, lv->wordCount * sizeof(uint64_t));
+    return set;
+}
+
+static void setBit(uint64_t* set, int offset){
+    if(offset <= 0) return;
+    int var = offset / 8 - 1;
+    set[var >> 6] |= 1ull << (var & 63);
+}
+
+static void clearBit(uint64_t* set, int offset){
+    if(offset <= 0) return;
+    int var = offset / 8 - 1;
+    set[var >> 6] &= ~(1ull << (var & 63));
+}
+
+static int testBit(const uint64_t* set, int offset){
+    if(offset <= 0) return 0;
+    int var = offset / 8 - 1;
+    return (set[var >> 6] >> (var & 63)) & 1;
+}
+
+static void unionInto(Liveness* lv, uint64_t* dst, const uint64_t* src){
+    for(int i = 0; i < lv->wordCount; i++) dst[i] |= src[i];
+}
+
+static int isSubset(Liveness* lv, const uint64_t* a, const uint64_t* b){
+    for(int i = 0; i < lv->wordCount; i++){
+        if(a[i] & ~b[i]) return 0;
+    }
+    return 1;
+}
+
+// The slot written at offset conflicts with every other slot whose value
+// is still needed after the write.
+static void addInterference(Liveness* lv, int offset, const uint64_t* live){
+    if(offset <= 0) return;
+    int var = offset / 8 - 1;
+    uint64_t* row = lv->interference + (size_t)var * lv->wordCount;
+    for(int i = 0; i < lv->wordCount; i++){
+        uint64_t bits = live[i];
+        row[i] |= bits;
+        while(bits){
+            int other = i * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            lv->interference[(size_t)other * lv->wordCount + (var >> 6)] |= 1ull << (var & 63);
+        }
+    }
+    row[var >> 6] &= ~(1ull << (var & 63));
+}
+
+// Expressions can nest arbitrarily deep, so both expression walks below
+// use the shared worklist instead of recursing.
+static void collectUses(Liveness* lv, NodeId root, uint64_t* live){
+    AST* ast = lv->ast;
+    NodeList* work = &lv->worklist;
+    work->count = 0;
+    if(root != NULL_NODE) pushNode(ast, work, root);
+
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        switch(ast->kind[node]){
+            case NODE_IDENTIFIER:
+                setBit(live, ast->value[node]);
+                break;
+            case NODE_BINARY_OP:
+            case NODE_LOGICAL_AND:
+            case NODE_LOGICAL_OR:
+            case NODE_CALL:
+            case NODE_INDEX:
+                pushChildren(ast, node, work);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Division can trap, so it only counts as pure when the divisor is a
+// constant that can neither be zero nor overflow the quotient.
+int isPureExpression(const AST* ast, NodeId root, NodeList* work){
+    work->count = 0;
+    if(root != NULL_NODE) pushNode(ast, work, root);
+
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        switch(ast->kind[node]){
+            case NODE_NUMBER:
+            case NODE_IDENTIFIER:
+                break;
+            case NODE_BINARY_OP:
+                if(ast->op[node] == TOKEN_SLASH){
+                    NodeId divisor = ast->right[node];
+                    if(ast->kind[divisor] != NODE_NUMBER) return 0;
+                    if(numberValue(ast, divisor) == 0 || numberValue(ast, divisor) == -1) return 0;
+                }
+                pushNode(ast, work, ast->left[node]);
+                pushNode(ast, work, ast->right[node]);
+                break;
+            case NODE_LOGICAL_AND:
+            case NODE_LOGICAL_OR:
+                pushNode(ast, work, ast->left[node]);
+                pushNode(ast, work, ast->right[node]);
+                break;
+            case NODE_INDEX:
+                pushNode(ast, work, ast->right[node]);
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static int isPure(Liveness* lv, NodeId root){
+    return isPureExpression(lv->ast, root, &lv->worklist);
+}
+
+static void liveBlock(Liveness* lv, NodeId block, uint64_t* live, int mutate);
+
+// Turns the live-out set into the live-in set of the statement. When
+// mutate is set, returns 1 if the statement is dead and must be dropped.
+static int liveStatement(Liveness* lv, NodeId node, uint64_t* live, int mutate){
+    AST* ast = lv->ast;
+    switch(ast->kind[node]){
+        case NODE_ASSIGN:
+            if(mutate && !testBit(live, ast->value[node]) && isPure(lv, ast->right[node])){
+                lv->changed = 1;
+                return 1;
+            }
+            if(lv->interference != NULL) addInterference(lv, ast->value[node], live);
+            clearBit(live, ast->value[node]);
+            collectUses(lv, ast->right[node], live);
+            return 0;
+
+        case NODE_PRINT:
+            collectUses(lv, ast->left[node], live);
+            return 0;
+
+        case NODE_BLOCK:
+            liveBlock(lv, node, live, mutate);
+            return 0;
+
+        case NODE_IF: {
+            NodeId body = ast->right[node];
+            uint64_t* bodyLive = copySet(lv, live);
+            liveBlock(lv, body, bodyLive, mutate);
+
+            if(mutate && ast->right[body] == 0 && isPure(lv, ast->left[node])){
+                free(bodyLive);
+                lv->changed = 1;
+                return 1;
+            }
+
+            unionInto(lv, live, bodyLive);
+            free(bodyLive);
+            collectUses(lv, ast->left[node], live);
+            return 0;
+        }
+
+        case NODE_WHILE: {
+            // Live at the loop head: what survives the exit, what the
+            // condition reads, and what the body needs on the back-edge.
+            uint64_t* head = copySet(lv, live);
+            collectUses(lv, ast->left[node], head);
+
+            uint64_t* bodyLive = newSet(lv);
+            for(;;){
+                memcpy(bodyLive, head, lv->wordCount * sizeof(uint64_t));
+                liveBlock(lv, ast->right[node], bodyLive, 0);
+                if(isSubset(lv, bodyLive, head)) break;
+                unionInto(lv, head, bodyLive);
+            }
+
+            if(mutate){
+                memcpy(bodyLive, head, lv->wordCount * sizeof(uint64_t));
+                liveBlock(lv, ast->right[node], bodyLive, 1);
+            }
+
+            memcpy(live, head, lv->wordCount * sizeof(uint64_t));
+            free(bodyLive);
+            free(head);
+            return 0;
+        }
+
+        case NODE_EXPRESSION_STATEMENT:
+            if(mutate && isPure(lv, ast->left[node])){
+                lv->changed = 1;
+                return 1;
+            }
+            collectUses(lv, ast->left[node], live);
+            return 0;
+
+        case NODE_RETURN:
+            // Nothing in this frame outlives the return.
+            memset(live, 0, lv->wordCount * sizeof(uint64_t));
+            collectUses(lv, ast->left[node], live);
+            return 0;
+
+        case NODE_FUNCTION:
+            // Has its own frame; handled separately.
+            return 0;
+
+        // Array elements are not tracked, so stores to them are always
+        // kept and declarations (which zero the storage) too.
+        case NODE_STORE:
+            collectUses(lv, ast->right[ast->left[node]], live);
+            collectUses(lv, ast->right[node], live);
+            return 0;
+
+        case NODE_ARRAY:
+            return 0;
+
+        default:
+            collectUses(lv, node, live);
+            return 0;
+    }
+}
+
+// Dead statements are squeezed out of the block's run in place; the
+// block keeps its first slot and only its count shrinks.
+static void liveBlock(Liveness* lv, NodeId block, uint64_t* live, int mutate){
+    NodeId* statements = blockStatements(lv->ast, block);
+    uint32_t count = lv->ast->right[block];
+
+    for(uint32_t i = count; i-- > 0;){
+        if(liveStatement(lv, statements[i], live, mutate)){
+            statements[i] = NULL_NODE;
+        }
+    }
+
+    uint32_t kept = 0;
+    for(uint32_t i = 0; i < count; i++){
+        if(statements[i] != NULL_NODE) statements[kept++] = statements[i];
+    }
+    lv->ast->right[block] = kept;
+}
+
+// Every node of the frame rooted at body, without descending into nested
+// function definitions.
+static void collectFrameNodes(Liveness* lv, NodeId body, NodeList* nodes){
+    AST* ast = lv->ast;
+    NodeList* work = &lv->worklist;
+    work->count = 0;
+    nodes->count = 0;
+    pushNode(ast, work, body);
+
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        if(ast->kind[node] == NODE_FUNCTION) continue;
+        pushNode(ast, nodes, node);
+        pushChildren(ast, node, work);
+    }
+}
+
+// Lays the frame out again from scratch. Scalar slots are coloured
+// greedily against the interference matrix, so variables whose values
+// are never needed at the same time share storage; parameters keep the
+// slots the prologue stores them in. Arrays follow the scalars, each in
+// a region of its own.
+static void allocateFrame(Liveness* lv, NodeId body, int* frameSize, int parameterCount){
+    AST* ast = lv->ast;
+    NodeList nodes = {NULL, 0, 0};
+    collectFrameNodes(lv, body, &nodes);
+
+    int varCount = *frameSize / 8;
+    int* colour = (int*)malloc((varCount > 0 ? varCount : 1) * sizeof(int));
+    int* arrayLength = (int*)calloc(varCount > 0 ? varCount : 1, sizeof(int));
+    if(colour == NULL || arrayLength == NULL){
+        reportError(ast->diagnostics, "Failed to allocate frame layout.");
+        fail(ast->diagnostics, 74);
+    }
+
+    uint64_t* used = newSet(lv);
+    for(int i = 0; i < parameterCount; i++) setBit(used, 8 * (i + 1));
+    for(uint32_t i = 0; i < nodes.count; i++){
+        NodeId node = nodes.items[i];
+        uint8_t kind = ast->kind[node];
+        if(kind == NODE_IDENTIFIER || kind == NODE_ASSIGN) setBit(used, ast->value[node]);
+        // Arrays from disjoint scopes may start at the same slot; their
+        // region has to fit the longest.
+        if(kind == NODE_ARRAY){
+            int var = ast->value[node] / 8 - 1;
+            if((int)ast->right[node] > arrayLength[var]) arrayLength[var] = (int)ast->right[node];
+        }
+    }
+
+    int colours = parameterCount;
+    uint64_t* taken = lv->interference != NULL ? newSet(lv) : NULL;
+    for(int var = 0; var < varCount; var++) colour[var] = -1;
+    for(int var = 0; var < varCount; var++){
+        if(!testBit(used, (var + 1) * 8)) continue;
+        if(var < parameterCount){
+            colour[var] = var;
+            continue;
+        }
+        if(taken == NULL){
+            colour[var] = colours++;
+            continue;
+        }
+
+        memset(taken, 0, lv->wordCount * sizeof(uint64_t));
+        const uint64_t* row = lv->interference + (size_t)var * lv->wordCount;
+        for(int i = 0; i < lv->wordCount; i++){
+            uint64_t bits = row[i];
+            while(bits){
+                int other = i * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if(colour[other] >= 0) setBit(taken, 8 * (colour[other] + 1));
+            }
+        }
+        int c = 0;
+        while(testBit(taken, 8 * (c + 1))) c++;
+        colour[var] = c;
+        if(c >= colours) colours = c + 1;
+    }
+
+    // Element 0 sits at the highest offset of its region.
+    int slots = colours;
+    for(int var = 0; var < varCount; var++){
+        if(arrayLength[var] == 0) continue;
+        slots += arrayLength[var];
+        arrayLength[var] = slots * 8;
+    }
+
+    for(uint32_t i = 0; i < nodes.count; i++){
+        NodeId node = nodes.items[i];
+        uint8_t kind = ast->kind[node];
+        if(ast->value[node] <= 0) continue;
+        int var = ast->value[node] / 8 - 1;
+        if(kind == NODE_IDENTIFIER || kind == NODE_ASSIGN){
+            ast->value[node] = 8 * (colour[var] + 1);
+        }else if(kind == NODE_ARRAY || kind == NODE_INDEX){
+            ast->value[node] = arrayLength[var];
+        }
+    }
+    *frameSize = slots * 8;
+
+    free(taken);
+    free(used);
+    free(arrayLength);
+    free(colour);
+    freeNodeList(&nodes);
+}
+
+// With keepLayout the dead stores still go, but every slot stays where
+// it was.
+static void optimizeFrame(Liveness* lv, NodeId body, int* frameSize, int parameterCount, int keepLayout){
+    lv->wordCount = (*frameSize / 8 + 63) / 64;
+    if(lv->wordCount == 0) lv->wordCount = 1;
+
+    // Removing one store can expose another (its operands lose their last
+    // reader), so sweep until nothing changes.
+    do {
+        lv->changed = 0;
+        uint64_t* live = newSet(lv);
+        liveBlock(lv, body, live, 1);
+        free(live);
+    } while(lv->changed);
+    if(keepLayout) return;
+
+    // One more pass, without changes, to record which slots conflict.
+    // Parameters and anything read before being written are all live on
+    // entry together.
+    int varCount = *frameSize / 8;
+    if(varCount <= MAX_COLOURED_SLOTS){
+        lv->interference = (uint64_t*)calloc((size_t)(varCount > 0 ? varCount : 1) * lv->wordCount, sizeof(uint64_t));
+        if(lv->interference == NULL){
+            reportError(lv->ast->diagnostics, "Failed to allocate interference matrix.");
+            fail(lv->ast->diagnostics, 74);
+        }
+        uint64_t* live = newSet(lv);
+        liveBlock(lv, body, live, 0);
+        for(int i = 0; i < parameterCount; i++) setBit(live, 8 * (i + 1));
+        for(int var = 0; var < varCount; var++){
+            if(testBit(live, 8 * (var + 1))) addInterference(lv, 8 * (var + 1), live);
+        }
+        free(live);
+    }
+
+    allocateFrame(lv, body, frameSize, parameterCount);
+    free(lv->interference);
+    lv->interference = NULL;
+}
+
+// main's frame is the top-level statement list; every function body has
+// a frame of its own.
+void eliminateDeadCode(AST* ast, NodeId program, SymbolTable* table, int stableFrame){
+    Liveness lv;
+    lv.ast = ast;
+    lv.worklist.items = NULL;
+    lv.worklist.count = 0;
+    lv.worklist.capacity = 0;
+    lv.interference = NULL;
+
+    optimizeFrame(&lv, program, &table->frameSize, 0, stableFrame);
+
+    NodeId* statements = blockStatements(ast, program);
+    for(uint32_t i = 0; i < ast->right[program]; i++){
+        NodeId function = statements[i];
+        if(ast->kind[function] != NODE_FUNCTION) continue;
+
+        int frameSize = ast->value[function];
+        optimizeFrame(&lv, ast->right[function], &frameSize, ast->op[function], 0);
+        ast->value[function] = frameSize;
+    }
+
+    freeNodeList(&lv.worklist);
+}
@@ -1,110 +1,186 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
-#include <sys/mman.h> 
-#include <sys/stat.h> 
-#include <fcntl.h>   
-#include <unistd.h>  
+#include <unistd.h>
 
-#include "arena.h"
-#include "symbol.h"
-#include "codegen.h"
-#include "lexer.h"
-#include "parser.h"
-#include "arena.h"
+#include "quartz.h"
+#include "schedule.h"
+#include "toolchain.h"
+#include "perf.h"
 
-char* mapFileToMem(const char* path, size_t* tamOut) {
-    int fd = open(path, O_RDONLY);
-    if(fd < 0) {
-        fprintf(stderr, "Error: not possible to open file '%s'.\n", path);
-        exit(74);
-    }
-
-    struct stat st;
-    if(fstat(fd, &st) < 0) {
-        fprintf(stderr, "Error: failed to read status of file\n");
-        close(fd);
-        exit(74);
-    }
-
-    *tamOut = st.st_size;
+#define DEFAULT_PROFILE_PATH "quartz.qzprof"
 
-    char* buffer = mmap(NULL, *tamOut, PROT_READ, MAP_PRIVATE, fd, 0);
+static void usage(const char* program){
+    fprintf(stderr, "Usage: %s [-o <out.s | out.o | executable | ->] [-O0|-O1|-O2] [-mtune=generic|haswell|skylake|znver3] [--profile-generate[=file] | --profile-use=file] [--emit=tokens|ast|ir|asm | --interpret] [-g] [--dump-ast] [--report-unroll] [--eval-fuel=n] [--perf-counters] [--freestanding] [--incremental=file] [-j[threads]] <path_to_source | ->\n", program);
+    exit(64);
+}
 
-    if(buffer == MAP_FAILED) {
-        fprintf(stderr, "Error: failed on mmap.\n");
-        close(fd);
+static int openOutputFile(const char* path){
+    if (path == NULL) return STDOUT_FILENO;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: not possible to open output '%s'.\n", path);
         exit(74);
     }
-
-    close(fd);
-    return buffer;
+    return fd;
 }
 
+static void finishPerfCounters(void){
+    reportPerfCounters(stderr);
+    stopPerfCounters();
+}
 
 int main(int argc, char** argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <path_to_source>\n", argv[0]);
-        exit(64);
+    const char* inputPath = NULL;
+    const char* outputPath = NULL;
+    // Without --emit the assembly is assembled, and linked unless -o
+    // names a .o or .s file.
+    QuartzEmit stage = QUARTZ_EMIT_ASSEMBLY;
+    int assemble = 1;
+    int dumpAST = 0;
+    int interpret = 0;
+    int perfCounters = 0;
+    int lineInfo = 0;
+    int reportUnroll = 0;
+    int freestanding = 0;
+    int jobs = 1;
+    int64_t fuel = 0;
+    int optimizationLevel = 1;
+    const char* profileGeneratePath = NULL;
+    const char* profileUsePath = NULL;
+    const char* incrementalPath = NULL;
+    const char* tune = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            if (i + 1 >= argc) usage(argv[0]);
+            // "-" is standard output, as it is standard input for the source.
+            i++;
+            outputPath = strcmp(argv[i], "-") == 0 ? NULL : argv[i];
+        } else if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0 || strcmp(argv[i], "-O2") == 0) {
+            optimizationLevel = argv[i][2] - '0';
+        } else if (strncmp(argv[i], "-mtune=", 7) == 0) {
+            tune = argv[i] + 7;
+            if (findTuneModel(tune) == NULL) {
+                fprintf(stderr, "Error: Unknown -mtune target '%s'\n", argv[i] + 7);
+                exit(64);
+            }
+        } else if (strcmp(argv[i], "--profile-generate") == 0) {
+            profileGeneratePath = DEFAULT_PROFILE_PATH;
+        } else if (strncmp(argv[i], "--profile-generate=", 19) == 0 && argv[i][19] != '\0') {
+            profileGeneratePath = argv[i] + 19;
+        } else if (strncmp(argv[i], "--profile-use=", 14) == 0 && argv[i][14] != '\0') {
+            profileUsePath = argv[i] + 14;
+        } else if (strcmp(argv[i], "--emit=tokens") == 0) {
+            stage = QUARTZ_EMIT_TOKENS;
+            assemble = 0;
+        } else if (strcmp(argv[i], "--emit=ast") == 0) {
+            stage = QUARTZ_EMIT_AST;
+            assemble = 0;
+        } else if (strcmp(argv[i], "--emit=ir") == 0) {
+            stage = QUARTZ_EMIT_IR;
+            assemble = 0;
+        } else if (strcmp(argv[i], "--emit=asm") == 0) {
+            stage = QUARTZ_EMIT_ASSEMBLY;
+            assemble = 0;
+        } else if (strcmp(argv[i], "--interpret") == 0) {
+            interpret = 1;
+        } else if (strcmp(argv[i], "-g") == 0) {
+            lineInfo = 1;
+        } else if (strcmp(argv[i], "--report-unroll") == 0) {
+            reportUnroll = 1;
+        } else if (strncmp(argv[i], "--eval-fuel=", 12) == 0) {
+            char* end;
+            unsigned long long steps = strtoull(argv[i] + 12, &end, 10);
+            if (argv[i][12] < '0' || argv[i][12] > '9' || *end != '\0') usage(argv[0]);
+            fuel = steps == 0 ? -1 : steps > INT64_MAX ? INT64_MAX : (int64_t)steps;
+        } else if (strcmp(argv[i], "--dump-ast") == 0) {
+            dumpAST = 1;
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            perfCounters = 1;
+        } else if (strcmp(argv[i], "--freestanding") == 0) {
+            freestanding = 1;
+        } else if (strncmp(argv[i], "--incremental=", 14) == 0 && argv[i][14] != '\0') {
+            incrementalPath = argv[i] + 14;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            long online = sysconf(_SC_NPROCESSORS_ONLN);
+            jobs = online > 0 ? (int)online : 1;
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            char* end;
+            long threads = strtol(argv[i] + 2, &end, 10);
+            if (*end != '\0' || threads < 1 || threads > 1024) usage(argv[0]);
+            jobs = (int)threads;
+        } else if (inputPath == NULL) {
+            inputPath = argv[i];
+        } else {
+            usage(argv[0]);
+        }
     }
-
-    char* ext = strrchr(argv[1], '.');
-    if(ext == NULL || strcmp(ext, ".qz") != 0){
-        fprintf(stderr, "Error: Source file must have .qz extension\n");
-        exit(64);
+    if (inputPath == NULL) usage(argv[0]);
+    if (profileGeneratePath != NULL && profileUsePath != NULL) usage(argv[0]);
+    if (interpret && (outputPath != NULL || !assemble || profileGeneratePath != NULL || freestanding)) usage(argv[0]);
+    // The cache holds generated code, so only builds that generate code
+    // can keep it.
+    if (incrementalPath != NULL && (interpret || stage != QUARTZ_EMIT_ASSEMBLY)) usage(argv[0]);
+
+    if (perfCounters) {
+        startPerfCounters();
+        atexit(finishPerfCounters);
     }
 
-    size_t fileSize;
-    char* sourceCode = mapFileToMem(argv[1], &fileSize);
-
-    initLexer(sourceCode, fileSize);
-    
-    Arena arena;
-    initArena(&arena, 1024 * 1024); 
-    SymbolTable table;
-    initSymbolTable(&table);
-    advanceToken();
-
-    ASTNode* statements[512]; 
-    int statementCount = 0;
-
-    while (currentToken.type != TOKEN_EOF) {
-        statements[statementCount] = parseStatement(&arena, &table);
-        statementCount++;
+    QuartzOptions options = {0};
+    options.optimizationLevel = optimizationLevel;
+    options.tune = tune;
+    options.emit = interpret ? QUARTZ_EMIT_RUN : stage;
+    if (lineInfo) options.sourceName = strcmp(inputPath, "-") == 0 ? "<stdin>" : inputPath;
+    options.jobs = jobs;
+    options.freestanding = freestanding;
+    options.profileGenerate = profileGeneratePath;
+    options.profileUse = profileUsePath;
+    options.incremental = incrementalPath;
+    options.evaluationFuel = fuel;
+    options.reportUnroll = reportUnroll;
+    options.dumpAST = dumpAST;
+    options.printErrors = 1;
+
+    QuartzContext* context = quartzCreateContext();
+    if (context == NULL) {
+        fprintf(stderr, "Error: Failed to allocate compiler context.\n");
+        exit(74);
     }
 
-    fprintf(stderr, "--- ABSTRACT TREE ---\n");
-    for (int i = 0; i < statementCount; i++) {
-        printAST(statements[i], 0);
+    // The assembler is started before any code is generated so that it
+    // consumes the text through the pipe while codegen is still running.
+    OutputKind outputKind = assemble && !interpret ? outputKindFor(outputPath) : OUTPUT_ASSEMBLY;
+    Assembler assembler;
+    int outputFd;
+    if (outputKind == OUTPUT_ASSEMBLY) {
+        outputFd = openOutputFile(outputPath);
+    } else {
+        outputFd = startAssembler(&assembler, outputKind == OUTPUT_OBJECT ? outputPath : NULL);
     }
 
-    fprintf(stderr, "--- ASSEMBLY ---\n");
-    printf(".intel_syntax noprefix\n");
-
-    printf(".data\n");
-    printf(".LC0:\n");
-    printf("  .string \"%%d\\n\"\n");
-
-    printf(".text\n");
-    printf(".global main\n");
-    printf("main:\n");
-    
-    printf("  push rbp\n");
-    printf("  mov rbp, rsp\n");
-    printf("  sub rsp, %d\n", table.currentOffset);
-
-    for (int i = 0; i < statementCount; i++) {
-        generateAssembly(statements[i], &table);
+    QuartzStatus status = quartzCompileFile(context, inputPath, outputFd, &options);
+    quartzDestroyContext(context);
+    if (status != QUARTZ_OK) {
+        // Nothing half-written is left behind under the name asked for.
+        if (outputKind != OUTPUT_ASSEMBLY) {
+            abandonAssembler(&assembler);
+        } else if (outputPath != NULL) {
+            close(outputFd);
+            unlink(outputPath);
+        }
+        return status;
     }
 
-    printf("  mov rax, 0\n");
-    printf("  mov rsp, rbp\n");
-    printf("  pop rbp\n");
-    printf("  ret\n");
-
-    freeArena(&arena);
-    munmap(sourceCode, fileSize);
-
+    if (outputKind == OUTPUT_ASSEMBLY) {
+        if (outputFd != STDOUT_FILENO) close(outputFd);
+    } else {
+        finishAssembler(&assembler);
+        if (outputKind == OUTPUT_EXECUTABLE) {
+            linkExecutable(&assembler, outputPath, freestanding);
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,38 @@
+#include "optimize.h"
+#include "inliner.h"
+#include "cse.h"
+#include "liveness.h"
+#include "unroll.h"
+#include "evaluate.h"
+#include "perf.h"
+
+void optimizeProgram(AST* ast, NodeId program, SymbolTable* table, int level, const Profile* profile,
+                     int reportUnroll, uint64_t fuel, int stableFrame){
+    beginPhase(PHASE_RESOLVE);
+    resolveFunctions(ast, program);
+    endPhase(PHASE_RESOLVE);
+    if (level >= 2) {
+        beginPhase(PHASE_INLINE);
+        inlineFunctions(ast, program, table, profile);
+        endPhase(PHASE_INLINE);
+        beginPhase(PHASE_UNROLL);
+        unrollLoops(ast, program, profile, reportUnroll);
+        endPhase(PHASE_UNROLL);
+    }
+    if (level >= 1) {
+        beginPhase(PHASE_TAIL_CALLS);
+        markTailCalls(ast, program);
+        endPhase(PHASE_TAIL_CALLS);
+        beginPhase(PHASE_CSE);
+        eliminateCommonSubexpressions(ast, program, table);
+        endPhase(PHASE_CSE);
+        beginPhase(PHASE_DEAD_CODE);
+        eliminateDeadCode(ast, program, table, stableFrame);
+        endPhase(PHASE_DEAD_CODE);
+    }
+    if (level >= 2) {
+        beginPhase(PHASE_EVALUATE);
+        evaluateProgram(ast, program, table, fuel);
+        endPhase(PHASE_EVALUATE);
+    }
+}
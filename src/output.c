@@ -0,0 +1,186 @@
+#include "output.h"
+#include "diagnostic.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static void appendMemory(Output* out, const struct iovec* iov, int count){
+    size_t needed = out->memoryLength + 1;
+    for(int i = 0; i < count; i++) needed += iov[i].iov_len;
+    if(needed > out->memoryCapacity){
+        size_t capacity = out->memoryCapacity ? out->memoryCapacity : OUTPUT_CHUNK_SIZE;
+        while(capacity < needed) capacity *= 2;
+        char* grown = (char*)realloc(out->memory, capacity);
+        if(grown == NULL){
+            reportError(out->diagnostics, "Failed to grow output buffer.");
+            fail(out->diagnostics, 74);
+        }
+        out->memory = grown;
+        out->memoryCapacity = capacity;
+    }
+    for(int i = 0; i < count; i++){
+        memcpy(out->memory + out->memoryLength, iov[i].iov_base, iov[i].iov_len);
+        out->memoryLength += iov[i].iov_len;
+    }
+    out->memory[out->memoryLength] = '\0';
+}
+
+void initOutput(Output* out, int fd, Diagnostics* diagnostics){
+    memset(out, 0, sizeof(*out));
+    out->fd = fd;
+    out->diagnostics = diagnostics;
+}
+
+void initOutputBuffer(Output* out, Diagnostics* diagnostics){
+    initOutput(out, -1, diagnostics);
+}
+
+// Hands the gathered text over to the caller, who frees it; gathering
+// starts over empty.
+char* takeOutputBuffer(Output* out, size_t* length){
+    flushOutput(out);
+    if(out->memory == NULL) appendMemory(out, NULL, 0);
+    char* text = out->memory;
+    *length = out->memoryLength;
+    out->memory = NULL;
+    out->memoryLength = 0;
+    out->memoryCapacity = 0;
+    return text;
+}
+
+// Drops whatever is still batched and releases every buffer; what a
+// failed compilation leaves behind.
+void discardOutput(Output* out){
+    for(int i = 0; i < OUTPUT_BATCH; i++){
+        free(out->chunks[i]);
+        out->chunks[i] = NULL;
+        out->chunkLengths[i] = 0;
+    }
+    out->currentChunk = 0;
+    free(out->memory);
+    out->memory = NULL;
+    out->memoryLength = 0;
+    out->memoryCapacity = 0;
+}
+
+static void writeAll(Output* out, struct iovec* iov, int count){
+    if(out->fd < 0){
+        appendMemory(out, iov, count);
+        return;
+    }
+    while(count > 0){
+        ssize_t written = writev(out->fd, iov, count);
+        if(written < 0){
+            if(errno == EINTR) continue;
+            reportError(out->diagnostics, "failed to write output.");
+            fail(out->diagnostics, 74);
+        }
+
+        while(count > 0 && (size_t)written >= iov->iov_len){
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+static void ensureChunk(Output* out){
+    if(out->chunks[out->currentChunk] != NULL) return;
+    out->chunks[out->currentChunk] = (char*)malloc(OUTPUT_CHUNK_SIZE);
+    if(out->chunks[out->currentChunk] == NULL){
+        reportError(out->diagnostics, "Failed to allocate output buffer.");
+        fail(out->diagnostics, 74);
+    }
+}
+
+void flushOutput(Output* out){
+    struct iovec iov[OUTPUT_BATCH];
+    int count = 0;
+    for(int i = 0; i <= out->currentChunk && i < OUTPUT_BATCH; i++){
+        if(out->chunkLengths[i] == 0) continue;
+        iov[count].iov_base = out->chunks[i];
+        iov[count].iov_len = out->chunkLengths[i];
+        count++;
+        out->chunkLengths[i] = 0;
+    }
+    out->currentChunk = 0;
+    writeAll(out, iov, count);
+}
+
+void emit(Output* out, const char* format, ...){
+    va_list args;
+
+    for(;;){
+        ensureChunk(out);
+
+        size_t used = out->chunkLengths[out->currentChunk];
+        size_t room = OUTPUT_CHUNK_SIZE - used;
+
+        va_start(args, format);
+        int length = vsnprintf(out->chunks[out->currentChunk] + used, room, format, args);
+        va_end(args);
+
+        if(length < 0){
+            reportError(out->diagnostics, "failed to format output.");
+            fail(out->diagnostics, 74);
+        }
+        if((size_t)length < room){
+            out->chunkLengths[out->currentChunk] += length;
+            return;
+        }
+
+        if(used == 0){
+            // Longer than a whole chunk: format it on the heap and write it
+            // straight through after whatever is already batched.
+            char* text = (char*)malloc((size_t)length + 1);
+            if(text == NULL){
+                reportError(out->diagnostics, "Failed to allocate output buffer.");
+                fail(out->diagnostics, 74);
+            }
+            va_start(args, format);
+            vsnprintf(text, (size_t)length + 1, format, args);
+            va_end(args);
+
+            flushOutput(out);
+            struct iovec iov = {text, (size_t)length};
+            writeAll(out, &iov, 1);
+            free(text);
+            return;
+        }
+
+        if(++out->currentChunk == OUTPUT_BATCH) flushOutput(out);
+    }
+}
+
+// Raw bytes share the same batches as formatted text.
+void emitBytes(Output* out, const void* data, size_t length){
+    const char* bytes = (const char*)data;
+    while(length > 0){
+        ensureChunk(out);
+
+        size_t room = OUTPUT_CHUNK_SIZE - out->chunkLengths[out->currentChunk];
+        size_t take = length < room ? length : room;
+        memcpy(out->chunks[out->currentChunk] + out->chunkLengths[out->currentChunk], bytes, take);
+        out->chunkLengths[out->currentChunk] += take;
+        bytes += take;
+        length -= take;
+
+        if(out->chunkLengths[out->currentChunk] == OUTPUT_CHUNK_SIZE && ++out->currentChunk == OUTPUT_BATCH){
+            flushOutput(out);
+        }
+    }
+}
+
+void freeOutput(Output* out){
+    flushOutput(out);
+    discardOutput(out);
+}
@@ -1,326 +1,680 @@
 #include "parser.h"
+#include "diagnostic.h"
 #include "symbol.h"
+#include "output.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-extern Token currentToken;
-extern void advanceToken();
-extern void consume(TokenType type, const char* message);
+NodeId parseBlock(Parser* parser, AST* ast, SymbolTable* table);
+
+typedef struct {
+    uint8_t left;
+    uint8_t right;
+    uint8_t kind;
+} BindingPower;
+
+// Infix binding powers; zero means the token does not continue an
+// expression. right = left + 1 makes every level left-associative.
+static const BindingPower bindingPowers[TOKEN_EQUAL_EQUAL + 1] = {
+    [TOKEN_LOGICAL_OR]    = {1, 2, NODE_LOGICAL_OR},
+    [TOKEN_LOGICAL_AND]   = {3, 4, NODE_LOGICAL_AND},
+    [TOKEN_EQUAL_EQUAL]   = {5, 6, NODE_BINARY_OP},
+    [TOKEN_BANG_EQUAL]    = {5, 6, NODE_BINARY_OP},
+    [TOKEN_LESS]          = {5, 6, NODE_BINARY_OP},
+    [TOKEN_LESS_EQUAL]    = {5, 6, NODE_BINARY_OP},
+    [TOKEN_GREATER]       = {5, 6, NODE_BINARY_OP},
+    [TOKEN_GREATER_EQUAL] = {5, 6, NODE_BINARY_OP},
+    [TOKEN_PLUS]          = {7, 8, NODE_BINARY_OP},
+    [TOKEN_MINUS]         = {7, 8, NODE_BINARY_OP},
+    [TOKEN_STAR]          = {9, 10, NODE_BINARY_OP},
+    [TOKEN_SLASH]         = {9, 10, NODE_BINARY_OP},
+};
+
+// An operator waiting for its right operand, or an open parenthesis
+// (operator == TOKEN_LPAREN). minPower is the binding power that was in
+// force before it was pushed.
+struct PendingOperator {
+    NodeId left;
+    uint8_t operator;
+    uint8_t minPower;
+};
+
+static void pushOperator(Parser* parser, NodeId left, TokenType operator, uint8_t minPower){
+    if(parser->operatorCount == parser->operatorCapacity){
+        parser->operatorCapacity = parser->operatorCapacity ? parser->operatorCapacity * 2 : 64;
+        parser->operators = realloc(parser->operators, parser->operatorCapacity * sizeof(PendingOperator));
+        if(parser->operators == NULL){
+            reportError(parser->lexer.diagnostics, "Failed to grow operator stack.");
+            fail(parser->lexer.diagnostics, 74);
+        }
+    }
+    parser->operators[parser->operatorCount].left = left;
+    parser->operators[parser->operatorCount].operator = (uint8_t)operator;
+    parser->operators[parser->operatorCount].minPower = minPower;
+    parser->operatorCount++;
+}
 
-ASTNode* parseBlock(Arena* arena, SymbolTable* table);
-ASTNode* parseStatement(Arena* arena, SymbolTable* table);
-ASTNode* parseLogicalOr(Arena* arena, SymbolTable* table);
-ASTNode* parseLogicalAnd(Arena* arena, SymbolTable* table);
-ASTNode* parseEquality(Arena* arena, SymbolTable* table);
-ASTNode* parseExpression(Arena* arena, SymbolTable* table);
-static ASTNode* parseTerm(Arena* arena, SymbolTable* table);
-static ASTNode* parseFactor(Arena* arena, SymbolTable* table);
+static BindingPower infixPower(TokenType type){
+    BindingPower none = {0, 0, 0};
+    if((unsigned)type > TOKEN_EQUAL_EQUAL) return none;
+    return bindingPowers[type];
+}
 
-static ASTNode* parseFactor(Arena* arena, SymbolTable* table){
-    if(currentToken.type == TOKEN_NUMBER){
-        ASTNode* node = (ASTNode*)arenaAlloc(arena, sizeof(ASTNode));
-        node->type = NODE_NUMBER;
+static NodeId newBinary(AST* ast, ASTNodeType type, TokenType operator, NodeId left, NodeId right){
+    NodeId node = newNode(ast, type);
+    ast->op[node] = (uint8_t)operator;
+    ast->left[node] = left;
+    ast->right[node] = right;
+    return node;
+}
 
-        char buffer[64];
-        snprintf(buffer, sizeof(buffer), "%.*s", currentToken.length, currentToken.start);
-        node->as.numberValue = atoi(buffer);
-        advanceToken();
-        return node;
+// name '[' expression ']', with name already known to be an array.
+static NodeId parseIndex(Parser* parser, AST* ast, SymbolTable* table){
+    Lexer* lexer = &parser->lexer;
+    int nameId = internName(ast, lexer->currentToken.start, lexer->currentToken.length);
+    Symbol* sym = findSymbol(table, nameId);
+    if(sym == NULL || sym->length == 0){
+        reportError(lexer->diagnostics, "'%.*s' is not an array at line %ld.", (int)lexer->currentToken.length, lexer->currentToken.start, lexer->currentToken.line);
+        fail(lexer->diagnostics, 65);
     }
-    if(currentToken.type == TOKEN_IDENTIFIER){
-        ASTNode* node = (ASTNode*)arenaAlloc(arena, sizeof(ASTNode));
-        node->type = NODE_IDENTIFIER;
+    int offset = sym->offset;
+    advanceToken(lexer);
+    advanceToken(lexer);
+
+    NodeId index = parseExpression(parser, ast, table);
+    consume(lexer, TOKEN_RBRACKET, "Expected ']' after index");
 
-        node->as.identifier.name = currentToken.start;
-        node->as.identifier.length = currentToken.length;
-        node->as.identifier.offset = getSymbolOffset(table, currentToken.start, currentToken.length);
+    NodeId node = newNode(ast, NODE_INDEX);
+    ast->left[node] = nameId;
+    ast->right[node] = index;
+    ast->value[node] = offset;
+    return node;
+}
 
-        advanceToken();
+static NodeId parsePrimary(Parser* parser, AST* ast, SymbolTable* table){
+    Lexer* lexer = &parser->lexer;
+    ast->currentLine = (uint32_t)lexer->currentToken.line;
+    if(lexer->currentToken.type == TOKEN_NUMBER){
+        NodeId node = newNode(ast, NODE_NUMBER);
+
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%.*s", (int)lexer->currentToken.length, lexer->currentToken.start);
+        errno = 0;
+        long long literal = strtoll(buffer, NULL, 10);
+        if(errno == ERANGE || lexer->currentToken.length >= sizeof(buffer)){
+            reportError(lexer->diagnostics, "Number '%.*s' does not fit in 64 bits", (int)lexer->currentToken.length, lexer->currentToken.start);
+            fail(lexer->diagnostics, 65);
+        }
+        ast->value[node] = (int32_t)literal;
+        if(literal != ast->value[node]){
+            ast->op[node] = 1;
+            ast->left[node] = (uint32_t)((uint64_t)literal >> 32);
+        }
+        advanceToken(lexer);
         return node;
     }
+    if(lexer->currentToken.type == TOKEN_READ){
+        advanceToken(lexer);
+        consume(lexer, TOKEN_LPAREN, "Expected '(' after 'read'");
+        consume(lexer, TOKEN_RPAREN, "Expected ')' after 'read('");
+        return newNode(ast, NODE_READ);
+    }
+    if(lexer->currentToken.type == TOKEN_IDENTIFIER && peekToken(lexer).type == TOKEN_LPAREN){
+        int nameId = internName(ast, lexer->currentToken.start, lexer->currentToken.length);
+        advanceToken(lexer);
+        advanceToken(lexer);
+
+        uint32_t base = parser->pendingStatements.count;
+        if(lexer->currentToken.type != TOKEN_RPAREN){
+            for(;;){
+                NodeId argument = parseExpression(parser, ast, table);
+                pushNode(ast, &parser->pendingStatements, argument);
+                if(lexer->currentToken.type != TOKEN_COMMA) break;
+                advanceToken(lexer);
+            }
+        }
+        consume(lexer, TOKEN_RPAREN, "Expected ')' after arguments");
+
+        NodeId call = newNode(ast, NODE_CALL);
+        uint32_t count = parser->pendingStatements.count - base;
+        ast->left[call] = appendChildren(ast, parser->pendingStatements.items + base, count);
+        ast->right[call] = count;
+        ast->value[call] = nameId;
+        parser->pendingStatements.count = base;
+        return call;
+    }
+    if(lexer->currentToken.type == TOKEN_IDENTIFIER && peekToken(lexer).type == TOKEN_LBRACKET){
+        return parseIndex(parser, ast, table);
+    }
+    if(lexer->currentToken.type == TOKEN_IDENTIFIER){
+        NodeId node = newNode(ast, NODE_IDENTIFIER);
+
+        int nameId = internName(ast, lexer->currentToken.start, lexer->currentToken.length);
+        Symbol* sym = findSymbol(table, nameId);
+        if(sym != NULL && sym->length > 0){
+            reportError(lexer->diagnostics, "Array '%.*s' used without an index at line %ld.", (int)lexer->currentToken.length, lexer->currentToken.start, lexer->currentToken.line);
+            fail(lexer->diagnostics, 65);
+        }
+        if(sym == NULL){
+            reportError(lexer->diagnostics, "Variable '%.*s' not declared at line %ld.", (int)lexer->currentToken.length, lexer->currentToken.start, lexer->currentToken.line);
+            fail(lexer->diagnostics, 65);
+        }
+        ast->left[node] = nameId;
+        ast->value[node] = sym->offset;
 
-    if(currentToken.type == TOKEN_LPAREN){
-        advanceToken();
-        ASTNode* node = parseLogicalOr(arena, table);
-        consume(TOKEN_RPAREN, "Expected ')' after expression");
+        advanceToken(lexer);
         return node;
     }
 
-    fprintf(stderr, "Error: Expected expression at line %d.\n", currentToken.line);
-    exit(65);
+    reportError(lexer->diagnostics, "Expected expression at line %ld.", lexer->currentToken.line);
+    fail(lexer->diagnostics, 65);
 }
 
-static ASTNode* parseTerm(Arena* arena, SymbolTable* table){
-    ASTNode* node = parseFactor(arena, table);
+// Precedence climbing driven by bindingPowers. Pending operators and open
+// parentheses live on an explicit stack rather than the C stack, so the
+// nesting depth of an expression is only bounded by memory. A caller that
+// had to parse the leading operand to see what it was passes it as first.
+static NodeId parseExpressionFrom(Parser* parser, AST* ast, SymbolTable* table, NodeId first){
+    Lexer* lexer = &parser->lexer;
+    uint32_t base = parser->operatorCount;
+    uint8_t minPower = 0;
+
+    for(;;){
+        NodeId left = first;
+        first = NULL_NODE;
+        if(left == NULL_NODE){
+            while(lexer->currentToken.type == TOKEN_LPAREN){
+                pushOperator(parser, NULL_NODE, TOKEN_LPAREN, minPower);
+                minPower = 0;
+                advanceToken(lexer);
+            }
+            left = parsePrimary(parser, ast, table);
+        }
 
-    while(currentToken.type == TOKEN_STAR || currentToken.type == TOKEN_SLASH){
-        TokenType operator = currentToken.type;
-        advanceToken();
+        for(;;){
+            BindingPower power = infixPower(lexer->currentToken.type);
+            if(power.left > minPower){
+                pushOperator(parser, left, lexer->currentToken.type, minPower);
+                minPower = power.right;
+                advanceToken(lexer);
+                break;
+            }
 
-        ASTNode* rigthtNode = parseFactor(arena, table);
+            if(parser->operatorCount == base) return left;
 
-        ASTNode* binaryNode = (ASTNode*)arenaAlloc(arena, sizeof(ASTNode));
-        
-        binaryNode->type = NODE_BINARY_OP;
-        binaryNode->as.binaryOp.left = node;
-        binaryNode->as.binaryOp.right = rigthtNode;
-        binaryNode->as.binaryOp.operator = operator;
+            PendingOperator pending = parser->operators[--parser->operatorCount];
+            minPower = pending.minPower;
+            if(pending.operator == TOKEN_LPAREN){
+                consume(lexer, TOKEN_RPAREN, "Expected ')' after expression");
+                continue;
+            }
 
-        node = binaryNode;
+            left = newBinary(ast, (ASTNodeType)bindingPowers[pending.operator].kind,
+                             (TokenType)pending.operator, pending.left, left);
+        }
     }
+}
 
-    return node;
+NodeId parseExpression(Parser* parser, AST* ast, SymbolTable* table){
+    return parseExpressionFrom(parser, ast, table, NULL_NODE);
 }
 
-ASTNode* parseExpression(Arena* arena, SymbolTable* table){
-    ASTNode* node = parseTerm(arena, table);
-    while(currentToken.type == TOKEN_PLUS || currentToken.type == TOKEN_MINUS){
-        TokenType  operator =  currentToken.type;
-        advanceToken();
+static NodeId parseExpressionStatement(Parser* parser, AST* ast, SymbolTable* table, NodeId first){
+    Lexer* lexer = &parser->lexer;
+    NodeId exprNode = parseExpressionFrom(parser, ast, table, first);
+    consume(lexer, TOKEN_SEMICOLON, "Expected ';' after expression");
 
-        ASTNode* rightnode = parseTerm(arena, table);
+    NodeId exprStatement = newNode(ast, NODE_EXPRESSION_STATEMENT);
+    ast->left[exprStatement] = exprNode;
 
-        ASTNode* binaryNode = (ASTNode*)arenaAlloc(arena, sizeof(ASTNode));
+    return exprStatement;
+}
 
-        binaryNode->type = NODE_BINARY_OP;
-        binaryNode->as.binaryOp.left = node;
-        binaryNode->as.binaryOp.right = rightnode;
-        binaryNode->as.binaryOp.operator = operator;
-        node = binaryNode;
-    }
-    return node;
+static NodeId closeBlock(Parser* parser, AST* ast, uint32_t base){
+    NodeId blockNode = newNode(ast, NODE_BLOCK);
+    uint32_t count = parser->pendingStatements.count - base;
+    ast->left[blockNode] = appendChildren(ast, parser->pendingStatements.items + base, count);
+    ast->right[blockNode] = count;
+    parser->pendingStatements.count = base;
+    return blockNode;
 }
 
-ASTNode* parseEquality(Arena* arena, SymbolTable* table){
-    ASTNode* left = parseExpression(arena, table);
+NodeId parseBlock(Parser* parser, AST* ast, SymbolTable* table){
+    Lexer* lexer = &parser->lexer;
+    consume(lexer, TOKEN_LBRACE, "Expected '{' at the beginning of block");
 
-    while(currentToken.type == TOKEN_EQUAL_EQUAL || 
-          currentToken.type == TOKEN_BANG_EQUAL ||
-          currentToken.type == TOKEN_LESS ||
-          currentToken.type == TOKEN_LESS_EQUAL ||
-          currentToken.type == TOKEN_GREATER ||
-          currentToken.type == TOKEN_GREATER_EQUAL) {
-        
-        TokenType operatorType = currentToken.type;
-        advanceToken();
+    beginScope(table);
 
-        ASTNode* right = parseExpression(arena, table);
+    uint32_t base = parser->pendingStatements.count;
+    while(lexer->currentToken.type != TOKEN_RBRACE && lexer->currentToken.type != TOKEN_EOF){
+        NodeId statement = parseStatement(parser, ast, table);
+        pushNode(ast, &parser->pendingStatements, statement);
+    }
 
-        ASTNode* node = (ASTNode*)arenaAlloc(arena, sizeof(ASTNode));
-        node->type = NODE_BINARY_OP;
-        node->as.binaryOp.operator = operatorType;
-        node->as.binaryOp.left = left;
-        node->as.binaryOp.right = right;
+    consume(lexer, TOKEN_RBRACE, "Expected '}' at the end of block");
 
-        left = node;
-    }
+    endScope(table);
 
-    return left;
+    return closeBlock(parser, ast, base);
 }
 
-ASTNode* parseLogicalAnd(Arena* arena, SymbolTable* table){
-    ASTNode* left = parseEquality(arena, table);
-    while(currentToken.type == TOKEN_LOGICAL_AND){
-        advanceToken();
-        ASTNode* right = parseEquality(arena, table);
-
-        ASTNode* node = (ASTNode*)arenaAlloc(arena, sizeof(ASTNode));
-        node->type = NODE_LOGICAL_AND;
-        node->as.binaryOp.left = left;
-        node->as.binaryOp.right = right;
-        left = node;
+NodeId parseProgram(Parser* parser, AST* ast, SymbolTable* table){
+    Lexer* lexer = &parser->lexer;
+    uint32_t line = (uint32_t)lexer->currentToken.line;
+    uint32_t base = parser->pendingStatements.count;
+    while(lexer->currentToken.type != TOKEN_EOF){
+        NodeId statement = parseStatement(parser, ast, table);
+        pushNode(ast, &parser->pendingStatements, statement);
     }
-    return left; 
+
+    NodeId program = closeBlock(parser, ast, base);
+    ast->line[program] = line;
+    freeParser(parser);
+    return program;
 }
 
-ASTNode* parseLogicalOr(Arena* arena, SymbolTable* table){
-    ASTNode* left = parseLogicalAnd(arena, table);
-    while(currentToken.type == TOKEN_LOGICAL_OR){
-        advanceToken();
-        ASTNode* right = parseLogicalAnd(arena, table);
-
-        ASTNode* node = (ASTNode*)arenaAlloc(arena, sizeof(ASTNode));
-        node->type = NODE_LOGICAL_OR;
-        node->as.binaryOp.left = left;
-        node->as.binaryOp.right = right;
-        left = node;
-    }
-    return left;
+void freeParser(Parser* parser){
+    freeNodeList(&parser->pendingStatements);
+    free(parser->operators);
+    parser->operators = NULL;
+    parser->operatorCount = 0;
+    parser->operatorCapacity = 0;
+    parser->insideFunction = 0;
 }
 
-ASTNode* parseBlock(Arena* arena, SymbolTable* table){
-    consume(TOKEN_LBRACE, "Expected '{' at the beginning of block");
+// Parameters and locals get their own frame starting at offset 8, and
+// main's variables are hidden from the body.
+static NodeId parseFunction(Parser* parser, AST* ast, SymbolTable* table){
+    Lexer* lexer = &parser->lexer;
+    long line = lexer->currentToken.line;
+    advanceToken(lexer);
 
+    if(parser->insideFunction || table->currentScopeDepth != 0){
+        reportError(lexer->diagnostics, "Functions can only be defined at top level, line %ld.", line);
+        fail(lexer->diagnostics, 65);
+    }
+    if(lexer->currentToken.type != TOKEN_IDENTIFIER){
+        reportError(lexer->diagnostics, "Expected function name at line %ld.", lexer->currentToken.line);
+        fail(lexer->diagnostics, 65);
+    }
+    int nameId = internName(ast, lexer->currentToken.start, lexer->currentToken.length);
+    advanceToken(lexer);
+
+    int savedOffset = table->currentOffset;
+    int savedFrameSize = table->frameSize;
+    int savedBase = table->frameBase;
+    table->currentOffset = 0;
+    table->frameSize = 0;
+    table->frameBase = table->count;
     beginScope(table);
 
-    ASTNode* blockNode = (ASTNode*)arenaAlloc(arena, sizeof(ASTNode));
-    blockNode->type = NODE_BLOCK;
-    blockNode->as.block.head = NULL;
-
-    ASTNode** current = &blockNode->as.block.head;
-
-    while(currentToken.type != TOKEN_RBRACE && currentToken.type != TOKEN_EOF){
-        ASTNode* statement = parseStatement(arena, table);
-        *current = statement;
-        current = &statement->next; 
+    consume(lexer, TOKEN_LPAREN, "Expected '(' after function name");
+    int parameterCount = 0;
+    if(lexer->currentToken.type != TOKEN_RPAREN){
+        for(;;){
+            if(lexer->currentToken.type != TOKEN_IDENTIFIER){
+                reportError(lexer->diagnostics, "Expected parameter name at line %ld.", lexer->currentToken.line);
+                fail(lexer->diagnostics, 65);
+            }
+            int parameterId = internName(ast, lexer->currentToken.start, lexer->currentToken.length);
+            if(getSymbolOffset(table, parameterId) != -1){
+                reportError(lexer->diagnostics, "Duplicate parameter at line %ld.", lexer->currentToken.line);
+                fail(lexer->diagnostics, 65);
+            }
+            if(++parameterCount > MAX_PARAMETERS){
+                reportError(lexer->diagnostics, "More than %d parameters at line %ld.", MAX_PARAMETERS, lexer->currentToken.line);
+                fail(lexer->diagnostics, 65);
+            }
+            addSymbol(table, parameterId);
+            advanceToken(lexer);
+            if(lexer->currentToken.type != TOKEN_COMMA) break;
+            advanceToken(lexer);
+        }
     }
+    consume(lexer, TOKEN_RPAREN, "Expected ')' after parameters");
 
-    consume(TOKEN_RBRACE, "Expected '}' at the end of block");
+    parser->insideFunction = 1;
+    NodeId body = parseBlock(parser, ast, table);
+    parser->insideFunction = 0;
 
-    endScope(table);
+    NodeId function = newNode(ast, NODE_FUNCTION);
+    ast->left[function] = nameId;
+    ast->right[function] = body;
+    ast->value[function] = table->frameSize;
+    ast->op[function] = (uint8_t)parameterCount;
 
-    return blockNode;
+    endScope(table);
+    table->currentOffset = savedOffset;
+    table->frameSize = savedFrameSize;
+    table->frameBase = savedBase;
+    return function;
 }
 
-ASTNode* parseStatement(Arena* arena, SymbolTable* table){
-    if(currentToken.type == TOKEN_PRINT){
-        advanceToken();
-        consume(TOKEN_LPAREN, "Expected '(' after 'print'");
-        ASTNode* exprNode = parseLogicalOr(arena, table);
-        consume(TOKEN_RPAREN, "Expected ')' after expression");
-        consume(TOKEN_SEMICOLON, "Expected ';' after print statement");
-        ASTNode* printNode = (ASTNode*)arenaAlloc(arena, sizeof(ASTNode));
-        printNode->type = NODE_PRINT;
-        printNode->as.print.expression = exprNode;
+static NodeId parseStatementBody(Parser* parser, AST* ast, SymbolTable* table){
+    Lexer* lexer = &parser->lexer;
+    if(lexer->currentToken.type == TOKEN_FUNC){
+        return parseFunction(parser, ast, table);
+    }
+
+    if(lexer->currentToken.type == TOKEN_RETURN){
+        if(!parser->insideFunction){
+            reportError(lexer->diagnostics, "'return' outside of a function at line %ld.", lexer->currentToken.line);
+            fail(lexer->diagnostics, 65);
+        }
+        advanceToken(lexer);
+
+        NodeId returnNode = newNode(ast, NODE_RETURN);
+        if(lexer->currentToken.type != TOKEN_SEMICOLON){
+            NodeId exprNode = parseExpression(parser, ast, table);
+            ast->left[returnNode] = exprNode;
+        }
+        consume(lexer, TOKEN_SEMICOLON, "Expected ';' after return");
+        return returnNode;
+    }
+
+    if(lexer->currentToken.type == TOKEN_PRINT){
+        advanceToken(lexer);
+        consume(lexer, TOKEN_LPAREN, "Expected '(' after 'print'");
+        NodeId exprNode = parseExpression(parser, ast, table);
+        consume(lexer, TOKEN_RPAREN, "Expected ')' after expression");
+        consume(lexer, TOKEN_SEMICOLON, "Expected ';' after print statement");
+        NodeId printNode = newNode(ast, NODE_PRINT);
+        ast->left[printNode] = exprNode;
 
         return printNode;
     }
 
-    if (currentToken.type == TOKEN_IF){
-        advanceToken();
+    if (lexer->currentToken.type == TOKEN_IF){
+        advanceToken(lexer);
 
-        consume(TOKEN_LPAREN, "Expected '(' after 'if'");
-        ASTNode* conditionNode = parseLogicalOr(arena, table);
-        consume(TOKEN_RPAREN, "Expected ')' after condition");
+        consume(lexer, TOKEN_LPAREN, "Expected '(' after 'if'");
+        NodeId conditionNode = parseExpression(parser, ast, table);
+        consume(lexer, TOKEN_RPAREN, "Expected ')' after condition");
 
-        ASTNode* bodyNode = parseBlock(arena, table);
+        NodeId bodyNode = parseBlock(parser, ast, table);
 
-        //consume(TOKEN_LBRACE, "Expected '{' before if body");
-        //ASTNode* bodyNode = parseStatement(arena, table);
-        //consume(TOKEN_RBRACE, "Expected '}' after if body");
+        //consume(lexer, TOKEN_LBRACE, "Expected '{' before if body");
+        //NodeId bodyNode = parseStatement(parser, ast, table);
+        //consume(lexer, TOKEN_RBRACE, "Expected '}' after if body");
 
-        ASTNode* ifNode = (ASTNode*)arenaAlloc(arena, sizeof(ASTNode));
-        ifNode->type = NODE_IF;
-        ifNode->as.controlFlow.condition = conditionNode;
-        ifNode->as.controlFlow.body = bodyNode;
+        NodeId ifNode = newNode(ast, NODE_IF);
+        ast->left[ifNode] = conditionNode;
+        ast->right[ifNode] = bodyNode;
 
         return ifNode;
     }
 
-    if(currentToken.type == TOKEN_WHILE){
-        advanceToken();
+    if(lexer->currentToken.type == TOKEN_WHILE){
+        advanceToken(lexer);
 
-        consume(TOKEN_LPAREN, "Expected '(' after 'while'");
-        ASTNode* conditionNode = parseLogicalOr(arena, table); 
-        consume(TOKEN_RPAREN, "Expected ')' after condition");
-        ASTNode* bodyNode = parseBlock(arena, table);
+        consume(lexer, TOKEN_LPAREN, "Expected '(' after 'while'");
+        NodeId conditionNode = parseExpression(parser, ast, table); 
+        consume(lexer, TOKEN_RPAREN, "Expected ')' after condition");
+        NodeId bodyNode = parseBlock(parser, ast, table);
 
-        ASTNode* whileNode = (ASTNode*)arenaAlloc(arena, sizeof(ASTNode));
-        whileNode->type = NODE_WHILE;
-        whileNode->as.controlFlow.condition = conditionNode;
-        whileNode->as.controlFlow.body = bodyNode;
+        NodeId whileNode = newNode(ast, NODE_WHILE);
+        ast->left[whileNode] = conditionNode;
+        ast->right[whileNode] = bodyNode;
 
         return whileNode;
     }
 
-    if(currentToken.type == TOKEN_IDENTIFIER){
-        const char* varName = currentToken.start;
-        int varLength = currentToken.length;
-
-        advanceToken();
+    if(lexer->currentToken.type == TOKEN_ARRAY){
+        advanceToken(lexer);
+        if(lexer->currentToken.type != TOKEN_IDENTIFIER){
+            reportError(lexer->diagnostics, "Expected array name at line %ld.", lexer->currentToken.line);
+            fail(lexer->diagnostics, 65);
+        }
+        int nameId = internName(ast, lexer->currentToken.start, lexer->currentToken.length);
+        long line = lexer->currentToken.line;
+        advanceToken(lexer);
+
+        consume(lexer, TOKEN_LBRACKET, "Expected '[' after array name");
+        if(lexer->currentToken.type != TOKEN_NUMBER){
+            reportError(lexer->diagnostics, "Array length must be a number at line %ld.", lexer->currentToken.line);
+            fail(lexer->diagnostics, 65);
+        }
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%.*s", (int)lexer->currentToken.length, lexer->currentToken.start);
+        int length = atoi(buffer);
+        if(length <= 0 || length > MAX_ARRAY_LENGTH){
+            reportError(lexer->diagnostics, "Array length must be between 1 and %d at line %ld.", MAX_ARRAY_LENGTH, lexer->currentToken.line);
+            fail(lexer->diagnostics, 65);
+        }
+        advanceToken(lexer);
+        consume(lexer, TOKEN_RBRACKET, "Expected ']' after array length");
+        consume(lexer, TOKEN_SEMICOLON, "Expected ';' after array declaration");
 
-        if(currentToken.type == TOKEN_ASSIGN){
-            advanceToken();
-            if(getSymbolOffset(table, varName, varLength) == -1){
-                addSymbol(table, varName, varLength);
-            }
+        if(getSymbolOffset(table, nameId) != -1){
+            reportError(lexer->diagnostics, "'%.*s' is already declared at line %ld.", ast->nameLengths[nameId], nameText(ast, nameId), line);
+            fail(lexer->diagnostics, 65);
+        }
+        addArray(table, nameId, length);
 
-            ASTNode* exprNode = parseLogicalOr(arena, table);
+        NodeId arrayNode = newNode(ast, NODE_ARRAY);
+        ast->left[arrayNode] = nameId;
+        ast->right[arrayNode] = length;
+        ast->value[arrayNode] = getSymbolOffset(table, nameId);
+        return arrayNode;
+    }
 
-            consume(TOKEN_SEMICOLON, "Expected ';' after expression");
+    // Only the token after the ']' tells an element store from an
+    // expression that starts with an element, such as v[0] + 1;
+    if(lexer->currentToken.type == TOKEN_IDENTIFIER && peekToken(lexer).type == TOKEN_LBRACKET){
+        NodeId target = parseIndex(parser, ast, table);
+        if(lexer->currentToken.type != TOKEN_ASSIGN) return parseExpressionStatement(parser, ast, table, target);
+        advanceToken(lexer);
+        NodeId exprNode = parseExpression(parser, ast, table);
+        consume(lexer, TOKEN_SEMICOLON, "Expected ';' after expression");
+
+        NodeId storeNode = newNode(ast, NODE_STORE);
+        ast->left[storeNode] = target;
+        ast->right[storeNode] = exprNode;
+        return storeNode;
+    }
 
-            ASTNode* assignNode = (ASTNode*)arenaAlloc(arena, sizeof(ASTNode));
-            assignNode->type = NODE_ASSIGN;
-            assignNode->as.assign.name = varName;
-            assignNode->as.assign.length = varLength;
-            assignNode->as.assign.expr = exprNode;
-            assignNode->as.assign.offset = getSymbolOffset(table, varName, varLength);
+    if(lexer->currentToken.type == TOKEN_IDENTIFIER && peekToken(lexer).type == TOKEN_ASSIGN){
+        int nameId = internName(ast, lexer->currentToken.start, lexer->currentToken.length);
 
-            return assignNode;
+        Symbol* sym = findSymbol(table, nameId);
+        if(sym != NULL && sym->length > 0){
+            reportError(lexer->diagnostics, "Cannot assign to array '%.*s' at line %ld.", ast->nameLengths[nameId], nameText(ast, nameId), lexer->currentToken.line);
+            fail(lexer->diagnostics, 65);
         }
+        advanceToken(lexer);
+        advanceToken(lexer);
+        if(sym == NULL){
+            addSymbol(table, nameId);
+        }
+
+        NodeId exprNode = parseExpression(parser, ast, table);
+
+        consume(lexer, TOKEN_SEMICOLON, "Expected ';' after expression");
+
+        NodeId assignNode = newNode(ast, NODE_ASSIGN);
+        ast->left[assignNode] = nameId;
+        ast->right[assignNode] = exprNode;
+        ast->value[assignNode] = getSymbolOffset(table, nameId);
+
+        return assignNode;
     }
 
-    return parseLogicalOr(arena, table);
+    return parseExpressionStatement(parser, ast, table, NULL_NODE);
 }
 
-void printAST(ASTNode* node, int depth){
-    if(node == NULL) return;
-    for(int i = 0; i < depth; i++){
-        fprintf(stderr, "  ");
-    }
+// A statement is put on the line it starts on, which is where its node's
+// own code (a store, a compare, a call) belongs rather than wherever its
+// last token happens to be.
+NodeId parseStatement(Parser* parser, AST* ast, SymbolTable* table){
+    Lexer* lexer = &parser->lexer;
+    uint32_t line = (uint32_t)lexer->currentToken.line;
+    NodeId statement = parseStatementBody(parser, ast, table);
+    ast->line[statement] = line;
+    return statement;
+}
 
-    switch(node->type){
-        case NODE_NUMBER:
-            fprintf(stderr, "Number: %d\n", node->as.numberValue);
-            break;
-        case NODE_IDENTIFIER:
-            fprintf(stderr, "Variable: %.*s\n", node->as.identifier.length, node->as.identifier.name);
-            break;
-        case NODE_BINARY_OP:{
-            const char* opStr = "?";
-            if(node->as.binaryOp.operator == TOKEN_EQUAL_EQUAL) opStr = "==";
-            else if(node->as.binaryOp.operator == TOKEN_BANG_EQUAL) opStr = "!=";
-            else if(node->as.binaryOp.operator == TOKEN_LESS) opStr = "<";
-            else if(node->as.binaryOp.operator == TOKEN_LESS_EQUAL) opStr = "<=";
-            else if(node->as.binaryOp.operator == TOKEN_GREATER) opStr = ">";
-            else if(node->as.binaryOp.operator == TOKEN_GREATER_EQUAL) opStr = ">=";
-            else if(node->as.binaryOp.operator == TOKEN_PLUS) opStr = "+"; 
-            else if(node->as.binaryOp.operator == TOKEN_MINUS) opStr = "-";
-            else if(node->as.binaryOp.operator == TOKEN_STAR) opStr = "*";
-            else if(node->as.binaryOp.operator == TOKEN_SLASH) opStr = "/";
-            
-            fprintf(stderr, "BinaryOp: [%s]\n", opStr);
-            printAST(node->as.binaryOp.left, depth + 1);
-            printAST(node->as.binaryOp.right, depth + 1);
-            break;
+typedef struct {
+    NodeId node;
+    int depth;
+} PrintItem;
+
+// Pre-order text dump through the output batches, driven by an explicit
+// stack; children are pushed in reverse so they come back out in source
+// order.
+void printAST(Output* out, AST* ast, NodeId root, int indent){
+    if(root == NULL_NODE) return;
+
+    uint32_t capacity = 64;
+    uint32_t count = 0;
+    PrintItem* stack = malloc(capacity * sizeof(PrintItem));
+    if(stack == NULL){
+        reportError(ast->diagnostics, "Failed to allocate print stack.");
+        fail(ast->diagnostics, 74);
+    }
+    stack[count].node = root;
+    stack[count].depth = indent;
+    count++;
+
+    while(count > 0){
+        PrintItem item = stack[--count];
+        NodeId node = item.node;
+        int depth = item.depth;
+
+        emit(out, "%*s", depth * 2, "");
+
+        NodeId children[2] = {NULL_NODE, NULL_NODE};
+        NodeId* list = children;
+        uint32_t listCount = 0;
+
+        switch(ast->kind[node]){
+            case NODE_NUMBER:
+                emit(out, "Number: %lld\n", (long long)numberValue(ast, node));
+                break;
+            case NODE_IDENTIFIER:
+                emit(out, "Variable: %.*s\n", ast->nameLengths[ast->left[node]], nameText(ast, ast->left[node]));
+                break;
+            case NODE_BINARY_OP:{
+                const char* opStr = "?";
+                if(ast->op[node] == TOKEN_EQUAL_EQUAL) opStr = "==";
+                else if(ast->op[node] == TOKEN_BANG_EQUAL) opStr = "!=";
+                else if(ast->op[node] == TOKEN_LESS) opStr = "<";
+                else if(ast->op[node] == TOKEN_LESS_EQUAL) opStr = "<=";
+                else if(ast->op[node] == TOKEN_GREATER) opStr = ">";
+                else if(ast->op[node] == TOKEN_GREATER_EQUAL) opStr = ">=";
+                else if(ast->op[node] == TOKEN_PLUS) opStr = "+"; 
+                else if(ast->op[node] == TOKEN_MINUS) opStr = "-";
+                else if(ast->op[node] == TOKEN_STAR) opStr = "*";
+                else if(ast->op[node] == TOKEN_SLASH) opStr = "/";
+                
+                emit(out, "BinaryOp: [%s]\n", opStr);
+                children[0] = ast->left[node];
+                children[1] = ast->right[node];
+                listCount = 2;
+                break;
+            }
+            case NODE_LOGICAL_AND:
+                emit(out, "Logical AND [&&]\n");
+                children[0] = ast->left[node];
+                children[1] = ast->right[node];
+                listCount = 2;
+                break;
+            case NODE_LOGICAL_OR: 
+                emit(out, "Logical OR [||]\n");
+                children[0] = ast->left[node];
+                children[1] = ast->right[node];
+                listCount = 2;
+                break;
+            case NODE_IF:
+                emit(out, "If Statement:\n");
+                children[0] = ast->left[node];
+                children[1] = ast->right[node];
+                listCount = 2;
+                break;
+            case NODE_WHILE:
+                emit(out, "While Statement:\n");
+                children[0] = ast->left[node];
+                children[1] = ast->right[node];
+                listCount = 2;
+                break;
+            case NODE_BLOCK:
+                emit(out, "Block:\n");
+                list = blockStatements(ast, node);
+                listCount = ast->right[node];
+                break;
+            case NODE_ASSIGN:
+                emit(out, "Assign: %.*s\n", ast->nameLengths[ast->left[node]], nameText(ast, ast->left[node]));
+                children[0] = ast->right[node];
+                listCount = 1;
+                break;
+            case NODE_PRINT:
+                emit(out, "Print Statement:\n");
+                children[0] = ast->left[node];
+                listCount = 1;
+                break;
+            case NODE_EXPRESSION_STATEMENT:
+                emit(out, "Expression Statement:\n");
+                children[0] = ast->left[node];
+                listCount = 1;
+                break;
+            case NODE_FUNCTION:
+                emit(out, "Function: %.*s (%d params)\n", ast->nameLengths[ast->left[node]], nameText(ast, ast->left[node]), ast->op[node]);
+                children[0] = ast->right[node];
+                listCount = 1;
+                break;
+            case NODE_CALL:
+                emit(out, "Call: %.*s\n", ast->nameLengths[ast->value[node]], nameText(ast, ast->value[node]));
+                list = callArguments(ast, node);
+                listCount = ast->right[node];
+                break;
+            case NODE_RETURN:
+                emit(out, "Return%s:\n", ast->op[node] ? " (tail call)" : "");
+                children[0] = ast->left[node];
+                listCount = 1;
+                break;
+            case NODE_ARRAY:
+                emit(out, "Array: %.*s[%u]\n", ast->nameLengths[ast->left[node]], nameText(ast, ast->left[node]), ast->right[node]);
+                break;
+            case NODE_INDEX:
+                emit(out, "Index: %.*s\n", ast->nameLengths[ast->left[node]], nameText(ast, ast->left[node]));
+                children[0] = ast->right[node];
+                listCount = 1;
+                break;
+            case NODE_STORE:
+                emit(out, "Store:\n");
+                children[0] = ast->left[node];
+                children[1] = ast->right[node];
+                listCount = 2;
+                break;
+            case NODE_READ:
+                emit(out, "Read\n");
+                break;
+            default:
+                emit(out, "Unknown node type\n");
         }
-        case NODE_LOGICAL_AND:
-            fprintf(stderr, "Logical AND [&&]\n");
-            printAST(node->as.binaryOp.left, depth + 1);
-            printAST(node->as.binaryOp.right, depth + 1);
-            break;
-        case NODE_LOGICAL_OR: 
-            fprintf(stderr, "Logical OR [||]\n");
-            printAST(node->as.binaryOp.left, depth + 1);
-            printAST(node->as.binaryOp.right, depth + 1);
-            break;
-        case NODE_IF:
-            fprintf(stderr, "If Statement:\n");
-            printAST(node->as.controlFlow.condition, depth + 1);
-            printAST(node->as.controlFlow.body, depth + 1);
-            break;
-        case NODE_WHILE:
-            fprintf(stderr, "While Statement:\n");
-            printAST(node->as.controlFlow.condition, depth + 1);
-            printAST(node->as.controlFlow.body, depth + 1);
-            break;
-        case NODE_BLOCK:
-            fprintf(stderr, "Block:\n");
-            ASTNode* curr = node->as.block.head;
-            while(curr != NULL) {
-                printAST(curr, depth + 1);
-                curr = curr->next;
+
+        if(count + listCount > capacity){
+            while(count + listCount > capacity) capacity *= 2;
+            stack = realloc(stack, capacity * sizeof(PrintItem));
+            if(stack == NULL){
+                reportError(ast->diagnostics, "Failed to grow print stack.");
+                fail(ast->diagnostics, 74);
             }
-            break;
-        case NODE_ASSIGN:
-            fprintf(stderr, "Assign: %.*s\n", node->as.assign.length, node->as.assign.name);
-            printAST(node->as.assign.expr, depth + 1);
-            break;
-        case NODE_PRINT:
-            fprintf(stderr, "Print Statement:\n");
-            printAST(node->as.print.expression, depth + 1); 
-            break;
-        default:
-            fprintf(stderr, "Unknown node type\n");
+        }
+        for(uint32_t i = listCount; i-- > 0;){
+            if(list[i] == NULL_NODE) continue;
+            stack[count].node = list[i];
+            stack[count].depth = depth + 1;
+            count++;
+        }
     }
-}
\ No newline at end of file
+
+    free(stack);
+}
+
+void printProgram(Output* out, AST* ast, NodeId program){
+    NodeId* statements = blockStatements(ast, program);
+    for(uint32_t i = 0; i < ast->right[program]; i++){
+        printAST(out, ast, statements[i], 0);
+    }
+}
@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+#include "perf.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1D_MISSES,
+    COUNTER_LLC_MISSES,
+    COUNTER_PAGE_FAULTS,
+    COUNTER_COUNT
+} Counter;
+
+#define CACHE_READ_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char* name;
+} events[COUNTER_COUNT] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+    {PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D), "L1D-misses"},
+    {PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL), "LLC-misses"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults"},
+};
+
+static const char* phaseNames[PHASE_COUNT] = {
+    "lex", "lex+parse", "resolve", "inline", "unroll", "tail-calls", "cse", "dead-code", "evaluate", "codegen", "interpret"
+};
+
+// Layout of a read() with TOTAL_TIME_ENABLED and TOTAL_TIME_RUNNING: the
+// two times tell how long the counter was actually on the PMU when the
+// kernel had to multiplex it.
+typedef struct {
+    uint64_t value;
+    uint64_t enabled;
+    uint64_t running;
+} Reading;
+
+typedef struct {
+    double counts[COUNTER_COUNT];
+    uint64_t nanoseconds;
+    uint32_t runs;
+} PhaseTotals;
+
+static _Thread_local int enabled;
+static _Thread_local int fds[COUNTER_COUNT];
+static _Thread_local int openError;
+static _Thread_local Reading starts[PHASE_COUNT][COUNTER_COUNT];
+static _Thread_local uint64_t startTimes[PHASE_COUNT];
+static _Thread_local PhaseTotals totals[PHASE_COUNT];
+
+static uint64_t now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Each counter is opened on its own rather than as a group, so one the
+// machine lacks (common under virtualisation) does not take the others
+// down with it.
+void startPerfCounters(void){
+    for(int i = 0; i < COUNTER_COUNT; i++){
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if(fds[i] < 0 && openError == 0) openError = errno;
+    }
+    memset(totals, 0, sizeof(totals));
+    enabled = 1;
+}
+
+int perfCountersEnabled(void){
+    return enabled;
+}
+
+static void readCounters(Reading* readings){
+    for(int i = 0; i < COUNTER_COUNT; i++){
+        if(fds[i] < 0 || read(fds[i], &readings[i], sizeof(Reading)) != (ssize_t)sizeof(Reading)){
+            memset(&readings[i], 0, sizeof(Reading));
+        }
+    }
+}
+
+void beginPhase(Phase phase){
+    if(!enabled) return;
+    startTimes[phase] = now();
+    readCounters(starts[phase]);
+}
+
+void endPhase(Phase phase){
+    if(!enabled) return;
+    Reading ends[COUNTER_COUNT];
+    readCounters(ends);
+    PhaseTotals* total = &totals[phase];
+    total->nanoseconds += now() - startTimes[phase];
+    total->runs++;
+
+    for(int i = 0; i < COUNTER_COUNT; i++){
+        const Reading* start = &starts[phase][i];
+        double value = (double)(ends[i].value - start->value);
+        uint64_t enabledTime = ends[i].enabled - start->enabled;
+        uint64_t runningTime = ends[i].running - start->running;
+        // Scale up a counter that was multiplexed out for part of the phase.
+        if(runningTime > 0 && runningTime < enabledTime) value *= (double)enabledTime / (double)runningTime;
+        total->counts[i] += value;
+    }
+}
+
+static void printCount(FILE* out, int width, int counter, double value){
+    if(fds[counter] < 0) fprintf(out, " %*s", width, "-");
+    else fprintf(out, " %*.0f", width, value);
+}
+
+// Misses per thousand instructions.
+static void printRate(FILE* out, int counter, const double* counts){
+    if(fds[counter] < 0 || fds[COUNTER_INSTRUCTIONS] < 0 || counts[COUNTER_INSTRUCTIONS] <= 0){
+        fprintf(out, " %7s", "-");
+    }else{
+        fprintf(out, " %7.2f", 1000.0 * counts[counter] / counts[COUNTER_INSTRUCTIONS]);
+    }
+}
+
+static void printRow(FILE* out, const char* name, const PhaseTotals* total){
+    const double* counts = total->counts;
+    fprintf(out, "%-10s %9.3f", name, (double)total->nanoseconds / 1e6);
+    printCount(out, 13, COUNTER_CYCLES, counts[COUNTER_CYCLES]);
+    printCount(out, 13, COUNTER_INSTRUCTIONS, counts[COUNTER_INSTRUCTIONS]);
+    if(fds[COUNTER_CYCLES] < 0 || fds[COUNTER_INSTRUCTIONS] < 0 || counts[COUNTER_CYCLES] <= 0){
+        fprintf(out, " %5s", "-");
+    }else{
+        fprintf(out, " %5.2f", counts[COUNTER_INSTRUCTIONS] / counts[COUNTER_CYCLES]);
+    }
+    printCount(out, 10, COUNTER_BRANCH_MISSES, counts[COUNTER_BRANCH_MISSES]);
+    printRate(out, COUNTER_BRANCH_MISSES, counts);
+    printCount(out, 10, COUNTER_L1D_MISSES, counts[COUNTER_L1D_MISSES]);
+    printRate(out, COUNTER_L1D_MISSES, counts);
+    printCount(out, 10, COUNTER_LLC_MISSES, counts[COUNTER_LLC_MISSES]);
+    printRate(out, COUNTER_LLC_MISSES, counts);
+    printCount(out, 7, COUNTER_PAGE_FAULTS, counts[COUNTER_PAGE_FAULTS]);
+    fputc('\n', out);
+}
+
+// One row per phase that ran, with IPC and misses per thousand
+// instructions (/ki) derived from the raw counts.
+void reportPerfCounters(FILE* out){
+    if(!enabled) return;
+
+    fprintf(out, "--- PERF COUNTERS ---\n");
+    int missing = 0;
+    for(int i = 0; i < COUNTER_COUNT; i++) missing += fds[i] < 0;
+    if(missing == COUNTER_COUNT){
+        fprintf(out, "note: performance counters unavailable (%s); wall time only\n", strerror(openError));
+    }else if(missing > 0){
+        fprintf(out, "note: not available here:");
+        for(int i = 0; i < COUNTER_COUNT; i++){
+            if(fds[i] < 0) fprintf(out, " %s", events[i].name);
+        }
+        fputc('\n', out);
+    }
+
+    fprintf(out, "%-10s %9s %13s %13s %5s %10s %7s %10s %7s %10s %7s %7s\n",
+            "phase", "ms", "cycles", "instructions", "IPC", "br-miss", "/ki",
+            "L1D-miss", "/ki", "LLC-miss", "/ki", "faults");
+    PhaseTotals sum;
+    memset(&sum, 0, sizeof(sum));
+    for(int phase = 0; phase < PHASE_COUNT; phase++){
+        const PhaseTotals* total = &totals[phase];
+        if(total->runs == 0) continue;
+        printRow(out, phaseNames[phase], total);
+        // The standalone lexing run is extra work done only to be
+        // measured; lex+parse already includes the real lexing.
+        if(phase == PHASE_LEX) continue;
+        sum.nanoseconds += total->nanoseconds;
+        for(int i = 0; i < COUNTER_COUNT; i++) sum.counts[i] += total->counts[i];
+    }
+    printRow(out, "total", &sum);
+}
+
+void stopPerfCounters(void){
+    for(int i = 0; i < COUNTER_COUNT; i++){
+        if(fds[i] >= 0) close(fds[i]);
+        fds[i] = -1;
+    }
+    enabled = 0;
+}
@@ -0,0 +1,134 @@
+#include "profile.h"
+#include "diagnostic.h"
+#include "output.h"
+#include "runtime.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Numbers the probes in a fixed pre-order walk of the tree as parsed, so
+// the instrumented build and the build that reads its profile agree. The
+// checksum covers the kinds in that order to catch stale profiles.
+uint32_t assignProbes(AST* ast, NodeId program, uint32_t* checksum){
+    NodeList work = {NULL, 0, 0};
+    pushNode(ast, &work, program);
+
+    uint32_t probes = 0;
+    uint32_t hash = 2166136261u;
+    while(work.count > 0){
+        NodeId node = work.items[--work.count];
+        uint8_t kind = ast->kind[node];
+        hash = (hash ^ kind) * 16777619u;
+
+        if(kind == NODE_IF || kind == NODE_WHILE){
+            ast->value[node] = (int32_t)++probes;
+        }else if(kind == NODE_FUNCTION){
+            ast->value[ast->right[node]] = (int32_t)++probes;
+        }
+        pushChildren(ast, node, &work);
+    }
+
+    freeNodeList(&work);
+    *checksum = hash ^ probes;
+    return probes;
+}
+
+// A missing file is an error; a profile recorded from a different program
+// is only reported and ignored, since the build still works without it.
+int loadProfile(Profile* profile, const char* path, uint32_t probeCount, uint32_t checksum, Diagnostics* diagnostics){
+    profile->counts = NULL;
+    profile->probeCount = 0;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        reportError(diagnostics, "not possible to open profile '%s'.", path);
+        fail(diagnostics, 74);
+    }
+
+    ProfileHeader header;
+    size_t size = 2 * (size_t)probeCount * sizeof(uint64_t);
+    uint64_t* counts = (uint64_t*)malloc(size > 0 ? size : 1);
+    if(counts == NULL){
+        reportError(diagnostics, "Failed to allocate profile.");
+        fail(diagnostics, 74);
+    }
+
+    if(read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+       memcmp(header.magic, PROFILE_MAGIC, 8) != 0 || header.version != PROFILE_VERSION ||
+       header.probeCount != probeCount || header.checksum != checksum ||
+       read(fd, counts, size) != (ssize_t)size){
+        fprintf(stderr, "Warning: profile '%s' does not match this program; ignoring it.\n", path);
+        free(counts);
+        close(fd);
+        return 0;
+    }
+
+    close(fd);
+    profile->counts = counts;
+    profile->probeCount = probeCount;
+    return 1;
+}
+
+void freeProfile(Profile* profile){
+    free(profile->counts);
+    profile->counts = NULL;
+    profile->probeCount = 0;
+}
+
+// The counters sit right behind a ProfileHeader in .data, so the dump at
+// exit is a single write of both. It runs from .fini_array, after main
+// returns, or from _start in a freestanding program, which has no libc to
+// run .fini_array.
+void emitProfileSupport(Output* out, const char* path, uint32_t probeCount, uint32_t checksum, int freestanding){
+    emit(out, "\n.data\n");
+    emit(out, ".p2align 3\n");
+    emit(out, "qz_profile_header:\n");
+    emit(out, "  .ascii \"QZPROF\\0\\0\"\n");
+    emit(out, "  .long %d, %u, %u, 0\n", PROFILE_VERSION, probeCount, checksum);
+    emit(out, "qz_profile_counters:\n");
+    emit(out, "  .zero %zu\n", 2 * (size_t)probeCount * sizeof(uint64_t));
+    emit(out, "qz_profile_path:\n");
+    emit(out, "  .string \"");
+    for(const char* c = path; *c; c++){
+        if(*c == '"' || *c == '\\') emit(out, "\\%c", *c);
+        else emit(out, "%c", *c);
+    }
+    emit(out, "\"\n");
+
+    emit(out, ".text\n");
+    emit(out, ".type qz_profile_dump, @function\n");
+    emit(out, "qz_profile_dump:\n");
+    emit(out, ".cfi_startproc\n");
+    emit(out, "  push rbx\n");
+    emit(out, ".cfi_def_cfa_offset 16\n");
+    emit(out, ".cfi_offset rbx, -16\n");
+    emit(out, "  lea rdi, [rip + qz_profile_path]\n");
+    emit(out, "  mov esi, %d\n", O_WRONLY | O_CREAT | O_TRUNC);
+    emit(out, "  mov edx, 420\n");
+    emit(out, "  xor eax, eax\n");
+    emitSystemCall(out, freestanding, "open", SYS_open);
+    emit(out, "  test eax, eax\n");
+    emit(out, "  js .Lqz_profile_done\n");
+    emit(out, "  mov ebx, eax\n");
+    emit(out, "  mov edi, eax\n");
+    emit(out, "  lea rsi, [rip + qz_profile_header]\n");
+    emit(out, "  mov rdx, %zu\n", sizeof(ProfileHeader) + 2 * (size_t)probeCount * sizeof(uint64_t));
+    emitSystemCall(out, freestanding, "write", SYS_write);
+    emit(out, "  mov edi, ebx\n");
+    emitSystemCall(out, freestanding, "close", SYS_close);
+    emit(out, ".Lqz_profile_done:\n");
+    emit(out, "  pop rbx\n");
+    emit(out, ".cfi_def_cfa_offset 8\n");
+    emit(out, "  ret\n");
+    emit(out, ".cfi_endproc\n");
+    emit(out, ".size qz_profile_dump, .-qz_profile_dump\n");
+    if(freestanding) return;
+    emit(out, ".section .fini_array, \"aw\"\n");
+    emit(out, ".p2align 3\n");
+    emit(out, "  .quad qz_profile_dump\n");
+    emit(out, ".text\n");
+}
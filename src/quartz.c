@@ -0,0 +1,247 @@
+#include "quartz.h"
+#include "diagnostic.h"
+#include "source.h"
+#include "lexer.h"
+#include "parser.h"
+#include "optimize.h"
+#include "evaluate.h"
+#include "codegen.h"
+#include "astfile.h"
+#include "bytecode.h"
+#include "incremental.h"
+#include "output.h"
+#include "perf.h"
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct QuartzContext {
+    Diagnostics diagnostics;
+    char* output;
+    size_t outputLength;
+    // The compilation in flight. It lives here rather than on the stack
+    // so that a failure can still release it after the longjmp; each part
+    // is left zeroed between compilations.
+    Output out;
+    Source source;
+    AST ast;
+    SymbolTable table;
+    Parser parser;
+    Profile profile;
+    IncrementalCache incremental;
+};
+
+QuartzContext* quartzCreateContext(void){
+    return calloc(1, sizeof(QuartzContext));
+}
+
+void quartzDestroyContext(QuartzContext* context){
+    if(context == NULL) return;
+    free(context->output);
+    free(context);
+}
+
+static void releaseCompilation(QuartzContext* context){
+    discardOutput(&context->out);
+    freeParser(&context->parser);
+    freeProfile(&context->profile);
+    freeAST(&context->ast);
+    closeIncremental(&context->incremental);
+    closeSource(&context->source);
+}
+
+static int validOptions(const QuartzOptions* options, const TuneModel* tune){
+    if(options->optimizationLevel < 0 || options->optimizationLevel > 2 || tune == NULL ||
+       options->emit > QUARTZ_EMIT_RUN){
+        return 0;
+    }
+    if(options->profileGenerate != NULL && options->profileUse != NULL) return 0;
+    // The cache holds generated code, so only builds that generate code
+    // can keep it.
+    if(options->incremental != NULL && options->emit != QUARTZ_EMIT_ASSEMBLY) return 0;
+    return options->emit != QUARTZ_EMIT_RUN || (options->profileGenerate == NULL && !options->freestanding);
+}
+
+static void emitTokens(Output* out, Lexer* lexer){
+    for(;;){
+        Token token = scanToken(lexer);
+        emit(out, "%ld %s '%.*s'\n", token.line, tokenTypeName(token.type), (int)token.length, token.start);
+        if(token.type == TOKEN_EOF) break;
+    }
+}
+
+// Everything from the opened source to the output, for both entry points.
+static void compileSource(QuartzContext* context, const QuartzOptions* options, const TuneModel* tune){
+    Diagnostics* diagnostics = &context->diagnostics;
+    Source* source = &context->source;
+    Lexer* lexer = &context->parser.lexer;
+    int level = options->optimizationLevel;
+    NodeId program;
+
+    memset(&context->parser, 0, sizeof(context->parser));
+    initSymbolTable(&context->table, diagnostics);
+    if(options->incremental != NULL) openIncremental(&context->incremental, options->incremental, diagnostics);
+
+    if(source->mapped && isASTFile(source->data, source->size)){
+        // A previously emitted AST: map it back in instead of parsing.
+        if(options->emit == QUARTZ_EMIT_TOKENS){
+            reportError(diagnostics, "--emit=tokens needs Quartz source, not an AST file.");
+            fail(diagnostics, QUARTZ_ERROR_USAGE);
+        }
+        loadASTFile(&context->ast, (char*)source->data, source->size, &program, &context->table.frameSize,
+                    diagnostics);
+    }else{
+        initLexer(lexer, source);
+        if(options->emit == QUARTZ_EMIT_TOKENS){
+            emitTokens(&context->out, lexer);
+            return;
+        }
+
+        // The parser pulls tokens on demand, so lexing on its own is
+        // measured by an extra scan over the text; lex+parse then includes
+        // the real lexing.
+        if(perfCountersEnabled()){
+            beginPhase(PHASE_LEX);
+            while(scanToken(lexer).type != TOKEN_EOF) {}
+            endPhase(PHASE_LEX);
+            initLexer(lexer, source);
+        }
+
+        // Only a source held whole in memory can be cut into statements;
+        // a piped one is parsed in full, but still fills the cache.
+        beginPhase(PHASE_PARSE);
+        if(options->incremental != NULL && source->mapped){
+            program = parseIncremental(&context->incremental, &context->parser, &context->ast, &context->table, source);
+        }else{
+            initAST(&context->ast, diagnostics);
+            advanceToken(lexer);
+            program = parseProgram(&context->parser, &context->ast, &context->table);
+        }
+        endPhase(PHASE_PARSE);
+    }
+
+    if(options->dumpAST){
+        Output dump;
+        initOutput(&dump, STDERR_FILENO, diagnostics);
+        emit(&dump, "--- ABSTRACT TREE ---\n");
+        printProgram(&dump, &context->ast, program);
+        freeOutput(&dump);
+    }
+
+    if(options->emit == QUARTZ_EMIT_AST){
+        writeASTFile(&context->out, &context->ast, program, context->table.frameSize);
+        return;
+    }
+
+    // Probes are numbered before any pass reshapes the tree, so both
+    // profile builds see the same numbering.
+    const Profile* profile = NULL;
+    uint32_t probeChecksum = 0;
+    uint32_t probes = 0;
+    if(options->profileGenerate != NULL || options->profileUse != NULL){
+        probes = assignProbes(&context->ast, program, &probeChecksum);
+    }
+    if(options->profileUse != NULL &&
+       loadProfile(&context->profile, options->profileUse, probes, probeChecksum, diagnostics)){
+        profile = &context->profile;
+    }
+
+    uint64_t fuel = DEFAULT_EVALUATION_FUEL;
+    if(options->evaluationFuel != 0) fuel = options->evaluationFuel > 0 ? (uint64_t)options->evaluationFuel : 0;
+    // An instrumented build has to run the program to count anything.
+    if(options->profileGenerate != NULL) fuel = 0;
+    optimizeProgram(&context->ast, program, &context->table, level, profile, options->reportUnroll, fuel,
+                    options->incremental != NULL);
+
+    if(options->emit == QUARTZ_EMIT_IR){
+        printProgram(&context->out, &context->ast, program);
+        return;
+    }
+
+    // No assembler or linker: the tree runs straight away on the VM.
+    if(options->emit == QUARTZ_EMIT_RUN){
+        Bytecode bytecode;
+        beginPhase(PHASE_CODEGEN);
+        compileBytecode(&context->ast, program, &context->table, &bytecode);
+        endPhase(PHASE_CODEGEN);
+        beginPhase(PHASE_INTERPRET);
+        runBytecode(&bytecode, &context->out);
+        endPhase(PHASE_INTERPRET);
+        freeBytecode(&bytecode);
+        return;
+    }
+
+    if(options->dumpAST) fprintf(stderr, "--- ASSEMBLY ---\n");
+    CodegenOptions codegenOptions = {0};
+    codegenOptions.vectorize = level >= 2;
+    codegenOptions.placeBlocks = level >= 1;
+    codegenOptions.alignCode = level >= 1;
+    codegenOptions.profileGenerate = options->profileGenerate != NULL;
+    codegenOptions.profilePath = options->profileGenerate;
+    codegenOptions.probeCount = probes;
+    codegenOptions.probeChecksum = probeChecksum;
+    codegenOptions.profile = profile;
+    codegenOptions.tune = level >= 1 ? tune : NULL;
+    codegenOptions.sourceName = options->sourceName;
+    codegenOptions.jobs = options->jobs;
+    codegenOptions.freestanding = options->freestanding;
+    if(options->incremental != NULL) codegenOptions.incremental = &context->incremental;
+    beginPhase(PHASE_CODEGEN);
+    generateProgram(&context->out, &context->ast, program, &context->table, &codegenOptions);
+    endPhase(PHASE_CODEGEN);
+    if(options->incremental != NULL) saveIncremental(&context->incremental, options->incremental);
+}
+
+// Reads path, or with none the length bytes at text; writes to fd, or
+// with none (-1) keeps the output for quartzOutput.
+static QuartzStatus compile(QuartzContext* context, const char* path, const char* text, size_t length, int fd,
+                            const QuartzOptions* options){
+    Diagnostics* diagnostics = &context->diagnostics;
+    free(context->output);
+    context->output = NULL;
+    context->outputLength = 0;
+    diagnostics->print = options->printErrors;
+    diagnostics->message[0] = '\0';
+
+    const TuneModel* tune = findTuneModel(options->tune != NULL ? options->tune : "generic");
+    if(!validOptions(options, tune)){
+        reportError(diagnostics, "Invalid compilation options.");
+        return QUARTZ_ERROR_USAGE;
+    }
+
+    initOutput(&context->out, fd, diagnostics);
+    int status = setjmp(diagnostics->failure);
+    if(status != 0){
+        releaseCompilation(context);
+        return (QuartzStatus)status;
+    }
+
+    if(path != NULL) openSource(&context->source, path, diagnostics);
+    else openSourceBuffer(&context->source, text, length, diagnostics);
+    compileSource(context, options, tune);
+    if(fd < 0) context->output = takeOutputBuffer(&context->out, &context->outputLength);
+    else flushOutput(&context->out);
+    releaseCompilation(context);
+    return QUARTZ_OK;
+}
+
+QuartzStatus quartzCompile(QuartzContext* context, const char* source, size_t length,
+                           const QuartzOptions* options){
+    return compile(context, NULL, source, length, -1, options);
+}
+
+QuartzStatus quartzCompileFile(QuartzContext* context, const char* path, int fd, const QuartzOptions* options){
+    return compile(context, path, NULL, 0, fd, options);
+}
+
+const char* quartzOutput(const QuartzContext* context, size_t* length){
+    if(length != NULL) *length = context->outputLength;
+    return context->output != NULL ? context->output : "";
+}
+
+const char* quartzError(const QuartzContext* context){
+    return context->diagnostics.message;
+}
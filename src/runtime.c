@@ -0,0 +1,185 @@
+#include "runtime.h"
+#include "output.h"
+
+#include <errno.h>
+#include <sys/syscall.h>
+
+// Output is kept in qz_output_buffer, qz_output_length bytes of it used,
+// until it fills or the program ends. Like stdout going to a file under
+// libc, a program that dies of a fault loses what it had not flushed.
+
+static void emitWriteAll(Output* out){
+    // rsi = text, rdx = length; a failed write drops the rest.
+    emit(out, ".type qz_write_all, @function\n");
+    emit(out, "qz_write_all:\n");
+    emit(out, ".cfi_startproc\n");
+    emit(out, ".Lqz_write_next:\n");
+    emit(out, "  test rdx, rdx\n");
+    emit(out, "  jz .Lqz_write_done\n");
+    emit(out, "  mov edi, 1\n");
+    emit(out, "  mov eax, %d\n", SYS_write);
+    emit(out, "  syscall\n");
+    emit(out, "  test rax, rax\n");
+    emit(out, "  js .Lqz_write_failed\n");
+    emit(out, "  add rsi, rax\n");
+    emit(out, "  sub rdx, rax\n");
+    emit(out, "  jmp .Lqz_write_next\n");
+    emit(out, ".Lqz_write_failed:\n");
+    emit(out, "  cmp rax, %d\n", -EINTR);
+    emit(out, "  je .Lqz_write_next\n");
+    emit(out, ".Lqz_write_done:\n");
+    emit(out, "  ret\n");
+    emit(out, ".cfi_endproc\n");
+    emit(out, ".size qz_write_all, .-qz_write_all\n");
+
+    emit(out, ".type qz_flush, @function\n");
+    emit(out, "qz_flush:\n");
+    emit(out, ".cfi_startproc\n");
+    emit(out, "  mov rdx, qword ptr [rip + qz_output_length]\n");
+    emit(out, "  lea rsi, [rip + qz_output_buffer]\n");
+    emit(out, "  mov qword ptr [rip + qz_output_length], 0\n");
+    emit(out, "  jmp qz_write_all\n");
+    emit(out, ".cfi_endproc\n");
+    emit(out, ".size qz_flush, .-qz_flush\n");
+}
+
+// Digits are produced last first into the red zone, dividing by 10 with
+// a multiply by 0xCCCCCCCCCCCCCCCD and a shift, then copied as three
+// quadwords; the buffer is kept 24 bytes short of full so that copy
+// always fits. The magnitude is taken as unsigned, so INT64_MIN prints
+// too.
+static void emitPrint(Output* out){
+    emit(out, ".type qz_print, @function\n");
+    emit(out, "qz_print:\n");
+    emit(out, ".cfi_startproc\n");
+    emit(out, "  mov rax, qword ptr [rip + qz_output_length]\n");
+    emit(out, "  cmp rax, %d\n", RUNTIME_OUTPUT_SIZE - 24);
+    emit(out, "  jbe .Lqz_print_room\n");
+    emit(out, "  push rdi\n");
+    emit(out, ".cfi_def_cfa_offset 16\n");
+    emit(out, "  call qz_flush\n");
+    emit(out, "  pop rdi\n");
+    emit(out, ".cfi_def_cfa_offset 8\n");
+    emit(out, "  xor eax, eax\n");
+    emit(out, ".Lqz_print_room:\n");
+    emit(out, "  lea r8, [rip + qz_output_buffer]\n");
+    emit(out, "  add r8, rax\n");
+    emit(out, "  mov rax, rdi\n");
+    emit(out, "  mov r9, rax\n");
+    emit(out, "  test rax, rax\n");
+    emit(out, "  jns .Lqz_print_positive\n");
+    emit(out, "  neg rax\n");
+    emit(out, ".Lqz_print_positive:\n");
+    emit(out, "  lea rsi, [rsp - 1]\n");
+    emit(out, "  mov byte ptr [rsi], 10\n");
+    emit(out, "  movabs r11, 0xCCCCCCCCCCCCCCCD\n");
+    emit(out, ".Lqz_print_digit:\n");
+    emit(out, "  mov rcx, rax\n");
+    emit(out, "  mul r11\n");
+    emit(out, "  shr rdx, 3\n");
+    emit(out, "  lea r10, [rdx + rdx*4]\n");
+    emit(out, "  add r10, r10\n");
+    emit(out, "  sub rcx, r10\n");
+    emit(out, "  add ecx, 48\n");
+    emit(out, "  dec rsi\n");
+    emit(out, "  mov byte ptr [rsi], cl\n");
+    emit(out, "  mov rax, rdx\n");
+    emit(out, "  test rax, rax\n");
+    emit(out, "  jnz .Lqz_print_digit\n");
+    emit(out, "  test r9, r9\n");
+    emit(out, "  jns .Lqz_print_copy\n");
+    emit(out, "  dec rsi\n");
+    emit(out, "  mov byte ptr [rsi], 45\n");
+    emit(out, ".Lqz_print_copy:\n");
+    emit(out, "  mov rax, qword ptr [rsi]\n");
+    emit(out, "  mov rdx, qword ptr [rsi + 8]\n");
+    emit(out, "  mov rcx, qword ptr [rsi + 16]\n");
+    emit(out, "  mov qword ptr [r8], rax\n");
+    emit(out, "  mov qword ptr [r8 + 8], rdx\n");
+    emit(out, "  mov qword ptr [r8 + 16], rcx\n");
+    emit(out, "  mov rax, rsp\n");
+    emit(out, "  sub rax, rsi\n");
+    emit(out, "  add qword ptr [rip + qz_output_length], rax\n");
+    emit(out, "  ret\n");
+    emit(out, ".cfi_endproc\n");
+    emit(out, ".size qz_print, .-qz_print\n");
+}
+
+// Text that does not fit after a flush is written straight from where it is.
+static void emitWriteText(Output* out){
+    emit(out, ".type qz_write_text, @function\n");
+    emit(out, "qz_write_text:\n");
+    emit(out, ".cfi_startproc\n");
+    emit(out, "  mov rax, qword ptr [rip + qz_output_length]\n");
+    emit(out, "  lea rdx, [rax + rsi]\n");
+    emit(out, "  cmp rdx, %d\n", RUNTIME_OUTPUT_SIZE);
+    emit(out, "  jbe .Lqz_text_copy\n");
+    emit(out, "  push rdi\n");
+    emit(out, ".cfi_def_cfa_offset 16\n");
+    emit(out, "  push rsi\n");
+    emit(out, ".cfi_def_cfa_offset 24\n");
+    emit(out, "  call qz_flush\n");
+    emit(out, "  pop rsi\n");
+    emit(out, ".cfi_def_cfa_offset 16\n");
+    emit(out, "  pop rdi\n");
+    emit(out, ".cfi_def_cfa_offset 8\n");
+    emit(out, "  xor eax, eax\n");
+    emit(out, "  cmp rsi, %d\n", RUNTIME_OUTPUT_SIZE);
+    emit(out, "  jb .Lqz_text_copy\n");
+    emit(out, "  mov rdx, rsi\n");
+    emit(out, "  mov rsi, rdi\n");
+    emit(out, "  jmp qz_write_all\n");
+    emit(out, ".Lqz_text_copy:\n");
+    emit(out, "  lea rdx, [rip + qz_output_buffer]\n");
+    emit(out, "  add rdx, rax\n");
+    emit(out, "  add qword ptr [rip + qz_output_length], rsi\n");
+    emit(out, "  mov rcx, rsi\n");
+    emit(out, "  mov rsi, rdi\n");
+    emit(out, "  mov rdi, rdx\n");
+    emit(out, "  rep movsb\n");
+    emit(out, "  ret\n");
+    emit(out, ".cfi_endproc\n");
+    emit(out, ".size qz_write_text, .-qz_write_text\n");
+}
+
+void emitSystemCall(Output* out, int freestanding, const char* function, int number){
+    if(freestanding){
+        emit(out, "  mov eax, %d\n", number);
+        emit(out, "  syscall\n");
+    }else{
+        emit(out, "  call %s@PLT\n", function);
+    }
+}
+
+void emitFreestandingRuntime(Output* out, int profileGenerate){
+    emit(out, "\n.data\n");
+    emit(out, ".p2align 3\n");
+    emit(out, "qz_output_length:\n");
+    emit(out, "  .quad 0\n");
+    emit(out, ".bss\n");
+    emit(out, ".p2align 6\n");
+    emit(out, "qz_output_buffer:\n");
+    emit(out, "  .zero %d\n", RUNTIME_OUTPUT_SIZE);
+
+    emit(out, ".text\n");
+    emit(out, ".global _start\n");
+    emit(out, ".type _start, @function\n");
+    emit(out, "_start:\n");
+    emit(out, ".cfi_startproc\n");
+    emit(out, ".cfi_undefined rip\n");
+    emit(out, "  xor ebp, ebp\n");
+    emit(out, "  call main\n");
+    emit(out, "  mov ebx, eax\n");
+    if(profileGenerate) emit(out, "  call qz_profile_dump\n");
+    emit(out, "  call qz_flush\n");
+    emit(out, "  mov edi, ebx\n");
+    emit(out, "  mov eax, %d\n", SYS_exit_group);
+    emit(out, "  syscall\n");
+    emit(out, "  hlt\n");
+    emit(out, ".cfi_endproc\n");
+    emit(out, ".size _start, .-_start\n");
+
+    emitWriteAll(out);
+    emitPrint(out);
+    emitWriteText(out);
+}
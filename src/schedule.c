@@ -0,0 +1,467 @@
+#include "schedule.h"
+#include "diagnostic.h"
+#include "output.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A list scheduler over the straight-line runs codegen emits between
+// labels, jumps and calls. Each run becomes a dependence graph over
+// registers, flags and frame slots; instructions then issue cycle by
+// cycle, longest remaining path first, as long as the model has a free
+// port for them. Anything it does not understand ends the run and keeps
+// its place.
+
+#define FLAGS_BIT (1u << 16)
+
+// Intel cores: bit i is port i (0, 1, 5 and 6 are the integer ALUs, 2 and
+// 3 load, 4 stores data). Zen 3: ALU0-3 are bits 0-3, the three load AGUs
+// bits 4-6 and the two store pipes bits 7-8.
+static const TuneModel tuneModels[] = {
+    {"generic", 4, {1, 1, 1, 3, 3, 40, 5, 1}, {0x63, 0x41, 0x22, 0x02, 0x02, 0x01, 0x0c, 0x10}},
+    {"haswell", 4, {1, 1, 1, 3, 3, 39, 5, 1}, {0x63, 0x41, 0x22, 0x02, 0x02, 0x01, 0x0c, 0x10}},
+    {"skylake", 4, {1, 1, 1, 3, 3, 42, 5, 1}, {0x63, 0x41, 0x22, 0x02, 0x02, 0x01, 0x0c, 0x10}},
+    {"znver3", 6, {1, 1, 1, 2, 3, 18, 4, 1}, {0x0f, 0x06, 0x0f, 0x0f, 0x02, 0x04, 0x70, 0x180}},
+};
+
+const TuneModel* findTuneModel(const char* name){
+    for(size_t i = 0; i < sizeof(tuneModels) / sizeof(tuneModels[0]); i++){
+        if(strcmp(tuneModels[i].name, name) == 0) return &tuneModels[i];
+    }
+    return NULL;
+}
+
+typedef enum {
+    OPERAND_REGISTER,
+    OPERAND_MEMORY,
+    OPERAND_IMMEDIATE
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    int reg;
+    int partial;
+    uint32_t addressRegisters;
+    int components;
+    int indexed;
+    MemoryRegion region;
+    char address[SCHEDULE_ADDRESS_LENGTH];
+} Operand;
+
+static const char* registerNames[16][4] = {
+    {"rax", "eax", "ax", "al"},   {"rbx", "ebx", "bx", "bl"},
+    {"rcx", "ecx", "cx", "cl"},   {"rdx", "edx", "dx", "dl"},
+    {"rsi", "esi", "si", "sil"},  {"rdi", "edi", "di", "dil"},
+    {"rbp", "ebp", "bp", "bpl"},  {"rsp", "esp", "sp", "spl"},
+    {"r8", "r8d", "r8w", "r8b"},  {"r9", "r9d", "r9w", "r9b"},
+    {"r10", "r10d", "r10w", "r10b"}, {"r11", "r11d", "r11w", "r11b"},
+    {"r12", "r12d", "r12w", "r12b"}, {"r13", "r13d", "r13w", "r13b"},
+    {"r14", "r14d", "r14w", "r14b"}, {"r15", "r15d", "r15w", "r15b"},
+};
+
+#define RAX 0
+#define RDX 3
+#define RBP 6
+#define RSP 7
+
+// Register number of name, or -1. Writing a 16- or 8-bit part keeps the
+// rest of the register, so it counts as a read as well.
+static int registerIndex(const char* name, size_t length, int* partial){
+    for(int i = 0; i < 16; i++){
+        for(int width = 0; width < 4; width++){
+            if(strlen(registerNames[i][width]) == length && memcmp(registerNames[i][width], name, length) == 0){
+                *partial = width >= 2;
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+static int isWordChar(char c){
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.';
+}
+
+static int parseOperand(const char* text, size_t length, Operand* operand){
+    memset(operand, 0, sizeof(*operand));
+    const char* open = memchr(text, '[', length);
+    if(open == NULL){
+        operand->reg = registerIndex(text, length, &operand->partial);
+        operand->kind = operand->reg >= 0 ? OPERAND_REGISTER : OPERAND_IMMEDIATE;
+        return 1;
+    }
+
+    const char* close = memchr(open, ']', length - (size_t)(open - text));
+    if(close == NULL || (size_t)(close - open) >= SCHEDULE_ADDRESS_LENGTH - 1) return 0;
+    operand->kind = OPERAND_MEMORY;
+    memcpy(operand->address, open, (size_t)(close - open + 1));
+
+    for(const char* p = open + 1; p < close;){
+        if(!isWordChar(*p)){
+            p++;
+            continue;
+        }
+        const char* word = p;
+        while(p < close && isWordChar(*p)) p++;
+        int partial;
+        int reg = registerIndex(word, (size_t)(p - word), &partial);
+        operand->components++;
+        if((size_t)(p - word) == 3 && memcmp(word, "rip", 3) == 0){
+            operand->region = MEMORY_GLOBAL;
+        }else if(reg >= 0){
+            operand->addressRegisters |= 1u << reg;
+            if(p < close && *p == '*'){
+                operand->indexed = 1;
+                p++;
+                while(p < close && isWordChar(*p)) p++;
+            }else if(reg == RBP && operand->region == MEMORY_NONE){
+                operand->region = MEMORY_FRAME;
+            }else if(reg == RSP && operand->region == MEMORY_NONE){
+                operand->region = MEMORY_STACK;
+            }
+        }
+    }
+    // Only frame slots and rip-relative data can be told apart by address.
+    if(operand->region == MEMORY_NONE) operand->indexed = 1;
+    return 1;
+}
+
+static void readOperand(ScheduledInstruction* in, const Operand* operand){
+    if(operand->kind == OPERAND_REGISTER){
+        in->uses |= 1u << operand->reg;
+    }else if(operand->kind == OPERAND_MEMORY){
+        in->uses |= operand->addressRegisters;
+        in->reads = 1;
+        in->loads = 1;
+    }
+}
+
+static void writeOperand(ScheduledInstruction* in, const Operand* operand){
+    if(operand->kind == OPERAND_REGISTER){
+        in->defs |= 1u << operand->reg;
+        if(operand->partial) in->uses |= 1u << operand->reg;
+    }else if(operand->kind == OPERAND_MEMORY){
+        in->uses |= operand->addressRegisters;
+        in->writes = 1;
+    }
+}
+
+// Fills in what the instruction reads and writes. Returns 0 for anything
+// the scheduler must not move.
+static int describe(ScheduledInstruction* in){
+    const char* text = in->text + 2;
+    const char* end = text;
+    while(*end >= 'a' && *end <= 'z') end++;
+    size_t mnemonicLength = (size_t)(end - text);
+    char mnemonic[16];
+    if(mnemonicLength == 0 || mnemonicLength >= sizeof(mnemonic) || (*end != ' ' && *end != '\n')) return 0;
+    memcpy(mnemonic, text, mnemonicLength);
+    mnemonic[mnemonicLength] = '\0';
+
+    Operand operands[3];
+    int count = 0;
+    const char* p = end;
+    while(*p == ' ') p++;
+    while(*p != '\n' && *p != '\0'){
+        if(count == 3) return 0;
+        const char* start = p;
+        while(*p != ',' && *p != '\n' && *p != '\0') p++;
+        const char* stop = p;
+        while(stop > start && stop[-1] == ' ') stop--;
+        const char* ptr = strstr(start, "ptr ");
+        if(ptr != NULL && ptr < stop) start = ptr + 4;
+        if(!parseOperand(start, (size_t)(stop - start), &operands[count++])) return 0;
+        if(*p == ',') p++;
+        while(*p == ' ') p++;
+    }
+
+    for(int i = 0; i < count; i++){
+        if(operands[i].kind == OPERAND_MEMORY){
+            in->region = operands[i].region;
+            in->indexed = (uint8_t)operands[i].indexed;
+            memcpy(in->address, operands[i].address, SCHEDULE_ADDRESS_LENGTH);
+        }
+    }
+
+    in->unit = UNIT_ALU;
+    if(strcmp(mnemonic, "mov") == 0 || strcmp(mnemonic, "movabs") == 0 || strcmp(mnemonic, "movzx") == 0){
+        if(count != 2) return 0;
+        readOperand(in, &operands[1]);
+        writeOperand(in, &operands[0]);
+        if(operands[1].kind == OPERAND_MEMORY) in->unit = UNIT_LOAD;
+        if(operands[0].kind == OPERAND_MEMORY) in->unit = UNIT_STORE;
+        in->loads = 0;
+    }else if(strcmp(mnemonic, "lea") == 0){
+        if(count != 2 || operands[1].kind != OPERAND_MEMORY) return 0;
+        in->uses |= operands[1].addressRegisters;
+        writeOperand(in, &operands[0]);
+        in->unit = operands[1].components >= 3 && operands[1].indexed ? UNIT_SLOW_LEA : UNIT_LEA;
+        in->region = MEMORY_NONE;
+    }else if(strcmp(mnemonic, "xor") == 0 && count == 2 && operands[0].kind == OPERAND_REGISTER &&
+             operands[1].kind == OPERAND_REGISTER && operands[0].reg == operands[1].reg){
+        // Zeroing idiom: depends on nothing.
+        in->defs |= (1u << operands[0].reg) | FLAGS_BIT;
+    }else if(strcmp(mnemonic, "add") == 0 || strcmp(mnemonic, "sub") == 0 || strcmp(mnemonic, "and") == 0 ||
+             strcmp(mnemonic, "or") == 0 || strcmp(mnemonic, "xor") == 0 ||
+             (strcmp(mnemonic, "imul") == 0 && count == 2)){
+        if(count != 2) return 0;
+        readOperand(in, &operands[0]);
+        readOperand(in, &operands[1]);
+        writeOperand(in, &operands[0]);
+        in->defs |= FLAGS_BIT;
+        in->fusible = mnemonic[0] != 'x' && mnemonic[0] != 'o' && mnemonic[0] != 'i';
+        if(mnemonic[0] == 'i') in->unit = UNIT_MULTIPLY;
+        if(operands[0].kind == OPERAND_MEMORY) in->unit = UNIT_STORE;
+    }else if(strcmp(mnemonic, "imul") == 0){
+        if(count != 3) return 0;
+        readOperand(in, &operands[1]);
+        writeOperand(in, &operands[0]);
+        in->defs |= FLAGS_BIT;
+        in->unit = UNIT_MULTIPLY;
+    }else if(strcmp(mnemonic, "cmp") == 0 || strcmp(mnemonic, "test") == 0){
+        if(count != 2) return 0;
+        readOperand(in, &operands[0]);
+        readOperand(in, &operands[1]);
+        in->defs |= FLAGS_BIT;
+        in->fusible = 1;
+    }else if(strcmp(mnemonic, "neg") == 0 || strcmp(mnemonic, "shl") == 0 ||
+             strcmp(mnemonic, "sar") == 0 || strcmp(mnemonic, "shr") == 0){
+        if(count < 1 || operands[0].kind != OPERAND_REGISTER) return 0;
+        readOperand(in, &operands[0]);
+        if(count == 2) readOperand(in, &operands[1]);
+        writeOperand(in, &operands[0]);
+        in->defs |= FLAGS_BIT;
+        if(mnemonic[0] == 's') in->unit = UNIT_SHIFT;
+    }else if(strcmp(mnemonic, "cqo") == 0){
+        in->uses |= 1u << RAX;
+        in->defs |= 1u << RDX;
+    }else if(strcmp(mnemonic, "idiv") == 0){
+        if(count != 1) return 0;
+        readOperand(in, &operands[0]);
+        in->uses |= (1u << RAX) | (1u << RDX);
+        in->defs |= (1u << RAX) | (1u << RDX) | FLAGS_BIT;
+        in->unit = UNIT_DIVIDE;
+    }else if(strncmp(mnemonic, "set", 3) == 0){
+        if(count != 1) return 0;
+        in->uses |= FLAGS_BIT;
+        writeOperand(in, &operands[0]);
+        in->unit = UNIT_SHIFT;
+    }else if(strcmp(mnemonic, "push") == 0 || strcmp(mnemonic, "pop") == 0){
+        if(count != 1 || operands[0].kind != OPERAND_REGISTER) return 0;
+        int push = mnemonic[1] == 'u';
+        if(push) readOperand(in, &operands[0]);
+        else writeOperand(in, &operands[0]);
+        in->uses |= 1u << RSP;
+        in->defs |= 1u << RSP;
+        in->reads = !push;
+        in->writes = (uint8_t)push;
+        in->region = MEMORY_STACK;
+        in->indexed = 1;
+        in->unit = push ? UNIT_STORE : UNIT_LOAD;
+    }else{
+        return 0;
+    }
+    if(in->unit == UNIT_LOAD || in->unit == UNIT_STORE) in->loads = 0;
+    return 1;
+}
+
+static int latencyOf(const Scheduler* scheduler, const ScheduledInstruction* in){
+    int latency = scheduler->model->latency[in->unit];
+    if(in->loads) latency += scheduler->model->latency[UNIT_LOAD];
+    return latency;
+}
+
+static int mayAlias(const ScheduledInstruction* a, const ScheduledInstruction* b){
+    if(a->region != b->region) return 0;
+    if(a->indexed || b->indexed) return 1;
+    return strcmp(a->address, b->address) == 0;
+}
+
+// Cycles b has to wait after a issues, or -1 if they are independent.
+static int dependence(const Scheduler* scheduler, const ScheduledInstruction* a, const ScheduledInstruction* b){
+    int latency = -1;
+    if(a->defs & b->uses) latency = latencyOf(scheduler, a);
+    if(((a->uses & b->defs) || (a->defs & b->defs)) && latency < 0) latency = 0;
+    if((a->writes || b->writes) && (a->reads || a->writes) && (b->reads || b->writes) && mayAlias(a, b)){
+        int memory = a->writes && b->reads ? scheduler->model->latency[UNIT_LOAD] : 0;
+        if(memory > latency) latency = memory;
+    }
+    return latency;
+}
+
+static int isInstructionLine(const char* text){
+    return text[0] == ' ' && text[1] == ' ' && text[2] >= 'a' && text[2] <= 'z';
+}
+
+// Each section has its own run of line-table rows, so the first
+// instruction after a switch always gets a .loc.
+static int isSectionChange(const char* text){
+    return strncmp(text, ".pushsection", 12) == 0 || strncmp(text, ".popsection", 11) == 0 ||
+           strncmp(text, ".section", 8) == 0 || strncmp(text, ".text", 5) == 0 || strncmp(text, ".data", 5) == 0;
+}
+
+static void emitLine(Scheduler* scheduler, const char* text, size_t length, uint32_t line){
+    if(scheduler->lineInfo){
+        if(isSectionChange(text)){
+            scheduler->emittedLine = 0;
+        }else if(line != 0 && line != scheduler->emittedLine && isInstructionLine(text)){
+            emit(scheduler->out, ".loc 1 %u\n", line);
+            scheduler->emittedLine = line;
+        }
+    }
+    emit(scheduler->out, "%.*s", (int)length, text);
+}
+
+// Issues the held instructions. With keepLast the final one stays last,
+// right before the conditional jump it fuses with.
+static void flushBlock(Scheduler* scheduler, int keepLast){
+    ScheduledInstruction* window = scheduler->window;
+    int8_t (*latency)[SCHEDULE_WINDOW] = scheduler->latency;
+    int height[SCHEDULE_WINDOW];
+    int predecessors[SCHEDULE_WINDOW];
+    int earliest[SCHEDULE_WINDOW];
+    uint8_t issued[SCHEDULE_WINDOW];
+    int count = scheduler->windowCount - (keepLast ? 1 : 0);
+
+    for(int j = 0; j < count; j++){
+        predecessors[j] = 0;
+        earliest[j] = 0;
+        issued[j] = 0;
+        for(int i = 0; i < j; i++){
+            int wait = dependence(scheduler, &window[i], &window[j]);
+            latency[i][j] = (int8_t)(wait > 127 ? 127 : wait);
+            if(wait >= 0) predecessors[j]++;
+        }
+    }
+    for(int i = count; i-- > 0;){
+        height[i] = latencyOf(scheduler, &window[i]);
+        for(int j = i + 1; j < count; j++){
+            if(latency[i][j] >= 0 && latency[i][j] + height[j] > height[i]) height[i] = latency[i][j] + height[j];
+        }
+    }
+
+    int remaining = count;
+    for(int cycle = 0; remaining > 0; cycle++){
+        uint16_t busy = 0;
+        for(int slot = 0; slot < scheduler->model->issueWidth; slot++){
+            int best = -1;
+            uint16_t bestPorts = 0;
+            for(int i = 0; i < count; i++){
+                if(issued[i] || predecessors[i] > 0 || earliest[i] > cycle) continue;
+                if(best >= 0 && height[i] <= height[best]) continue;
+                uint16_t free = scheduler->model->ports[window[i].unit] & ~busy;
+                if(free == 0) continue;
+                uint16_t ports = free & (uint16_t)-free;
+                if(window[i].loads){
+                    uint16_t load = scheduler->model->ports[UNIT_LOAD] & ~busy & ~ports;
+                    if(load == 0) continue;
+                    ports |= load & (uint16_t)-load;
+                }
+                best = i;
+                bestPorts = ports;
+            }
+            if(best < 0) break;
+
+            busy |= bestPorts;
+            issued[best] = 1;
+            remaining--;
+            emitLine(scheduler, window[best].text, strlen(window[best].text), window[best].line);
+            for(int j = best + 1; j < count; j++){
+                if(latency[best][j] < 0) continue;
+                predecessors[j]--;
+                if(cycle + latency[best][j] > earliest[j]) earliest[j] = cycle + latency[best][j];
+            }
+        }
+    }
+
+    if(keepLast) emitLine(scheduler, window[count].text, strlen(window[count].text), window[count].line);
+    scheduler->windowCount = 0;
+}
+
+void startSchedule(Scheduler* scheduler, Output* out, const TuneModel* model, int lineInfo){
+    scheduler->out = out;
+    scheduler->model = model;
+    scheduler->windowCount = 0;
+    scheduler->lineInfo = lineInfo;
+    scheduler->sourceLine = 0;
+    scheduler->emittedLine = 0;
+}
+
+void setSourceLine(Scheduler* scheduler, uint32_t line){
+    if(line != 0) scheduler->sourceLine = line;
+}
+
+void emitSourceLine(Scheduler* scheduler){
+    if(scheduler->lineInfo && scheduler->sourceLine != 0 && scheduler->sourceLine != scheduler->emittedLine){
+        emit(scheduler->out, ".loc 1 %u\n", scheduler->sourceLine);
+        scheduler->emittedLine = scheduler->sourceLine;
+    }
+}
+
+void flushSchedule(Scheduler* scheduler){
+    if(scheduler->windowCount > 0) flushBlock(scheduler, 0);
+}
+
+static int isConditionalJump(const char* line){
+    return line[0] == ' ' && line[1] == ' ' && line[2] == 'j' && strncmp(line + 2, "jmp", 3) != 0;
+}
+
+static void scheduleLine(Scheduler* scheduler, const char* line, size_t length){
+    if(scheduler->model != NULL && length < SCHEDULE_LINE_LENGTH && isInstructionLine(line)){
+        ScheduledInstruction* in = &scheduler->window[scheduler->windowCount];
+        memset(in, 0, sizeof(*in));
+        memcpy(in->text, line, length);
+        in->line = scheduler->sourceLine;
+        if(describe(in)){
+            scheduler->windowCount++;
+            if(scheduler->windowCount == SCHEDULE_WINDOW) flushBlock(scheduler, 0);
+            return;
+        }
+        if(isConditionalJump(line) && scheduler->windowCount > 0 && scheduler->window[scheduler->windowCount - 1].fusible){
+            flushBlock(scheduler, 1);
+            emitLine(scheduler, line, length, scheduler->sourceLine);
+            return;
+        }
+    }
+    flushSchedule(scheduler);
+    emitLine(scheduler, line, length, scheduler->sourceLine);
+}
+
+void schedule(Scheduler* scheduler, const char* format, ...){
+    char buffer[SCHEDULE_LINE_LENGTH * 2];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if(length < 0){
+        reportError(scheduler->out->diagnostics, "failed to format output.");
+        fail(scheduler->out->diagnostics, 74);
+    }
+
+    char* text = buffer;
+    if((size_t)length >= sizeof(buffer)){
+        text = malloc((size_t)length + 1);
+        if(text == NULL){
+            reportError(scheduler->out->diagnostics, "Failed to allocate output buffer.");
+            fail(scheduler->out->diagnostics, 74);
+        }
+        va_start(args, format);
+        vsnprintf(text, (size_t)length + 1, format, args);
+        va_end(args);
+    }
+
+    if(scheduler->model == NULL && !scheduler->lineInfo){
+        emit(scheduler->out, "%s", text);
+    }else{
+        const char* line = text;
+        while(*line != '\0'){
+            const char* newline = strchr(line, '\n');
+            size_t lineLength = newline != NULL ? (size_t)(newline - line + 1) : strlen(line);
+            scheduleLine(scheduler, line, lineLength);
+            line += lineLength;
+        }
+    }
+    if(text != buffer) free(text);
+}
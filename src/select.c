@@ -0,0 +1,210 @@
+#include "select.h"
+#include "diagnostic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Bottom-up tree-pattern matching in the style of BURS: every node gets
+// the cheapest way to compute it into a register, given the cheapest way
+// to compute each of its children. Leaves can also be matched as an
+// immediate or memory operand for free, so a parent pattern that folds
+// them in never pays for loading them. Costs roughly count instructions,
+// weighted by how slow they are.
+
+#define NO_COST (UINT32_MAX / 4)
+
+static uint32_t sum(uint32_t a, uint32_t b){
+    return a + b > NO_COST ? NO_COST : a + b;
+}
+
+static uint32_t operationCost(TokenType op){
+    switch(op){
+        case TOKEN_PLUS:
+        case TOKEN_MINUS:
+            return 1;
+        case TOKEN_STAR:
+            return 3;
+        case TOKEN_SLASH:
+            return 24;
+        default:
+            return 3;
+    }
+}
+
+int isComparison(TokenType op){
+    return op == TOKEN_EQUAL_EQUAL || op == TOKEN_BANG_EQUAL ||
+           op == TOKEN_LESS || op == TOKEN_LESS_EQUAL ||
+           op == TOKEN_GREATER || op == TOKEN_GREATER_EQUAL;
+}
+
+int isImmediate(const AST* ast, NodeId node){
+    return ast->kind[node] == NODE_NUMBER && !ast->op[node];
+}
+
+static int isMemory(const AST* ast, NodeId node){
+    return ast->kind[node] == NODE_IDENTIFIER;
+}
+
+// The scale of a product lea can fold into an address, or 0.
+int scaleOf(const AST* ast, NodeId node){
+    if(ast->kind[node] != NODE_BINARY_OP || ast->op[node] != TOKEN_STAR) return 0;
+    NodeId factor = ast->right[node];
+    if(!isImmediate(ast, factor)) return 0;
+    int32_t scale = ast->value[factor];
+    return scale == 2 || scale == 4 || scale == 8 ? scale : 0;
+}
+
+int elementOffset(const AST* ast, NodeId array, int64_t index){
+    int64_t offset = ast->value[array] - 8 * index;
+    return offset > 0 && offset < INT32_MAX ? (int)offset : 0;
+}
+
+// The constant an index of the form i + c or i - c adds to i, or 0.
+int64_t indexShift(const AST* ast, NodeId index){
+    if(ast->kind[index] != NODE_BINARY_OP || !isImmediate(ast, ast->right[index])) return 0;
+    if(ast->op[index] == TOKEN_PLUS) return ast->value[ast->right[index]];
+    if(ast->op[index] == TOKEN_MINUS) return -(int64_t)ast->value[ast->right[index]];
+    return 0;
+}
+
+typedef struct {
+    const AST* ast;
+    Selection* selection;
+    uint32_t bestCost;
+    uint8_t bestTile;
+} Matcher;
+
+static void consider(Matcher* m, Tile tile, uint32_t cost){
+    if(cost < m->bestCost){
+        m->bestCost = cost;
+        m->bestTile = (uint8_t)tile;
+    }
+}
+
+static uint32_t regCost(const Matcher* m, NodeId node){
+    return m->selection->cost[node];
+}
+
+static void matchBinary(Matcher* m, NodeId node){
+    const AST* ast = m->ast;
+    TokenType op = (TokenType)ast->op[node];
+    NodeId left = ast->left[node];
+    NodeId right = ast->right[node];
+    uint32_t cost = operationCost(op);
+    // Operands arrive the other way round for the swapped patterns: a
+    // comparison just flips its condition, a subtraction needs a neg and
+    // a division cannot be swapped at all.
+    uint32_t swapped = op == TOKEN_MINUS ? 1 : 0;
+
+    if(isImmediate(ast, right)){
+        consider(m, TILE_REG_IMM, sum(regCost(m, left), cost + (op == TOKEN_SLASH)));
+        if(isMemory(ast, left) && (isComparison(op) || op == TOKEN_STAR)){
+            consider(m, TILE_MEM_IMM, cost);
+        }
+        int32_t factor = ast->value[right];
+        if(op == TOKEN_STAR && (factor == 2 || factor == 4 || factor == 8 ||
+                                factor == 3 || factor == 5 || factor == 9)){
+            consider(m, TILE_SCALE, sum(regCost(m, left), 1));
+        }
+    }
+    if(isMemory(ast, right)){
+        consider(m, TILE_REG_MEM, sum(regCost(m, left), cost + 1));
+    }
+    if(op != TOKEN_SLASH){
+        if(isImmediate(ast, left)) consider(m, TILE_IMM_REG, sum(regCost(m, right), cost + swapped));
+        if(isMemory(ast, left)) consider(m, TILE_MEM_REG, sum(regCost(m, right), cost + swapped + 1));
+    }
+    if(op == TOKEN_PLUS && scaleOf(ast, right)){
+        consider(m, TILE_LEA_INDEX, sum(sum(regCost(m, left), regCost(m, ast->left[right])), 3));
+    }
+    if(op == TOKEN_PLUS && scaleOf(ast, left)){
+        consider(m, TILE_LEA_INDEX_SWAPPED, sum(sum(regCost(m, right), regCost(m, ast->left[left])), 3));
+    }
+    consider(m, TILE_REG_REG, sum(sum(regCost(m, left), regCost(m, right)),
+                                  cost + 2 + (op == TOKEN_MINUS || op == TOKEN_SLASH)));
+}
+
+static void matchIndex(Matcher* m, NodeId node){
+    const AST* ast = m->ast;
+    NodeId index = ast->right[node];
+
+    if(isImmediate(ast, index) && elementOffset(ast, node, ast->value[index])){
+        consider(m, TILE_INDEX_CONST, 1);
+    }
+    int64_t shift = indexShift(ast, index);
+    if(shift != 0 && elementOffset(ast, node, shift)){
+        consider(m, TILE_INDEX_OFFSET, sum(regCost(m, ast->left[index]), 1));
+    }
+    consider(m, TILE_INDEX, sum(regCost(m, index), 1));
+}
+
+static void matchNode(Matcher* m, NodeId node, NodeList* scratch){
+    const AST* ast = m->ast;
+    m->bestCost = NO_COST;
+    m->bestTile = TILE_GENERIC;
+
+    switch(ast->kind[node]){
+        case NODE_NUMBER:
+            consider(m, TILE_IMMEDIATE, ast->op[node] ? 2 : 1);
+            break;
+        case NODE_IDENTIFIER:
+            consider(m, TILE_LOAD, 1);
+            break;
+        case NODE_BINARY_OP:
+            matchBinary(m, node);
+            break;
+        case NODE_INDEX:
+            matchIndex(m, node);
+            break;
+        default: {
+            uint32_t cost = 2;
+            scratch->count = 0;
+            pushChildren(ast, node, scratch);
+            for(uint32_t i = 0; i < scratch->count; i++) cost = sum(cost, regCost(m, scratch->items[i]));
+            consider(m, TILE_GENERIC, cost);
+            break;
+        }
+    }
+
+    m->selection->cost[node] = m->bestCost;
+    m->selection->tile[node] = m->bestTile;
+}
+
+// Labels every node under program, children before parents. The walk
+// keeps its own stack so deep expressions cannot overflow the C stack.
+void selectInstructions(const AST* ast, NodeId program, Selection* selection){
+    selection->count = ast->count;
+    selection->cost = calloc(ast->count, sizeof(uint32_t));
+    selection->tile = calloc(ast->count, sizeof(uint8_t));
+    if(selection->cost == NULL || selection->tile == NULL){
+        reportError(ast->diagnostics, "Failed to allocate instruction selection.");
+        fail(ast->diagnostics, 74);
+    }
+
+    Matcher matcher = {ast, selection, NO_COST, TILE_NONE};
+    NodeList work = {NULL, 0, 0};
+    NodeList scratch = {NULL, 0, 0};
+    pushNode(ast, &work, program);
+
+    while(work.count > 0){
+        NodeId node = work.items[work.count - 1];
+        if(selection->tile[node] == TILE_NONE){
+            selection->tile[node] = TILE_PENDING;
+            pushChildren(ast, node, &work);
+            continue;
+        }
+        work.count--;
+        if(selection->tile[node] == TILE_PENDING) matchNode(&matcher, node, &scratch);
+    }
+
+    freeNodeList(&work);
+    freeNodeList(&scratch);
+}
+
+void freeSelection(Selection* selection){
+    free(selection->cost);
+    free(selection->tile);
+    selection->cost = NULL;
+    selection->tile = NULL;
+    selection->count = 0;
+}
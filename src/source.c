@@ -0,0 +1,146 @@
+#include "source.h"
+#include "diagnostic.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void startStreaming(Source* source, int fd){
+    source->fd = fd;
+    source->windowCapacity = SOURCE_CHUNK_SIZE;
+    source->windowLength = 0;
+    source->window = (char*)malloc(source->windowCapacity);
+    if(source->window == NULL){
+        reportError(source->diagnostics, "Failed to allocate input window.");
+        fail(source->diagnostics, 74);
+    }
+    source->data = source->window;
+    source->size = 0;
+}
+
+static int isSpecialPath(const char* path){
+    return strncmp(path, "/dev/", 5) == 0 || strncmp(path, "/proc/", 6) == 0;
+}
+
+// Regular files are mapped whole; pipes, terminals and files whose size
+// stat cannot report (e.g. under /proc) are streamed instead. "-" reads
+// standard input.
+void openSource(Source* source, const char* path, Diagnostics* diagnostics){
+    memset(source, 0, sizeof(Source));
+    source->fd = -1;
+    source->diagnostics = diagnostics;
+
+    int fd = STDIN_FILENO;
+    if(strcmp(path, "-") != 0){
+        fd = open(path, O_RDONLY);
+        if(fd < 0) {
+            reportError(source->diagnostics, "not possible to open file '%s'.", path);
+            fail(source->diagnostics, 74);
+        }
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        reportError(source->diagnostics, "failed to read status of file");
+        close(fd);
+        fail(source->diagnostics, 74);
+    }
+
+    // Only a file named by the user has to say what it holds; /dev/stdin
+    // or /proc/self/fd/0 redirected from a .qz file is a regular file too.
+    if(S_ISREG(st.st_mode) && fd != STDIN_FILENO && !isSpecialPath(path)){
+        const char* ext = strrchr(path, '.');
+        if(ext == NULL || (strcmp(ext, ".qz") != 0 && strcmp(ext, ".qzast") != 0)){
+            reportError(source->diagnostics, "Source file must have .qz or .qzast extension");
+            close(fd);
+            fail(source->diagnostics, 64);
+        }
+    }
+
+    if(!S_ISREG(st.st_mode) || st.st_size == 0){
+        startStreaming(source, fd);
+        return;
+    }
+
+    // Private and writable: a mapped AST file is rewritten in place by the
+    // passes, which only ever dirties our own copy-on-write pages.
+    char* buffer = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if(buffer == MAP_FAILED) {
+        reportError(source->diagnostics, "failed on mmap.");
+        close(fd);
+        fail(source->diagnostics, 74);
+    }
+    madvise(buffer, st.st_size, MADV_SEQUENTIAL);
+
+    if(fd != STDIN_FILENO) close(fd);
+    source->mapped = 1;
+    source->data = buffer;
+    source->size = (size_t)st.st_size;
+}
+
+// Text that is already in memory, e.g. handed to libquartz. The caller
+// keeps it alive until the compilation ends.
+void openSourceBuffer(Source* source, const char* data, size_t size, Diagnostics* diagnostics){
+    memset(source, 0, sizeof(Source));
+    source->fd = -1;
+    source->diagnostics = diagnostics;
+    source->data = data;
+    source->size = size;
+}
+
+// Slides everything from keep onward to the front of the window (growing
+// it only when the kept bytes leave less than half a chunk free) and
+// appends the next chunk. keep always ends up at source->window; returns
+// the number of bytes read, 0 once the input is exhausted.
+size_t refillSource(Source* source, const char* keep){
+    if(source->fd < 0) return 0;
+
+    size_t kept = source->windowLength - (size_t)(keep - source->window);
+    memmove(source->window, keep, kept);
+
+    if(source->windowCapacity - kept < SOURCE_CHUNK_SIZE / 2){
+        source->windowCapacity *= 2;
+        source->window = (char*)realloc(source->window, source->windowCapacity);
+        if(source->window == NULL){
+            reportError(source->diagnostics, "Failed to grow input window.");
+            fail(source->diagnostics, 74);
+        }
+    }
+
+    ssize_t got;
+    do {
+        got = read(source->fd, source->window + kept, source->windowCapacity - kept);
+    } while(got < 0 && errno == EINTR);
+
+    if(got < 0){
+        reportError(source->diagnostics, "failed to read input.");
+        fail(source->diagnostics, 74);
+    }
+
+    source->windowLength = kept + (size_t)got;
+    source->data = source->window;
+    source->size = source->windowLength;
+
+    if(got == 0){
+        if(source->fd != STDIN_FILENO) close(source->fd);
+        source->fd = -1;
+    }
+    return (size_t)got;
+}
+
+void closeSource(Source* source){
+    if(source->mapped){
+        munmap((void*)source->data, source->size);
+    }
+    if(source->fd >= 0 && source->fd != STDIN_FILENO){
+        close(source->fd);
+    }
+    free(source->window);
+    memset(source, 0, sizeof(Source));
+    source->fd = -1;
+}
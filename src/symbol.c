@@ -1,34 +1,67 @@
 #include "symbol.h"
-#include <string.h>
+#include "diagnostic.h"
 
-void initSymbolTable(SymbolTable* table){
+#include <stddef.h>
+
+void initSymbolTable(SymbolTable* table, Diagnostics* diagnostics){
     table->count = 0;
     table->currentScopeDepth = 0;
     table->currentOffset = 0;
-    //table->capacity = 1000;
+    table->frameSize = 0;
+    table->frameBase = 0;
+    table->diagnostics = diagnostics;
 }
 
+static void reserveSymbol(SymbolTable* table){
+    if(table->count == SYMBOL_CAPACITY){
+        reportError(table->diagnostics, "Too many variables in scope: at most %d are supported.", SYMBOL_CAPACITY);
+        fail(table->diagnostics, 65);
+    }
+}
 
-void addSymbol(SymbolTable* table, const char* name, int length){
+void addSymbol(SymbolTable* table, int nameId){
+    reserveSymbol(table);
     table->currentOffset += 8;
+    if(table->currentOffset > table->frameSize) table->frameSize = table->currentOffset;
 
     Symbol* sym = &table->symbols[table->count];
-    sym->name = name;
-    sym->length = length;
+    sym->nameId = nameId;
+    sym->offset = table->currentOffset;
+    sym->depth = table->currentScopeDepth;
+    sym->length = 0;
+
+    table->count++;
+}
+
+// Element i lives at [rbp - offset + 8 * i], so the array grows upwards
+// from its offset like a C array would.
+void addArray(SymbolTable* table, int nameId, int length){
+    reserveSymbol(table);
+    table->currentOffset += 8 * length;
+    if(table->currentOffset > table->frameSize) table->frameSize = table->currentOffset;
+
+    Symbol* sym = &table->symbols[table->count];
+    sym->nameId = nameId;
     sym->offset = table->currentOffset;
     sym->depth = table->currentScopeDepth;
+    sym->length = length;
 
     table->count++;
 }
 
-int getSymbolOffset(SymbolTable* table, const char* name, int length){
-    for(int i = table->count - 1; i >= 0; i--){
+Symbol* findSymbol(SymbolTable* table, int nameId){
+    for(int i = table->count - 1; i >= table->frameBase; i--){
         Symbol* sym = &table->symbols[i];
-        if(sym->length == length && strncmp(sym->name, name, length) == 0){
-            return sym->offset;
+        if(sym->nameId == nameId){
+            return sym;
         }
     }
-    return -1;
+    return NULL;
+}
+
+int getSymbolOffset(SymbolTable* table, int nameId){
+    Symbol* sym = findSymbol(table, nameId);
+    return sym != NULL ? sym->offset : -1;
 }
 
 void beginScope(SymbolTable* table){
@@ -40,4 +73,8 @@ void endScope(SymbolTable* table) {
         table->count--;
     }
     table->currentScopeDepth--;
+
+    // Symbols are stacked in offset order, so everything above the last
+    // one still visible is free again.
+    table->currentOffset = table->count > table->frameBase ? table->symbols[table->count - 1].offset : 0;
 }
\ No newline at end of file
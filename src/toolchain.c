@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include "toolchain.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+OutputKind outputKindFor(const char* path){
+    if(path == NULL) return OUTPUT_ASSEMBLY;
+    const char* ext = strrchr(path, '.');
+    if(ext != NULL && strcmp(ext, ".s") == 0) return OUTPUT_ASSEMBLY;
+    if(ext != NULL && strcmp(ext, ".o") == 0) return OUTPUT_OBJECT;
+    return OUTPUT_EXECUTABLE;
+}
+
+static pid_t spawnTool(char* const argv[], int stdinFd){
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if(stdinFd >= 0){
+        posix_spawn_file_actions_adddup2(&actions, stdinFd, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, stdinFd);
+    }
+
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if(err != 0){
+        fprintf(stderr, "Error: failed to start '%s': %s\n", argv[0], strerror(err));
+        exit(70);
+    }
+    return pid;
+}
+
+static void waitTool(pid_t pid, const char* name){
+    int status;
+    while(waitpid(pid, &status, 0) < 0){
+        if(errno != EINTR){
+            fprintf(stderr, "Error: failed to wait for '%s'.\n", name);
+            exit(70);
+        }
+    }
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        fprintf(stderr, "Error: '%s' failed.\n", name);
+        exit(70);
+    }
+}
+
+// Starts the assembler reading from a pipe and returns its write end, so
+// code generation and assembly run side by side. With no objectPath the
+// object goes to an anonymous memfd that linkExecutable hands to the
+// linker as /dev/fd/N, and nothing touches the filesystem.
+int startAssembler(Assembler* assembler, const char* objectPath){
+    char memfdPath[64];
+    assembler->objectFd = -1;
+    assembler->objectPath = objectPath;
+
+    if(objectPath == NULL){
+        assembler->objectFd = memfd_create("quartz.o", 0);
+        if(assembler->objectFd < 0){
+            fprintf(stderr, "Error: failed to create in-memory object file.\n");
+            exit(70);
+        }
+        snprintf(memfdPath, sizeof(memfdPath), "/dev/fd/%d", assembler->objectFd);
+        objectPath = memfdPath;
+    }
+
+    int fds[2];
+    if(pipe2(fds, O_CLOEXEC) < 0){
+        fprintf(stderr, "Error: failed to create assembler pipe.\n");
+        exit(70);
+    }
+
+    // A dying assembler must surface as a write error, not kill us.
+    signal(SIGPIPE, SIG_IGN);
+
+    char* argv[] = {"as", "--64", "--noexecstack", "-o", (char*)objectPath, NULL};
+    assembler->pid = spawnTool(argv, fds[0]);
+    close(fds[0]);
+
+    assembler->input = fds[1];
+    return assembler->input;
+}
+
+void finishAssembler(Assembler* assembler){
+    close(assembler->input);
+    assembler->input = -1;
+    waitTool(assembler->pid, "as");
+}
+
+void abandonAssembler(Assembler* assembler){
+    kill(assembler->pid, SIGKILL);
+    close(assembler->input);
+    assembler->input = -1;
+    while(waitpid(assembler->pid, NULL, 0) < 0 && errno == EINTR) {}
+    if(assembler->objectPath != NULL) unlink(assembler->objectPath);
+    if(assembler->objectFd >= 0) close(assembler->objectFd);
+    assembler->objectFd = -1;
+}
+
+// A freestanding object brings its own _start and makes its own syscalls,
+// so it is linked on its own: no crt files, no libc, no dynamic loader.
+void linkExecutable(Assembler* assembler, const char* exePath, int freestanding){
+    char objectPath[64];
+    snprintf(objectPath, sizeof(objectPath), "/dev/fd/%d", assembler->objectFd);
+
+    char* hosted[] = {"cc", "-z", "noexecstack", "-o", (char*)exePath, objectPath, NULL};
+    char* standalone[] = {"cc", "-nostdlib", "-static", "-z", "noexecstack", "-o", (char*)exePath, objectPath, NULL};
+    pid_t pid = spawnTool(freestanding ? standalone : hosted, -1);
+    waitTool(pid, "cc");
+
+    close(assembler->objectFd);
+    assembler->objectFd = -1;
+}
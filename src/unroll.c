@@ -0,0 +1,410 @@
+#include "unroll.h"
+#include "diagnostic.h"
+#include "vectorize.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// A loop whose trip count is known and whose copies fit in
+// FULL_UNROLL_BUDGET nodes becomes straight-line code.
+#define FULL_UNROLL_TRIPS 16
+#define FULL_UNROLL_BUDGET 128
+// Otherwise the body is repeated by the largest power of two up to
+// MAX_UNROLL_FACTOR whose copies fit in UNROLL_BUDGET nodes.
+#define MAX_UNROLL_FACTOR 8
+#define UNROLL_BUDGET 128
+// Nodes all the copies together may add to the program.
+#define PROGRAM_UNROLL_BUDGET 4096
+// With a profile, loops that averaged fewer iterations per entry than
+// this are not worth the code.
+#define MIN_PROFILED_TRIPS 4
+#define MAX_STEP (1 << 20)
+
+// while (i < n) { ...; i = i + step; }, or <=, or > and >= counting down
+// with i = i - step. n is a constant or a variable, and the body assigns
+// neither i (other than the final step) nor n.
+typedef struct {
+    int counter;
+    TokenType compare;
+    NodeId limit;
+    int64_t step;
+} CountedLoop;
+
+typedef struct {
+    AST* ast;
+    const Profile* profile;
+    int report;
+    int64_t budget;
+    NodeList walk;
+    // Each loop as its enclosing block and its position in it.
+    NodeList loops;
+    NodeList parts;
+} Unroller;
+
+static int isVariable(const AST* ast, NodeId node, int offset){
+    return ast->kind[node] == NODE_IDENTIFIER && ast->value[node] == offset;
+}
+
+static uint32_t countNodes(Unroller* u, NodeId root){
+    NodeList* work = &u->walk;
+    work->count = 0;
+    pushNode(u->ast, work, root);
+    uint32_t count = 0;
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        count++;
+        pushChildren(u->ast, node, work);
+    }
+    return count;
+}
+
+static int assigns(Unroller* u, NodeId root, int offset){
+    NodeList* work = &u->walk;
+    work->count = 0;
+    pushNode(u->ast, work, root);
+    while(work->count > 0){
+        NodeId node = work->items[--work->count];
+        if(u->ast->kind[node] == NODE_ASSIGN && u->ast->value[node] == offset) return 1;
+        pushChildren(u->ast, node, work);
+    }
+    return 0;
+}
+
+static const char* matchLoop(Unroller* u, NodeId node, CountedLoop* loop){
+    AST* ast = u->ast;
+    NodeId condition = ast->left[node];
+    if(ast->kind[condition] != NODE_BINARY_OP) return "condition is not a comparison";
+    loop->compare = (TokenType)ast->op[condition];
+    if(loop->compare != TOKEN_LESS && loop->compare != TOKEN_LESS_EQUAL &&
+       loop->compare != TOKEN_GREATER && loop->compare != TOKEN_GREATER_EQUAL){
+        return "condition is not an ordered comparison";
+    }
+    NodeId counter = ast->left[condition];
+    loop->limit = ast->right[condition];
+    if(ast->kind[counter] != NODE_IDENTIFIER || ast->value[counter] <= 0) return "no induction variable";
+    loop->counter = ast->value[counter];
+    uint8_t limitKind = ast->kind[loop->limit];
+    if(limitKind != NODE_NUMBER &&
+       !(limitKind == NODE_IDENTIFIER && ast->value[loop->limit] > 0 && ast->value[loop->limit] != loop->counter)){
+        return "limit is not a constant or a variable";
+    }
+
+    NodeId body = ast->right[node];
+    uint32_t count = ast->right[body];
+    if(count == 0) return "no induction variable";
+    NodeId step = blockStatements(ast, body)[count - 1];
+    NodeId increment = ast->right[step];
+    if(ast->kind[step] != NODE_ASSIGN || ast->value[step] != loop->counter ||
+       ast->kind[increment] != NODE_BINARY_OP || !isVariable(ast, ast->left[increment], loop->counter) ||
+       ast->kind[ast->right[increment]] != NODE_NUMBER){
+        return "no induction variable";
+    }
+    int64_t amount = numberValue(ast, ast->right[increment]);
+    if(amount <= 0 || amount > MAX_STEP ||
+       (ast->op[increment] != TOKEN_PLUS && ast->op[increment] != TOKEN_MINUS)){
+        return "step is not a small constant";
+    }
+    loop->step = ast->op[increment] == TOKEN_PLUS ? amount : -amount;
+    int up = loop->compare == TOKEN_LESS || loop->compare == TOKEN_LESS_EQUAL;
+    if(up != (loop->step > 0)) return "step runs away from the limit";
+
+    for(uint32_t i = 0; i + 1 < count; i++){
+        NodeId statement = blockStatements(ast, body)[i];
+        if(assigns(u, statement, loop->counter)) return "induction variable assigned in the body";
+        if(limitKind == NODE_IDENTIFIER && assigns(u, statement, ast->value[loop->limit])){
+            return "limit assigned in the body";
+        }
+    }
+    return NULL;
+}
+
+// Iterations from start, or -1 when the counter would wrap around first.
+static int64_t tripCount(const CountedLoop* loop, int64_t start, int64_t limit){
+    int up = loop->step > 0;
+    int64_t span;
+    if(__builtin_sub_overflow(up ? limit : start, up ? start : limit, &span)) return -1;
+    if(loop->compare == TOKEN_LESS_EQUAL || loop->compare == TOKEN_GREATER_EQUAL){
+        if(__builtin_add_overflow(span, 1, &span)) return -1;
+    }
+    if(span <= 0) return 0;
+    int64_t magnitude = up ? loop->step : -loop->step;
+    int64_t trips = span / magnitude + (span % magnitude != 0);
+    int64_t last;
+    if(__builtin_mul_overflow(trips, loop->step, &last) || __builtin_add_overflow(start, last, &last)) return -1;
+    return trips;
+}
+
+// Copies a loop body subtree. Bodies are bounded by the budgets, so
+// recursing is fine here.
+static NodeId cloneTree(AST* ast, NodeId node){
+    NodeId copy = newNode(ast, (ASTNodeType)ast->kind[node]);
+    ast->op[copy] = ast->op[node];
+    ast->left[copy] = ast->left[node];
+    ast->right[copy] = ast->right[node];
+    ast->value[copy] = ast->value[node];
+    ast->line[copy] = ast->line[node];
+
+    NodeId child;
+    switch(ast->kind[node]){
+        case NODE_ASSIGN:
+        case NODE_INDEX:
+            child = cloneTree(ast, ast->right[node]);
+            ast->right[copy] = child;
+            break;
+        case NODE_BINARY_OP:
+        case NODE_LOGICAL_AND:
+        case NODE_LOGICAL_OR:
+        case NODE_IF:
+        case NODE_WHILE:
+        case NODE_STORE:
+            child = cloneTree(ast, ast->left[node]);
+            ast->left[copy] = child;
+            child = cloneTree(ast, ast->right[node]);
+            ast->right[copy] = child;
+            break;
+        case NODE_PRINT:
+        case NODE_EXPRESSION_STATEMENT:
+        case NODE_RETURN:
+            if(ast->left[node] != NULL_NODE){
+                child = cloneTree(ast, ast->left[node]);
+                ast->left[copy] = child;
+            }
+            break;
+        case NODE_BLOCK:
+        case NODE_CALL: {
+            uint32_t count = ast->right[node];
+            NodeId* copies = (NodeId*)malloc((count > 0 ? count : 1) * sizeof(NodeId));
+            if(copies == NULL){
+                reportError(ast->diagnostics, "Failed to allocate unrolled loop.");
+                fail(ast->diagnostics, 74);
+            }
+            for(uint32_t i = 0; i < count; i++){
+                copies[i] = cloneTree(ast, ast->children[ast->left[node] + i]);
+            }
+            ast->left[copy] = appendChildren(ast, copies, count);
+            free(copies);
+            break;
+        }
+        default:
+            break;
+    }
+    return copy;
+}
+
+// parts gets copies of the body's statements, times over.
+static void repeatBody(Unroller* u, NodeId body, int64_t times){
+    AST* ast = u->ast;
+    for(int64_t copy = 0; copy < times; copy++){
+        for(uint32_t i = 0; i < ast->right[body]; i++){
+            NodeId statement = cloneTree(ast, blockStatements(ast, body)[i]);
+            pushNode(ast, &u->parts, statement);
+        }
+    }
+}
+
+static void makeBlock(Unroller* u, NodeId node){
+    AST* ast = u->ast;
+    ast->kind[node] = NODE_BLOCK;
+    ast->op[node] = 0;
+    ast->left[node] = appendChildren(ast, u->parts.items, u->parts.count);
+    ast->right[node] = u->parts.count;
+    ast->value[node] = 0;
+}
+
+static NodeId newBinary(AST* ast, TokenType op, NodeId left, NodeId right){
+    NodeId node = newNode(ast, NODE_BINARY_OP);
+    ast->op[node] = (uint8_t)op;
+    ast->left[node] = left;
+    ast->right[node] = right;
+    return node;
+}
+
+static NodeId newNumber(AST* ast, int64_t value){
+    NodeId node = newNode(ast, NODE_NUMBER);
+    ast->value[node] = (int32_t)value;
+    if(value != ast->value[node]){
+        ast->op[node] = 1;
+        ast->left[node] = (uint32_t)((uint64_t)value >> 32);
+    }
+    return node;
+}
+
+// Rewrites the loop as
+//
+//   while (i < n - (factor - 1) * step) { body; ... body; }
+//   while (i < n) { body; }
+//
+// The first loop only runs while all factor iterations are due, so the
+// copies need no test in between. With a variable n the first loop sits
+// under "if (n - k < n)", which fails exactly when n - k would wrap. The
+// second loop is the original node, probe and all.
+static int unrollByFactor(Unroller* u, NodeId node, const CountedLoop* loop, int factor){
+    AST* ast = u->ast;
+    int64_t reach = (int64_t)(factor - 1) * loop->step;
+    NodeId bound;
+    NodeId guard = NULL_NODE;
+    if(ast->kind[loop->limit] == NODE_NUMBER){
+        int64_t limit;
+        if(__builtin_sub_overflow(numberValue(ast, loop->limit), reach, &limit)) return 0;
+        bound = newNumber(ast, limit);
+    }else{
+        TokenType op = loop->step > 0 ? TOKEN_MINUS : TOKEN_PLUS;
+        int64_t magnitude = reach > 0 ? reach : -reach;
+        bound = newBinary(ast, op, cloneTree(ast, loop->limit), newNumber(ast, magnitude));
+        NodeId shifted = newBinary(ast, op, cloneTree(ast, loop->limit), newNumber(ast, magnitude));
+        guard = newBinary(ast, loop->step > 0 ? TOKEN_LESS : TOKEN_GREATER, shifted, cloneTree(ast, loop->limit));
+    }
+
+    NodeId condition = ast->left[node];
+    NodeId unrolled = newNode(ast, NODE_WHILE);
+    // Built before the store: it may reallocate the columns.
+    NodeId test = newBinary(ast, loop->compare, cloneTree(ast, ast->left[condition]), bound);
+    ast->left[unrolled] = test;
+    u->parts.count = 0;
+    repeatBody(u, ast->right[node], factor);
+    NodeId body = newNode(ast, NODE_BLOCK);
+    makeBlock(u, body);
+    ast->right[unrolled] = body;
+
+    NodeId first = unrolled;
+    if(guard != NULL_NODE){
+        NodeId inner = newNode(ast, NODE_BLOCK);
+        ast->left[inner] = appendChildren(ast, &unrolled, 1);
+        ast->right[inner] = 1;
+        first = newNode(ast, NODE_IF);
+        ast->left[first] = guard;
+        ast->right[first] = inner;
+    }
+
+    NodeId remainder = newNode(ast, NODE_WHILE);
+    ast->left[remainder] = ast->left[node];
+    ast->right[remainder] = ast->right[node];
+    ast->value[remainder] = ast->value[node];
+
+    u->parts.count = 0;
+    pushNode(ast, &u->parts, first);
+    pushNode(ast, &u->parts, remainder);
+    makeBlock(u, node);
+    return 1;
+}
+
+// Start value of the counter when the statement right before the loop
+// sets it to a constant.
+static int knownStart(const AST* ast, NodeId block, uint32_t index, int counter, int64_t* start){
+    if(index == 0) return 0;
+    NodeId previous = blockStatements(ast, block)[index - 1];
+    if(ast->kind[previous] != NODE_ASSIGN || ast->value[previous] != counter) return 0;
+    if(ast->kind[ast->right[previous]] != NODE_NUMBER) return 0;
+    *start = numberValue(ast, ast->right[previous]);
+    return 1;
+}
+
+static void unrollLoop(Unroller* u, NodeId block, uint32_t index){
+    AST* ast = u->ast;
+    NodeId node = blockStatements(ast, block)[index];
+    uint32_t line = ast->line[node];
+    CountedLoop loop;
+
+    const char* reason = matchLoop(u, node, &loop);
+    if(reason == NULL && isVectorLoop(ast, node, u->profile)) reason = "left to the vectorizer";
+    if(reason != NULL){
+        if(u->report) fprintf(stderr, "unroll: line %u: kept, %s\n", line, reason);
+        return;
+    }
+
+    int64_t averageTrips = -1;
+    if(u->profile != NULL && ast->value[node] > 0){
+        uint64_t reached = probeCount(u->profile, probeOf(ast, node), PROBE_REACHED);
+        uint64_t iterations = probeCount(u->profile, probeOf(ast, node), PROBE_TAKEN);
+        uint64_t entries = reached - iterations;
+        averageTrips = (int64_t)(iterations / (entries > 0 ? entries : 1));
+        if(averageTrips < MIN_PROFILED_TRIPS){
+            if(u->report) fprintf(stderr, "unroll: line %u: kept, profile averages %lld trips\n",
+                                  line, (long long)averageTrips);
+            return;
+        }
+    }
+
+    uint32_t size = countNodes(u, ast->right[node]);
+    int64_t start;
+    int64_t trips = -1;
+    if(ast->kind[loop.limit] == NODE_NUMBER && knownStart(ast, block, index, loop.counter, &start)){
+        trips = tripCount(&loop, start, numberValue(ast, loop.limit));
+    }
+    ast->currentLine = line;
+
+    if(trips >= 0 && trips <= FULL_UNROLL_TRIPS && trips * size <= FULL_UNROLL_BUDGET &&
+       trips * size <= u->budget){
+        u->parts.count = 0;
+        repeatBody(u, ast->right[node], trips);
+        makeBlock(u, node);
+        u->budget -= trips * size;
+        if(u->report) fprintf(stderr, "unroll: line %u: fully unrolled, trip count %lld, body of %u nodes\n",
+                              line, (long long)trips, size);
+        return;
+    }
+
+    int factor = MAX_UNROLL_FACTOR;
+    while(factor > 1 && (int64_t)factor * size > UNROLL_BUDGET) factor /= 2;
+    while(factor > 1 && trips >= 0 && factor > trips) factor /= 2;
+    while(factor > 1 && averageTrips >= 0 && factor > averageTrips) factor /= 2;
+    if(factor < 2){
+        if(u->report){
+            if(trips >= 0 && trips < 2) fprintf(stderr, "unroll: line %u: kept, trip count %lld\n", line, (long long)trips);
+            else fprintf(stderr, "unroll: line %u: kept, body of %u nodes over budget\n", line, size);
+        }
+        return;
+    }
+    if((int64_t)factor * size > u->budget){
+        if(u->report) fprintf(stderr, "unroll: line %u: kept, program size budget spent\n", line);
+        return;
+    }
+    if(!unrollByFactor(u, node, &loop, factor)){
+        if(u->report) fprintf(stderr, "unroll: line %u: kept, limit too close to the end of the range\n", line);
+        return;
+    }
+    u->budget -= (int64_t)factor * size;
+    if(u->report) fprintf(stderr, "unroll: line %u: unrolled by %d with a remainder loop, body of %u nodes\n",
+                          line, factor, size);
+}
+
+static void pushPending(const AST* ast, NodeList* pending, NodeId node, NodeId block, uint32_t index){
+    pushNode(ast, pending, node);
+    pushNode(ast, pending, block);
+    pushNode(ast, pending, index);
+}
+
+// Loops are unrolled innermost first, so an outer loop is sized with its
+// inner loops already expanded, and otherwise in source order. The walk
+// records them in reverse post-order.
+void unrollLoops(AST* ast, NodeId program, const Profile* profile, int report){
+    Unroller u = {ast, profile, report, PROGRAM_UNROLL_BUDGET, {NULL, 0, 0}, {NULL, 0, 0}, {NULL, 0, 0}};
+    NodeList pending = {NULL, 0, 0};
+    pushPending(ast, &pending, program, NULL_NODE, 0);
+    while(pending.count > 0){
+        pending.count -= 3;
+        NodeId node = pending.items[pending.count];
+        if(ast->kind[node] == NODE_WHILE){
+            pushNode(ast, &u.loops, pending.items[pending.count + 1]);
+            pushNode(ast, &u.loops, pending.items[pending.count + 2]);
+        }
+        if(ast->kind[node] == NODE_BLOCK){
+            for(uint32_t i = 0; i < ast->right[node]; i++){
+                pushPending(ast, &pending, blockStatements(ast, node)[i], node, i);
+            }
+        }else{
+            u.walk.count = 0;
+            pushChildren(ast, node, &u.walk);
+            for(uint32_t i = 0; i < u.walk.count; i++) pushPending(ast, &pending, u.walk.items[i], NULL_NODE, 0);
+        }
+    }
+    freeNodeList(&pending);
+
+    for(uint32_t i = u.loops.count; i > 0; i -= 2){
+        unrollLoop(&u, u.loops.items[i - 2], u.loops.items[i - 1]);
+    }
+
+    freeNodeList(&u.walk);
+    freeNodeList(&u.loops);
+    freeNodeList(&u.parts);
+}
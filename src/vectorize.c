@@ -0,0 +1,328 @@
+#include "vectorize.h"
+#include "output.h"
+
+// Temporaries are allocated from xmm0/ymm0 upwards and reduction
+// accumulators from register 15 downwards.
+#define VECTOR_REGISTERS 16
+#define MAX_REDUCTIONS 8
+#define NOT_VECTORIZABLE (VECTOR_REGISTERS + 1)
+// With a profile, loops averaging fewer iterations per entry stay scalar.
+#define MIN_VECTOR_TRIPS 8
+
+// A loop of the form
+//
+//   while (i < n) { a[i] = ...; s = s + ...; ... i = i + 1; }
+//
+// where every array access is indexed by i itself, so iterations only
+// depend on each other through the sums. i may also be read as a value:
+// each lane gets its own iteration's count.
+typedef struct {
+    int counter;
+    NodeId limit;
+    NodeId body;
+    uint32_t statementCount;
+    int reductions[MAX_REDUCTIONS];
+    int reductionCount;
+} VectorLoop;
+
+static int isVariable(const AST* ast, NodeId node, int offset){
+    return ast->kind[node] == NODE_IDENTIFIER && ast->value[node] == offset;
+}
+
+static int isInvariant(const VectorLoop* loop, int offset){
+    if(offset <= 0 || offset == loop->counter) return 0;
+    for(int i = 0; i < loop->reductionCount; i++){
+        if(loop->reductions[i] == offset) return 0;
+    }
+    return 1;
+}
+
+// Registers needed to evaluate node, or NOT_VECTORIZABLE. depth bounds
+// the recursion: anything nested deeper would not fit in registers anyway.
+static int registerNeed(const AST* ast, const VectorLoop* loop, NodeId node, int depth){
+    if(depth >= VECTOR_REGISTERS) return NOT_VECTORIZABLE;
+
+    switch(ast->kind[node]){
+        case NODE_NUMBER:
+            return 1;
+        case NODE_IDENTIFIER:
+            if(ast->value[node] == loop->counter) return 1;
+            return isInvariant(loop, ast->value[node]) ? 1 : NOT_VECTORIZABLE;
+        case NODE_INDEX:
+            return isVariable(ast, ast->right[node], loop->counter) ? 1 : NOT_VECTORIZABLE;
+        case NODE_BINARY_OP: {
+            if(ast->op[node] != TOKEN_PLUS && ast->op[node] != TOKEN_MINUS) return NOT_VECTORIZABLE;
+            int left = registerNeed(ast, loop, ast->left[node], depth + 1);
+            int right = registerNeed(ast, loop, ast->right[node], depth + 1);
+            if(left == NOT_VECTORIZABLE || right == NOT_VECTORIZABLE) return NOT_VECTORIZABLE;
+            return left > right + 1 ? left : right + 1;
+        }
+        default:
+            return NOT_VECTORIZABLE;
+    }
+}
+
+static int isReduction(const AST* ast, NodeId statement){
+    if(ast->kind[statement] != NODE_ASSIGN) return 0;
+    NodeId sum = ast->right[statement];
+    return ast->kind[sum] == NODE_BINARY_OP && ast->op[sum] == TOKEN_PLUS &&
+           isVariable(ast, ast->left[sum], ast->value[statement]);
+}
+
+static int matchLoop(const AST* ast, NodeId node, VectorLoop* loop){
+    NodeId condition = ast->left[node];
+    if(ast->kind[condition] != NODE_BINARY_OP || ast->op[condition] != TOKEN_LESS) return 0;
+    NodeId counter = ast->left[condition];
+    if(ast->kind[counter] != NODE_IDENTIFIER || ast->value[counter] <= 0) return 0;
+    loop->counter = ast->value[counter];
+    loop->limit = ast->right[condition];
+    loop->body = ast->right[node];
+    loop->reductionCount = 0;
+
+    uint32_t count = ast->right[loop->body];
+    if(count < 2) return 0;
+    NodeId* statements = blockStatements(ast, loop->body);
+    loop->statementCount = count - 1;
+
+    NodeId step = statements[count - 1];
+    if(ast->kind[step] != NODE_ASSIGN || ast->value[step] != loop->counter) return 0;
+    NodeId increment = ast->right[step];
+    if(ast->kind[increment] != NODE_BINARY_OP || ast->op[increment] != TOKEN_PLUS ||
+       !isVariable(ast, ast->left[increment], loop->counter) ||
+       ast->kind[ast->right[increment]] != NODE_NUMBER || numberValue(ast, ast->right[increment]) != 1){
+        return 0;
+    }
+
+    for(uint32_t i = 0; i < loop->statementCount; i++){
+        NodeId statement = statements[i];
+        if(ast->kind[statement] == NODE_STORE) continue;
+        if(!isReduction(ast, statement) || loop->reductionCount == MAX_REDUCTIONS) return 0;
+        int sum = ast->value[statement];
+        if(!isInvariant(loop, sum)) return 0;
+        loop->reductions[loop->reductionCount++] = sum;
+    }
+
+    uint8_t limitKind = ast->kind[loop->limit];
+    if(limitKind != NODE_NUMBER &&
+       !(limitKind == NODE_IDENTIFIER && isInvariant(loop, ast->value[loop->limit]))){
+        return 0;
+    }
+
+    int available = VECTOR_REGISTERS - loop->reductionCount;
+    for(uint32_t i = 0; i < loop->statementCount; i++){
+        NodeId statement = statements[i];
+        NodeId value;
+        if(ast->kind[statement] == NODE_STORE){
+            if(!isVariable(ast, ast->right[ast->left[statement]], loop->counter)) return 0;
+            value = ast->right[statement];
+        }else{
+            value = ast->right[ast->right[statement]];
+        }
+        if(registerNeed(ast, loop, value, 0) > available) return 0;
+    }
+    return 1;
+}
+
+static void emitVectorExpression(Output* out, const AST* ast, const VectorLoop* loop, NodeId node, int reg, int wide){
+    switch(ast->kind[node]){
+        case NODE_NUMBER:
+        case NODE_IDENTIFIER:
+            if(ast->kind[node] == NODE_IDENTIFIER && ast->value[node] == loop->counter){
+                // The counter in every lane, plus the lane's own index.
+                if(wide){
+                    emit(out, "  vmovq xmm%d, rax\n", reg);
+                    emit(out, "  vpbroadcastq ymm%d, xmm%d\n", reg, reg);
+                    emit(out, "  vpaddq ymm%d, ymm%d, [rip + qz_lane_index]\n", reg, reg);
+                }else{
+                    emit(out, "  movq xmm%d, rax\n", reg);
+                    emit(out, "  punpcklqdq xmm%d, xmm%d\n", reg, reg);
+                    emit(out, "  paddq xmm%d, [rip + qz_lane_index]\n", reg);
+                }
+                break;
+            }
+            if(ast->kind[node] == NODE_NUMBER){
+                emit(out, "  movabs rcx, %lld\n", (long long)numberValue(ast, node));
+            }else{
+                emit(out, "  mov rcx, [rbp - %d]\n", ast->value[node]);
+            }
+            if(wide){
+                emit(out, "  vmovq xmm%d, rcx\n", reg);
+                emit(out, "  vpbroadcastq ymm%d, xmm%d\n", reg, reg);
+            }else{
+                emit(out, "  movq xmm%d, rcx\n", reg);
+                emit(out, "  punpcklqdq xmm%d, xmm%d\n", reg, reg);
+            }
+            break;
+        case NODE_INDEX:
+            emit(out, "  %s %cmm%d, [rbp + rax*8 - %d]\n", wide ? "vmovdqu" : "movdqu", wide ? 'y' : 'x', reg, ast->value[node]);
+            break;
+        default: {
+            const char* operation = ast->op[node] == TOKEN_PLUS ? "paddq" : "psubq";
+            emitVectorExpression(out, ast, loop, ast->left[node], reg, wide);
+            emitVectorExpression(out, ast, loop, ast->right[node], reg + 1, wide);
+            if(wide){
+                emit(out, "  v%s ymm%d, ymm%d, ymm%d\n", operation, reg, reg, reg + 1);
+            }else{
+                emit(out, "  %s xmm%d, xmm%d\n", operation, reg, reg + 1);
+            }
+            break;
+        }
+    }
+}
+
+// One strip-mined copy of the loop; rax holds the counter and rdx the
+// bound. Leaves rax at the first iteration not yet executed.
+static void emitStripLoop(Output* out, const AST* ast, const VectorLoop* loop, int wide, int head, int exit){
+    int lanes = wide ? 4 : 2;
+    char prefix = wide ? 'y' : 'x';
+
+    for(int r = 0; r < loop->reductionCount; r++){
+        int acc = VECTOR_REGISTERS - 1 - r;
+        if(wide) emit(out, "  vpxor ymm%d, ymm%d, ymm%d\n", acc, acc, acc);
+        else emit(out, "  pxor xmm%d, xmm%d\n", acc, acc);
+    }
+
+    emit(out, ".p2align 4,,10\n");
+    emit(out, ".L%d:\n", head);
+    emit(out, "  lea rcx, [rax + %d]\n", lanes);
+    emit(out, "  cmp rcx, rdx\n");
+    emit(out, "  jg .L%d\n", exit);
+
+    NodeId* statements = blockStatements(ast, loop->body);
+    int reduction = 0;
+    for(uint32_t i = 0; i < loop->statementCount; i++){
+        NodeId statement = statements[i];
+        if(ast->kind[statement] == NODE_STORE){
+            emitVectorExpression(out, ast, loop, ast->right[statement], 0, wide);
+            emit(out, "  %s [rbp + rax*8 - %d], %cmm0\n", wide ? "vmovdqu" : "movdqu", ast->value[ast->left[statement]], prefix);
+        }else{
+            int acc = VECTOR_REGISTERS - 1 - reduction++;
+            emitVectorExpression(out, ast, loop, ast->right[ast->right[statement]], 0, wide);
+            if(wide) emit(out, "  vpaddq ymm%d, ymm%d, ymm0\n", acc, acc);
+            else emit(out, "  paddq xmm%d, xmm0\n", acc);
+        }
+    }
+
+    emit(out, "  add rax, %d\n", lanes);
+    emit(out, "  jmp .L%d\n", head);
+    emit(out, ".L%d:\n", exit);
+
+    // Fold each accumulator's lanes into the scalar it stands for.
+    reduction = 0;
+    for(uint32_t i = 0; i < loop->statementCount; i++){
+        NodeId statement = statements[i];
+        if(ast->kind[statement] == NODE_STORE) continue;
+        int acc = VECTOR_REGISTERS - 1 - reduction++;
+        if(wide){
+            emit(out, "  vextracti128 xmm0, ymm%d, 1\n", acc);
+            emit(out, "  vpaddq xmm%d, xmm%d, xmm0\n", acc, acc);
+            emit(out, "  vpshufd xmm0, xmm%d, 0x4E\n", acc);
+            emit(out, "  vpaddq xmm%d, xmm%d, xmm0\n", acc, acc);
+            emit(out, "  vmovq rcx, xmm%d\n", acc);
+        }else{
+            emit(out, "  pshufd xmm0, xmm%d, 0x4E\n", acc);
+            emit(out, "  paddq xmm%d, xmm0\n", acc);
+            emit(out, "  movq rcx, xmm%d\n", acc);
+        }
+        emit(out, "  add [rbp - %d], rcx\n", ast->value[statement]);
+    }
+}
+
+// Whether emitVectorLoop will take the loop, for passes that would
+// otherwise reshape it first.
+int isVectorLoop(const AST* ast, NodeId node, const Profile* profile){
+    if(profile != NULL && ast->value[node] > 0){
+        uint64_t reached = probeCount(profile, probeOf(ast, node), PROBE_REACHED);
+        uint64_t iterations = probeCount(profile, probeOf(ast, node), PROBE_TAKEN);
+        uint64_t entries = reached - iterations;
+        if(iterations < MIN_VECTOR_TRIPS * (entries > 0 ? entries : 1)) return 0;
+    }
+    VectorLoop loop;
+    return matchLoop(ast, node, &loop);
+}
+
+// Emits an AVX2 and an SSE2 copy of the loop ahead of the scalar one and
+// picks between them at run time. Returns 0, emitting nothing, when the
+// loop does not fit the pattern; a program that got one needs
+// emitVectorSupport.
+int emitVectorLoop(Output* out, AST* ast, NodeId node, int* labelCount, const Profile* profile){
+    VectorLoop loop;
+    if(!isVectorLoop(ast, node, profile) || !matchLoop(ast, node, &loop)) return 0;
+
+    int label = *labelCount;
+    *labelCount += VECTOR_LOOP_LABELS;
+
+    emit(out, "  cmp dword ptr [rip + qz_simd_level], 0\n");
+    emit(out, "  jne .L%d\n", label);
+    emit(out, "  call qz_detect_simd\n");
+    emit(out, ".L%d:\n", label);
+
+    emit(out, "  mov rax, [rbp - %d]\n", loop.counter);
+    if(ast->kind[loop.limit] == NODE_NUMBER){
+        emit(out, "  movabs rdx, %lld\n", (long long)numberValue(ast, loop.limit));
+    }else{
+        emit(out, "  mov rdx, [rbp - %d]\n", ast->value[loop.limit]);
+    }
+
+    emit(out, "  cmp dword ptr [rip + qz_simd_level], 2\n");
+    emit(out, "  jl .L%d\n", label + 1);
+    emitStripLoop(out, ast, &loop, 1, label + 2, label + 3);
+    emit(out, "  vzeroupper\n");
+    emit(out, "  jmp .L%d\n", label + 4);
+
+    emit(out, ".L%d:\n", label + 1);
+    emitStripLoop(out, ast, &loop, 0, label + 5, label + 6);
+
+    emit(out, ".L%d:\n", label + 4);
+    emit(out, "  mov [rbp - %d], rax\n", loop.counter);
+    return 1;
+}
+
+// qz_simd_level is 0 until the first vector loop asks, then 1 for SSE2
+// (always there on x86-64) or 2 when the CPU and OS both support AVX2.
+// qz_lane_index is what each lane adds to the loop counter.
+void emitVectorSupport(Output* out){
+    emit(out, "\n.data\n");
+    emit(out, "qz_simd_level:\n");
+    emit(out, "  .long 0\n");
+    emit(out, ".section .rodata\n");
+    emit(out, ".p2align 5\n");
+    emit(out, "qz_lane_index:\n");
+    emit(out, "  .quad 0, 1, 2, 3\n");
+    emit(out, ".text\n");
+    emit(out, ".type qz_detect_simd, @function\n");
+    emit(out, "qz_detect_simd:\n");
+    emit(out, ".cfi_startproc\n");
+    emit(out, "  push rbx\n");
+    emit(out, ".cfi_def_cfa_offset 16\n");
+    emit(out, ".cfi_offset rbx, -16\n");
+    emit(out, "  mov esi, 1\n");
+    emit(out, "  xor eax, eax\n");
+    emit(out, "  cpuid\n");
+    emit(out, "  cmp eax, 7\n");
+    emit(out, "  jl .Lqz_simd_done\n");
+    emit(out, "  mov eax, 1\n");
+    emit(out, "  cpuid\n");
+    // OSXSAVE and AVX, then the OS must save the xmm and ymm state.
+    emit(out, "  and ecx, 0x18000000\n");
+    emit(out, "  cmp ecx, 0x18000000\n");
+    emit(out, "  jne .Lqz_simd_done\n");
+    emit(out, "  xor ecx, ecx\n");
+    emit(out, "  xgetbv\n");
+    emit(out, "  and eax, 6\n");
+    emit(out, "  cmp eax, 6\n");
+    emit(out, "  jne .Lqz_simd_done\n");
+    emit(out, "  mov eax, 7\n");
+    emit(out, "  xor ecx, ecx\n");
+    emit(out, "  cpuid\n");
+    emit(out, "  test ebx, 0x20\n");
+    emit(out, "  jz .Lqz_simd_done\n");
+    emit(out, "  mov esi, 2\n");
+    emit(out, ".Lqz_simd_done:\n");
+    emit(out, "  mov [rip + qz_simd_level], esi\n");
+    emit(out, "  pop rbx\n");
+    emit(out, ".cfi_def_cfa_offset 8\n");
+    emit(out, "  ret\n");
+    emit(out, ".cfi_endproc\n");
+    emit(out, ".size qz_detect_simd, .-qz_detect_simd\n");
+}
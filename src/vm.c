@@ -0,0 +1,261 @@
+#include "bytecode.h"
+#include "output.h"
+#include "input.h"
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Direct-threaded interpreter: every instruction carries the address of
+// its handler and each handler ends by jumping to the next one's, so
+// there is no central switch and every dispatch site gets its own entry
+// in the branch predictor.
+
+// Registers of all live frames, 256 MiB at most. The native build would
+// have run out of stack long before.
+#define MAX_REGISTERS (32u * 1024 * 1024)
+
+typedef struct {
+    const Instruction* returnTo;
+    uint32_t base;
+    int32_t target;
+    uint32_t frameRegisters;
+} CallRecord;
+
+typedef struct {
+    int64_t* registers;
+    uint32_t capacity;
+    CallRecord* calls;
+    uint32_t callCount;
+    uint32_t callCapacity;
+    Output* out;
+} Machine;
+
+static void reserveRegisters(Machine* machine, uint32_t count){
+    if(count <= machine->capacity) return;
+    if(count > MAX_REGISTERS){
+        flushOutput(machine->out);
+        fprintf(stderr, "Error: Call stack exhausted.\n");
+        exit(70);
+    }
+    uint32_t capacity = machine->capacity ? machine->capacity : 1024;
+    while(capacity < count) capacity = capacity > MAX_REGISTERS / 2 ? MAX_REGISTERS : capacity * 2;
+    machine->registers = realloc(machine->registers, capacity * sizeof(int64_t));
+    if(machine->registers == NULL){
+        fprintf(stderr, "Error: Failed to grow interpreter registers.\n");
+        exit(74);
+    }
+    memset(machine->registers + machine->capacity, 0, (capacity - machine->capacity) * sizeof(int64_t));
+    machine->capacity = capacity;
+}
+
+static CallRecord* pushCall(Machine* machine){
+    if(machine->callCount == machine->callCapacity){
+        machine->callCapacity = machine->callCapacity ? machine->callCapacity * 2 : 256;
+        machine->calls = realloc(machine->calls, machine->callCapacity * sizeof(CallRecord));
+        if(machine->calls == NULL){
+            fprintf(stderr, "Error: Failed to grow interpreter call stack.\n");
+            exit(74);
+        }
+    }
+    return &machine->calls[machine->callCount++];
+}
+
+// Dies the way the native idiv does. Like the native runtime's buffer,
+// output not yet written goes down with the program.
+static void divisionFault(Output* out){
+    discardOutput(out);
+    signal(SIGFPE, SIG_DFL);
+    raise(SIGFPE);
+    exit(70);
+}
+
+static void elementFault(Output* out){
+    flushOutput(out);
+    fprintf(stderr, "Error: Array index outside the frame.\n");
+    exit(70);
+}
+
+void runBytecode(Bytecode* bytecode, Output* out){
+    static const void* const handlers[OP_COUNT] = {
+        [OP_MOVE] = &&move,
+        [OP_CONSTANT] = &&constant,
+        [OP_WIDE_CONSTANT] = &&wideConstant,
+        [OP_ADD] = &&add,
+        [OP_SUBTRACT] = &&subtract,
+        [OP_MULTIPLY] = &&multiply,
+        [OP_DIVIDE] = &&divide,
+        [OP_ADD_IMMEDIATE] = &&addImmediate,
+        [OP_MULTIPLY_IMMEDIATE] = &&multiplyImmediate,
+        [OP_EQUAL + CONDITION_EQUAL] = &&equal,
+        [OP_EQUAL + CONDITION_NOT_EQUAL] = &&notEqual,
+        [OP_EQUAL + CONDITION_LESS] = &&less,
+        [OP_EQUAL + CONDITION_LESS_EQUAL] = &&lessEqual,
+        [OP_EQUAL + CONDITION_GREATER] = &&greater,
+        [OP_EQUAL + CONDITION_GREATER_EQUAL] = &&greaterEqual,
+        [OP_EQUAL_IMMEDIATE + CONDITION_EQUAL] = &&equalImmediate,
+        [OP_EQUAL_IMMEDIATE + CONDITION_NOT_EQUAL] = &&notEqualImmediate,
+        [OP_EQUAL_IMMEDIATE + CONDITION_LESS] = &&lessImmediate,
+        [OP_EQUAL_IMMEDIATE + CONDITION_LESS_EQUAL] = &&lessEqualImmediate,
+        [OP_EQUAL_IMMEDIATE + CONDITION_GREATER] = &&greaterImmediate,
+        [OP_EQUAL_IMMEDIATE + CONDITION_GREATER_EQUAL] = &&greaterEqualImmediate,
+        [OP_JUMP_EQUAL + CONDITION_EQUAL] = &&jumpEqual,
+        [OP_JUMP_EQUAL + CONDITION_NOT_EQUAL] = &&jumpNotEqual,
+        [OP_JUMP_EQUAL + CONDITION_LESS] = &&jumpLess,
+        [OP_JUMP_EQUAL + CONDITION_LESS_EQUAL] = &&jumpLessEqual,
+        [OP_JUMP_EQUAL + CONDITION_GREATER] = &&jumpGreater,
+        [OP_JUMP_EQUAL + CONDITION_GREATER_EQUAL] = &&jumpGreaterEqual,
+        [OP_JUMP_EQUAL_IMMEDIATE + CONDITION_EQUAL] = &&jumpEqualImmediate,
+        [OP_JUMP_EQUAL_IMMEDIATE + CONDITION_NOT_EQUAL] = &&jumpNotEqualImmediate,
+        [OP_JUMP_EQUAL_IMMEDIATE + CONDITION_LESS] = &&jumpLessImmediate,
+        [OP_JUMP_EQUAL_IMMEDIATE + CONDITION_LESS_EQUAL] = &&jumpLessEqualImmediate,
+        [OP_JUMP_EQUAL_IMMEDIATE + CONDITION_GREATER] = &&jumpGreaterImmediate,
+        [OP_JUMP_EQUAL_IMMEDIATE + CONDITION_GREATER_EQUAL] = &&jumpGreaterEqualImmediate,
+        [OP_JUMP] = &&jump,
+        [OP_JUMP_IF_ZERO] = &&jumpIfZero,
+        [OP_JUMP_IF_NOT_ZERO] = &&jumpIfNotZero,
+        [OP_LOAD_ELEMENT] = &&loadElement,
+        [OP_STORE_ELEMENT] = &&storeElement,
+        [OP_CLEAR] = &&clear,
+        [OP_PRINT] = &&print,
+        [OP_READ] = &&readNumber,
+        [OP_CALL] = &&call,
+        [OP_RETURN] = &&ret,
+        [OP_HALT] = &&halt,
+    };
+
+    if(!bytecode->threaded){
+        for(uint32_t i = 0; i < bytecode->count; i++){
+            bytecode->code[i].handler = handlers[bytecode->code[i].op];
+        }
+        bytecode->threaded = 1;
+    }
+
+    Input input;
+    initInput(&input, STDIN_FILENO, out);
+    Machine machine = {NULL, 0, NULL, 0, 0, out};
+    const Instruction* code = bytecode->code;
+    const int64_t* constants = bytecode->constants;
+    const BytecodeFunction* functions = bytecode->functions;
+    reserveRegisters(&machine, functions[0].registerCount + 1);
+
+    int64_t* r = machine.registers;
+    uint32_t base = 0;
+    uint32_t frameRegisters = functions[0].frameRegisters;
+    const Instruction* pc = code + functions[0].entry;
+
+#define A (r[pc->a])
+#define B (r[pc->b])
+#define C (r[pc->c])
+#define DISPATCH() goto *pc->handler
+#define NEXT() do { pc++; DISPATCH(); } while(0)
+#define BRANCH(condition) do { pc = (condition) ? code + pc->c : pc + 1; DISPATCH(); } while(0)
+
+    DISPATCH();
+
+move:               A = B; NEXT();
+constant:           A = pc->b; NEXT();
+wideConstant:       A = constants[pc->b]; NEXT();
+add:                A = (int64_t)((uint64_t)B + (uint64_t)C); NEXT();
+subtract:           A = (int64_t)((uint64_t)B - (uint64_t)C); NEXT();
+multiply:           A = (int64_t)((uint64_t)B * (uint64_t)C); NEXT();
+divide:
+    if(C == 0 || (C == -1 && B == INT64_MIN)) divisionFault(out);
+    A = B / C;
+    NEXT();
+addImmediate:       A = (int64_t)((uint64_t)B + (uint64_t)(int64_t)pc->c); NEXT();
+multiplyImmediate:  A = (int64_t)((uint64_t)B * (uint64_t)(int64_t)pc->c); NEXT();
+
+equal:              A = B == C; NEXT();
+notEqual:           A = B != C; NEXT();
+less:               A = B < C; NEXT();
+lessEqual:          A = B <= C; NEXT();
+greater:            A = B > C; NEXT();
+greaterEqual:       A = B >= C; NEXT();
+equalImmediate:         A = B == pc->c; NEXT();
+notEqualImmediate:      A = B != pc->c; NEXT();
+lessImmediate:          A = B < pc->c; NEXT();
+lessEqualImmediate:     A = B <= pc->c; NEXT();
+greaterImmediate:       A = B > pc->c; NEXT();
+greaterEqualImmediate:  A = B >= pc->c; NEXT();
+
+jumpEqual:          BRANCH(A == B);
+jumpNotEqual:       BRANCH(A != B);
+jumpLess:           BRANCH(A < B);
+jumpLessEqual:      BRANCH(A <= B);
+jumpGreater:        BRANCH(A > B);
+jumpGreaterEqual:   BRANCH(A >= B);
+jumpEqualImmediate:         BRANCH(A == pc->b);
+jumpNotEqualImmediate:      BRANCH(A != pc->b);
+jumpLessImmediate:          BRANCH(A < pc->b);
+jumpLessEqualImmediate:     BRANCH(A <= pc->b);
+jumpGreaterImmediate:       BRANCH(A > pc->b);
+jumpGreaterEqualImmediate:  BRANCH(A >= pc->b);
+jump:               pc = code + pc->c; DISPATCH();
+jumpIfZero:         BRANCH(A == 0);
+jumpIfNotZero:      BRANCH(A != 0);
+
+    // Out-of-range indices are as unchecked as in native code as long as
+    // they stay inside the frame; beyond it they stop the program.
+loadElement: {
+    uint64_t element = (uint64_t)((int64_t)pc->c - B);
+    if(element >= frameRegisters) elementFault(out);
+    A = r[element];
+    NEXT();
+}
+storeElement: {
+    uint64_t element = (uint64_t)((int64_t)pc->c - B);
+    if(element >= frameRegisters) elementFault(out);
+    r[element] = A;
+    NEXT();
+}
+clear:
+    memset(&A, 0, (size_t)pc->b * sizeof(int64_t));
+    NEXT();
+print:
+    emit(out, "%" PRId64 "\n", A);
+    NEXT();
+readNumber:
+    A = readInput(&input);
+    NEXT();
+
+call: {
+    const BytecodeFunction* function = &functions[pc->b];
+    CallRecord* record = pushCall(&machine);
+    record->returnTo = pc + 1;
+    record->base = base;
+    record->target = pc->a;
+    record->frameRegisters = frameRegisters;
+    base += (uint32_t)pc->c;
+    reserveRegisters(&machine, base + function->registerCount);
+    r = machine.registers + base;
+    frameRegisters = function->frameRegisters;
+    pc = code + function->entry;
+    DISPATCH();
+}
+ret: {
+    int64_t value = A;
+    CallRecord* record = &machine.calls[--machine.callCount];
+    base = record->base;
+    r = machine.registers + base;
+    r[record->target] = value;
+    frameRegisters = record->frameRegisters;
+    pc = record->returnTo;
+    DISPATCH();
+}
+
+halt:
+#undef A
+#undef B
+#undef C
+#undef DISPATCH
+#undef NEXT
+#undef BRANCH
+    flushOutput(out);
+    freeInput(&input);
+    free(machine.registers);
+    free(machine.calls);
+}
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Damages one byte at a time of a .qzast file; loading it has to either
+# succeed or be rejected with exit code 65, never crash.
+set -e
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf 'func sq(x) {\n  return x * x;\n}\narray v[4];\nn = read();\ni = 0;\nwhile (i < 4 && n > 0) {\n  v[i] = sq(i);\n  print(v[i]);\n  i = i + 1;\n}\n' > "$dir/program.qz"
+"$compiler" --emit=ast "$dir/program.qz" -o "$dir/program.qzast"
+size=$(wc -c < "$dir/program.qzast")
+
+offset=0
+while [ $offset -lt $size ]; do
+    for byte in '\377' '\001'; do
+        cp "$dir/program.qzast" "$dir/corrupt.qzast"
+        printf "$byte" | dd of="$dir/corrupt.qzast" bs=1 seek=$offset conv=notrunc 2>/dev/null
+        status=0
+        "$compiler" -O2 "$dir/corrupt.qzast" --emit=asm -o "$dir/out.s" 2>/dev/null || status=$?
+        if [ $status -ne 0 ] && [ $status -ne 65 ]; then
+            echo "damaged byte $offset: exit status $status"
+            exit 1
+        fi
+    done
+    offset=$((offset + 1))
+done
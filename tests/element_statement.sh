@@ -0,0 +1,18 @@
+#!/bin/sh
+# A statement starting with an element is a store only when '=' follows
+# the ']'; anything else is an expression statement.
+set -e
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+echo "array v[4]; v[0] = 5; v[0] + 1; v[1] * 2 == v[0]; v[v[1]] = v[0] + 1; print(v[0]);" > "$dir/program.qz"
+for level in -O0 -O1 -O2; do
+    "$compiler" $level "$dir/program.qz" -o "$dir/program"
+    test "$("$dir/program")" = 6
+done
+
+echo "array v[4]; v[0] 3;" > "$dir/bad.qz"
+status=0
+"$compiler" "$dir/bad.qz" > "$dir/bad.s" 2>/dev/null || status=$?
+test $status -eq 65
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Compile-time evaluation replaces a loop only by as many statements as
+# the loop had nodes: a short loop folds away, a long one stays a loop.
+set -e
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+echo "i = 0; while (i < 5) { print(i * i); i = i + 1; }" > "$dir/short.qz"
+"$compiler" -O2 --emit=ir "$dir/short.qz" > "$dir/short.ir"
+if grep -q "While" "$dir/short.ir"; then exit 1; fi
+
+echo "i = 0; while (i < 150000) { print(i); i = i + 1; }" > "$dir/prints.qz"
+echo "array v[60000]; i = 0; while (i < 60000) { v[i] = i; i = i + 1; } n = read(); print(v[n]);" > "$dir/fill.qz"
+for name in prints fill; do
+    "$compiler" -O2 --emit=ir "$dir/$name.qz" > "$dir/$name.ir"
+    grep -q "While" "$dir/$name.ir"
+    test "$(wc -l < "$dir/$name.ir")" -lt 100
+    "$compiler" -O1 "$dir/$name.qz" -o "$dir/$name-O1"
+    "$compiler" -O2 "$dir/$name.qz" -o "$dir/$name-O2"
+    echo 59999 | "$dir/$name-O1" > "$dir/$name-O1.out"
+    echo 59999 | "$dir/$name-O2" > "$dir/$name-O2.out"
+    cmp "$dir/$name-O1.out" "$dir/$name-O2.out"
+done
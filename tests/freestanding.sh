@@ -0,0 +1,37 @@
+#!/bin/sh
+# A --freestanding build is a static binary with no interpreter, and it
+# prints the same text and exits with the same status as the libc build.
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+programs=$(dirname "$0")/programs
+
+failed=0
+check(){
+    name=$1
+    input=$2
+    for level in -O0 -O1 -O2; do
+        "$compiler" $level "$programs/$name.qz" -o "$dir/$name" || exit 1
+        "$compiler" $level --freestanding "$programs/$name.qz" -o "$dir/$name-freestanding" || exit 1
+        if readelf -l "$dir/$name-freestanding" | grep -q INTERP; then
+            echo "$name $level: --freestanding binary asks for a dynamic loader"
+            failed=1
+        fi
+        printf "$input" | "$dir/$name" > "$dir/libc.out" 2>/dev/null
+        libc=$?
+        printf "$input" | "$dir/$name-freestanding" > "$dir/freestanding.out" 2>/dev/null
+        freestanding=$?
+        if [ $libc -ne $freestanding ] || ! cmp -s "$dir/libc.out" "$dir/freestanding.out"; then
+            echo "$name $level: libc build exited $libc, --freestanding $freestanding"
+            diff "$dir/libc.out" "$dir/freestanding.out"
+            failed=1
+        fi
+    done
+}
+
+check functions "20\n"
+check arrays "40\n"
+check division "5\n"
+check division "0\n"
+check read "1\n-7\n12\n0\n"
+exit $failed
@@ -0,0 +1,12 @@
+#!/bin/sh
+# Without a profile, only an if body that returns is guessed cold: an
+# equality test that holds on every iteration keeps its body inline.
+set -e
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf 'func f(x) {\n  if (x < 0) {\n    return 0;\n  }\n  return x;\n}\nn = 100;\ni = 0;\nc = 0;\nwhile (i < n) {\n  if (i == i) {\n    c = c + f(i);\n  }\n  i = i + 1;\n}\nprint(c);\n' > "$dir/program.qz"
+"$compiler" -O1 "$dir/program.qz" > "$dir/program.s"
+# f's early return is the only body moved out of line.
+test "$(grep -c '\.text\.unlikely' "$dir/program.s")" -eq 1
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Edits a function body between two --incremental builds; the rebuilt
+# program must behave like a clean build of the edited source, and its
+# assembly must match a build from an empty cache.
+set -e
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf 'func sq(x) {\n  return x * x;\n}\nn = read();\ni = 0;\nwhile (i < n) {\n  print(sq(i));\n  i = i + 1;\n}\n' > "$dir/program.qz"
+for flags in "-O0" "-O1" "-O2" "-O2 -g -j4"; do
+    rm -f "$dir/cache" "$dir/fresh"
+    "$compiler" $flags --incremental="$dir/cache" "$dir/program.qz" -o "$dir/before"
+    sed 's/x \* x;/x * x * x;/' "$dir/program.qz" > "$dir/edited.qz"
+
+    "$compiler" $flags --incremental="$dir/cache" "$dir/edited.qz" --emit=asm -o "$dir/rebuilt.s"
+    "$compiler" $flags --incremental="$dir/fresh" "$dir/edited.qz" --emit=asm -o "$dir/fresh.s"
+    cmp "$dir/rebuilt.s" "$dir/fresh.s"
+
+    rm -f "$dir/cache"
+    "$compiler" $flags --incremental="$dir/cache" "$dir/program.qz" -o "$dir/before"
+    "$compiler" $flags --incremental="$dir/cache" "$dir/edited.qz" -o "$dir/rebuilt"
+    "$compiler" $flags "$dir/edited.qz" -o "$dir/clean"
+    for input in 0 3 20; do
+        echo $input | "$dir/rebuilt" > "$dir/rebuilt.out"
+        echo $input | "$dir/clean" > "$dir/clean.out"
+        cmp "$dir/rebuilt.out" "$dir/clean.out"
+    done
+done
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Every program runs natively and through --interpret at each level, and
+# both have to print the same text and exit with the same status.
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+programs=$(dirname "$0")/programs
+
+failed=0
+check(){
+    name=$1
+    input=$2
+    for level in -O0 -O1 -O2; do
+        "$compiler" $level "$programs/$name.qz" -o "$dir/$name" || exit 1
+        printf "$input" | "$dir/$name" > "$dir/native.out" 2>/dev/null
+        native=$?
+        printf "$input" | "$compiler" $level --interpret "$programs/$name.qz" > "$dir/vm.out" 2>/dev/null
+        vm=$?
+        if [ $native -ne $vm ] || ! cmp -s "$dir/native.out" "$dir/vm.out"; then
+            echo "$name $level: native exited $native, --interpret $vm"
+            diff "$dir/native.out" "$dir/vm.out"
+            failed=1
+        fi
+    done
+}
+
+check functions "20\n"
+check arrays "40\n"
+check division "5\n"
+check division "0\n"
+check read "1\n-7\n12\n0\n"
+exit $failed
@@ -0,0 +1,110 @@
+// Two threads compile at once, each in its own context, while a third
+// compilation fails on the main thread; every one has to get what a
+// compilation on its own gets, and the failed context has to work again.
+#include "quartz.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATEMENTS 6000
+#define ROUNDS 8
+
+typedef struct {
+    const char* source;
+    const char* expected;
+    size_t expectedLength;
+    QuartzOptions options;
+    int failed;
+} Job;
+
+// Enough statements for several codegen regions, so -j has work to share;
+// the read keeps compile-time evaluation from folding it all away.
+static char* makeProgram(void){
+    size_t capacity = (size_t)STATEMENTS * 96 + 256;
+    char* text = malloc(capacity);
+    if(text == NULL) exit(1);
+    size_t length = (size_t)snprintf(text, capacity,
+                                     "func twice(n) { return n + n; }\nx = read();\ni = 0;\n");
+    for(int i = 0; i < STATEMENTS; i++){
+        length += (size_t)snprintf(text + length, capacity - length,
+                                   "if (x < %d) { x = twice(x) + %d; }\nif (x > %d) { x = x - x / 3; }\n", i * 7, i, i * 9);
+    }
+    snprintf(text + length, capacity - length, "while (i < 64) { i = i + 1; }\nprint(x + i);\n");
+    return text;
+}
+
+static void* compileRounds(void* argument){
+    Job* job = argument;
+    QuartzContext* context = quartzCreateContext();
+    if(context == NULL){
+        job->failed = 1;
+        return NULL;
+    }
+    for(int round = 0; round < ROUNDS && !job->failed; round++){
+        size_t length;
+        if(quartzCompile(context, job->source, strlen(job->source), &job->options) != QUARTZ_OK){
+            fprintf(stderr, "parallel compilation failed: %s\n", quartzError(context));
+            job->failed = 1;
+        }else if(strcmp(quartzOutput(context, &length), job->expected) != 0 || length != job->expectedLength){
+            fprintf(stderr, "parallel compilation differs from the serial one\n");
+            job->failed = 1;
+        }
+    }
+    quartzDestroyContext(context);
+    return NULL;
+}
+
+int main(void){
+    char* source = makeProgram();
+    QuartzOptions serial = {0};
+    serial.optimizationLevel = 2;
+    serial.tune = "skylake";
+    QuartzContext* context = quartzCreateContext();
+    if(context == NULL) return 1;
+    if(quartzCompile(context, source, strlen(source), &serial) != QUARTZ_OK){
+        fprintf(stderr, "serial compilation failed: %s\n", quartzError(context));
+        return 1;
+    }
+    size_t expectedLength;
+    char* expected = strdup(quartzOutput(context, &expectedLength));
+    if(expected == NULL) return 1;
+
+    Job jobs[2];
+    pthread_t threads[2];
+    for(int i = 0; i < 2; i++){
+        jobs[i] = (Job){source, expected, expectedLength, serial, 0};
+        jobs[i].options.jobs = 2 + i;
+        if(pthread_create(&threads[i], NULL, compileRounds, &jobs[i]) != 0) return 1;
+    }
+
+    int failed = 0;
+    const char* broken = "x = 1;\ny = ;\nprint(x);\n";
+    for(int round = 0; round < ROUNDS; round++){
+        QuartzStatus status = quartzCompile(context, broken, strlen(broken), &serial);
+        if(status != QUARTZ_ERROR_SOURCE || strcmp(quartzError(context), "Expected expression at line 2.") != 0){
+            fprintf(stderr, "failing compilation returned %d, \"%s\"\n", status, quartzError(context));
+            failed = 1;
+        }
+    }
+
+    for(int i = 0; i < 2; i++){
+        pthread_join(threads[i], NULL);
+        failed |= jobs[i].failed;
+    }
+
+    // The context that failed compiles again, and forgets the error.
+    size_t length;
+    if(quartzCompile(context, source, strlen(source), &serial) != QUARTZ_OK ||
+       strcmp(quartzOutput(context, &length), expected) != 0 || length != expectedLength ||
+       quartzError(context)[0] != '\0'){
+        fprintf(stderr, "context reused after a failure: \"%s\"\n", quartzError(context));
+        failed = 1;
+    }
+
+    quartzDestroyContext(context);
+    free(expected);
+    free(source);
+    return failed;
+}
@@ -0,0 +1,15 @@
+#!/bin/sh
+# "-o -" writes to standard output instead of creating a file named "-".
+set -e
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+echo "x = 6; print(x * 7);" > "$dir/program.qz"
+cd "$dir"
+"$compiler" program.qz > default.s
+"$compiler" program.qz -o - > dash.s
+cmp default.s dash.s
+"$compiler" --emit=ir program.qz -o - > ir.txt
+test -s ir.txt
+test ! -e ./-
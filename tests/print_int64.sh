@@ -0,0 +1,37 @@
+#!/bin/sh
+# print writes the whole 64-bit value, whether it is known at compile
+# time or read at run time, natively, freestanding and in the VM.
+set -e
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/big.qz" <<'QZ'
+print(4294967296);
+print(0 - 9223372036854775807 - 1);
+x = read();
+print(x);
+print(0 - x * 1000);
+print(x - x - 1);
+print(0 - 9223372036854775807 - 1 + x - x);
+print(9223372036854775807 + x - x);
+QZ
+cat > "$dir/expected" <<'EOF2'
+4294967296
+-9223372036854775808
+12345678901
+-12345678901000
+-1
+-9223372036854775808
+9223372036854775807
+EOF2
+
+for level in -O0 -O2; do
+    for mode in "" --freestanding; do
+        "$compiler" $level $mode "$dir/big.qz" -o "$dir/big"
+        echo 12345678901 | "$dir/big" > "$dir/out"
+        cmp "$dir/expected" "$dir/out"
+    done
+    echo 12345678901 | "$compiler" $level --interpret "$dir/big.qz" > "$dir/out"
+    cmp "$dir/expected" "$dir/out"
+done
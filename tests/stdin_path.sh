@@ -0,0 +1,17 @@
+#!/bin/sh
+# A program redirected into /dev/stdin compiles like the file itself,
+# while a named file still needs a .qz or .qzast extension.
+set -e
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+echo "x = 6; print(x * 7);" > "$dir/program.qz"
+"$compiler" "$dir/program.qz" > "$dir/named.s"
+"$compiler" /dev/stdin > "$dir/redirected.s" < "$dir/program.qz"
+cmp "$dir/named.s" "$dir/redirected.s"
+
+cp "$dir/program.qz" "$dir/program.txt"
+status=0
+"$compiler" "$dir/program.txt" > "$dir/other.s" 2>/dev/null || status=$?
+test $status -eq 64
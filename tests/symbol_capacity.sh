@@ -0,0 +1,20 @@
+#!/bin/sh
+# More variables than the symbol table holds is a compile error, not a
+# crash; exactly as many still compile.
+set -e
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for count in 512 600; do
+    seq 0 $((count - 1)) | sed 's/.*/v& = &;/' > "$dir/program.qz"
+    echo "print(v$((count - 1)));" >> "$dir/program.qz"
+    status=0
+    "$compiler" "$dir/program.qz" > "$dir/program.s" 2> "$dir/err" || status=$?
+    if [ $count -eq 512 ]; then
+        test $status -eq 0
+    else
+        test $status -eq 65
+        grep -q "Too many variables" "$dir/err"
+    fi
+done
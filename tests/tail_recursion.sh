@@ -0,0 +1,14 @@
+#!/bin/sh
+# Ten million self tail calls need a constant stack: without the tail call
+# the frames would overflow an 8 MB stack long before the base case.
+set -e
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+echo "func count(n, total) { if (n < 1) { return total; } return count(n - 1, total + 2); } print(count(10000000, 0));" > "$dir/count.qz"
+ulimit -s 8192 2>/dev/null || true
+for level in -O1 -O2; do
+    "$compiler" $level "$dir/count.qz" -o "$dir/count"
+    test "$("$dir/count")" = 20000000
+done
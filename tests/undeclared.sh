@@ -0,0 +1,19 @@
+#!/bin/sh
+# Reading a variable that was never assigned is a compile error wherever
+# it appears: as a leaf operand, inside an expression, or interpreted.
+set -e
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for program in 'y = 1; print(z);' 'y = 1; print(z + 1);' 'y = z;' 'func f(a) { return b; } print(f(1));'; do
+    echo "$program" > "$dir/program.qz"
+    for flags in "-O0 --emit=asm -o $dir/out.s" "-O2 --emit=asm -o $dir/out.s" "--interpret"; do
+        status=0
+        "$compiler" $flags "$dir/program.qz" 2> "$dir/err" || status=$?
+        if [ $status -ne 65 ] || ! grep -q "not declared" "$dir/err"; then
+            echo "'$program' with ${flags%% *}: exit status $status"
+            exit 1
+        fi
+    done
+done
@@ -0,0 +1,18 @@
+#!/bin/sh
+# An array loop that reads its counter as a value has to be vectorized
+# at -O2 and still print what the scalar build prints. The outer loop
+# runs long enough that nothing can fold it away at compile time.
+set -e
+compiler=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+echo "array v[1000]; r = 0; s = 0; while (r < 2000) { i = 0; while (i < 1000) { v[i] = i; s = s + v[i]; i = i + 1; } r = r + 1; } print(s);" > "$dir/program.qz"
+"$compiler" -O2 "$dir/program.qz" > "$dir/program.s"
+grep -q "paddq xmm0, \[rip + qz_lane_index\]" "$dir/program.s"
+gcc -z noexecstack "$dir/program.s" -o "$dir/vector"
+"$compiler" -O0 "$dir/program.qz" > "$dir/scalar.s"
+gcc -z noexecstack "$dir/scalar.s" -o "$dir/scalar"
+"$dir/vector" > "$dir/vector.out"
+"$dir/scalar" > "$dir/scalar.out"
+cmp "$dir/vector.out" "$dir/scalar.out"